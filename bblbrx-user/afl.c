@@ -0,0 +1,302 @@
+/*
+ * QEmu "bblbrx" usermode - AFL fork server and persistent mode
+ * vim: ft=c sw=4 ts=4 et :
+ *
+ *  Copyright (c) 2019-2022 William Towle <william_towle@yahoo.co.uk>
+ *  [...under GPL...]
+ */
+
+#include "qemu/osdep.h"
+#include "qemu.h"
+
+#include "qemu/error-report.h"
+#include <sys/shm.h>
+
+
+//#define EMIT_DEBUG ZAPHOD_DEBUG
+#define EMIT_DEBUG 0
+#define DPRINTF(fmt, ...) \
+    do { if (EMIT_DEBUG) error_printf("bblbrx-user afl: " fmt , ## __VA_ARGS__); } while(0)
+
+
+/* Conventions shared with afl-fuzz: the coverage map is a SysV shared
+ * memory segment whose id is passed in the environment, and the fork
+ * server talks to the fuzzer over a fixed pair of file descriptors
+ * (control in on FORKSRV_FD, status out on FORKSRV_FD + 1)
+ */
+#define AFL_SHM_ENV_VAR     "__AFL_SHM_ID"
+#define AFL_FORKSRV_FD      198
+
+
+/* option settings, from main.c */
+bool            afl_enabled;
+unsigned long   afl_persistent_count;
+abi_long        afl_input_addr= -1;
+abi_ulong       afl_input_maxlen= 0x1000;
+
+/* Coverage map. Without a fuzzer attached the instrumentation still
+ * runs, into a private area, so behaviour is identical either way
+ */
+static uint8_t          afl_private_area[AFL_MAP_SIZE];
+static uint8_t          *afl_area= afl_private_area;
+static target_ulong     afl_prev_loc;
+static bool             afl_forkserver_running;
+
+/* persistent mode state: RAM and CPU as they were when the child
+ * started, plus a record of which host pages have since been written
+ */
+static struct {
+    CPUZ80State     env;
+    uint8_t         ram[BBLBRX_RAM_SIZE];
+} afl_snapshot;
+static uint8_t          afl_dirty[BBLBRX_RAM_SIZE / 4096];
+static unsigned long    afl_iterations;
+
+
+void afl_maybe_log(target_ulong cur_loc)
+{
+    afl_area[(cur_loc ^ afl_prev_loc) & (AFL_MAP_SIZE - 1)]++;
+    afl_prev_loc= cur_loc >> 1;
+}
+
+
+static size_t afl_page_count(void)
+{
+    return DIV_ROUND_UP(BBLBRX_RAM_SIZE, qemu_real_host_page_size);
+}
+
+static void afl_mark_dirty(size_t page)
+{
+    size_t  page_size= qemu_real_host_page_size;
+
+    afl_dirty[page]= 1;
+    mprotect(g2h(page * page_size), page_size, PROT_READ | PROT_WRITE);
+}
+
+static void afl_dirty_page_handler(int sig, siginfo_t *info, void *puc)
+{
+    uintptr_t   offs= (uintptr_t)info->si_addr - (uintptr_t)g2h(0);
+
+    if (offs < BBLBRX_RAM_SIZE)
+    {   /* first write to a clean page since the last restore */
+        afl_mark_dirty(offs / qemu_real_host_page_size);
+        return;
+    }
+
+    /* Not ours - a genuine crash. Restore the default action and
+     * return; the faulting access repeats and kills us, which is
+     * what afl-fuzz needs to see
+     */
+    signal(SIGSEGV, SIG_DFL);
+}
+
+static void afl_snapshot_take(CPUArchState *env)
+{
+    struct sigaction act;
+
+    memcpy(&afl_snapshot.env, env, offsetof(CPUZ80State, end_reset_fields));
+    memcpy(afl_snapshot.ram, g2h(0), BBLBRX_RAM_SIZE);
+
+    memset(&act, 0, sizeof(act));
+    sigemptyset(&act.sa_mask);
+    act.sa_flags= SA_SIGINFO;
+    act.sa_sigaction= afl_dirty_page_handler;
+    sigaction(SIGSEGV, &act, NULL);
+
+    /* Write-protect guest RAM so the first store to each page
+     * faults once and records it as needing restoration
+     */
+    memset(afl_dirty, 0, sizeof(afl_dirty));
+    mprotect(g2h(0), BBLBRX_RAM_SIZE, PROT_READ);
+}
+
+static void afl_snapshot_restore(CPUArchState *env)
+{
+    CPUState    *cs= env_cpu(env);
+    size_t      page_size= qemu_real_host_page_size;
+    size_t      page;
+
+    /* NB: like the rest of bblbrx we do not track self-modifying
+     * code, so cached translations are assumed to match the snapshot
+     */
+    for (page= 0; page < afl_page_count(); page++)
+    {
+        size_t  offs= page * page_size;
+
+        if (!afl_dirty[page])
+            continue;
+
+        memcpy(g2h(offs), afl_snapshot.ram + offs,
+                MIN(page_size, BBLBRX_RAM_SIZE - offs));
+        mprotect(g2h(offs), page_size, PROT_READ);
+        afl_dirty[page]= 0;
+    }
+
+    memcpy(env, &afl_snapshot.env, offsetof(CPUZ80State, end_reset_fields));
+    cs->halted= 0;
+    cs->exception_index= -1;
+    afl_prev_loc= 0;
+}
+
+static void afl_load_input(CPUArchState *env)
+{
+    abi_ulong   maxlen;
+    ssize_t     len;
+    size_t      page;
+
+    if (afl_input_addr < 0)
+        return;
+
+    maxlen= MIN(afl_input_maxlen, BBLBRX_RAM_SIZE - afl_input_addr);
+
+    /* read() into a write-protected page fails with EFAULT rather
+     * than faulting, so unprotect the destination up front
+     */
+    if (afl_persistent_count && maxlen)
+    {
+        for (page= afl_input_addr / qemu_real_host_page_size;
+             page <= (afl_input_addr + maxlen - 1) / qemu_real_host_page_size;
+             page++)
+        {
+            if (!afl_dirty[page])
+                afl_mark_dirty(page);
+        }
+    }
+
+    /* afl-fuzz rewrites the testcase behind our stdin between runs */
+    lseek(0, 0, SEEK_SET);
+    len= read(0, g2h(afl_input_addr), maxlen);
+    if (len < 0)
+        len= 0;
+
+    /* guest convention: HL points to the testcase, BC is its length */
+    env->regs[R_HL]= afl_input_addr;
+    env->regs[R_BC]= len;
+#if 1   /* WmT - TRACE */
+;DPRINTF("%s(): %zd byte testcase at 0x%04x\n", __func__, len, (unsigned int)afl_input_addr);
+#endif
+}
+
+static void afl_child_init(CPUArchState *env)
+{
+    if (afl_persistent_count && afl_forkserver_running)
+        afl_snapshot_take(env);
+
+    afl_iterations= 0;
+    afl_prev_loc= 0;
+    afl_load_input(env);
+}
+
+
+void afl_setup(void)
+{
+    const char  *id_str;
+    void        *area;
+
+    if (!afl_enabled)
+        return;
+
+    id_str= getenv(AFL_SHM_ENV_VAR);
+    if (id_str)
+    {
+        area= shmat(atoi(id_str), NULL, 0);
+        if (area == (void *)-1)
+        {
+            perror("shmat");
+            exit(EXIT_FAILURE);
+        }
+
+        afl_area= area;
+        /* let the fuzzer know the instrumentation is live */
+        afl_area[0]= 1;
+    }
+}
+
+/* Called once loading and TCG prologue generation are complete, so
+ * each child starts from a fully initialised emulator. Returns in the
+ * child (or immediately, if no fuzzer is attached); the parent never
+ * returns, and only relays run status back to afl-fuzz
+ */
+void afl_forkserver(CPUArchState *env)
+{
+    static uint8_t  hello[4];
+    pid_t           child_pid= 0;
+    bool            child_stopped= false;
+
+    if (!afl_enabled)
+        return;
+
+    if (write(AFL_FORKSRV_FD + 1, hello, 4) != 4)
+    {   /* not running under afl-fuzz: behave as a single run */
+        afl_child_init(env);
+        return;
+    }
+    afl_forkserver_running= true;
+
+    for (;;)
+    {
+        uint32_t    was_killed;
+        int         status;
+
+        if (read(AFL_FORKSRV_FD, &was_killed, 4) != 4)
+            exit(2);
+
+        /* a stopped persistent child that afl-fuzz timed out and
+         * killed must be reaped before we fork its replacement
+         */
+        if (child_stopped && was_killed)
+        {
+            child_stopped= false;
+            if (waitpid(child_pid, &status, 0) < 0)
+                exit(8);
+        }
+
+        if (!child_stopped)
+        {
+            child_pid= fork();
+            if (child_pid < 0)
+                exit(4);
+
+            if (child_pid == 0)
+            {
+                close(AFL_FORKSRV_FD);
+                close(AFL_FORKSRV_FD + 1);
+                afl_child_init(env);
+                return;
+            }
+        }
+        else
+        {   /* persistent mode: the same child runs the next testcase */
+            kill(child_pid, SIGCONT);
+            child_stopped= false;
+        }
+
+        if (write(AFL_FORKSRV_FD + 1, &child_pid, 4) != 4)
+            exit(5);
+        if (waitpid(child_pid, &status,
+                    afl_persistent_count ? WUNTRACED : 0) < 0)
+            exit(6);
+        if (WIFSTOPPED(status))
+            child_stopped= true;
+        if (write(AFL_FORKSRV_FD + 1, &status, 4) != 4)
+            exit(7);
+    }
+}
+
+/* Called at the end of a testcase. In persistent mode we signal the
+ * fork server by stopping, and on resumption roll RAM and CPU state
+ * back to the snapshot and load the next testcase
+ */
+bool afl_persistent_next(CPUArchState *env)
+{
+    if (!afl_forkserver_running || !afl_persistent_count)
+        return false;
+    if (++afl_iterations >= afl_persistent_count)
+        return false;       /* exit, and let afl-fuzz fork a fresh child */
+
+    raise(SIGSTOP);
+
+    afl_snapshot_restore(env);
+    afl_load_input(env);
+    return true;
+}
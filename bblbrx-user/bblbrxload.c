@@ -45,7 +45,38 @@ static int prepare_binprm(struct bblbrx_binprm *bprm)
     return 0;
 }
 
-/* handle raw binary loading */
+static int guess_format(const char *filename)
+{
+    static const struct {
+        const char  *ext;
+        int         format;
+    } exts[]= {
+        { ".hex",   BBLBRX_FORMAT_IHEX },
+        { ".ihx",   BBLBRX_FORMAT_IHEX },
+        { ".ihex",  BBLBRX_FORMAT_IHEX },
+        { ".s19",   BBLBRX_FORMAT_SREC },
+        { ".s28",   BBLBRX_FORMAT_SREC },
+        { ".s37",   BBLBRX_FORMAT_SREC },
+        { ".srec",  BBLBRX_FORMAT_SREC },
+        { ".mot",   BBLBRX_FORMAT_SREC },
+    };
+    const char  *ext= strrchr(filename, '.');
+    int         i;
+
+    if (ext)
+    {
+        for (i= 0; i < ARRAY_SIZE(exts); i++)
+        {
+            if (g_ascii_strcasecmp(ext, exts[i].ext) == 0)
+                return exts[i].format;
+        }
+    }
+    return BBLBRX_FORMAT_RAW;
+}
+
+/* Load the program; bprm->format, ->origin and ->entry are
+ * preset by the caller (entry as -1 to take it from the file)
+ */
 int bblbrx_exec(const char *filename, struct bblbrx_binprm *bprm)
 {
     int                     ret;
@@ -62,7 +93,26 @@ int bblbrx_exec(const char *filename, struct bblbrx_binprm *bprm)
 
     ret= prepare_binprm(bprm);
     if (ret >= 0)
-        ret= load_raw_binary(bprm);
+    {
+        if (bprm->format == BBLBRX_FORMAT_AUTO)
+            bprm->format= guess_format(filename);
+
+        switch (bprm->format)
+        {
+        case BBLBRX_FORMAT_IHEX:
+            ret= load_ihex_binary(bprm);
+            break;
+        case BBLBRX_FORMAT_SREC:
+            ret= load_srec_binary(bprm);
+            break;
+        default:
+            ret= load_raw_binary(bprm);
+            break;
+        }
+
+        if (ret == 0 && bprm->entry < 0)
+            bprm->entry= 0;
+    }
 
     /* Store an invalid file descriptor if loading failed */
     if (ret <= 0)
@@ -0,0 +1,272 @@
+/*
+ * QEmu "bblbrx" usermode - barebones layer for binary execution
+ * vim: ft=c sw=4 ts=4 et :
+ *
+ *  Copyright (c) 2019-2022 William Towle <william_towle@yahoo.co.uk>
+ *  [...under GPL...]
+ */
+
+
+#include "qemu/osdep.h"
+#include "qemu.h"
+#include "cpu.h"
+
+#include "qemu/ctype.h"
+#include "qemu/error-report.h"
+#include "exec/cpu_ldst.h"
+
+
+//#define EMIT_DEBUG ZAPHOD_DEBUG
+#define EMIT_DEBUG 0
+#define DPRINTF(fmt, ...) \
+    do { if (EMIT_DEBUG) error_printf("bblbrx-user hexload: " fmt , ## __VA_ARGS__); } while(0)
+
+
+/* Longest record we accept: type/count prefix plus 255 data bytes
+ * and their address/checksum overheads, as hex, plus line ending
+ */
+#define HEXLOAD_MAX_LINE    600
+
+
+static int hex_nibble(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c= qemu_tolower(c);
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/* Decode a run of hex digit pairs up to the end of 'str' into 'buf'.
+ * Returns the number of bytes decoded, or -1 if malformed
+ */
+static int hex_decode(const char *str, uint8_t *buf, int size)
+{
+    int     n= 0;
+
+    while (*str && !qemu_isspace(*str))
+    {
+        int hi= hex_nibble(str[0]);
+        int lo= (hi < 0) ? -1 : hex_nibble(str[1]);
+
+        if (lo < 0 || n == size)
+            return -1;
+        buf[n++]= (hi << 4) | lo;
+        str+= 2;
+    }
+    return n;
+}
+
+static FILE *hexload_open(struct bblbrx_binprm *bprm)
+{
+    int     fd;
+    FILE    *f;
+
+    /* leave bprm->fd for the caller to close */
+    fd= dup(bprm->fd);
+    if (fd < 0)
+        return NULL;
+
+    f= fdopen(fd, "r");
+    if (f == NULL)
+        close(fd);
+    return f;
+}
+
+static int hexload_store(struct bblbrx_binprm *bprm, int lineno,
+                            uint32_t addr, const uint8_t *data, int len)
+{
+    /* NB. 'addr + len' could wrap for 32-bit record addresses */
+    if (addr >= BBLBRX_RAM_SIZE || len > BBLBRX_RAM_SIZE - addr)
+    {
+        fprintf(stderr, "%s:%d: record at 0x%x exceeds guest RAM\n",
+                bprm->filename, lineno, addr);
+        return -ENOEXEC;
+    }
+
+    memcpy(g2h(addr), data, len);
+    return 0;
+}
+
+/* Takes a start record's address as the entry point (unless one was
+ * given) provided it's a guest address
+ */
+static int hexload_entry(struct bblbrx_binprm *bprm, int lineno,
+                            uint32_t addr)
+{
+    if (addr >= BBLBRX_RAM_SIZE)
+    {
+        fprintf(stderr, "%s:%d: start address 0x%x is outside guest RAM\n",
+                bprm->filename, lineno, addr);
+        return -ENOEXEC;
+    }
+
+    if (bprm->entry < 0)
+        bprm->entry= addr;
+    return 0;
+}
+
+
+/* Intel HEX - as produced by SDCC (.ihx) and z88dk (.hex) */
+int load_ihex_binary(struct bblbrx_binprm *bprm)
+{
+    FILE        *f;
+    char        line[HEXLOAD_MAX_LINE];
+    uint8_t     rec[HEXLOAD_MAX_LINE / 2];
+    uint32_t    base= 0;
+    int         lineno= 0;
+    int         ret= 0;
+
+    f= hexload_open(bprm);
+    if (f == NULL)
+        return -errno;
+
+    while (ret == 0 && fgets(line, sizeof(line), f))
+    {
+        uint8_t sum= 0;
+        int     len, i;
+
+        lineno++;
+        g_strstrip(line);
+        if (line[0] == '\0')
+            continue;
+
+        /* ":" count(1) addr(2) type(1) data(count) checksum(1) */
+        len= (line[0] == ':') ? hex_decode(&line[1], rec, sizeof(rec)) : -1;
+        if (len < 5 || len != rec[0] + 5)
+            goto bad_record;
+        for (i= 0; i < len; i++)
+            sum+= rec[i];
+        if (sum != 0)
+            goto bad_record;
+
+        switch (rec[3])
+        {
+        case 0x00:      /* data */
+            ret= hexload_store(bprm, lineno,
+                                base + ((rec[1] << 8) | rec[2]),
+                                &rec[4], rec[0]);
+            break;
+        case 0x01:      /* end of file */
+            goto done;
+        case 0x02:      /* extended segment address */
+            if (rec[0] != 2)
+                goto bad_record;
+            base= ((rec[4] << 8) | rec[5]) << 4;
+            break;
+        case 0x03:      /* start segment address (CS:IP) */
+            if (rec[0] != 4)
+                goto bad_record;
+            ret= hexload_entry(bprm, lineno,
+                                (((rec[4] << 8) | rec[5]) << 4)
+                                + ((rec[6] << 8) | rec[7]));
+            break;
+        case 0x04:      /* extended linear address */
+            if (rec[0] != 2)
+                goto bad_record;
+            base= ((rec[4] << 8) | rec[5]) << 16;
+            break;
+        case 0x05:      /* start linear address */
+            if (rec[0] != 4)
+                goto bad_record;
+            ret= hexload_entry(bprm, lineno, ldl_be_p(&rec[4]));
+            break;
+        default:
+            goto bad_record;
+        }
+    }
+
+done:
+    fclose(f);
+#if 1   /* WmT - TRACE */
+;DPRINTF("%s(): loaded %d lines from %s (ret %d)\n", __func__, lineno, bprm->filename, ret);
+#endif
+    return ret;
+
+bad_record:
+    fprintf(stderr, "%s:%d: bad Intel HEX record\n", bprm->filename, lineno);
+    fclose(f);
+    return -ENOEXEC;
+}
+
+
+/* Motorola S-record (S19/S28/S37) */
+int load_srec_binary(struct bblbrx_binprm *bprm)
+{
+    FILE        *f;
+    char        line[HEXLOAD_MAX_LINE];
+    uint8_t     rec[HEXLOAD_MAX_LINE / 2];
+    int         lineno= 0;
+    int         ret= 0;
+
+    f= hexload_open(bprm);
+    if (f == NULL)
+        return -errno;
+
+    while (ret == 0 && fgets(line, sizeof(line), f))
+    {
+        uint8_t     sum= 0;
+        uint32_t    addr;
+        int         len, alen, i;
+
+        lineno++;
+        g_strstrip(line);
+        if (line[0] == '\0')
+            continue;
+
+        /* "S" type count(1) addr(alen) data checksum(1) */
+        len= (line[0] == 'S' && line[1] != '\0')
+                ? hex_decode(&line[2], rec, sizeof(rec)) : -1;
+        if (len < 1 || len != rec[0] + 1)
+            goto bad_record;
+        for (i= 0; i < len; i++)
+            sum+= rec[i];
+        if (sum != 0xff)
+            goto bad_record;
+
+        switch (line[1])
+        {
+        case '0':           /* header */
+        case '5':           /* record count */
+        case '6':
+            continue;
+        case '1': case '9':
+            alen= 2;
+            break;
+        case '2': case '8':
+            alen= 3;
+            break;
+        case '3': case '7':
+            alen= 4;
+            break;
+        default:
+            goto bad_record;
+        }
+
+        if (rec[0] < alen + 1)
+            goto bad_record;
+        for (addr= 0, i= 0; i < alen; i++)
+            addr= (addr << 8) | rec[1 + i];
+
+        if (line[1] >= '7')
+        {   /* S7/S8/S9 terminate, giving the start address */
+            ret= hexload_entry(bprm, lineno, addr);
+            break;
+        }
+
+        ret= hexload_store(bprm, lineno, addr,
+                            &rec[1 + alen], rec[0] - alen - 1);
+    }
+
+    fclose(f);
+#if 1   /* WmT - TRACE */
+;DPRINTF("%s(): loaded %d lines from %s (ret %d)\n", __func__, lineno, bprm->filename, ret);
+#endif
+    return ret;
+
+bad_record:
+    fprintf(stderr, "%s:%d: bad S-record\n", bprm->filename, lineno);
+    fclose(f);
+    return -ENOEXEC;
+}
@@ -30,6 +30,20 @@ unsigned long reserved_va;
 __thread CPUState *thread_cpu;
 int singlestep;
 
+/* program loading options */
+static int load_format= BBLBRX_FORMAT_AUTO;
+static target_ulong load_origin;
+static target_long load_entry= -1;
+static const char *load_mapfile;
+
+/* execution limit and reporting options */
+static uint64_t insn_limit;
+static double timeout_secs;
+static const char *report_filename;
+
+volatile sig_atomic_t bblbrx_timed_out;
+static CPUState *timeout_cpu;
+
 
 bool qemu_cpu_is_self(CPUState *cpu)
 {   /* [QEmu v2] called by generic_handle_interrupt() */
@@ -42,10 +56,43 @@ void qemu_cpu_kick(CPUState *cpu)
 }
 
 
+/* exit statuses for runs stopped early */
+#define BBLBRX_STATUS_INSN_LIMIT    2
+#define BBLBRX_STATUS_TIMEOUT       3
+
+
 static void usage(int exitcode)
 {
     /* NB: platforms may pass program arguments */
     printf("Usage: qemu-" TARGET_NAME " [options] program\n");
+    printf("\n"
+           "Options:\n"
+           "  -help                   display this help and exit\n"
+           "  -cpu model              select CPU (-cpu help for list)\n"
+           "  -singlestep             run in singlestep mode\n"
+           "  -format fmt             program format: raw, ihex or srec\n"
+           "                          (default: by extension, else raw)\n"
+           "  -origin addr            load address for raw programs\n"
+           "  -entry addr             initial PC (default: from the\n"
+           "                          file, else the load address)\n"
+           "  -map file               read symbols from a z88dk/SDCC\n"
+           "                          linker map\n"
+           "  -afl                    record edge coverage and run as an\n"
+           "                          afl-fuzz fork server\n"
+           "  -afl-persistent count   as -afl, running up to 'count'\n"
+           "                          testcases per forked child\n"
+           "  -afl-input addr[,len]   load each testcase from stdin at\n"
+           "                          'addr' (HL=addr, BC=length read)\n"
+           "  -icount-limit count     stop after 'count' instructions\n"
+           "  -timeout secs           stop after 'secs' seconds\n"
+           "  -report file            write a JSON summary of the run to\n"
+           "                          'file' (not stdout, which the guest\n"
+           "                          uses); its instruction and T-state\n"
+           "                          counts are upper bounds\n"
+           "\n"
+           "Exit status is 0 when the program finishes, %d if stopped by\n"
+           "-icount-limit and %d if stopped by -timeout\n",
+           BBLBRX_STATUS_INSN_LIMIT, BBLBRX_STATUS_TIMEOUT);
     exit(exitcode);
 }
 
@@ -61,6 +108,126 @@ static void handle_arg_cpu(char *arg)
     }
 }
 
+static void handle_arg_format(char *arg)
+{
+    if (arg == NULL)
+        usage(EXIT_FAILURE);
+
+    if (strcmp(arg, "raw") == 0 || strcmp(arg, "bin") == 0)
+        load_format= BBLBRX_FORMAT_RAW;
+    else if (strcmp(arg, "ihex") == 0 || strcmp(arg, "ihx") == 0)
+        load_format= BBLBRX_FORMAT_IHEX;
+    else if (strcmp(arg, "srec") == 0)
+        load_format= BBLBRX_FORMAT_SREC;
+    else
+    {
+        fprintf(stderr, "Unknown program format '%s'\n", arg);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static target_ulong parse_address(const char *opt, char *arg)
+{
+    unsigned long   addr;
+    char            *end;
+
+    if (arg == NULL)
+        usage(EXIT_FAILURE);
+
+    addr= strtoul(arg, &end, 0);
+    if (*end != '\0' || addr >= BBLBRX_RAM_SIZE)
+    {
+        fprintf(stderr, "Bad address '%s' for %s\n", arg, opt);
+        exit(EXIT_FAILURE);
+    }
+    return addr;
+}
+
+static void handle_arg_afl_persistent(char *arg)
+{
+    if (arg == NULL)
+        usage(EXIT_FAILURE);
+
+    afl_enabled= true;
+    afl_persistent_count= strtoul(arg, NULL, 0);
+}
+
+static void handle_arg_afl_input(char *arg)
+{
+    char    *end;
+
+    if (arg == NULL)
+        usage(EXIT_FAILURE);
+
+    afl_input_addr= strtoul(arg, &end, 0);
+    if (*end == ',')
+        afl_input_maxlen= strtoul(end + 1, &end, 0);
+    if (*end != '\0' || afl_input_addr >= BBLBRX_RAM_SIZE)
+    {
+        fprintf(stderr, "Bad -afl-input specification '%s'\n", arg);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void handle_arg_icount_limit(char *arg)
+{
+    char    *end;
+
+    if (arg == NULL)
+        usage(EXIT_FAILURE);
+
+    insn_limit= strtoull(arg, &end, 0);
+    if (*end != '\0' || insn_limit == 0)
+    {
+        fprintf(stderr, "Bad -icount-limit count '%s'\n", arg);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void handle_arg_timeout(char *arg)
+{
+    char    *end;
+
+    if (arg == NULL)
+        usage(EXIT_FAILURE);
+
+    timeout_secs= strtod(arg, &end);
+    if (*end != '\0' || timeout_secs <= 0)
+    {
+        fprintf(stderr, "Bad -timeout value '%s'\n", arg);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void timeout_handler(int sig)
+{
+    /* cpu_loop() sees EXCP_INTERRUPT at the next block boundary */
+    bblbrx_timed_out= 1;
+    cpu_exit(timeout_cpu);
+}
+
+static void timeout_start(CPUState *cpu)
+{
+    struct sigaction    act;
+    struct itimerval    it;
+
+    if (timeout_secs <= 0)
+        return;
+
+    timeout_cpu= cpu;
+    memset(&act, 0, sizeof(act));
+    sigemptyset(&act.sa_mask);
+    act.sa_handler= timeout_handler;
+    sigaction(SIGALRM, &act, NULL);
+
+    memset(&it, 0, sizeof(it));
+    it.it_value.tv_sec= (time_t)timeout_secs;
+    it.it_value.tv_usec= (suseconds_t)((timeout_secs - it.it_value.tv_sec) * 1e6);
+    if (it.it_value.tv_sec == 0 && it.it_value.tv_usec == 0)
+        it.it_value.tv_usec= 1;
+    setitimer(ITIMER_REAL, &it, NULL);
+}
+
 static int parse_args(int argc, char **argv)
 {
     int         optind;
@@ -90,6 +257,53 @@ static int parse_args(int argc, char **argv)
         else if (strcmp(r, "-singlestep") == 0) {
             singlestep = 1;
         }
+        else if (strcmp(r, "-format") == 0)
+        {
+            handle_arg_format(argv[optind++]);
+        }
+        else if (strcmp(r, "-origin") == 0)
+        {
+            load_origin= parse_address(r, argv[optind++]);
+        }
+        else if (strcmp(r, "-entry") == 0)
+        {
+            load_entry= parse_address(r, argv[optind++]);
+        }
+        else if (strcmp(r, "-map") == 0)
+        {
+            if ((load_mapfile= argv[optind++]) == NULL)
+                usage(EXIT_FAILURE);
+        }
+        else if (strcmp(r, "-afl") == 0)
+        {
+            afl_enabled= true;
+        }
+        else if (strcmp(r, "-afl-persistent") == 0)
+        {
+            handle_arg_afl_persistent(argv[optind++]);
+        }
+        else if (strcmp(r, "-afl-input") == 0)
+        {
+            handle_arg_afl_input(argv[optind++]);
+        }
+        else if (strcmp(r, "-icount-limit") == 0)
+        {
+            handle_arg_icount_limit(argv[optind++]);
+        }
+        else if (strcmp(r, "-timeout") == 0)
+        {
+            handle_arg_timeout(argv[optind++]);
+        }
+        else if (strcmp(r, "-report") == 0)
+        {
+            if ((report_filename= argv[optind++]) == NULL)
+                usage(EXIT_FAILURE);
+            if (strcmp(report_filename, "-") == 0)
+            {   /* it would be mixed with guest output and messages */
+                fprintf(stderr, "-report cannot be written to stdout\n");
+                exit(EXIT_FAILURE);
+            }
+        }
         else
         {
             fprintf(stderr, "Unexpected option '%s'\n", &r[1]);
@@ -109,6 +323,8 @@ int main(int argc, char **argv)
     void  *target_ram;
     struct bblbrx_binprm bprm;
     TaskState ts;
+    FILE *report= NULL;
+    int64_t start_time;
     int optind;
     int ret;
 
@@ -135,6 +351,18 @@ int main(int argc, char **argv)
         usage(EXIT_FAILURE);
     filename= argv[optind];
 
+    if (report_filename)
+    {   /* open now, so a bad path fails before the run */
+        report= fopen(report_filename, "w");
+        if (report == NULL)
+        {
+            fprintf(stderr, "%s: %s\n", report_filename, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    afl_setup();
+
     if (cpu_model == NULL) {
         cpu_model= "z80";       /* TODO: respect "cpu" option here */
     }
@@ -151,6 +379,10 @@ int main(int argc, char **argv)
 #endif
     cpu_reset(cpu);
 
+    /* Only pay for instruction/T-state counting when it's wanted */
+    env->accounting= (insn_limit != 0) || (report != NULL);
+    env->insn_limit= insn_limit ? insn_limit : UINT64_MAX;
+
 #if 1   /* WmT - TRACE */
 ;DPRINTF("%s(): INFO - CPU reset OK; initial state dump follows...\n", __func__);
 ;cpu_dump_state(cpu, stderr, 0);
@@ -170,7 +402,7 @@ int main(int argc, char **argv)
      * Setting guest_base ensures that disas_insn()'s byte fetch
      * doesn't segfault
      */
-    target_ram= mmap(0, 64*1024,
+    target_ram= mmap(0, BBLBRX_RAM_SIZE,
                      PROT_READ | PROT_WRITE,
                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     if (target_ram == MAP_FAILED)
@@ -184,9 +416,15 @@ int main(int argc, char **argv)
     memset(&ts, 0, sizeof ts);
     ts.used = 1;
     ts.bprm = &bprm;
+    ts.afl_instrument = afl_enabled;
     //env->opaque = ts;
     cpu->opaque = &ts;
 
+    memset(&bprm, 0, sizeof bprm);
+    bprm.format= load_format;
+    bprm.origin= load_origin;
+    bprm.entry= load_entry;
+
     ret= bblbrx_exec(filename, &bprm);
     if (ret != 0) {
         if (ret > 0)
@@ -195,6 +433,10 @@ int main(int argc, char **argv)
             printf("Error while loading %s: %s\n", filename, strerror(-ret));
         exit(EXIT_FAILURE);
     }
+    env->pc= bprm.entry;
+
+    if (load_mapfile && load_symbol_map(load_mapfile) != 0)
+        exit(EXIT_FAILURE);
 
     /* Now GUEST_BASE is known, generate the prologue so its value
      * can be taken into account
@@ -225,7 +467,32 @@ int main(int argc, char **argv)
 #if 1   /* WmT - PARTIAL */
 ;DPRINTF("%s(): PARTIAL - run filename=%s via cpu_loop() (requested CPU '%s', env %p)\n", __func__, filename, cpu_model, env);
 #endif
-    cpu_loop(env);
+    /* Under afl-fuzz the parent stays in here, and only forked
+     * children (which start from this fully-initialised state)
+     * return to run the program
+     */
+    afl_forkserver(env);
+
+    /* after any fork, since children don't inherit interval timers */
+    start_time= g_get_monotonic_time();
+    timeout_start(cpu);
 
-    return EXIT_SUCCESS; /* if cpu_loop() exits (ILLOP/KERNEL_TRAP) */
+    ret= cpu_loop(env);
+
+    if (report)
+    {
+        cpu_loop_report(report, env, ret,
+                        (g_get_monotonic_time() - start_time) / 1e6);
+        fclose(report);
+    }
+
+    switch (ret)
+    {
+    case BBLBRX_EXIT_INSN_LIMIT:
+        return BBLBRX_STATUS_INSN_LIMIT;
+    case BBLBRX_EXIT_TIMEOUT:
+        return BBLBRX_STATUS_TIMEOUT;
+    default:    /* ILLOP, KERNEL_TRAP, halt */
+        return EXIT_SUCCESS;
+    }
 }
@@ -14,9 +14,14 @@
 #include "exec/cpu_ldst.h"
 
 
+/* Size of the guest RAM window at guest_base */
+#define BBLBRX_RAM_SIZE (64*1024)
+
+
 typedef struct TaskState {
     int used;
     struct bblbrx_binprm *bprm;
+    bool afl_instrument;        /* emit coverage at block entry */
 } TaskState;    /* alignment is useful here, for the linux-user case */
 
 
@@ -72,19 +77,60 @@ static inline void unlock_user(void *host_ptr, abi_ulong guest_addr,
 }
 
 
+/* program file formats */
+enum {
+    BBLBRX_FORMAT_AUTO,     /* by filename extension, else raw */
+    BBLBRX_FORMAT_RAW,
+    BBLBRX_FORMAT_IHEX,
+    BBLBRX_FORMAT_SREC
+};
+
 struct bblbrx_binprm {
     const char      *filename;
     int             fd;
     long            filesize;
     target_ulong    magic_ramloc;
+    int             format;     /* BBLBRX_FORMAT_xxx */
+    target_ulong    origin;     /* load address for raw binaries */
+    target_long     entry;      /* initial PC; -1 if not (yet) known */
 };
 
 
 /* bblbrx-specific routines */
 
 int load_raw_binary(struct bblbrx_binprm *bprm);
+int load_ihex_binary(struct bblbrx_binprm *bprm);
+int load_srec_binary(struct bblbrx_binprm *bprm);
+int load_symbol_map(const char *filename);
 int bblbrx_exec(const char *filename, struct bblbrx_binprm *bprm);
 
-void cpu_loop(CPUArchState *env);
+/* why cpu_loop() returned */
+enum {
+    BBLBRX_EXIT_TRAP,       /* "magic ramtop" reached: normal exit */
+    BBLBRX_EXIT_HALT,
+    BBLBRX_EXIT_ILLOP,
+    BBLBRX_EXIT_INSN_LIMIT, /* -icount-limit reached */
+    BBLBRX_EXIT_TIMEOUT     /* -timeout expired */
+};
+
+extern volatile sig_atomic_t bblbrx_timed_out;
+
+int cpu_loop(CPUArchState *env);
+void cpu_loop_report(FILE *f, CPUArchState *env, int reason, double wall_time);
+
+
+/* afl.c - fuzzing support */
+
+#define AFL_MAP_SIZE    (1 << 16)
+
+extern bool             afl_enabled;
+extern unsigned long    afl_persistent_count;
+extern abi_long         afl_input_addr;
+extern abi_ulong        afl_input_maxlen;
+
+void afl_setup(void);
+void afl_forkserver(CPUArchState *env);
+bool afl_persistent_next(CPUArchState *env);
+void afl_maybe_log(target_ulong cur_loc);
 
 #endif /* QEMU_H */
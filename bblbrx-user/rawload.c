@@ -21,15 +21,51 @@
     do { if (EMIT_DEBUG) error_printf("bblbrx-user rawload: " fmt , ## __VA_ARGS__); } while(0)
 
 
+/* Images at least this large are mapped rather than copied */
+#define RAWLOAD_MMAP_THRESHOLD  (16*1024)
+
+
 int load_raw_binary(struct bblbrx_binprm *bprm)
 {
     abi_ulong   code_start, code_size;
     ssize_t     read;
 
-    code_start= 0x0000;
+    code_start= bprm->origin;
     code_size= bprm->filesize;
 
-    read= pread(bprm->fd, g2h(code_start), code_size, code_start);
+    if (code_start + code_size > BBLBRX_RAM_SIZE)
+    {
+        fprintf(stderr, "%s: %lu bytes at origin 0x%04x exceeds guest RAM\n",
+                bprm->filename, (unsigned long)code_size,
+                (unsigned int)code_start);
+        exit(-ENOEXEC);
+    }
+
+    /* Large images at a host page aligned origin are mapped
+     * copy-on-write straight over the guest RAM window, so only
+     * pages the guest actually touches get read in (and only pages
+     * it writes get copied)
+     */
+    if (code_size >= RAWLOAD_MMAP_THRESHOLD
+        && (code_start & (qemu_real_host_page_size - 1)) == 0)
+    {
+        void    *p;
+
+        p= mmap(g2h(code_start),
+                ROUND_UP(code_size, qemu_real_host_page_size),
+                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                bprm->fd, 0);
+        if (p != MAP_FAILED)
+        {
+#if 1   /* WmT - TRACE */
+;DPRINTF("%s(): mmap() of %lu bytes at 0x%04x successful\n", __func__, (unsigned long)code_size, (unsigned int)code_start);
+#endif
+            goto loaded;
+        }
+        /* otherwise, fall back to copying */
+    }
+
+    read= pread(bprm->fd, g2h(code_start), code_size, 0);
     if (read != code_size)
     {
         fprintf(stderr, "%s: %s\n", bprm->filename, strerror(errno));
@@ -39,5 +75,9 @@ int load_raw_binary(struct bblbrx_binprm *bprm)
 #if 1   /* WmT - TRACE */
 ;DPRINTF("%s(): pread() of %zd bytes successful\n", __func__, read);
 #endif
+loaded:
+    if (bprm->entry < 0)
+        bprm->entry= code_start;
+
     return 0;   /* "success" */
 }
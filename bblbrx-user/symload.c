@@ -0,0 +1,184 @@
+/*
+ * QEmu "bblbrx" usermode - linker map file symbols
+ * vim: ft=c sw=4 ts=4 et :
+ *
+ *  Copyright (c) 2019-2022 William Towle <william_towle@yahoo.co.uk>
+ *  [...under GPL...]
+ */
+
+
+#include "qemu/osdep.h"
+#include "qemu.h"
+
+#include "qemu/ctype.h"
+#include "qemu/error-report.h"
+#include "disas/disas.h"
+
+
+//#define EMIT_DEBUG ZAPHOD_DEBUG
+#define EMIT_DEBUG 0
+#define DPRINTF(fmt, ...) \
+    do { if (EMIT_DEBUG) error_printf("bblbrx-user symload: " fmt , ## __VA_ARGS__); } while(0)
+
+
+struct bblbrx_sym {
+    target_ulong    addr;
+    char            *name;
+};
+
+static struct bblbrx_sym    *bblbrx_syms;
+static unsigned int         bblbrx_nsyms;
+
+
+static int symcmp(const void *a, const void *b)
+{
+    const struct bblbrx_sym *sa= a, *sb= b;
+
+    return (sa->addr > sb->addr) - (sa->addr < sb->addr);
+}
+
+/* Maps give no symbol sizes, so report addresses relative to the
+ * nearest symbol at or below them
+ */
+static const char *bblbrx_lookup_symbol(struct syminfo *s,
+                                        target_ulong orig_addr)
+{
+    static char     buf[128];
+    unsigned int    lo= 0, hi= bblbrx_nsyms;
+    struct bblbrx_sym *sym;
+
+    while (hi - lo > 1)
+    {
+        unsigned int mid= (lo + hi) / 2;
+
+        if (bblbrx_syms[mid].addr <= orig_addr)
+            lo= mid;
+        else
+            hi= mid;
+    }
+
+    if (bblbrx_nsyms == 0 || bblbrx_syms[lo].addr > orig_addr)
+        return "";
+
+    sym= &bblbrx_syms[lo];
+    if (sym->addr == orig_addr)
+        return sym->name;
+    snprintf(buf, sizeof(buf), "%s+0x%x", sym->name,
+                (unsigned int)(orig_addr - sym->addr));
+    return buf;
+}
+
+static struct syminfo bblbrx_syminfo= {
+    .lookup_symbol  = bblbrx_lookup_symbol,
+};
+
+
+static bool is_hex_word(const char *s)
+{
+    int     n;
+
+    for (n= 0; qemu_isxdigit(s[n]); n++)
+        ;
+    return s[n] == '\0' && n >= 4 && n <= 8;
+}
+
+static bool is_identifier(const char *s)
+{
+    return qemu_isalpha(s[0]) || s[0] == '_' || s[0] == '.';
+}
+
+/* Recognise one line of:
+ *  - z88dk .map:           "_main   = $0123 ; addr, public, ..."
+ *  - SDCC (aslink) .map:   "  C:   00000123  _main    main"
+ *                     or:  "     00000123  _main"
+ *  - SDCC NoICE .noi:      "DEF _main 0x0123"
+ */
+static bool parse_map_line(char *line, char **name, target_ulong *addr)
+{
+    char            *tok[3];
+    unsigned int    value;
+    int             n, pos;
+    static char     namebuf[80];
+
+    if (sscanf(line, "%79s = $%x", namebuf, &value) == 2)
+    {
+        *name= namebuf;
+        *addr= value;
+        return true;
+    }
+
+    for (n= 0; n < 3; n++)
+    {
+        tok[n]= strtok(n ? NULL : line, " \t\r\n");
+        if (tok[n] == NULL)
+            break;
+    }
+    if (n < 2)
+        return false;
+
+    if (n == 3 && strcmp(tok[0], "DEF") == 0)
+    {
+        *name= tok[1];
+        *addr= strtoul(tok[2], NULL, 0);
+        return is_identifier(tok[1]);
+    }
+
+    pos= 0;
+    if (tok[0][strlen(tok[0]) - 1] == ':')
+        pos++;              /* area prefix */
+    if (pos + 1 >= n)
+        return false;
+    if (!is_hex_word(tok[pos]) || !is_identifier(tok[pos + 1]))
+        return false;
+
+    *name= tok[pos + 1];
+    *addr= strtoul(tok[pos], NULL, 16);
+    return true;
+}
+
+int load_symbol_map(const char *filename)
+{
+    FILE            *f;
+    char            line[256];
+    unsigned int    alloc= 0;
+
+    f= fopen(filename, "r");
+    if (f == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+        return -errno;
+    }
+
+    while (fgets(line, sizeof(line), f))
+    {
+        char            *name;
+        target_ulong    addr;
+
+        if (!parse_map_line(line, &name, &addr) || addr >= BBLBRX_RAM_SIZE)
+            continue;
+
+        if (bblbrx_nsyms == alloc)
+        {
+            alloc= alloc ? alloc * 2 : 256;
+            bblbrx_syms= g_renew(struct bblbrx_sym, bblbrx_syms, alloc);
+        }
+        bblbrx_syms[bblbrx_nsyms].addr= addr;
+        bblbrx_syms[bblbrx_nsyms].name= g_strdup(name);
+        bblbrx_nsyms++;
+    }
+    fclose(f);
+
+    qsort(bblbrx_syms, bblbrx_nsyms, sizeof(*bblbrx_syms), symcmp);
+#if 1   /* WmT - TRACE */
+;DPRINTF("%s(): %u symbols from %s\n", __func__, bblbrx_nsyms, filename);
+#endif
+
+    /* make them available to lookup_symbol() for traces */
+    if (bblbrx_syminfo.next == NULL && syminfos != &bblbrx_syminfo)
+    {
+        bblbrx_syminfo.next= syminfos;
+        syminfos= &bblbrx_syminfo;
+    }
+    bblbrx_syminfo.disas_num_syms= bblbrx_nsyms;
+    return 0;
+}
@@ -8,19 +8,23 @@
 #include "qemu/osdep.h"
 #include "qemu.h"
 
+#include "exec/exec-all.h"
+#include "disas/disas.h"
+
 
 #define EMIT_DEBUG 1
 #define DPRINTF(fmt, ...) \
     do { if (EMIT_DEBUG) error_printf("bblbrx-user cpu_loop: " fmt , ## __VA_ARGS__); } while(0)
 
 
-void cpu_loop(CPUZ80State *env)
+int cpu_loop(CPUZ80State *env)
 {
     CPUState *cs= env_cpu(env);
     int trapnr;
+    int reason;
 
     for(;;) {
-#if 1   /* WmT - TRACE */
+#if 0   /* WmT - TRACE */
 ;DPRINTF("INFO: %s() calling cpu_exec_*()...\n", __func__);
 #endif
         cpu_exec_start(cs);
@@ -32,23 +36,139 @@ void cpu_loop(CPUZ80State *env)
         {
         case EXCP_ILLOP:
             /* instruction parser is incomplete - bailing is normal */
+            if (afl_enabled)
+            {   /* ...but a fuzzer needs to see it as a crash */
+                abort();
+            }
             printf("%s() encountered EXCP_ILLOP (trapnr=%d) - aborting emulation\n", __func__, trapnr);
+            reason= BBLBRX_EXIT_ILLOP;
             break;      /* to loop-exit 'break' */
         case EXCP_KERNEL_TRAP:
             /* "magic ramtop" reached - exit and show CPU state */
+            if (afl_persistent_next(env))
+            {   /* snapshot restored, next testcase loaded */
+                continue;
+            }
             printf("Program exit. Register dump follows:\n");
+            reason= BBLBRX_EXIT_TRAP;
+            break;      /* to loop-exit 'break' */
+        case EXCP_HLT:
+            /* nothing can interrupt us - treat as exit */
+            printf("Program halted. Register dump follows:\n");
+            reason= BBLBRX_EXIT_HALT;
+            break;      /* to loop-exit 'break' */
+        case EXCP_INSN_LIMIT:
+            /* The next block would overrun the budget. Run up to the
+             * limit as a shorter block, or stop if we're already there
+             */
+            if (env->insns < env->insn_limit)
+            {
+                cs->cflags_next_tb= curr_cflags()
+                        | MIN(env->insn_limit - env->insns, CF_COUNT_MASK);
+                continue;
+            }
+            printf("Instruction limit reached. Register dump follows:\n");
+            reason= BBLBRX_EXIT_INSN_LIMIT;
+            break;      /* to loop-exit 'break' */
+        case EXCP_INTERRUPT:
+            /* cpu_exit() called - only our timeout does this */
+            if (!bblbrx_timed_out)
+            {
+                continue;
+            }
+            printf("Timeout expired. Register dump follows:\n");
+            reason= BBLBRX_EXIT_TIMEOUT;
             break;      /* to loop-exit 'break' */
         default:
             printf("qemu: cpu_exec() returned unhandled exception 0x%x at PC=0x%04x - aborting emulation\n", trapnr, env->pc);
+            z80_cpu_dump_tb_trace(cs, stderr);
             abort();
         }
 
 #if 0	/* target-i386: loop continues */
         process_pending_signals(env);
-#else	/* z80: ILLOP (incomplete parser) or KERNEL_TRAP */
+#else	/* z80: ILLOP (incomplete parser), KERNEL_TRAP or a limit */
         //cpu_dump_state(cs, stderr, fprintf, 0);
         cpu_dump_state(cs, stderr, 0);
+        if (reason == BBLBRX_EXIT_ILLOP)
+            z80_cpu_dump_tb_trace(cs, stderr);
         break;	/* exit loop */
 #endif
     }
+
+    return reason;
+}
+
+
+static void report_string(FILE *f, const char *str)
+{
+    if (str == NULL || *str == '\0')
+    {
+        fputs("null", f);
+        return;
+    }
+
+    fputc('"', f);
+    for (; *str; str++)
+    {
+        if (*str == '"' || *str == '\\')
+            fprintf(f, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            fprintf(f, "\\u%04x", *str);
+        else
+            fputc(*str, f);
+    }
+    fputc('"', f);
+}
+
+/* Machine-readable summary of the run, as a single line of JSON */
+void cpu_loop_report(FILE *f, CPUZ80State *env, int reason, double wall_time)
+{
+    static const char *const reason_names[]= {
+        [BBLBRX_EXIT_TRAP]          = "exit",
+        [BBLBRX_EXIT_HALT]          = "halt",
+        [BBLBRX_EXIT_ILLOP]         = "illegal-opcode",
+        [BBLBRX_EXIT_INSN_LIMIT]    = "icount-limit",
+        [BBLBRX_EXIT_TIMEOUT]       = "timeout",
+    };
+    static const struct {
+        const char  *name;
+        int         hi, lo;     /* regs[] indexes; -1 for none */
+    } regs[]= {
+        { "af",     R_A,    R_F },
+        { "bc",     R_BC,   -1 },
+        { "de",     R_DE,   -1 },
+        { "hl",     R_HL,   -1 },
+        { "ix",     R_IX,   -1 },
+        { "iy",     R_IY,   -1 },
+        { "sp",     R_SP,   -1 },
+        { "af'",    R_AX,   R_FX },
+        { "bc'",    R_BCX,  -1 },
+        { "de'",    R_DEX,  -1 },
+        { "hl'",    R_HLX,  -1 },
+        { "i",      R_I,    -1 },
+        { "r",      R_R,    -1 },
+    };
+    int     n;
+
+    fprintf(f, "{\"reason\": \"%s\", \"pc\": %u, \"symbol\": ",
+            reason_names[reason], (unsigned int)env->pc);
+    report_string(f, lookup_symbol(env->pc));
+
+    fputs(", \"registers\": {", f);
+    for (n= 0; n < ARRAY_SIZE(regs); n++)
+    {
+        unsigned int value= env->regs[regs[n].hi];
+
+        if (regs[n].lo >= 0)
+            value= (value << 8) | env->regs[regs[n].lo];
+        fprintf(f, "%s\"%s\": %u", n ? ", " : "", regs[n].name, value);
+    }
+    fprintf(f, ", \"iff1\": %d, \"iff2\": %d, \"im\": %d}",
+            env->iff1, env->iff2, env->imode);
+
+    fprintf(f, ", \"instructions\": %" PRIu64 ", \"tstates\": %" PRIu64
+                ", \"wall_time\": %.6f}\n",
+            env->insns, env->tstates, wall_time);
+    fflush(f);
 }
@@ -5,6 +5,12 @@
 CONFIG_ZAPHOD_HAS_IOCORE=y
 CONFIG_ZAPHOD_HAS_UART=y
 CONFIG_ZAPHOD_HAS_SCREEN=y
+CONFIG_ZAPHOD_HAS_CF=y
+CONFIG_ZAPHOD_HAS_DMA=y
+CONFIG_ZAPHOD_HAS_CTC=y
+CONFIG_ZAPHOD_HAS_SIO=y
+CONFIG_ZAPHOD_HAS_HOSTIO=y
 
 # Defines for board support:
 CONFIG_ZAPHOD=y
+CONFIG_ZAPHOD_CLUSTER=y
@@ -16,6 +16,15 @@ struct buffer
     int n_fetch;
     int n_used;
     signed char data[4];
+
+    /* set for print_insn_z80_buf(): bytes come from 'code', and text
+     * goes to 'out' rather than through info->fprintf_func
+     */
+    const uint8_t *code;
+    int code_len;
+    char *out;
+    size_t out_size;
+    size_t out_len;
 };
 
 
@@ -29,6 +38,13 @@ struct tab_elt
     const char    *text;
 };
 
+/* First matching entry for each opcode byte, per prefix page;
+ * filled from the tables below by z80_disas_init_tables()
+ */
+static const struct tab_elt *opc_main_idx[256];
+static const struct tab_elt *opc_ed_idx[256];
+static const struct tab_elt *opc_ind_idx[256];
+
 
 #define TXTSIZ 24
 /* Names of 16-bit registers.  */
@@ -52,6 +68,15 @@ int fetch_data(struct buffer *buf, disassemble_info * info, int n)
     if (buf->n_fetch + n > 4)
           abort();
 
+    if (buf->code)
+    {
+        if (buf->n_fetch + n > buf->code_len)
+            return 0;
+        memcpy(buf->data + buf->n_fetch, buf->code + buf->n_fetch, n);
+        buf->n_fetch+= n;
+        return 1;
+    }
+
     r= info->read_memory_func(buf->base + buf->n_fetch,
                             (unsigned char*) buf->data + buf->n_fetch,
                             n, info);
@@ -61,10 +86,36 @@ int fetch_data(struct buffer *buf, disassemble_info * info, int n)
     return !r;
 }
 
+static GCC_FMT_ATTR(3, 4)
+void emit(struct buffer *buf, disassemble_info *info, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    if (buf->out)
+    {
+        if (buf->out_len < buf->out_size)
+        {
+            int n= vsnprintf(buf->out + buf->out_len,
+                                buf->out_size - buf->out_len, fmt, ap);
+            if (n > 0)
+                buf->out_len= MIN(buf->out_len + n, buf->out_size - 1);
+        }
+    }
+    else
+    {
+        char txt[64];
+
+        vsnprintf(txt, sizeof txt, fmt, ap);
+        info->fprintf_func(info->stream, "%s", txt);
+    }
+    va_end(ap);
+}
+
 static
 int prt(struct buffer *buf, disassemble_info *info, const char *txt)
 {
-    info->fprintf_func(info->stream, "%s", txt);
+    emit (buf, info, "%s", txt);
     buf->n_used = buf->n_fetch;
     return 1;
 }
@@ -80,7 +131,7 @@ int prt_e (struct buffer *buf, disassemble_info * info, const char *txt)
         e = buf->data[1];
         target_addr = (buf->base + 2 + e) & 0xffff;
         buf->n_used = buf->n_fetch;
-        info->fprintf_func(info->stream, "%s0x%04x", txt, target_addr);
+        emit (buf, info, "%s0x%04x", txt, target_addr);
     }
     else
         buf->n_used = -1;
@@ -107,7 +158,7 @@ int prt_nn (struct buffer *buf, disassemble_info * info, const char *txt)
     if (fetch_data (buf, info, 2))
     {
         nn = p[0] + (p[1] << 8);
-        info->fprintf_func (info->stream, txt, nn);
+        emit (buf, info, txt, nn);
         buf->n_used = buf->n_fetch;
     }
     else
@@ -126,8 +177,8 @@ int prt_rr_nn (struct buffer *buf, disassemble_info * info, const char *txt)
 static
 int prt_rr (struct buffer *buf, disassemble_info * info, const char *txt)
 {
-    info->fprintf_func (info->stream, "%s%s", txt,
-                        rr_str[(buf->data[buf->n_fetch - 1] >> 4) & 3]);
+    emit (buf, info, "%s%s", txt,
+          rr_str[(buf->data[buf->n_fetch - 1] >> 4) & 3]);
     buf->n_used = buf->n_fetch;
     return buf->n_used;
  }
@@ -143,7 +194,7 @@ int prt_n (struct buffer *buf, disassemble_info * info, const char *txt)
     if (fetch_data (buf, info, 1))
     {
         n = p[0];
-        info->fprintf_func (info->stream, txt, n);
+        emit (buf, info, txt, n);
         buf->n_used = buf->n_fetch;
     }
     else
@@ -164,8 +215,8 @@ int ld_r_n (struct buffer *buf, disassemble_info * info, const char *txt)
 static
 int prt_r (struct buffer *buf, disassemble_info * info, const char *txt)
 {
-    info->fprintf_func (info->stream, txt,
-                        r_str[(buf->data[buf->n_fetch - 1] >> 3) & 7]);
+    emit (buf, info, txt,
+          r_str[(buf->data[buf->n_fetch - 1] >> 3) & 7]);
     buf->n_used = buf->n_fetch;
     return buf->n_used;
 }
@@ -173,9 +224,9 @@ int prt_r (struct buffer *buf, disassemble_info * info, const char *txt)
 static
 int ld_r_r (struct buffer *buf, disassemble_info * info, const char *txt)
 {
-    info->fprintf_func (info->stream, txt,
-                        r_str[(buf->data[buf->n_fetch - 1] >> 3) & 7],
-                        r_str[buf->data[buf->n_fetch - 1] & 7]);
+    emit (buf, info, txt,
+          r_str[(buf->data[buf->n_fetch - 1] >> 3) & 7],
+          r_str[buf->data[buf->n_fetch - 1] & 7]);
     buf->n_used = buf->n_fetch;
     return buf->n_used;
 }
@@ -183,9 +234,9 @@ int ld_r_r (struct buffer *buf, disassemble_info * info, const char *txt)
 static
 int arit_r (struct buffer *buf, disassemble_info * info, const char *txt)
 {
-    info->fprintf_func (info->stream, txt,
-                        arit_str[(buf->data[buf->n_fetch - 1] >> 3) & 7],
-                        r_str[buf->data[buf->n_fetch - 1] & 7]);
+    emit (buf, info, txt,
+          arit_str[(buf->data[buf->n_fetch - 1] >> 3) & 7],
+          r_str[buf->data[buf->n_fetch - 1] & 7]);
     buf->n_used = buf->n_fetch;
     return buf->n_used;
 }
@@ -193,8 +244,8 @@ int arit_r (struct buffer *buf, disassemble_info * info, const char *txt)
 static
 int prt_cc (struct buffer *buf, disassemble_info * info, const char *txt)
 {
-    info->fprintf_func (info->stream, "%s%s", txt,
-                        cc_str[(buf->data[0] >> 3) & 7]);
+    emit (buf, info, "%s%s", txt,
+          cc_str[(buf->data[0] >> 3) & 7]);
     buf->n_used = buf->n_fetch;
     return buf->n_used;
 }
@@ -204,8 +255,8 @@ int pop_rr (struct buffer *buf, disassemble_info * info, const char *txt)
 {
     static const char *rr_stack[] = { "bc","de","hl","af"};
 
-    info->fprintf_func (info->stream, "%s %s", txt,
-                        rr_stack[(buf->data[0] >> 4) & 3]);
+    emit (buf, info, "%s %s", txt,
+          rr_stack[(buf->data[0] >> 4) & 3]);
     buf->n_used = buf->n_fetch;
     return buf->n_used;
 }
@@ -232,7 +283,7 @@ int arit_n (struct buffer *buf, disassemble_info * info, const char *txt)
 static
 int rst (struct buffer *buf, disassemble_info * info, const char *txt)
 {
-    info->fprintf_func (info->stream, txt, buf->data[0] & 0x38);
+    emit (buf, info, txt, buf->data[0] & 0x38);
     buf->n_used = buf->n_fetch;
     return buf->n_used;
 }
@@ -247,10 +298,9 @@ int cis (struct buffer *buf, disassemble_info * info, const char *txt ATTRIBUTE_
 
     c = buf->data[1];
     op = ((0x13 & c) == 0x13) ? "ot" : (opar[c & 3]);
-    info->fprintf_func (info->stream,
-                        "%s%c%s", op,
-                        (c & 0x08) ? 'd' : 'i',
-                        (c & 0x10) ? "r" : "");
+    emit (buf, info, "%s%c%s", op,
+          (c & 0x08) ? 'd' : 'i',
+          (c & 0x10) ? "r" : "");
     buf->n_used = 2;
     return buf->n_used;
 }
@@ -260,16 +310,16 @@ int dump (struct buffer *buf, disassemble_info * info, const char *txt)
 {
     int i;
 
-    info->fprintf_func (info->stream, "defb ");
+    emit (buf, info, "defb ");
     for (i = 0; txt[i]; ++i)
-        info->fprintf_func (info->stream, i ? ", 0x%02x" : "0x%02x",
-                          (unsigned char) buf->data[i]);
+        emit (buf, info, i ? ", 0x%02x" : "0x%02x",
+              (unsigned char) buf->data[i]);
     buf->n_used = i;
     return buf->n_used;
 }
 
 /* Table to disassemble machine codes with prefix 0xED.  */
-struct tab_elt opc_ed[] =
+static const struct tab_elt opc_ed[] =
 {
     { 0x70, 0xFF, prt, "in f,(c)" },
     { 0x70, 0xFF, dump, "xx" },
@@ -302,12 +352,11 @@ static
 int pref_ed (struct buffer * buf, disassemble_info * info,
             const char* txt ATTRIBUTE_UNUSED)
 {
-    struct tab_elt *p;
+    const struct tab_elt *p;
 
     if (fetch_data(buf, info, 1))
     {
-        for (p = opc_ed; p->val != (buf->data[1] & p->mask); ++p)
-                           ;
+        p = opc_ed_idx[(unsigned char) buf->data[1]];
         p->fp (buf, info, p->text);
     }
     else
@@ -332,14 +381,14 @@ int pref_cb (struct buffer * buf, disassemble_info * info,
     {
         buf->n_used = 2;
         if ((buf->data[1] & 0xc0) == 0)
-            info->fprintf_func (info->stream, "%s %s",
-                                   cb2_str[(buf->data[1] >> 3) & 7],
-                                   r_str[buf->data[1] & 7]);
+            emit (buf, info, "%s %s",
+                  cb2_str[(buf->data[1] >> 3) & 7],
+                  r_str[buf->data[1] & 7]);
         else
-            info->fprintf_func (info->stream, "%s %d,%s",
-                                    cb1_str[(buf->data[1] >> 6) & 3],
-                                    (buf->data[1] >> 3) & 7,
-                                    r_str[buf->data[1] & 7]);
+            emit (buf, info, "%s %d,%s",
+                  cb1_str[(buf->data[1] >> 6) & 3],
+                  (buf->data[1] >> 3) & 7,
+                  r_str[buf->data[1] & 7]);
     }
     else
         buf->n_used = -1;
@@ -351,7 +400,7 @@ int pref_cb (struct buffer * buf, disassemble_info * info,
 static
 int addvv (struct buffer * buf, disassemble_info * info, const char* txt)
 {
-    info->fprintf_func (info->stream, "add %s,%s", txt, txt);
+    emit (buf, info, "add %s,%s", txt, txt);
 
     return buf->n_used = buf->n_fetch;
 }
@@ -376,7 +425,7 @@ int prt_d (struct buffer *buf, disassemble_info * info, const char *txt)
     if (fetch_data (buf, info, 1))
     {
         d = p[0];
-        info->fprintf_func (info->stream, txt, d);
+        emit (buf, info, txt, d);
                           buf->n_used = buf->n_fetch;
     }
     else
@@ -458,14 +507,14 @@ int pref_xd_cb (struct buffer * buf, disassemble_info * info, const char* txt)
             snprintf (arg, TXTSIZ, "(%s%+d),%s", txt, d, r_str[p[3] & 7]);
 
         if ((p[3] & 0xc0) == 0)
-            info->fprintf_func (info->stream, "%s %s",
-                                cb2_str[(buf->data[3] >> 3) & 7],
-                                arg);
+            emit (buf, info, "%s %s",
+                  cb2_str[(buf->data[3] >> 3) & 7],
+                  arg);
         else
-            info->fprintf_func (info->stream, "%s %d,%s",
-                                cb1_str[(buf->data[3] >> 6) & 3],
-                                (buf->data[3] >> 3) & 7,
-                                arg);
+            emit (buf, info, "%s %d,%s",
+                  cb1_str[(buf->data[3] >> 6) & 3],
+                  (buf->data[3] >> 3) & 7,
+                  arg);
     }
     else
         buf->n_used = -1;
@@ -475,7 +524,7 @@ int pref_xd_cb (struct buffer * buf, disassemble_info * info, const char* txt)
 
 
 /* Table to disassemble machine codes with prefix 0xDD or 0xFD.  */
-static struct tab_elt opc_ind[] =
+static const struct tab_elt opc_ind[] =
 {
     { 0x24, 0xF7, prt_r, "inc %s%%s" },
     { 0x25, 0xF7, prt_r, "dec %s%%s" },
@@ -516,10 +565,9 @@ int pref_ind (struct buffer * buf, disassemble_info * info, const char* txt)
     if (fetch_data (buf, info, 1))
     {
         char mytxt[TXTSIZ];
-        struct tab_elt *p;
+        const struct tab_elt *p;
 
-        for (p = opc_ind; p->val != (buf->data[1] & p->mask); ++p)
-            ;
+        p = opc_ind_idx[(unsigned char) buf->data[1]];
         snprintf (mytxt, TXTSIZ, p->text, txt);
         p->fp (buf, info, mytxt);
     }
@@ -531,7 +579,7 @@ int pref_ind (struct buffer * buf, disassemble_info * info, const char* txt)
 
 
 /* Table to disassemble machine codes without prefix.  */
-static struct tab_elt opc_main[] =
+static const struct tab_elt opc_main[] =
 {
 //#if 0   /* TODO: some print handlers missing */
     { 0x00, 0xFF, prt, "nop" },
@@ -595,22 +643,67 @@ static struct tab_elt opc_main[] =
     { 0x00, 0x00, prt, "????" },
 };
 
-int
-print_insn_z80(bfd_vma memaddr, disassemble_info *info)
+static const struct tab_elt *
+lookup_tab(const struct tab_elt *tab, unsigned char c)
+{
+    const struct tab_elt *p;
+
+    /* each table ends with a catch-all (mask 0x00) entry */
+    for (p= tab; p->val != (c & p->mask); ++p)
+        ;
+    return p;
+}
+
+static void __attribute__((constructor)) z80_disas_init_tables(void)
 {
-    struct buffer buf;
-    struct tab_elt *p;
+    int c;
 
-    buf.base= memaddr;
-    buf.n_fetch= 0;
-    buf.n_used= 0;
+    for (c= 0; c < 256; c++)
+    {
+        opc_main_idx[c]= lookup_tab(opc_main, c);
+        opc_ed_idx[c]= lookup_tab(opc_ed, c);
+        opc_ind_idx[c]= lookup_tab(opc_ind, c);
+    }
+}
 
-    if (!fetch_data(&buf, info, 1))
+static
+int z80_disas_insn(struct buffer *buf, disassemble_info *info)
+{
+    const struct tab_elt *p;
+
+    if (!fetch_data(buf, info, 1))
         return -1;
 
-    for (p= opc_main; p->val != (buf.data[0] & p->mask); ++p)
-        ;
-    p->fp(&buf, info, p->text);
+    p= opc_main_idx[(unsigned char) buf->data[0]];
+    p->fp(buf, info, p->text);
 
-    return buf.n_used;
+    return buf->n_used;
+}
+
+int
+print_insn_z80(bfd_vma memaddr, disassemble_info *info)
+{
+    struct buffer buf= { .base= memaddr };
+
+    return z80_disas_insn(&buf, info);
+}
+
+/* Disassembles one instruction from the 'len' bytes at 'code' into
+ * 'out' (always NUL terminated), without the per-token callbacks of
+ * print_insn_z80(). Returns the instruction length, or -1 if 'len'
+ * bytes don't cover it
+ */
+int
+print_insn_z80_buf(bfd_vma memaddr, const uint8_t *code, int len,
+                    char *out, size_t size)
+{
+    struct buffer buf= {
+        .base= memaddr,
+        .code= code, .code_len= len,
+        .out= out, .out_size= size
+    };
+
+    if (size > 0)
+        out[0]= '\0';
+    return z80_disas_insn(&buf, NULL);
 }
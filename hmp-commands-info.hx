@@ -142,6 +142,22 @@ SRST
     Show io APIC state
 ERST
 
+#if defined(TARGET_Z80)
+    {
+        .name       = "tbtrace",
+        .args_type  = "cpustate_all:-a",
+        .params     = "[-a]",
+        .help       = "show the entry PCs of the most recently executed blocks (-a: all cpus)",
+        .cmd        = hmp_info_tbtrace,
+    },
+#endif
+
+SRST
+  ``info tbtrace``
+    Show the entry PCs of the most recently executed translation blocks,
+    oldest first (Z80 only).
+ERST
+
     {
         .name       = "cpus",
         .args_type  = "",
@@ -11,13 +11,16 @@
 #include "cpu.h"
 
 #include "qemu/config-file.h"
+#include "qemu/cutils.h"
 #include "qemu/option.h"
 #include "exec/address-spaces.h"
 #include "hw/hw.h"
 #include "hw/boards.h"
 #include "hw/loader.h"
+#include "elf.h"
 #include "hw/qdev-properties.h"
 #include "sysemu/sysemu.h"
+#include "sysemu/blockdev.h"
 #include "sysemu/reset.h"
 #include "qapi/error.h"
 #include "qemu/units.h"
@@ -34,6 +37,13 @@
  */
 #define ZAPHOD_RAM_SIZE     Z80_MAX_RAM_SIZE
 
+/* EM_Z80:
+ * ELF machine number for the Zilog Z80 (not in elf.h)
+ */
+#ifndef EM_Z80
+#define EM_Z80              220
+#endif
+
 #define STRINGIFY(x) #x
 #define TOSTRING(x) STRINGIFY(x)
 
@@ -55,61 +65,183 @@ static QemuOptsList zaphod_io_opts = {
         {
             .name = "screen-type",
             .type = QEMU_OPT_STRING,
-            .help = "Screen type identifier",
+            .help = "Screen type identifier (simple, graphics, text or none)",
         },
         { /* end of list */ }
     }
 };
 
 void zaphod_interrupt_request(void *opaque, int source, int level)
-{   /* ACIA has received input */
+{   /* a device has changed the state of its /INT output */
     ZaphodMachineState  *zms= (ZaphodMachineState *)opaque;
     //CPUState            *cs= CPU(z80_env_get_cpu(zms->cpu));
     CPUState            *cs= CPU(zms->cpu);
 
     if (level)
     {
+        zms->irq_pending|= 1 << source;
         cpu_interrupt(cs, CPU_INTERRUPT_HARD);
     }
     else
+    {   /* /INT is wired-OR: released once no source drives it */
+        zms->irq_pending&= ~(1 << source);
+        if (!zms->irq_pending)
+            cpu_reset_interrupt(cs, CPU_INTERRUPT_HARD);
+    }
+}
+
+void zaphod_set_irq_ack(ZaphodMachineState *zms, int source,
+                        ZaphodIRQAckFn fn, void *opaque)
+{
+    zms->irq_ack[source].fn= fn;
+    zms->irq_ack[source].opaque= opaque;
+}
+
+/* Interrupt acknowledge cycle: returns the data bus value */
+int cpu_get_pic_interrupt(CPUZ80State *env)
+{
+    ZaphodMachineState  *zms= ZAPHOD_MACHINE(qdev_get_machine());
+    int                 source;
+
+    for (source= 0; source < ZAPHOD_IRQ_SOURCE_COUNT; source++)
     {
-        cpu_reset_interrupt(cs, CPU_INTERRUPT_HARD);
+        if (!(zms->irq_pending & (1 << source)))
+            continue;
+        if (zms->irq_ack[source].fn)
+            return zms->irq_ack[source].fn(zms->irq_ack[source].opaque);
+        break;
     }
+
+    return 0xff;
 }
 
 
-static void zaphod_load_kernel(const char *kernel_filename)
+static int zaphod_find_loader(void *opaque, QemuOpts *opts, Error **errp)
+{
+    const char *driver= qemu_opt_get(opts, "driver");
+
+    return driver && strcmp(driver, "loader") == 0;
+}
+
+/* Load '-kernel' as ELF, Intel HEX, gzip-compressed or raw binary. More
+ * segments can be added with '-device loader,file=...[,addr=...]'
+ */
+void zaphod_load_kernel(ZaphodMachineState *zms, const char *kernel_filename)
 {
     if (!kernel_filename || !kernel_filename[0])
     {
-        hw_error("No code to run - missing '-kernel' argument");
+        if (!qemu_opts_foreach(qemu_find_opts("device"),
+                                zaphod_find_loader, NULL, NULL))
+            hw_error("No code to run - missing '-kernel' argument");
     }
     else
     {
-        int   kernel_size;
+        const char  *format;
+        uint64_t    elf_entry;
+        hwaddr      hex_entry= 0;   /* as raw, without a start record */
+        int         image_size, kernel_size;
 
-        kernel_size= get_image_size(kernel_filename);
-        if (kernel_size <= 0)
+        image_size= get_image_size(kernel_filename);
+        if (image_size <= 0)
         {
-            hw_error("%s(): Kernel with bad size specified - %s\n", __func__, (kernel_size == 0)? "file empty" : "file missing?");
+            hw_error("%s(): Kernel with bad size specified - %s\n", __func__, (image_size == 0)? "file empty" : "file missing?");
         }
 
-        kernel_size= load_image_targphys(kernel_filename, 0, kernel_size);
-        if (kernel_size < 0) {
-            hw_error("Couldn't load kernel file '%s'", kernel_filename);
+        /* NB: load_elf() fails, rather than returning NOT_ELF, for
+         * images shorter than an ELF identifier
+         */
+        kernel_size= ELF_LOAD_NOT_ELF;
+        if (image_size >= EI_NIDENT)
+            kernel_size= load_elf(kernel_filename, NULL, NULL, NULL,
+                                    &elf_entry, NULL, NULL, NULL,
+                                    0, EM_Z80, 0, 0);
+        if (kernel_size >= 0)
+        {
+            format= "ELF";
+            if (elf_entry >= ZAPHOD_RAM_SIZE)
+                hw_error("ELF kernel '%s' has start address 0x%" PRIx64 " outside the address space", kernel_filename, elf_entry);
+            zms->reset_pc= elf_entry;
+        }
+        else if (kernel_size != ELF_LOAD_NOT_ELF)
+        {
+            hw_error("Couldn't load ELF kernel '%s': %s", kernel_filename, load_elf_strerror(kernel_size));
+        }
+        else if (g_str_has_suffix(kernel_filename, ".hex")
+                || g_str_has_suffix(kernel_filename, ".ihx"))
+        {   /* SDCC and z88dk emit Intel HEX as .ihx */
+            format= "Intel HEX";
+            kernel_size= load_targphys_hex_as(kernel_filename, &hex_entry, NULL);
+            if (kernel_size < 0)
+                hw_error("Couldn't load Intel HEX kernel '%s'", kernel_filename);
+            if (hex_entry >= ZAPHOD_RAM_SIZE)
+                hw_error("Intel HEX kernel '%s' has start address 0x%" HWADDR_PRIx " outside the address space", kernel_filename, hex_entry);
+            zms->reset_pc= hex_entry;
+        }
+        else if ((kernel_size= load_image_gzipped(kernel_filename, 0,
+                                                ZAPHOD_RAM_SIZE)) >= 0)
+        {
+            format= "gzip";
+        }
+        else
+        {
+            format= "raw";
+            kernel_size= load_image_targphys(kernel_filename, 0, image_size);
+            if (kernel_size < 0) {
+                hw_error("Couldn't load kernel file '%s'", kernel_filename);
+            }
         }
 
 #if 1   /* WmT - TRACE */
-;DPRINTF("INFO: %s(): Kernel size %d bytes\n", __func__, kernel_size);
+;DPRINTF("INFO: %s(): Kernel size %d bytes (%s), entry 0x%04x\n", __func__, kernel_size, format, zms->reset_pc);
 #endif
     }
 }
 
+/* With '-machine warm-tb=on', translate the code reachable from the
+ * reset, RST and NMI vectors ahead of time - limited to ROM if any
+ * is given, as RAM contents may yet change
+ */
+static bool zaphod_warm_filter(void *opaque, uint16_t pc)
+{
+    ZaphodMachineState *zms= (ZaphodMachineState *)opaque;
+    int n;
+
+    if (zms->rom_count == 0)
+        return true;
+    for (n= 0; n < zms->rom_count; n++)
+    {
+        if (pc >= zms->rom[n].base && pc - zms->rom[n].base < zms->rom[n].size)
+            return true;
+    }
+    return false;
+}
+
+void zaphod_warm_tb_cache(ZaphodMachineState *zms, Z80CPU *cpu)
+{
+    uint16_t entry[10];
+    int n, count= 0;
+
+    if (!zms->warm_tb)
+        return;
+
+    entry[count++]= zms->reset_pc;
+    for (n= 0; n < 8; n++)
+        entry[count++]= n * 8;          /* RST n; IM 1 uses 0x38 */
+    entry[count++]= 0x66;               /* NMI */
+    z80_cpu_warm_tb_cache(cpu, entry, count, zaphod_warm_filter, zms);
+}
+
 static void main_cpu_reset(void *opaque)
 {
-    Z80CPU *cpu = opaque;
+    ZaphodMachineState *zms= (ZaphodMachineState *)opaque;
+    CPUState *cs= CPU(zms->cpu);
 
-    cpu_reset(CPU(cpu));
+    cpu_reset(cs);
+    cpu_set_pc(cs, zms->reset_pc);
+    /* runs on the vCPU thread once all reset handlers (including
+     * the loaders' ROM copies) are done
+     */
+    zaphod_warm_tb_cache(zms, zms->cpu);
 }
 
 
@@ -133,6 +265,7 @@ static bool zaphod_board_has_screen(int board_type)
     {
     case ZAPHOD_BOARD_TYPE_ZAPHOD_1:
     case ZAPHOD_BOARD_TYPE_ZAPHOD_2:
+    case ZAPHOD_BOARD_TYPE_ZAPHOD_RC:
         return false;
     case ZAPHOD_BOARD_TYPE_ZAPHOD_DEV:
     default:
@@ -153,6 +286,75 @@ static bool zaphod_board_has_stdio(int board_type)
     }
 }
 
+#ifdef CONFIG_ZAPHOD_HAS_DMA
+static bool zaphod_board_has_dma(int board_type)
+{
+    switch (board_type)
+    {
+    case ZAPHOD_BOARD_TYPE_ZAPHOD_DEV:
+        return true;
+    default:
+        return false;
+    }
+}
+#endif
+
+#ifdef CONFIG_ZAPHOD_HAS_CTC
+static bool zaphod_board_has_ctc(int board_type)
+{
+    switch (board_type)
+    {
+    case ZAPHOD_BOARD_TYPE_ZAPHOD_DEV:
+    case ZAPHOD_BOARD_TYPE_ZAPHOD_RC:
+        return true;
+    default:
+        return false;
+    }
+}
+#endif
+
+#ifdef CONFIG_ZAPHOD_HAS_CF
+static bool zaphod_board_has_cf(int board_type)
+{
+    switch (board_type)
+    {
+    case ZAPHOD_BOARD_TYPE_ZAPHOD_2:
+    case ZAPHOD_BOARD_TYPE_ZAPHOD_DEV:
+    case ZAPHOD_BOARD_TYPE_ZAPHOD_RC:
+        return true;
+    default:
+        return false;
+    }
+}
+#endif
+
+#ifdef CONFIG_ZAPHOD_HAS_SIO
+static bool zaphod_board_has_sio(int board_type)
+{
+    switch (board_type)
+    {
+    case ZAPHOD_BOARD_TYPE_ZAPHOD_RC:
+        return true;
+    default:
+        return false;
+    }
+}
+#endif
+
+#ifdef CONFIG_ZAPHOD_HAS_HOSTIO
+static bool zaphod_board_has_hostio(int board_type)
+{
+    switch (board_type)
+    {
+    case ZAPHOD_BOARD_TYPE_ZAPHOD_DEV:
+    case ZAPHOD_BOARD_TYPE_ZAPHOD_RC:
+        return true;
+    default:
+        return false;
+    }
+}
+#endif
+
 /* Initialise UART object */
 static void zaphod_uart_init(ZaphodUARTState *zus, Chardev *chr_fallback, const char *label)
 {
@@ -182,6 +384,10 @@ void zaphod_screen_set_type(ZaphodScreenState *zss, const char *type_id, const c
     {
         qdev_prop_set_bit(DEVICE(zss), "simple-escape-codes", false);
     }
+    else if (type_id && strcmp(type_id, "text") == 0)
+    {   /* headless: contents via query-zaphod-screen and QMP events */
+        qdev_prop_set_bit(DEVICE(zss), "text-only", true);
+    }
 }
 
 static int zaphod_peripherals_init(void *opaque, QemuOpts *opts, Error **errp)
@@ -261,6 +467,23 @@ static void zaphod_iocore_init(ZaphodMachineState *zms)
                         zaphod_board_has_stdio(zmc->board_type));
     qdev_prop_set_bit(DEVICE(zms->iocore), "has-acia",
                         zaphod_board_has_acia(zmc->board_type));
+#ifdef CONFIG_ZAPHOD_HAS_DMA
+    if (zaphod_board_has_dma(zmc->board_type))
+        zms->iocore->dma= ZAPHOD_DMA(object_new(TYPE_ZAPHOD_DMA));
+#endif
+#ifdef CONFIG_ZAPHOD_HAS_CTC
+    if (zaphod_board_has_ctc(zmc->board_type))
+        zms->iocore->ctc= ZAPHOD_CTC(object_new(TYPE_ZAPHOD_CTC));
+#endif
+#ifdef CONFIG_ZAPHOD_HAS_SIO
+    if (zaphod_board_has_sio(zmc->board_type))
+        zms->iocore->sio= ZAPHOD_SIO(object_new(TYPE_ZAPHOD_SIO));
+#endif
+#ifdef CONFIG_ZAPHOD_HAS_HOSTIO
+    /* files are only reachable with '-global zaphod-hostio.root=DIR' */
+    if (zaphod_board_has_hostio(zmc->board_type))
+        zms->iocore->hostio= ZAPHOD_HOSTIO(object_new(TYPE_ZAPHOD_HOSTIO));
+#endif
 
 
     /* Enable stdio and ACIA UARTs if relevant opts are used */
@@ -297,6 +520,131 @@ static void zaphod_iocore_init(ZaphodMachineState *zms)
                 uart_count++;
         }
     }
+
+#ifdef CONFIG_ZAPHOD_HAS_SIO
+    if (zms->iocore->sio)
+    {   /* SIO channel A is the console; B is connected if given */
+        DeviceState *dev= DEVICE(zms->iocore->sio);
+        Chardev     *chr;
+
+        if ((chr= serial_hd(uart_count)) == NULL)
+        {
+#if QEMU_VERSION_MAJOR < 5
+            chr= qemu_chr_new("zaphod.sio-a", "vc:" TOSTRING(ZAPHOD_TEXT_COLS) "Cx" TOSTRING(ZAPHOD_TEXT_ROWS) "C");
+#else
+            chr= qemu_chr_new("zaphod.sio-a", "vc:" TOSTRING(ZAPHOD_TEXT_COLS) "Cx" TOSTRING(ZAPHOD_TEXT_ROWS) "C", NULL);
+#endif
+        }
+        qdev_prop_set_chr(dev, "chardev-a", chr);
+        if ((chr= serial_hd(uart_count + 1)) != NULL)
+            qdev_prop_set_chr(dev, "chardev-b", chr);
+    }
+#endif
+}
+
+
+#ifdef CONFIG_ZAPHOD_HAS_CF
+/* Fit a CompactFlash interface if the board has one and a drive
+ * is given, e.g. '-drive if=ide,format=qcow2,file=cpm.qcow2'
+ */
+static void zaphod_cf_init(ZaphodMachineState *zms)
+{
+    ZaphodMachineClass *zmc = ZAPHOD_MACHINE_GET_CLASS(zms);
+    DriveInfo *dinfo;
+
+    if (!zaphod_board_has_cf(zmc->board_type))
+        return;
+    if ((dinfo= drive_get(IF_IDE, 0, 0)) == NULL)
+        return;
+
+    zms->cf= ZAPHOD_CF(object_new(TYPE_ZAPHOD_CF));
+    qdev_prop_set_drive(DEVICE(zms->cf), "drive", blk_by_legacy_dinfo(dinfo));
+    qdev_realize(DEVICE(zms->cf), NULL, &error_fatal);
+}
+#endif
+
+
+/* ROM: '-machine rom=START-END[:START-END...]', page aligned */
+static void zaphod_rom_init(ZaphodMachineState *zms, MemoryRegion *sysmem)
+{
+    int n;
+
+    for (n= 0; n < zms->rom_count; n++)
+    {
+        MemoryRegion    *rom= g_new(MemoryRegion, 1);
+        char            *name= g_strdup_printf("zaphod.rom%d", n);
+
+        memory_region_init_rom(rom, NULL, name, zms->rom[n].size,
+                                &error_fatal);
+        memory_region_add_subregion_overlap(sysmem, zms->rom[n].base,
+                                            rom, 1);
+        g_free(name);
+    }
+}
+
+static char *zaphod_get_rom(Object *obj, Error **errp)
+{
+    ZaphodMachineState *zms= ZAPHOD_MACHINE(obj);
+
+    return g_strdup(zms->rom_spec);
+}
+
+static void zaphod_set_rom(Object *obj, const char *value, Error **errp)
+{
+    ZaphodMachineState *zms= ZAPHOD_MACHINE(obj);
+    gchar **ranges= g_strsplit(value, ":", -1);
+    typeof(zms->rom) rom;   /* nothing changes unless all ranges are valid */
+    int n;
+
+    for (n= 0; ranges[n]; n++)
+    {
+        const char *p= ranges[n];
+        uint64_t start, end;
+
+        if (n == ZAPHOD_ROM_MAX)
+        {
+            error_setg(errp, "rom: at most %d ranges", ZAPHOD_ROM_MAX);
+            goto out;
+        }
+        if (qemu_strtou64(p, &p, 0, &start) < 0 || *p++ != '-'
+                || qemu_strtou64(p, &p, 0, &end) < 0 || *p != '\0'
+                || end < start || end >= Z80_MAX_RAM_SIZE)
+        {
+            error_setg(errp, "rom: '%s' is not START-END within 64KiB",
+                        ranges[n]);
+            goto out;
+        }
+        if ((start | (end + 1)) & ~TARGET_PAGE_MASK)
+        {
+            error_setg(errp, "rom: '%s' must be aligned to 0x%x",
+                        ranges[n], (unsigned)TARGET_PAGE_SIZE);
+            goto out;
+        }
+        rom[n].base= start;
+        rom[n].size= end + 1 - start;
+    }
+
+    memcpy(zms->rom, rom, n * sizeof(rom[0]));
+    zms->rom_count= n;
+    g_free(zms->rom_spec);
+    zms->rom_spec= g_strdup(value);
+out:
+    g_strfreev(ranges);
+}
+
+
+static bool zaphod_get_warm_tb(Object *obj, Error **errp)
+{
+    ZaphodMachineState *zms= ZAPHOD_MACHINE(obj);
+
+    return zms->warm_tb;
+}
+
+static void zaphod_set_warm_tb(Object *obj, bool value, Error **errp)
+{
+    ZaphodMachineState *zms= ZAPHOD_MACHINE(obj);
+
+    zms->warm_tb= value;
 }
 
 
@@ -315,7 +663,7 @@ static void zaphod_board_init(MachineState *ms)
 
     cs= cpu_create(ms->cpu_type);
     zms->cpu = Z80_CPU(cs);
-    qemu_register_reset(main_cpu_reset, zms->cpu);
+    qemu_register_reset(main_cpu_reset, zms);
 
     /* QEmu v5: reset has happened */
     //cpu_reset(cs);
@@ -333,10 +681,13 @@ static void zaphod_board_init(MachineState *ms)
     memory_region_init_ram(ram, NULL, "zaphod.ram",
                             ZAPHOD_RAM_SIZE, &error_fatal);
     /* Leaving the entire 64KiB memory space writable supports
-     * self-modifying test code. Call memory_region_set_readonly()
-     * for ROM regions,
+     * self-modifying test code. Ranges given with '-machine rom='
+     * are overlaid with ROM, which the loaders below can still fill
+     * but the guest can't write - sparing the TCG code invalidation
+     * checks on stores for firmware pages
      */
     memory_region_add_subregion(address_space_mem, 0x0000, ram);
+    zaphod_rom_init(zms, address_space_mem);
 
 
     /* Initialise ports/devices */
@@ -353,14 +704,30 @@ static void zaphod_board_init(MachineState *ms)
 #else
     qdev_realize(DEVICE(zms->iocore), NULL, NULL);
 #endif
+#endif
+#ifdef CONFIG_ZAPHOD_HAS_CF
+    zaphod_cf_init(zms);
 #endif
 
     /* Populate RAM */
 
-    zaphod_load_kernel(kernel_filename);
+    zaphod_load_kernel(zms, kernel_filename);
 }
 
 
+static void zaphod_machine_class_init(ObjectClass *oc, void *data)
+{
+    object_class_property_add_str(oc, "rom",
+                                    zaphod_get_rom, zaphod_set_rom);
+    object_class_property_set_description(oc, "rom",
+                "Read-only ranges, as START-END[:START-END...]");
+    object_class_property_add_bool(oc, "warm-tb",
+                                    zaphod_get_warm_tb, zaphod_set_warm_tb);
+    object_class_property_set_description(oc, "warm-tb",
+                "Translate code reachable from the reset and RST vectors "
+                "before it first runs");
+}
+
 static void zaphod_machine_state_init(Object *obj)
 {
 #if 1   /* WmT - TRACE */
@@ -373,7 +740,9 @@ static const char *board_type_name(const int board_type)
     const char *names[]= {
         [ZAPHOD_BOARD_TYPE_ZAPHOD_1]    = "Zaphod 1 (Phil Brown emulator)",
         [ZAPHOD_BOARD_TYPE_ZAPHOD_2]    = "Zaphod 2 (Grant Searle SBC)",
-        [ZAPHOD_BOARD_TYPE_ZAPHOD_DEV]  = "Zaphod Development"
+        [ZAPHOD_BOARD_TYPE_ZAPHOD_DEV]  = "Zaphod Development",
+        [ZAPHOD_BOARD_TYPE_ZAPHOD_RC]   = "Zaphod RC (RC2014-style SIO/2)",
+        [ZAPHOD_BOARD_TYPE_ZAPHOD_CLUSTER] = "Zaphod cluster (one node per CPU)"
     };
 
     if (board_type < ARRAY_SIZE(names))
@@ -382,7 +751,7 @@ static const char *board_type_name(const int board_type)
     return names[0];
 }
 
-static void zaphod_common_machine_class_init(ObjectClass *oc,
+void zaphod_common_machine_class_init(ObjectClass *oc,
                                     bool set_default, int board_type)
 {
     MachineClass *mc = MACHINE_CLASS(oc);
@@ -405,6 +774,11 @@ static void zaphod_common_machine_class_init(ObjectClass *oc,
     mc->max_cpus= mc->default_cpus;
     mc->default_ram_size= ZAPHOD_RAM_SIZE;
 
+#ifdef CONFIG_ZAPHOD_HAS_CF
+    /* '-drive' defaults to the CF slot, where there is one */
+    if (zaphod_board_has_cf(board_type))
+        mc->block_default_type= IF_IDE;
+#endif
     mc->no_floppy= 1;
     mc->no_cdrom= 1;
     mc->no_parallel= 1;
@@ -439,6 +813,15 @@ static void zaphod_dev_machine_class_init(ObjectClass *oc, void *data)
     zaphod_common_machine_class_init(oc, true, zmc->board_type);
 }
 
+static void zaphod_rc_machine_class_init(ObjectClass *oc, void *data)
+{
+    ZaphodMachineClass *zmc= ZAPHOD_MACHINE_CLASS(oc);
+
+    zmc->board_type= ZAPHOD_BOARD_TYPE_ZAPHOD_RC;
+
+    zaphod_common_machine_class_init(oc, false, zmc->board_type);
+}
+
 
 /* TODO: support board variants:
  * - "zaphod-pb" -- Phil Brown machine simulation
@@ -451,7 +834,7 @@ static const TypeInfo zaphod_machine_types[]= {
         .parent         = TYPE_MACHINE,
         .abstract       = true,
         .class_size     = sizeof(ZaphodMachineClass),
-        //.class_init     = zaphod_machine_class_init,
+        .class_init     = zaphod_machine_class_init,
         .instance_size  = sizeof(ZaphodMachineState),
         .instance_init  = zaphod_machine_state_init,
     }, {    /* Phil Brown emulator */
@@ -469,6 +852,11 @@ static const TypeInfo zaphod_machine_types[]= {
         .parent= TYPE_ZAPHOD_MACHINE,
         .class_size     = sizeof(ZaphodMachineClass),
         .class_init= zaphod_dev_machine_class_init
+    }, {    /* RC2014-style, SIO/2 serial on both channels */
+        .name= MACHINE_TYPE_NAME("zaphod-rc"),
+        .parent= TYPE_ZAPHOD_MACHINE,
+        .class_size     = sizeof(ZaphodMachineClass),
+        .class_init= zaphod_rc_machine_class_init
     }
 };
 
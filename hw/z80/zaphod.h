@@ -24,6 +24,9 @@
 #ifdef CONFIG_ZAPHOD_HAS_UART
 #include "zaphod_uart.h"
 #endif
+#ifdef CONFIG_ZAPHOD_HAS_CF
+#include "zaphod_cf.h"
+#endif
 
 
 /* Z80_MAX_RAM_SIZE:
@@ -34,11 +37,34 @@
 #endif
 #define Z80_MAX_RAM_SIZE    (64 * KiB)
 
+/* ZAPHOD_ROM_MAX:
+ * Number of read-only ranges that can be given with '-machine rom='
+ */
+#define ZAPHOD_ROM_MAX      8
+
+
+/* Interrupt sources, in daisy chain priority order (highest first).
+ * On acknowledge, the highest priority source asserting /INT may put
+ * a vector on the data bus for IM2 (or an RST opcode for IM0)
+ */
+enum zaphod_irq_source_t {
+    ZAPHOD_IRQ_DMA,
+    ZAPHOD_IRQ_CTC,
+    ZAPHOD_IRQ_SIO,
+    ZAPHOD_IRQ_HOSTIO,
+    ZAPHOD_IRQ_ACIA,                /* MC6850: no vector, bus floats */
+    ZAPHOD_IRQ_SOURCE_COUNT
+};
+
+typedef uint8_t (*ZaphodIRQAckFn)(void *opaque);
+
 
 enum zaphod_board_type_t {
     ZAPHOD_BOARD_TYPE_ZAPHOD_1,     /* Phil Brown emulator */
     ZAPHOD_BOARD_TYPE_ZAPHOD_2,     /* Grant Searle SBC sim */
-    ZAPHOD_BOARD_TYPE_ZAPHOD_DEV    /* Board for development/testing */
+    ZAPHOD_BOARD_TYPE_ZAPHOD_DEV,   /* Board for development/testing */
+    ZAPHOD_BOARD_TYPE_ZAPHOD_RC,    /* RC2014-style, with SIO/2 */
+    ZAPHOD_BOARD_TYPE_ZAPHOD_CLUSTER /* many 'zaphod-pb' nodes */
 };
 
 
@@ -59,6 +85,22 @@ typedef struct ZaphodMachineState {
 #ifdef CONFIG_ZAPHOD_HAS_IOCORE
     ZaphodIOCoreState   *iocore;
 #endif
+#ifdef CONFIG_ZAPHOD_HAS_CF
+    ZaphodCFState       *cf;
+#endif
+    char                *rom_spec;      /* as given */
+    int                 rom_count;
+    struct {
+        uint32_t        base;
+        uint32_t        size;
+    }                   rom[ZAPHOD_ROM_MAX];
+    uint16_t            reset_pc;       /* image entry point */
+    bool                warm_tb;        /* pre-translate at reset */
+    uint32_t            irq_pending;    /* (1 << ZAPHOD_IRQ_*) */
+    struct {
+        ZaphodIRQAckFn  fn;
+        void            *opaque;
+    }                   irq_ack[ZAPHOD_IRQ_SOURCE_COUNT];
 } ZaphodMachineState;
 
 
@@ -72,7 +114,13 @@ typedef struct ZaphodMachineState {
     OBJECT_GET_CLASS(ZaphodMachineClass, (obj), TYPE_ZAPHOD_MACHINE)
 
 
+void zaphod_common_machine_class_init(ObjectClass *oc,
+                                    bool set_default, int board_type);
+void zaphod_load_kernel(ZaphodMachineState *zms, const char *kernel_filename);
+void zaphod_warm_tb_cache(ZaphodMachineState *zms, Z80CPU *cpu);
 void zaphod_interrupt_request(void *opaque, int source, int level);
+void zaphod_set_irq_ack(ZaphodMachineState *zms, int source,
+                        ZaphodIRQAckFn fn, void *opaque);
 
 
 #endif  /* HW_Z80_ZAPHOD_H */
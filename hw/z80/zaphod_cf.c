@@ -0,0 +1,515 @@
+/*
+ * QEmu Zaphod board - CompactFlash support
+ * vim: ft=c sw=4 ts=4 et :
+ *
+ * [...William Towle c. 2013-2022, under GPL...]
+ */
+
+
+#include "qemu/osdep.h"
+#include "zaphod.h"
+
+#include "qemu/error-report.h"
+#include "exec/address-spaces.h"
+#include "hw/qdev-properties.h"
+#include "qapi/error.h"
+#include "sysemu/reset.h"
+
+
+//#define EMIT_DEBUG ZAPHOD_DEBUG
+#define EMIT_DEBUG 0
+#define DPRINTF(fmt, ...) \
+    do { if (EMIT_DEBUG) error_printf("zaphod_cf: " fmt , ## __VA_ARGS__); } while(0)
+
+
+/* Grant Searle's CP/M board attaches a CompactFlash card in "True IDE"
+ * mode via an 8-bit interface, polling BSY/DRQ rather than taking an
+ * interrupt. Sector transfers are staged in a buffer that the data
+ * register drains or fills a byte at a time; the buffer is read from
+ * or written to the BlockBackend as one asynchronous request, so
+ * cache modes, I/O throttling and accounting all come from '-drive'.
+ * Only LBA addressing is supported - the Searle BIOS selects it
+ */
+
+static int64_t zaphod_cf_get_sector(ZaphodCFState *zcs)
+{
+    return ((int64_t)(zcs->select & 0x0f) << 24)
+            | (zcs->lba[2] << 16) | (zcs->lba[1] << 8) | zcs->lba[0];
+}
+
+static void zaphod_cf_set_sector(ZaphodCFState *zcs, int64_t sector)
+{
+    zcs->select= (zcs->select & 0xf0) | ((sector >> 24) & 0x0f);
+    zcs->lba[2]= sector >> 16;
+    zcs->lba[1]= sector >> 8;
+    zcs->lba[0]= sector;
+}
+
+static int zaphod_cf_get_count(ZaphodCFState *zcs)
+{
+    return zcs->nsector ? zcs->nsector : ZAPHOD_CF_MAX_SECTORS;
+}
+
+static bool zaphod_cf_is_write(uint8_t cmd)
+{
+    return cmd == CF_CMD_WRITE_SECTORS || cmd == CF_CMD_WRITE_SECTORS_NR;
+}
+
+static void zaphod_cf_abort(ZaphodCFState *zcs, uint8_t error)
+{
+    zcs->error= error;
+    zcs->status= CF_STAT_DRDY | CF_STAT_DSC | CF_STAT_ERR;
+    zcs->buf_pos= zcs->buf_len= 0;
+}
+
+static void zaphod_cf_ready(ZaphodCFState *zcs)
+{
+    zcs->status= CF_STAT_DRDY | CF_STAT_DSC;
+    zcs->buf_pos= zcs->buf_len= 0;
+}
+
+/* Hand 'len' buffered bytes to the guest through the data register */
+static void zaphod_cf_transfer(ZaphodCFState *zcs, uint32_t len)
+{
+    zcs->buf_pos= 0;
+    zcs->buf_len= len;
+    zcs->status= CF_STAT_DRDY | CF_STAT_DSC | CF_STAT_DRQ;
+}
+
+
+/* Asynchronous I/O */
+
+static void zaphod_cf_aio_cb(void *opaque, int ret)
+{
+    ZaphodCFState   *zcs= (ZaphodCFState *)opaque;
+    int             count= zcs->xfer_count;
+
+    zcs->aiocb= NULL;
+
+    if (ret < 0)
+    {
+#if 1   /* WmT - TRACE */
+;DPRINTF("%s(): command 0x%02x failed at sector %" PRId64 " (%s)\n", __func__, zcs->cmd, zcs->xfer_sector, strerror(-ret));
+#endif
+        block_acct_failed(blk_get_stats(zcs->blk), &zcs->acct);
+        zaphod_cf_abort(zcs, (zcs->cmd == CF_CMD_FLUSH_CACHE
+                                || zaphod_cf_is_write(zcs->cmd))
+                                ? CF_ERR_ABRT : CF_ERR_UNC);
+        return;
+    }
+    block_acct_done(blk_get_stats(zcs->blk), &zcs->acct);
+
+    switch (zcs->cmd)
+    {
+    case CF_CMD_READ_SECTORS:
+    case CF_CMD_READ_SECTORS_NR:
+        /* registers report the last sector transferred */
+        zaphod_cf_set_sector(zcs, zcs->xfer_sector + count - 1);
+        zaphod_cf_transfer(zcs, count * ZAPHOD_CF_SECTOR_SIZE);
+        break;
+    case CF_CMD_WRITE_SECTORS:
+    case CF_CMD_WRITE_SECTORS_NR:
+        zaphod_cf_set_sector(zcs, zcs->xfer_sector + count - 1);
+        zaphod_cf_ready(zcs);
+        break;
+    default:
+        zaphod_cf_ready(zcs);
+        break;
+    }
+}
+
+static bool zaphod_cf_check_range(ZaphodCFState *zcs)
+{
+    int64_t     sector= zaphod_cf_get_sector(zcs);
+
+    if (!(zcs->select & CF_SEL_LBA)
+            || sector + zaphod_cf_get_count(zcs) > zcs->nb_sectors)
+    {
+#if 1   /* WmT - TRACE */
+;DPRINTF("%s(): rejecting access to sector %" PRId64 " (select 0x%02x)\n", __func__, sector, zcs->select);
+#endif
+        zaphod_cf_abort(zcs, CF_ERR_IDNF | CF_ERR_ABRT);
+        return false;
+    }
+
+    zcs->xfer_sector= sector;
+    zcs->xfer_count= zaphod_cf_get_count(zcs);
+    return true;
+}
+
+static void zaphod_cf_start_read(ZaphodCFState *zcs)
+{
+    uint32_t    len;
+
+    if (!zaphod_cf_check_range(zcs))
+        return;
+    len= zcs->xfer_count * ZAPHOD_CF_SECTOR_SIZE;
+
+    zcs->status= CF_STAT_BSY;
+    qemu_iovec_init_buf(&zcs->qiov, zcs->buf, len);
+    block_acct_start(blk_get_stats(zcs->blk), &zcs->acct,
+                        len, BLOCK_ACCT_READ);
+    zcs->aiocb= blk_aio_preadv(zcs->blk,
+                        zcs->xfer_sector * ZAPHOD_CF_SECTOR_SIZE,
+                        &zcs->qiov, 0, zaphod_cf_aio_cb, zcs);
+}
+
+static void zaphod_cf_start_write(ZaphodCFState *zcs)
+{
+    if (blk_is_read_only(zcs->blk))
+    {
+        zaphod_cf_abort(zcs, CF_ERR_ABRT);
+        return;
+    }
+    if (!zaphod_cf_check_range(zcs))
+        return;
+
+    /* the request is issued once the guest has filled the buffer */
+    zaphod_cf_transfer(zcs, zcs->xfer_count * ZAPHOD_CF_SECTOR_SIZE);
+}
+
+static void zaphod_cf_submit_write(ZaphodCFState *zcs)
+{
+    zcs->status= CF_STAT_BSY;
+    qemu_iovec_init_buf(&zcs->qiov, zcs->buf, zcs->buf_len);
+    block_acct_start(blk_get_stats(zcs->blk), &zcs->acct,
+                        zcs->buf_len, BLOCK_ACCT_WRITE);
+    zcs->aiocb= blk_aio_pwritev(zcs->blk,
+                        zcs->xfer_sector * ZAPHOD_CF_SECTOR_SIZE,
+                        &zcs->qiov, 0, zaphod_cf_aio_cb, zcs);
+}
+
+static void zaphod_cf_start_flush(ZaphodCFState *zcs)
+{
+    zcs->status= CF_STAT_BSY;
+    block_acct_start(blk_get_stats(zcs->blk), &zcs->acct,
+                        0, BLOCK_ACCT_FLUSH);
+    zcs->aiocb= blk_aio_flush(zcs->blk, zaphod_cf_aio_cb, zcs);
+}
+
+
+/* IDENTIFY DEVICE */
+
+static void zaphod_cf_padstr(uint8_t *p, const char *src, int len)
+{   /* ATA strings hold the first of each character pair in the MSB */
+    int i;
+
+    for (i= 0; i < len; i++)
+        p[i ^ 1]= *src ? *src++ : ' ';
+}
+
+static void zaphod_cf_identify(ZaphodCFState *zcs)
+{
+    uint8_t     *p= zcs->buf;
+    uint32_t    lba_sectors= MIN(zcs->nb_sectors, 0x0fffffff);
+    uint32_t    heads= 16, spt= 63;
+    uint32_t    cyls= MIN(lba_sectors / (heads * spt), 16383);
+
+    memset(p, 0, ZAPHOD_CF_SECTOR_SIZE);
+
+    stw_le_p(p + 0 * 2, 0x848a);                /* CFA signature */
+    stw_le_p(p + 1 * 2, cyls);
+    stw_le_p(p + 3 * 2, heads);
+    stw_le_p(p + 6 * 2, spt);
+    stw_le_p(p + 7 * 2, lba_sectors >> 16);     /* sectors per card */
+    stw_le_p(p + 8 * 2, lba_sectors);
+    zaphod_cf_padstr(p + 10 * 2, "ZCF00001", 20);
+    zaphod_cf_padstr(p + 23 * 2, qemu_hw_version(), 8);
+    zaphod_cf_padstr(p + 27 * 2, "QEMU ZAPHOD CF", 40);
+    stw_le_p(p + 47 * 2, 0x0001);               /* one sector/interrupt */
+    stw_le_p(p + 49 * 2, 0x0200);               /* LBA supported */
+    stw_le_p(p + 53 * 2, 0x0001);               /* words 54-58 valid */
+    stw_le_p(p + 54 * 2, cyls);
+    stw_le_p(p + 55 * 2, heads);
+    stw_le_p(p + 56 * 2, spt);
+    stw_le_p(p + 57 * 2, cyls * heads * spt);
+    stw_le_p(p + 58 * 2, (cyls * heads * spt) >> 16);
+    stw_le_p(p + 60 * 2, lba_sectors);
+    stw_le_p(p + 61 * 2, lba_sectors >> 16);
+    stw_le_p(p + 82 * 2, 0x0020);               /* write cache supported */
+    stw_le_p(p + 83 * 2, 0x5000);               /* FLUSH CACHE supported */
+    stw_le_p(p + 84 * 2, 0x4000);
+    stw_le_p(p + 85 * 2,
+                blk_enable_write_cache(zcs->blk) ? 0x0020 : 0x0000);
+    stw_le_p(p + 86 * 2, 0x1000);
+    stw_le_p(p + 87 * 2, 0x4000);
+
+    zaphod_cf_transfer(zcs, ZAPHOD_CF_SECTOR_SIZE);
+}
+
+
+static void zaphod_cf_set_features(ZaphodCFState *zcs)
+{
+    switch (zcs->features)
+    {
+    case CF_FEAT_8BIT_ON:
+    case CF_FEAT_8BIT_OFF:
+        /* the interface is 8-bit regardless */
+        zaphod_cf_ready(zcs);
+        break;
+    case CF_FEAT_WCACHE_ON:
+    case CF_FEAT_WCACHE_OFF:
+        blk_set_enable_write_cache(zcs->blk,
+                                    zcs->features == CF_FEAT_WCACHE_ON);
+        zaphod_cf_ready(zcs);
+        break;
+    default:
+        zaphod_cf_abort(zcs, CF_ERR_ABRT);
+        break;
+    }
+}
+
+static void zaphod_cf_command(ZaphodCFState *zcs, uint8_t cmd)
+{
+    if (zcs->status & CF_STAT_BSY)
+    {   /* ignore commands until the current request completes */
+#if 1   /* WmT - TRACE */
+;DPRINTF("%s(): command 0x%02x while busy\n", __func__, cmd);
+#endif
+        return;
+    }
+
+    /* ATA: a drive select bit of 1 addresses an absent slave */
+    if (zcs->select & CF_SEL_DRV)
+        return;
+
+    zcs->cmd= cmd;
+    zcs->error= 0;
+
+    switch (cmd)
+    {
+    case CF_CMD_READ_SECTORS:
+    case CF_CMD_READ_SECTORS_NR:
+        zaphod_cf_start_read(zcs);
+        break;
+    case CF_CMD_WRITE_SECTORS:
+    case CF_CMD_WRITE_SECTORS_NR:
+        zaphod_cf_start_write(zcs);
+        break;
+    case CF_CMD_IDENTIFY:
+        zaphod_cf_identify(zcs);
+        break;
+    case CF_CMD_SET_FEATURES:
+        zaphod_cf_set_features(zcs);
+        break;
+    case CF_CMD_FLUSH_CACHE:
+        zaphod_cf_start_flush(zcs);
+        break;
+    case CF_CMD_DIAGNOSTIC:
+        zaphod_cf_ready(zcs);
+        zcs->error= 0x01;       /* no error detected */
+        break;
+    case CF_CMD_RECALIBRATE:
+    case CF_CMD_INIT_PARAMS:
+    case CF_CMD_IDLE_IMMEDIATE:
+    case CF_CMD_IDLE:
+        zaphod_cf_ready(zcs);
+        break;
+    default:
+#if 1   /* WmT - TRACE */
+;DPRINTF("%s(): unsupported command 0x%02x\n", __func__, cmd);
+#endif
+        zaphod_cf_abort(zcs, CF_ERR_ABRT);
+        break;
+    }
+}
+
+
+/* ioport handlers */
+
+static uint32_t zaphod_cf_read(void *opaque, uint32_t addr)
+{
+    ZaphodCFState   *zcs= (ZaphodCFState *)opaque;
+    uint8_t         value;
+
+    switch (addr & 0x07)
+    {
+    case CF_REG_DATA:
+        if (!(zcs->status & CF_STAT_DRQ) || zaphod_cf_is_write(zcs->cmd))
+            return 0xff;
+        value= zcs->buf[zcs->buf_pos++];
+        if (zcs->buf_pos == zcs->buf_len)
+            zaphod_cf_ready(zcs);
+        return value;
+    case CF_REG_ERROR:
+        return zcs->error;
+    case CF_REG_NSECTOR:
+        return zcs->nsector;
+    case CF_REG_LBA0:
+    case CF_REG_LBA1:
+    case CF_REG_LBA2:
+        return zcs->lba[(addr & 0x07) - CF_REG_LBA0];
+    case CF_REG_SELECT:
+        return zcs->select;
+    default:        /* CF_REG_STATUS */
+        return zcs->status;
+    }
+}
+
+static void zaphod_cf_write(void *opaque, uint32_t addr, uint32_t value)
+{
+    ZaphodCFState   *zcs= (ZaphodCFState *)opaque;
+
+    value&= 0xff;
+
+    /* the task file is not writable while a request is in flight */
+    if ((zcs->status & CF_STAT_BSY) && (addr & 0x07) != CF_REG_STATUS)
+        return;
+
+    switch (addr & 0x07)
+    {
+    case CF_REG_DATA:
+        if (!(zcs->status & CF_STAT_DRQ) || !zaphod_cf_is_write(zcs->cmd))
+            break;
+        zcs->buf[zcs->buf_pos++]= value;
+        if (zcs->buf_pos == zcs->buf_len)
+            zaphod_cf_submit_write(zcs);
+        break;
+    case CF_REG_ERROR:
+        zcs->features= value;
+        break;
+    case CF_REG_NSECTOR:
+        zcs->nsector= value;
+        break;
+    case CF_REG_LBA0:
+    case CF_REG_LBA1:
+    case CF_REG_LBA2:
+        zcs->lba[(addr & 0x07) - CF_REG_LBA0]= value;
+        break;
+    case CF_REG_SELECT:
+        zcs->select= value;
+        break;
+    default:        /* CF_REG_STATUS */
+        zaphod_cf_command(zcs, value);
+        break;
+    }
+}
+
+static const MemoryRegionPortio zaphod_cf_portio[] = {
+    { 0x00, 8, 1,
+                .read = zaphod_cf_read,
+                .write = zaphod_cf_write
+                },
+    PORTIO_END_OF_LIST()
+};
+
+
+static void zaphod_cf_reset(void *opaque)
+{
+    ZaphodCFState   *zcs= (ZaphodCFState *)opaque;
+
+    /* let any request in flight complete before clearing state */
+    if (zcs->aiocb)
+        blk_drain(zcs->blk);
+
+    zcs->features= 0;
+    zcs->select= 0xa0;
+    zcs->cmd= 0;
+    /* task file signature after reset/diagnostics */
+    zcs->nsector= 1;
+    zcs->lba[0]= 1;
+    zcs->lba[1]= zcs->lba[2]= 0;
+    zaphod_cf_ready(zcs);
+    zcs->error= 0x01;
+}
+
+static void zaphod_cf_realizefn(DeviceState *dev, Error **errp)
+{
+    ZaphodCFState   *zcs= ZAPHOD_CF(dev);
+    uint64_t        perm;
+
+    if (!zcs->blk)
+    {
+        error_setg(errp, "drive property not set");
+        return;
+    }
+    if (!blk_is_inserted(zcs->blk))
+    {
+        error_setg(errp, "device needs media, but drive is empty");
+        return;
+    }
+    if (zcs->iobase & 0x07 || zcs->iobase > 0xf8)
+    {
+        error_setg(errp, "iobase must be a multiple of 8 below 0x100");
+        return;
+    }
+
+    perm= BLK_PERM_CONSISTENT_READ;
+    if (!blk_is_read_only(zcs->blk))
+        perm|= BLK_PERM_WRITE;
+    if (blk_set_perm(zcs->blk, perm, BLK_PERM_ALL, errp) < 0)
+        return;
+
+    zcs->nb_sectors= blk_getlength(zcs->blk);
+    if (zcs->nb_sectors < 0)
+    {
+        error_setg_errno(errp, -zcs->nb_sectors, "cannot get drive size");
+        return;
+    }
+    zcs->nb_sectors/= ZAPHOD_CF_SECTOR_SIZE;
+    blk_set_guest_block_size(zcs->blk, ZAPHOD_CF_SECTOR_SIZE);
+
+    zcs->buf= blk_blockalign(zcs->blk,
+                    ZAPHOD_CF_MAX_SECTORS * ZAPHOD_CF_SECTOR_SIZE);
+
+    zcs->ioports= g_new(PortioList, 1);
+    portio_list_init(zcs->ioports, OBJECT(zcs), zaphod_cf_portio,
+                    zcs, "zaphod.cf");
+    portio_list_add(zcs->ioports, get_system_io(), zcs->iobase);
+
+    zaphod_cf_reset(zcs);
+    qemu_register_reset(zaphod_cf_reset, zcs);
+#if 1   /* WmT - TRACE */
+;DPRINTF("INFO: %s(): %" PRId64 " sectors at port 0x%02x\n", __func__, zcs->nb_sectors, zcs->iobase);
+#endif
+}
+
+static void zaphod_cf_unrealizefn(DeviceState *dev)
+{
+    ZaphodCFState   *zcs= ZAPHOD_CF(dev);
+
+    qemu_unregister_reset(zaphod_cf_reset, zcs);
+    blk_drain(zcs->blk);
+    qemu_vfree(zcs->buf);
+}
+
+
+static Property zaphod_cf_properties[]= {
+    DEFINE_PROP_DRIVE("drive", ZaphodCFState, blk),
+    DEFINE_PROP_UINT32("iobase", ZaphodCFState, iobase,
+                        ZAPHOD_CF_IOBASE_DEFAULT),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void zaphod_cf_class_init(ObjectClass *oc, void *data)
+{
+    DeviceClass *dc= DEVICE_CLASS(oc);
+
+    dc->desc= "Zaphod CompactFlash interface";
+    dc->realize= zaphod_cf_realizefn;
+    dc->unrealize= zaphod_cf_unrealizefn;
+#if QEMU_VERSION_MAJOR < 5
+    dc->props= zaphod_cf_properties;
+#else
+    device_class_set_props(dc, zaphod_cf_properties);
+#endif
+    set_bit(DEVICE_CATEGORY_STORAGE, dc->categories);
+}
+
+
+static const TypeInfo zaphod_cf_info= {
+    .name= TYPE_ZAPHOD_CF,
+    .parent= TYPE_DEVICE,
+    /* For ZaphodCFClass with virtual functions:
+    .class_size= sizeof(ZaphodCFClass),
+     */
+    .class_init= zaphod_cf_class_init,
+    .instance_size= sizeof(ZaphodCFState)
+};
+
+static void zaphod_cf_register_types(void)
+{
+    type_register_static(&zaphod_cf_info);
+}
+
+type_init(zaphod_cf_register_types)
@@ -0,0 +1,103 @@
+/*
+ * QEmu Zaphod board - CompactFlash support
+ * vim: ft=c sw=4 ts=4 et :
+ *
+ * [...William Towle c. 2013-2022, under GPL...]
+ */
+
+
+#ifndef HW_Z80_ZAPHOD_CF_H
+#define HW_Z80_ZAPHOD_CF_H
+
+#include "exec/ioport.h"
+#include "block/accounting.h"
+#include "sysemu/block-backend.h"
+
+
+#define ZAPHOD_CF_IOBASE_DEFAULT    0x10
+#define ZAPHOD_CF_SECTOR_SIZE       512
+#define ZAPHOD_CF_MAX_SECTORS       256     /* sector count of 0 */
+
+/* Task file registers, relative to iobase. Grant Searle's interface
+ * wires D0-D7 only, so the data register is read/written bytewise
+ */
+#define CF_REG_DATA             0
+#define CF_REG_ERROR            1       /* read; write is features */
+#define CF_REG_NSECTOR          2
+#define CF_REG_LBA0             3       /* LBA 7:0 */
+#define CF_REG_LBA1             4       /* LBA 15:8 */
+#define CF_REG_LBA2             5       /* LBA 23:16 */
+#define CF_REG_SELECT           6       /* LBA 27:24, drive, mode */
+#define CF_REG_STATUS           7       /* read; write is command */
+
+#define CF_STAT_ERR             0x01
+#define CF_STAT_DRQ             0x08
+#define CF_STAT_DSC             0x10
+#define CF_STAT_DRDY            0x40
+#define CF_STAT_BSY             0x80
+
+#define CF_ERR_ABRT             0x04
+#define CF_ERR_IDNF             0x10
+#define CF_ERR_UNC              0x40
+
+#define CF_SEL_LBA              0x40
+#define CF_SEL_DRV              0x10
+
+#define CF_CMD_RECALIBRATE      0x10
+#define CF_CMD_READ_SECTORS     0x20
+#define CF_CMD_READ_SECTORS_NR  0x21
+#define CF_CMD_WRITE_SECTORS    0x30
+#define CF_CMD_WRITE_SECTORS_NR 0x31
+#define CF_CMD_DIAGNOSTIC       0x90
+#define CF_CMD_INIT_PARAMS      0x91
+#define CF_CMD_IDLE_IMMEDIATE   0xe1
+#define CF_CMD_IDLE             0xe3
+#define CF_CMD_FLUSH_CACHE      0xe7
+#define CF_CMD_IDENTIFY         0xec
+#define CF_CMD_SET_FEATURES     0xef
+
+#define CF_FEAT_8BIT_ON         0x01
+#define CF_FEAT_WCACHE_ON       0x02
+#define CF_FEAT_8BIT_OFF        0x81
+#define CF_FEAT_WCACHE_OFF      0x82
+
+
+typedef DeviceClass ZaphodCFClass;
+
+typedef struct {
+    DeviceState     parent;
+
+    BlockBackend    *blk;
+    uint32_t        iobase;
+    PortioList      *ioports;
+    int64_t         nb_sectors;
+
+    /* task file */
+    uint8_t         error, features, nsector;
+    uint8_t         lba[3];
+    uint8_t         select;
+    uint8_t         status;
+    uint8_t         cmd;
+
+    /* data register transfer, staged through 'buf' */
+    uint8_t         *buf;
+    uint32_t        buf_pos, buf_len;
+    int64_t         xfer_sector;
+    int             xfer_count;
+    QEMUIOVector    qiov;
+    BlockAIOCB      *aiocb;
+    BlockAcctCookie acct;
+} ZaphodCFState;
+
+
+#define TYPE_ZAPHOD_CF "zaphod-cf"
+
+#define ZAPHOD_CF_GET_CLASS(obj) \
+    OBJECT_GET_CLASS(ZaphodCFClass, obj, TYPE_ZAPHOD_CF)
+#define ZAPHOD_CF_CLASS(oc) \
+    OBJECT_CLASS_CHECK(ZaphodCFClass, oc, TYPE_ZAPHOD_CF)
+#define ZAPHOD_CF(obj) \
+    OBJECT_CHECK(ZaphodCFState, obj, TYPE_ZAPHOD_CF)
+
+
+#endif  /* HW_Z80_ZAPHOD_CF_H */
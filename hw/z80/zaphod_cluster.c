@@ -0,0 +1,218 @@
+/*
+ * QEmu Zaphod board - multi-node cluster support
+ * vim: ft=c sw=4 ts=4 et :
+ *
+ * [...William Towle c. 2013-2022, under GPL...]
+ */
+
+
+#include "qemu/osdep.h"
+#include "zaphod_cluster.h"
+
+#include "qemu/error-report.h"
+#include "exec/address-spaces.h"
+#include "hw/qdev-properties.h"
+#include "qapi/error.h"
+#include "sysemu/sysemu.h"
+#include "sysemu/reset.h"
+
+
+//#define EMIT_DEBUG ZAPHOD_DEBUG
+#define EMIT_DEBUG 0
+#define DPRINTF(fmt, ...) \
+    do { if (EMIT_DEBUG) error_printf("zaphod_cluster: " fmt , ## __VA_ARGS__); } while(0)
+
+
+/* "zaphod-cluster": one independent 'zaphod-pb' style machine per
+ * CPU given with '-smp N', so that many small Z80 systems can share
+ * a process (and, under MTTCG, run a vCPU thread each). A node has
+ * its own 64KiB of RAM, its own I/O space with stdin/stdout at ports
+ * 0x00/0x01, and the chardev given by the matching '-serial'.
+ *
+ * '-kernel' is loaded once into ROM that every node maps (by default
+ * 8KiB at 0; see '-machine rom='). As each node sees the same RAM
+ * block at the same address, a block translated for one node is
+ * found in the TB hash table by all of them.
+ */
+
+/* Node stdio ports */
+
+static uint32_t zaphod_cluster_read_stdio(void *opaque, uint32_t addr)
+{
+    ZaphodClusterNode   *node= (ZaphodClusterNode *)opaque;
+
+    return zaphod_uart_get_inkey(node->uart, true);
+}
+
+static void zaphod_cluster_write_stdio(void *opaque, uint32_t addr,
+                                        uint32_t value)
+{
+    ZaphodClusterNode   *node= (ZaphodClusterNode *)opaque;
+
+    zaphod_uart_putchar(node->uart, value & 0xff);
+}
+
+static const MemoryRegionPortio zaphod_cluster_portio_stdio[] = {
+    { 0x00, 1, 1, .read = zaphod_cluster_read_stdio },     /* stdin */
+    { 0x01, 1, 1, .write = zaphod_cluster_write_stdio, },  /* stdout */
+    PORTIO_END_OF_LIST()
+};
+
+static void zaphod_cluster_receive(void *opaque, const uint8_t *buf, int len)
+{
+    ZaphodUARTState *zus= ZAPHOD_UART(opaque);
+    int             n;
+
+    /* can_receive() limits 'len' to what the FIFO has room for */
+    for (n= 0; n < len; n++)
+        zaphod_uart_set_inkey(zus, buf[n], true);
+}
+
+
+static void zaphod_cluster_node_reset(void *opaque)
+{
+    ZaphodClusterNode   *node= (ZaphodClusterNode *)opaque;
+    ZaphodMachineState  *zms= ZAPHOD_MACHINE(qdev_get_machine());
+    CPUState            *cs= CPU(node->cpu);
+
+    device_legacy_reset(DEVICE(node->uart));
+    cpu_reset(cs);
+    cpu_set_pc(cs, zms->reset_pc);
+    /* the ROM is shared, so its blocks serve every node */
+    if (node->index == 0)
+        zaphod_warm_tb_cache(zms, node->cpu);
+}
+
+static void zaphod_cluster_node_init(ZaphodClusterState *zcs,
+                                        ZaphodClusterNode *node, int index)
+{
+    MachineState        *ms= MACHINE(zcs);
+    ZaphodMachineState  *zms= ZAPHOD_MACHINE(zcs);
+    Chardev             *chr;
+    char                *name;
+    int                 n;
+
+    node->index= index;
+
+    /* memory: private RAM, overlaid with the shared ROM */
+    name= g_strdup_printf("zaphod.node%d", index);
+    memory_region_init(&node->mem, OBJECT(zcs), name, Z80_MAX_RAM_SIZE);
+    g_free(name);
+
+    name= g_strdup_printf("zaphod.node%d.ram", index);
+    memory_region_init_ram(&node->ram, OBJECT(zcs), name,
+                            Z80_MAX_RAM_SIZE, &error_fatal);
+    g_free(name);
+    memory_region_add_subregion(&node->mem, 0x0000, &node->ram);
+
+    node->rom_alias= g_new0(MemoryRegion, zms->rom_count);
+    for (n= 0; n < zms->rom_count; n++)
+    {
+        name= g_strdup_printf("zaphod.node%d.rom%d", index, n);
+        memory_region_init_alias(&node->rom_alias[n], OBJECT(zcs), name,
+                                    &zcs->rom[n], 0, zms->rom[n].size);
+        memory_region_add_subregion_overlap(&node->mem, zms->rom[n].base,
+                                            &node->rom_alias[n], 1);
+        g_free(name);
+    }
+
+    /* I/O: a private port space with the console on it */
+    name= g_strdup_printf("zaphod.node%d.io", index);
+    memory_region_init(&node->io, OBJECT(zcs), name, 0x10000);
+    address_space_init(&node->io_as, &node->io, name);
+    g_free(name);
+
+    node->uart= ZAPHOD_UART(object_new(TYPE_ZAPHOD_UART));
+    if ((chr= serial_hd(index)) != NULL)
+        qdev_prop_set_chr(DEVICE(node->uart), "chardev", chr);
+    qdev_realize(DEVICE(node->uart), NULL, &error_fatal);
+    qemu_chr_fe_set_handlers(&node->uart->chr,
+                    zaphod_uart_can_receive, zaphod_cluster_receive,
+                    NULL,
+                    NULL, node->uart, NULL, true);
+
+    portio_list_init(&node->ioports, OBJECT(zcs),
+                    zaphod_cluster_portio_stdio, node, "zaphod.node-stdio");
+    portio_list_add(&node->ioports, &node->io, 0x00);
+
+    /* CPU, wired to the node's address spaces */
+    node->cpu= Z80_CPU(object_new(ms->cpu_type));
+    object_property_set_link(OBJECT(node->cpu), "memory",
+                                OBJECT(&node->mem), &error_abort);
+    node->cpu->io_as= &node->io_as;
+    qdev_realize(DEVICE(node->cpu), NULL, &error_fatal);
+    object_unref(OBJECT(node->cpu));
+
+    qemu_register_reset(zaphod_cluster_node_reset, node);
+}
+
+static void zaphod_cluster_init(MachineState *ms)
+{
+    ZaphodClusterState  *zcs= ZAPHOD_CLUSTER_MACHINE(ms);
+    ZaphodMachineState  *zms= ZAPHOD_MACHINE(ms);
+    int                 n;
+
+    if (zms->rom_count == 0)
+    {
+        zms->rom[0].base= 0x0000;
+        zms->rom[0].size= ZAPHOD_CLUSTER_ROM_DEFAULT;
+        zms->rom_count= 1;
+    }
+
+    /* The shared ROM lives in the system address space, which is
+     * where the loaders write; nodes see it through aliases
+     */
+    zcs->rom= g_new0(MemoryRegion, zms->rom_count);
+    for (n= 0; n < zms->rom_count; n++)
+    {
+        char *name= g_strdup_printf("zaphod.rom%d", n);
+
+        memory_region_init_rom(&zcs->rom[n], OBJECT(zcs), name,
+                                zms->rom[n].size, &error_fatal);
+        memory_region_add_subregion(get_system_memory(), zms->rom[n].base,
+                                    &zcs->rom[n]);
+        g_free(name);
+    }
+
+    zcs->nodes= ms->smp.cpus;
+    zcs->node= g_new0(ZaphodClusterNode, zcs->nodes);
+    for (n= 0; n < zcs->nodes; n++)
+        zaphod_cluster_node_init(zcs, &zcs->node[n], n);
+    zms->cpu= zcs->node[0].cpu;
+
+    /* NB: anything loaded outside the ROM ranges is discarded */
+    zaphod_load_kernel(zms, ms->kernel_filename);
+#if 1   /* WmT - TRACE */
+;DPRINTF("INFO: %s(): %d nodes, %d ROM range(s)\n", __func__, zcs->nodes, zms->rom_count);
+#endif
+}
+
+
+static void zaphod_cluster_machine_class_init(ObjectClass *oc, void *data)
+{
+    MachineClass *mc = MACHINE_CLASS(oc);
+    ZaphodMachineClass *zmc= ZAPHOD_MACHINE_CLASS(oc);
+
+    zmc->board_type= ZAPHOD_BOARD_TYPE_ZAPHOD_CLUSTER;
+
+    zaphod_common_machine_class_init(oc, false, zmc->board_type);
+    mc->init= zaphod_cluster_init;
+    mc->default_cpus= 2;
+    mc->min_cpus= 1;
+    mc->max_cpus= ZAPHOD_CLUSTER_MAX_NODES;
+}
+
+static const TypeInfo zaphod_cluster_machine_info= {
+    .name= TYPE_ZAPHOD_CLUSTER_MACHINE,
+    .parent= TYPE_ZAPHOD_MACHINE,
+    .class_size     = sizeof(ZaphodMachineClass),
+    .class_init= zaphod_cluster_machine_class_init,
+    .instance_size  = sizeof(ZaphodClusterState)
+};
+
+static void zaphod_cluster_register_types(void)
+{
+    type_register_static(&zaphod_cluster_machine_info);
+}
+
+type_init(zaphod_cluster_register_types)
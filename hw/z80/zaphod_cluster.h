@@ -0,0 +1,51 @@
+/*
+ * QEmu Zaphod board - multi-node cluster support
+ * vim: ft=c sw=4 ts=4 et :
+ *
+ * [...William Towle c. 2013-2022, under GPL...]
+ */
+
+
+#ifndef HW_Z80_ZAPHOD_CLUSTER_H
+#define HW_Z80_ZAPHOD_CLUSTER_H
+
+#include "zaphod.h"
+#include "zaphod_uart.h"
+#include "exec/ioport.h"
+
+
+#define ZAPHOD_CLUSTER_MAX_NODES    256
+#define ZAPHOD_CLUSTER_ROM_DEFAULT  0x2000  /* at 0, if no 'rom=' */
+
+/* One independent machine: CPU, private RAM and I/O space, and a
+ * stdio-style console (as 'zaphod-pb') on its own chardev
+ */
+typedef struct {
+    int             index;
+    Z80CPU          *cpu;
+    MemoryRegion    mem;            /* the CPU's view: RAM, shared ROM */
+    MemoryRegion    ram;
+    MemoryRegion    *rom_alias;
+    MemoryRegion    io;
+    AddressSpace    io_as;
+    PortioList      ioports;
+    ZaphodUARTState *uart;
+} ZaphodClusterNode;
+
+typedef struct {
+    /*< private >*/
+    ZaphodMachineState parent;
+
+    /*< public >*/
+    int                 nodes;
+    ZaphodClusterNode   *node;
+    MemoryRegion        *rom;       /* one per 'rom=' range, shared */
+} ZaphodClusterState;
+
+
+#define TYPE_ZAPHOD_CLUSTER_MACHINE \
+    MACHINE_TYPE_NAME("zaphod-cluster")
+#define ZAPHOD_CLUSTER_MACHINE(obj) \
+    OBJECT_CHECK(ZaphodClusterState, (obj), TYPE_ZAPHOD_CLUSTER_MACHINE)
+
+#endif  /* HW_Z80_ZAPHOD_CLUSTER_H */
@@ -0,0 +1,443 @@
+/*
+ * QEmu Zaphod board - Z80 CTC support
+ * vim: ft=c sw=4 ts=4 et :
+ *
+ * [...William Towle c. 2013-2022, under GPL...]
+ */
+
+
+#include "qemu/osdep.h"
+#include "zaphod.h"
+
+#include "qemu/error-report.h"
+#include "exec/address-spaces.h"
+#include "hw/qdev-properties.h"
+#include "qapi/error.h"
+#include "qemu/host-utils.h"
+#include "sysemu/reset.h"
+
+
+//#define EMIT_DEBUG ZAPHOD_DEBUG
+#define EMIT_DEBUG 0
+#define DPRINTF(fmt, ...) \
+    do { if (EMIT_DEBUG) error_printf("zaphod_ctc: " fmt , ## __VA_ARGS__); } while(0)
+
+
+/* Zilog Z80 CTC model. Nothing ticks per count: a running timer
+ * remembers when its time constant was loaded, a count read is
+ * worked out from the virtual clock, and a QEMUTimer is armed only
+ * for the next zero count - and only if an interrupt or a chained
+ * counter depends on it.
+ *
+ * Counter mode channels count the ZC/TO output of the channel below
+ * (the usual cascade) when "chain" is set; otherwise, like channel 0,
+ * their CLK/TRG input is unconnected. For the same reason, timers
+ * set to start on a CLK/TRG edge start at once.
+ */
+
+static uint32_t zaphod_ctc_tc(ZaphodCTCChannel *ch)
+{
+    return ch->tc ? ch->tc : 256;
+}
+
+static uint64_t zaphod_ctc_ticks_per_period(ZaphodCTCChannel *ch)
+{
+    return (uint64_t)zaphod_ctc_tc(ch)
+            * ((ch->control & CTC_CTRL_PRESCALE_256) ? 256 : 16);
+}
+
+static bool zaphod_ctc_is_timer(ZaphodCTCChannel *ch)
+{
+    return ch->running && !(ch->control & CTC_CTRL_COUNTER);
+}
+
+/* Prescaled clock ticks since the time constant was loaded */
+static uint64_t zaphod_ctc_elapsed(ZaphodCTCChannel *ch, int64_t now)
+{
+    return muldiv64(now - ch->base_ns,
+                    ch->ctc->clock_hz, NANOSECONDS_PER_SECOND);
+}
+
+/* When period 'n' ends - rounded up, so that the tick count derived
+ * from it at expiry is never short
+ */
+static int64_t zaphod_ctc_period_end(ZaphodCTCChannel *ch, uint64_t n)
+{
+    return ch->base_ns + 1 + muldiv64(n * zaphod_ctc_ticks_per_period(ch),
+                            NANOSECONDS_PER_SECOND, ch->ctc->clock_hz);
+}
+
+static uint8_t zaphod_ctc_read_count(ZaphodCTCChannel *ch)
+{
+    uint64_t    ticks, tpp;
+
+    if (!zaphod_ctc_is_timer(ch))
+        return ch->count;
+
+    tpp= zaphod_ctc_ticks_per_period(ch);
+    ticks= zaphod_ctc_elapsed(ch, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    return zaphod_ctc_tc(ch) - (ticks % tpp) * zaphod_ctc_tc(ch) / tpp;
+}
+
+
+/* Interrupts */
+
+static void zaphod_ctc_update_irq(ZaphodCTCState *zcs)
+{
+    int     n;
+    bool    level= false;
+
+    for (n= 0; n < ZAPHOD_CTC_CHANNELS; n++)
+    {
+        if (zcs->ch[n].ip && (zcs->ch[n].control & CTC_CTRL_INT_ENABLE))
+            level= true;
+    }
+    qemu_set_irq(zcs->irq, level);
+}
+
+/* Called by the board on interrupt acknowledge. Channel 0 has the
+ * highest priority; each channel's vector differs in D2-D1
+ */
+uint8_t zaphod_ctc_irq_ack(void *opaque)
+{
+    ZaphodCTCState  *zcs= ZAPHOD_CTC(opaque);
+    int             n;
+
+    for (n= 0; n < ZAPHOD_CTC_CHANNELS; n++)
+    {
+        ZaphodCTCChannel    *ch= &zcs->ch[n];
+
+        if (ch->ip && (ch->control & CTC_CTRL_INT_ENABLE))
+        {
+            ch->ip= false;
+            zaphod_ctc_update_irq(zcs);
+            return zcs->vector | (n << 1);
+        }
+    }
+
+    return 0xff;
+}
+
+
+/* Counting */
+
+static void zaphod_ctc_clock_pulses(ZaphodCTCState *zcs, int index,
+                                    uint64_t pulses);
+
+/* Channel 'index' has reached zero 'events' times */
+static void zaphod_ctc_zc_to(ZaphodCTCState *zcs, int index, uint64_t events)
+{
+    ZaphodCTCChannel    *ch= &zcs->ch[index];
+
+    if (ch->control & CTC_CTRL_INT_ENABLE)
+    {
+        ch->ip= true;
+        zaphod_ctc_update_irq(zcs);
+    }
+
+    if (zcs->chain && index + 1 < ZAPHOD_CTC_CHANNELS)
+        zaphod_ctc_clock_pulses(zcs, index + 1, events);
+}
+
+static void zaphod_ctc_clock_pulses(ZaphodCTCState *zcs, int index,
+                                    uint64_t pulses)
+{
+    ZaphodCTCChannel    *ch= &zcs->ch[index];
+    uint32_t            tc= zaphod_ctc_tc(ch);
+    uint64_t            zeroes;
+
+    if (!ch->running || !(ch->control & CTC_CTRL_COUNTER))
+        return;
+
+    if (pulses < ch->count)
+    {
+        ch->count-= pulses;
+        return;
+    }
+
+    /* down to zero, then reloaded from the time constant */
+    pulses-= ch->count;
+    zeroes= 1 + pulses / tc;
+    ch->count= tc - pulses % tc;
+    zaphod_ctc_zc_to(zcs, index, zeroes);
+}
+
+static bool zaphod_ctc_needs_timer(ZaphodCTCChannel *ch)
+{
+    ZaphodCTCState      *zcs= ch->ctc;
+    ZaphodCTCChannel    *next;
+
+    if (!zaphod_ctc_is_timer(ch))
+        return false;
+    if (ch->control & CTC_CTRL_INT_ENABLE)
+        return true;
+
+    if (!zcs->chain || ch->index + 1 >= ZAPHOD_CTC_CHANNELS)
+        return false;
+    next= &zcs->ch[ch->index + 1];
+    return next->running && (next->control & CTC_CTRL_COUNTER);
+}
+
+/* Deliver the zero counts of periods that have ended since the last
+ * look, as if the timer had fired for them
+ */
+static void zaphod_ctc_deliver(ZaphodCTCChannel *ch)
+{
+    uint64_t            periods;
+
+    if (!zaphod_ctc_is_timer(ch))
+        return;
+
+    periods= zaphod_ctc_elapsed(ch, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL))
+                / zaphod_ctc_ticks_per_period(ch);
+    if (periods > ch->periods_seen)
+    {
+        uint64_t    events= periods - ch->periods_seen;
+
+        ch->periods_seen= periods;
+        zaphod_ctc_zc_to(ch->ctc, ch->index, events);
+    }
+}
+
+static void zaphod_ctc_arm(ZaphodCTCChannel *ch)
+{
+    uint64_t    periods;
+
+    /* a zero count may be due with its callback yet to run */
+    if (timer_pending(ch->timer))
+        zaphod_ctc_deliver(ch);
+
+    if (!zaphod_ctc_needs_timer(ch))
+    {
+        timer_del(ch->timer);
+        return;
+    }
+
+    /* nothing was watching periods that ended while we were idle */
+    periods= zaphod_ctc_elapsed(ch, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL))
+                / zaphod_ctc_ticks_per_period(ch);
+    ch->periods_seen= MAX(ch->periods_seen, periods);
+
+    timer_mod(ch->timer, zaphod_ctc_period_end(ch, ch->periods_seen + 1));
+}
+
+static void zaphod_ctc_timer_cb(void *opaque)
+{
+    ZaphodCTCChannel    *ch= (ZaphodCTCChannel *)opaque;
+
+    zaphod_ctc_deliver(ch);
+    zaphod_ctc_arm(ch);
+}
+
+
+/* Programming */
+
+static void zaphod_ctc_stop(ZaphodCTCChannel *ch)
+{
+    ch->count= zaphod_ctc_read_count(ch);
+    ch->running= false;
+    timer_del(ch->timer);
+}
+
+static void zaphod_ctc_start(ZaphodCTCChannel *ch)
+{
+    ZaphodCTCState  *zcs= ch->ctc;
+
+    /* NB: a time constant written to a running channel takes effect
+     * at once, rather than at the next zero count
+     */
+    ch->running= true;
+    ch->count= zaphod_ctc_tc(ch);
+    ch->base_ns= qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    ch->periods_seen= 0;
+    zaphod_ctc_arm(ch);
+
+    /* a counter may need the channel below to start reporting ZC/TO */
+    if ((ch->control & CTC_CTRL_COUNTER) && ch->index > 0)
+        zaphod_ctc_arm(&zcs->ch[ch->index - 1]);
+#if 1   /* WmT - TRACE */
+;DPRINTF("%s(): channel %d %s, tc %u, control 0x%02x\n", __func__, ch->index, (ch->control & CTC_CTRL_COUNTER) ? "counter" : "timer", zaphod_ctc_tc(ch), ch->control);
+#endif
+}
+
+static void zaphod_ctc_write(void *opaque, uint32_t addr, uint32_t value)
+{
+    ZaphodCTCState      *zcs= (ZaphodCTCState *)opaque;
+    ZaphodCTCChannel    *ch= &zcs->ch[addr & 0x03];
+
+    value&= 0xff;
+
+    /* zero counts already due happen under the old settings */
+    if (timer_pending(ch->timer))
+        zaphod_ctc_deliver(ch);
+
+    if (ch->tc_pending)
+    {
+        ch->tc= value;
+        ch->tc_pending= false;
+        zaphod_ctc_start(ch);
+        return;
+    }
+
+    if (!(value & CTC_CTRL_CONTROL))
+    {   /* interrupt vector; D2-D1 are supplied per channel */
+        if (ch->index == 0)
+            zcs->vector= value & 0xf8;
+        return;
+    }
+
+    if (ch->running && !(value & CTC_CTRL_RESET)
+            && ((ch->control ^ value)
+                & (CTC_CTRL_COUNTER | CTC_CTRL_PRESCALE_256)))
+    {   /* keep the lazily derived count consistent across a change */
+        zaphod_ctc_stop(ch);
+        ch->control= value;
+        zaphod_ctc_start(ch);
+    }
+    else
+    {
+        ch->control= value;
+    }
+
+    if (value & CTC_CTRL_RESET)
+        zaphod_ctc_stop(ch);
+    if (value & CTC_CTRL_TC_FOLLOWS)
+        ch->tc_pending= true;
+
+    /* the interrupt enable may have changed */
+    zaphod_ctc_update_irq(zcs);
+    if (ch->running)
+        zaphod_ctc_arm(ch);
+}
+
+static uint32_t zaphod_ctc_read(void *opaque, uint32_t addr)
+{
+    ZaphodCTCState  *zcs= (ZaphodCTCState *)opaque;
+
+    return zaphod_ctc_read_count(&zcs->ch[addr & 0x03]);
+}
+
+static const MemoryRegionPortio zaphod_ctc_portio[] = {
+    { 0x00, ZAPHOD_CTC_CHANNELS, 1,
+                .read = zaphod_ctc_read,
+                .write = zaphod_ctc_write
+                },
+    PORTIO_END_OF_LIST()
+};
+
+
+static void zaphod_ctc_reset(void *opaque)
+{
+    ZaphodCTCState  *zcs= (ZaphodCTCState *)opaque;
+    int             n;
+
+    for (n= 0; n < ZAPHOD_CTC_CHANNELS; n++)
+    {
+        ZaphodCTCChannel    *ch= &zcs->ch[n];
+
+        timer_del(ch->timer);
+        ch->control= 0;
+        ch->tc= 0;
+        ch->tc_pending= false;
+        ch->running= false;
+        ch->ip= false;
+        ch->count= 0;
+    }
+    zaphod_ctc_update_irq(zcs);
+}
+
+static void zaphod_ctc_realizefn(DeviceState *dev, Error **errp)
+{
+    ZaphodCTCState  *zcs= ZAPHOD_CTC(dev);
+    int             n;
+
+    if (zcs->iobase & 0x03 || zcs->iobase > 0xfc)
+    {
+        error_setg(errp, "iobase must be a multiple of 4 below 0x100");
+        return;
+    }
+    if (zcs->clock_hz == 0)
+    {
+        error_setg(errp, "clock-hz must be non-zero");
+        return;
+    }
+
+    for (n= 0; n < ZAPHOD_CTC_CHANNELS; n++)
+    {
+        zcs->ch[n].ctc= zcs;
+        zcs->ch[n].index= n;
+        zcs->ch[n].timer= timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                        zaphod_ctc_timer_cb, &zcs->ch[n]);
+    }
+
+    zcs->ioports= g_new(PortioList, 1);
+    portio_list_init(zcs->ioports, OBJECT(zcs), zaphod_ctc_portio,
+                    zcs, "zaphod.ctc");
+    portio_list_add(zcs->ioports, get_system_io(), zcs->iobase);
+
+    zaphod_ctc_reset(zcs);
+    qemu_register_reset(zaphod_ctc_reset, zcs);
+}
+
+static void zaphod_ctc_unrealizefn(DeviceState *dev)
+{
+    ZaphodCTCState  *zcs= ZAPHOD_CTC(dev);
+    int             n;
+
+    qemu_unregister_reset(zaphod_ctc_reset, zcs);
+    for (n= 0; n < ZAPHOD_CTC_CHANNELS; n++)
+        timer_free(zcs->ch[n].timer);
+}
+
+
+static Property zaphod_ctc_properties[]= {
+    /* properties can be set with '-global zaphod-ctc.VAR=VAL' */
+    DEFINE_PROP_UINT32("iobase", ZaphodCTCState, iobase,
+                        ZAPHOD_CTC_IOBASE_DEFAULT),
+    DEFINE_PROP_UINT32("clock-hz", ZaphodCTCState, clock_hz,
+                        ZAPHOD_CTC_CLOCK_HZ_DEFAULT),
+    DEFINE_PROP_BOOL("chain", ZaphodCTCState, chain, true),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void zaphod_ctc_class_init(ObjectClass *oc, void *data)
+{
+    DeviceClass *dc= DEVICE_CLASS(oc);
+
+    dc->desc= "Zaphod Z80 CTC counter/timer";
+    dc->realize= zaphod_ctc_realizefn;
+    dc->unrealize= zaphod_ctc_unrealizefn;
+#if QEMU_VERSION_MAJOR < 5
+    dc->props= zaphod_ctc_properties;
+#else
+    device_class_set_props(dc, zaphod_ctc_properties);
+#endif
+    set_bit(DEVICE_CATEGORY_MISC, dc->categories);
+}
+
+static void zaphod_ctc_instance_init(Object *obj)
+{
+    ZaphodCTCState  *zcs= ZAPHOD_CTC(obj);
+
+    /* connected to the board by the IOCore */
+    qdev_init_gpio_out(DEVICE(obj), &zcs->irq, 1);
+}
+
+
+static const TypeInfo zaphod_ctc_info= {
+    .name= TYPE_ZAPHOD_CTC,
+    .parent= TYPE_DEVICE,
+    /* For ZaphodCTCClass with virtual functions:
+    .class_size= sizeof(ZaphodCTCClass),
+     */
+    .class_init= zaphod_ctc_class_init,
+    .instance_size= sizeof(ZaphodCTCState),
+    .instance_init= zaphod_ctc_instance_init
+};
+
+static void zaphod_ctc_register_types(void)
+{
+    type_register_static(&zaphod_ctc_info);
+}
+
+type_init(zaphod_ctc_register_types)
@@ -0,0 +1,78 @@
+/*
+ * QEmu Zaphod board - Z80 CTC support
+ * vim: ft=c sw=4 ts=4 et :
+ *
+ * [...William Towle c. 2013-2022, under GPL...]
+ */
+
+
+#ifndef HW_Z80_ZAPHOD_CTC_H
+#define HW_Z80_ZAPHOD_CTC_H
+
+#include "exec/ioport.h"
+#include "hw/irq.h"
+#include "qemu/timer.h"
+
+
+#define ZAPHOD_CTC_IOBASE_DEFAULT   0x04
+#define ZAPHOD_CTC_CLOCK_HZ_DEFAULT 7372800     /* as Grant Searle's SBC */
+#define ZAPHOD_CTC_CHANNELS         4
+
+/* Channel control word (D0 set; D0 clear on channel 0 is the vector) */
+#define CTC_CTRL_CONTROL        0x01
+#define CTC_CTRL_RESET          0x02
+#define CTC_CTRL_TC_FOLLOWS     0x04
+#define CTC_CTRL_TRIGGER        0x08    /* timer starts on CLK/TRG */
+#define CTC_CTRL_RISING_EDGE    0x10
+#define CTC_CTRL_PRESCALE_256   0x20    /* else 16 */
+#define CTC_CTRL_COUNTER        0x40    /* else timer */
+#define CTC_CTRL_INT_ENABLE     0x80
+
+
+typedef struct ZaphodCTCState ZaphodCTCState;
+
+typedef struct {
+    ZaphodCTCState  *ctc;
+    int             index;
+
+    uint8_t         control;
+    uint8_t         tc;             /* as written; 0 means 256 */
+    bool            tc_pending;     /* next write is a time constant */
+    bool            running;
+    bool            ip;             /* interrupt pending */
+
+    uint32_t        count;          /* counter mode, or when stopped */
+    int64_t         base_ns;        /* timer mode: when 'tc' was loaded */
+    uint64_t        periods_seen;   /* ZC/TO events since base_ns */
+    QEMUTimer       *timer;         /* armed for the next ZC/TO */
+} ZaphodCTCChannel;
+
+typedef DeviceClass ZaphodCTCClass;
+
+struct ZaphodCTCState {
+    DeviceState     parent;
+
+    uint32_t        iobase;
+    uint32_t        clock_hz;
+    bool            chain;          /* ZC/TO(n) drives CLK/TRG(n+1) */
+    PortioList      *ioports;
+    qemu_irq        irq;
+
+    uint8_t         vector;
+    ZaphodCTCChannel ch[ZAPHOD_CTC_CHANNELS];
+};
+
+
+#define TYPE_ZAPHOD_CTC "zaphod-ctc"
+
+#define ZAPHOD_CTC_GET_CLASS(obj) \
+    OBJECT_GET_CLASS(ZaphodCTCClass, obj, TYPE_ZAPHOD_CTC)
+#define ZAPHOD_CTC_CLASS(oc) \
+    OBJECT_CLASS_CHECK(ZaphodCTCClass, oc, TYPE_ZAPHOD_CTC)
+#define ZAPHOD_CTC(obj) \
+    OBJECT_CHECK(ZaphodCTCState, obj, TYPE_ZAPHOD_CTC)
+
+
+uint8_t zaphod_ctc_irq_ack(void *opaque);
+
+#endif  /* HW_Z80_ZAPHOD_CTC_H */
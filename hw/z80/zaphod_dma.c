@@ -0,0 +1,609 @@
+/*
+ * QEmu Zaphod board - Z80 DMA support
+ * vim: ft=c sw=4 ts=4 et :
+ *
+ * [...William Towle c. 2013-2022, under GPL...]
+ */
+
+
+#include "qemu/osdep.h"
+#include "zaphod.h"
+
+#include "qemu/error-report.h"
+#include "exec/address-spaces.h"
+#include "hw/qdev-properties.h"
+#include "qapi/error.h"
+#include "qemu/host-utils.h"
+#include "sysemu/reset.h"
+
+
+//#define EMIT_DEBUG ZAPHOD_DEBUG
+#define EMIT_DEBUG 0
+#define DPRINTF(fmt, ...) \
+    do { if (EMIT_DEBUG) error_printf("zaphod_dma: " fmt , ## __VA_ARGS__); } while(0)
+
+
+/* Zilog Z8410 (Z80 DMA) model. Programming follows the datasheet:
+ * a base register byte selects WR0-WR6, and its bits say which
+ * parameter bytes follow on the same port.
+ *
+ * On enabling, the whole block is moved at once - in burst and
+ * continuous modes the CPU would be held off the bus throughout, so
+ * it cannot tell the difference. Memory-to-memory moves are done in
+ * bulk; anything involving an I/O port goes a byte at a time, as the
+ * device at the other end may have side effects. With "clock-hz" set,
+ * completion (end-of-block status, interrupt) is then deferred by
+ * the number of cycles the transfer would have taken.
+ *
+ * RDY is taken as always active, and interrupt-under-service is not
+ * tracked, so 'Enable after RETI' has nothing to do.
+ */
+
+static uint16_t zaphod_dma_get16(const uint8_t *reg)
+{
+    return reg[0] | (reg[1] << 8);
+}
+
+static void zaphod_dma_update_irq(ZaphodDMAState *zds)
+{
+    qemu_set_irq(zds->irq, zds->ip && (zds->wr3 & DMA_WR3_INT_ENABLE));
+}
+
+static void zaphod_dma_raise_irq(ZaphodDMAState *zds)
+{
+    zds->ip= true;
+    zds->status&= ~DMA_RR0_NO_IP;
+    zaphod_dma_update_irq(zds);
+}
+
+/* Called by the board on interrupt acknowledge: supply our vector */
+uint8_t zaphod_dma_irq_ack(void *opaque)
+{
+    ZaphodDMAState  *zds= ZAPHOD_DMA(opaque);
+    uint8_t         vector= zds->vector;
+
+    if (zds->int_ctrl & DMA_INT_STATUS_VECTOR)
+    {   /* D2-D1: 01 match, 10 end of block, 11 both */
+        uint8_t reason= 0;
+
+        if (!(zds->status & DMA_RR0_NO_MATCH))
+            reason|= 1;
+        if (!(zds->status & DMA_RR0_NO_EOB))
+            reason|= 2;
+        vector= (vector & ~0x06) | (reason << 1);
+    }
+
+    zds->ip= false;
+    zds->status|= DMA_RR0_NO_IP;
+    zaphod_dma_update_irq(zds);
+
+    return vector;
+}
+
+
+/* Transfers */
+
+static bool zaphod_dma_port_is_io(uint8_t wr)
+{
+    return (wr & DMA_WR12_IO) != 0;
+}
+
+static uint16_t zaphod_dma_port_step(uint8_t wr, uint16_t addr)
+{
+    switch (wr & DMA_WR12_MODE_MASK)
+    {
+    case DMA_WR12_MODE_DEC:
+        return addr - 1;
+    case DMA_WR12_MODE_INC:
+        return addr + 1;
+    default:        /* fixed */
+        return addr;
+    }
+}
+
+static int zaphod_dma_port_cycles(uint8_t wr, uint8_t timing)
+{
+    if (timing == DMA_TIMING_STANDARD)
+        return zaphod_dma_port_is_io(wr) ? 4 : 3;
+
+    switch (timing & DMA_TIMING_CYCLES_MASK)
+    {
+    case 0x01:
+        return 3;
+    case 0x02:
+        return 2;
+    default:
+        return 4;
+    }
+}
+
+static uint8_t zaphod_dma_port_read(uint8_t wr, uint16_t addr)
+{
+    if (zaphod_dma_port_is_io(wr))
+        return address_space_ldub(&address_space_io, addr & 0xff,
+                                    MEMTXATTRS_UNSPECIFIED, NULL);
+    return address_space_ldub(&address_space_memory, addr,
+                                MEMTXATTRS_UNSPECIFIED, NULL);
+}
+
+static void zaphod_dma_port_write(uint8_t wr, uint16_t addr, uint8_t value)
+{
+    if (zaphod_dma_port_is_io(wr))
+        address_space_stb(&address_space_io, addr & 0xff, value,
+                            MEMTXATTRS_UNSPECIFIED, NULL);
+    else
+        address_space_stb(&address_space_memory, addr, value,
+                            MEMTXATTRS_UNSPECIFIED, NULL);
+}
+
+static uint32_t zaphod_dma_block_size(ZaphodDMAState *zds)
+{   /* the Z8410 moves one byte more than the programmed length */
+    return zaphod_dma_get16(zds->block_len) + 1;
+}
+
+/* Memory to memory, both incrementing */
+static void zaphod_dma_copy(ZaphodDMAState *zds, uint16_t *src, uint16_t *dst)
+{
+    uint8_t     buf[4096];
+    uint32_t    total= zaphod_dma_block_size(zds);
+
+    while (zds->byte_count < total)
+    {
+        uint32_t    len= MIN(total - zds->byte_count, sizeof(buf));
+        uint16_t    dist= *dst - *src;
+
+        /* stay within the 64K address space, and move an overlapping
+         * forward copy in steps no longer than its offset so the
+         * byte-at-a-time result is kept (e.g. fills with dst=src+1)
+         */
+        len= MIN(len, 0x10000 - *src);
+        len= MIN(len, 0x10000 - *dst);
+        if (dist && dist < len)
+            len= dist;
+
+        address_space_read(&address_space_memory, *src,
+                            MEMTXATTRS_UNSPECIFIED, buf, len);
+        address_space_write(&address_space_memory, *dst,
+                            MEMTXATTRS_UNSPECIFIED, buf, len);
+        *src+= len;
+        *dst+= len;
+        zds->byte_count+= len;
+    }
+}
+
+/* Move/search the remainder of the block, returning the number of
+ * bytes read from the source. Stops early on a match if so asked
+ */
+static uint32_t zaphod_dma_run(ZaphodDMAState *zds)
+{
+    bool        a_to_b= (zds->wr0 & DMA_WR0_A_TO_B) != 0;
+    bool        transfer= (zds->wr0 & DMA_WR0_TRANSFER) != 0;
+    bool        search= (zds->wr0 & DMA_WR0_SEARCH) != 0;
+    uint8_t     src_wr= a_to_b ? zds->wr1 : zds->wr2;
+    uint8_t     dst_wr= a_to_b ? zds->wr2 : zds->wr1;
+    uint16_t    *src= a_to_b ? &zds->addr_a : &zds->addr_b;
+    uint16_t    *dst= a_to_b ? &zds->addr_b : &zds->addr_a;
+    uint32_t    total= zaphod_dma_block_size(zds);
+    uint32_t    start= zds->byte_count;
+
+    if (zds->byte_count >= total)
+        return 0;
+    zds->status|= DMA_RR0_OCCURRED;
+
+    if (transfer && !search
+            && !zaphod_dma_port_is_io(src_wr) && !zaphod_dma_port_is_io(dst_wr)
+            && (src_wr & DMA_WR12_MODE_MASK) == DMA_WR12_MODE_INC
+            && (dst_wr & DMA_WR12_MODE_MASK) == DMA_WR12_MODE_INC)
+    {
+        zaphod_dma_copy(zds, src, dst);
+        return zds->byte_count - start;
+    }
+
+    while (zds->byte_count < total)
+    {
+        uint8_t value= zaphod_dma_port_read(src_wr, *src);
+
+        if (transfer)
+        {
+            zaphod_dma_port_write(dst_wr, *dst, value);
+            *dst= zaphod_dma_port_step(dst_wr, *dst);
+        }
+        *src= zaphod_dma_port_step(src_wr, *src);
+        zds->byte_count++;
+
+        /* mask bits set to 1 exclude that bit from the comparison */
+        if (search && (value | zds->mask) == (zds->match | zds->mask))
+        {
+            zds->status&= ~DMA_RR0_NO_MATCH;
+            if (zds->wr3 & DMA_WR3_STOP_ON_MATCH)
+                break;
+        }
+    }
+
+    return zds->byte_count - start;
+}
+
+static void zaphod_dma_load(ZaphodDMAState *zds)
+{
+    zds->addr_a= zaphod_dma_get16(zds->start_a);
+    zds->addr_b= zaphod_dma_get16(zds->start_b);
+    zds->byte_count= 0;
+    zds->status&= ~DMA_RR0_OCCURRED;
+    zds->status|= DMA_RR0_NO_MATCH | DMA_RR0_NO_EOB;
+}
+
+static void zaphod_dma_complete(ZaphodDMAState *zds)
+{
+    bool    eob= zds->byte_count >= zaphod_dma_block_size(zds);
+    bool    matched= !(zds->status & DMA_RR0_NO_MATCH);
+
+    zds->busy= false;
+    if (eob)
+        zds->status&= ~DMA_RR0_NO_EOB;
+#if 1   /* WmT - TRACE */
+;DPRINTF("%s(): %u bytes, A=0x%04x B=0x%04x%s%s\n", __func__, zds->byte_count, zds->addr_a, zds->addr_b, eob ? " EOB" : "", matched ? " match" : "");
+#endif
+
+    if ( (eob && (zds->int_ctrl & DMA_INT_ON_EOB))
+            || (matched && (zds->int_ctrl & DMA_INT_ON_MATCH)) )
+    {
+        zaphod_dma_raise_irq(zds);
+    }
+
+    if (eob && (zds->wr5 & DMA_WR5_AUTO_RESTART) && zds->enabled)
+    {   /* go again from the timer, so instant mode cannot spin here */
+        zaphod_dma_load(zds);
+        timer_mod(zds->done_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+        return;
+    }
+    zds->enabled= false;
+}
+
+static void zaphod_dma_start(ZaphodDMAState *zds)
+{
+    uint8_t     src_wr, dst_wr, src_timing, dst_timing;
+    uint32_t    count;
+    int         cycles;
+
+    zds->enabled= true;
+    if (zds->busy || !(zds->wr0 & (DMA_WR0_TRANSFER | DMA_WR0_SEARCH)))
+        return;
+
+    count= zaphod_dma_run(zds);
+    if (zds->clock_hz == 0)
+    {
+        zaphod_dma_complete(zds);
+        return;
+    }
+
+    if (zds->wr0 & DMA_WR0_A_TO_B)
+    {
+        src_wr= zds->wr1;   src_timing= zds->timing_a;
+        dst_wr= zds->wr2;   dst_timing= zds->timing_b;
+    }
+    else
+    {
+        src_wr= zds->wr2;   src_timing= zds->timing_b;
+        dst_wr= zds->wr1;   dst_timing= zds->timing_a;
+    }
+    cycles= zaphod_dma_port_cycles(src_wr, src_timing);
+    if (zds->wr0 & DMA_WR0_TRANSFER)
+        cycles+= zaphod_dma_port_cycles(dst_wr, dst_timing);
+
+    zds->busy= true;
+    timer_mod(zds->done_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)
+                + muldiv64((uint64_t)count * cycles,
+                            NANOSECONDS_PER_SECOND, zds->clock_hz));
+}
+
+static void zaphod_dma_timer_cb(void *opaque)
+{
+    ZaphodDMAState  *zds= (ZaphodDMAState *)opaque;
+
+    if (zds->busy)
+        zaphod_dma_complete(zds);
+    else if (zds->enabled)
+        zaphod_dma_start(zds);      /* auto restart */
+}
+
+
+/* Register programming */
+
+static void zaphod_dma_follow(ZaphodDMAState *zds, uint8_t *reg)
+{
+    if (zds->follow_count < ZAPHOD_DMA_MAX_FOLLOW)
+        zds->follow[zds->follow_count++]= reg;
+}
+
+static void zaphod_dma_read_sequence(ZaphodDMAState *zds)
+{
+    uint8_t values[7]= {
+        zds->status,
+        zds->byte_count & 0xff, (zds->byte_count >> 8) & 0xff,
+        zds->addr_a, zds->addr_a >> 8,
+        zds->addr_b, zds->addr_b >> 8
+    };
+    int     n;
+
+    zds->read_count= zds->read_pos= 0;
+    for (n= 0; n < 7; n++)
+    {
+        if (zds->read_mask & (1 << n))
+            zds->read_regs[zds->read_count++]= values[n];
+    }
+}
+
+static void zaphod_dma_reset(void *opaque)
+{
+    ZaphodDMAState  *zds= (ZaphodDMAState *)opaque;
+
+    timer_del(zds->done_timer);
+    zds->enabled= zds->busy= false;
+    zds->ip= false;
+    zds->wr3= zds->wr5= 0;
+    zds->int_ctrl= 0;
+    zds->timing_a= zds->timing_b= DMA_TIMING_STANDARD;
+    zds->follow_count= zds->follow_pos= 0;
+    zds->read_mask= 0x7f;
+    zds->read_count= zds->read_pos= 0;
+    zds->status= DMA_RR0_RESET;
+    zaphod_dma_update_irq(zds);
+}
+
+static void zaphod_dma_command(ZaphodDMAState *zds, uint8_t cmd)
+{
+    switch (cmd)
+    {
+    case DMA_CMD_RESET:
+        zaphod_dma_reset(zds);
+        break;
+    case DMA_CMD_RESET_A_TIMING:
+        zds->timing_a= DMA_TIMING_STANDARD;
+        break;
+    case DMA_CMD_RESET_B_TIMING:
+        zds->timing_b= DMA_TIMING_STANDARD;
+        break;
+    case DMA_CMD_LOAD:
+        zaphod_dma_load(zds);
+        break;
+    case DMA_CMD_CONTINUE:
+        zds->byte_count= 0;
+        zds->status|= DMA_RR0_NO_MATCH | DMA_RR0_NO_EOB;
+        break;
+    case DMA_CMD_DISABLE_INT:
+        zds->wr3&= ~DMA_WR3_INT_ENABLE;
+        zaphod_dma_update_irq(zds);
+        break;
+    case DMA_CMD_ENABLE_INT:
+        zds->wr3|= DMA_WR3_INT_ENABLE;
+        zaphod_dma_update_irq(zds);
+        break;
+    case DMA_CMD_RESET_DISABLE_INT:
+        zds->wr3&= ~DMA_WR3_INT_ENABLE;
+        zds->ip= false;
+        zds->status|= DMA_RR0_NO_IP;
+        zaphod_dma_update_irq(zds);
+        break;
+    case DMA_CMD_ENABLE_AFTER_RETI:
+    case DMA_CMD_FORCE_READY:
+        break;
+    case DMA_CMD_READ_STATUS:
+        zds->read_regs[0]= zds->status;
+        zds->read_count= 1;
+        zds->read_pos= 0;
+        break;
+    case DMA_CMD_REINIT_STATUS:
+        zds->status|= DMA_RR0_NO_MATCH | DMA_RR0_NO_EOB;
+        break;
+    case DMA_CMD_READ_SEQUENCE:
+        zaphod_dma_read_sequence(zds);
+        break;
+    case DMA_CMD_READ_MASK:
+        zaphod_dma_follow(zds, &zds->read_mask);
+        break;
+    case DMA_CMD_ENABLE:
+        zaphod_dma_start(zds);
+        break;
+    case DMA_CMD_DISABLE:
+        /* a deferred completion still reports; bytes have moved */
+        zds->enabled= false;
+        break;
+    default:
+#if 1   /* WmT - TRACE */
+;DPRINTF("%s(): unsupported command 0x%02x\n", __func__, cmd);
+#endif
+        break;
+    }
+}
+
+static void zaphod_dma_write(void *opaque, uint32_t addr, uint32_t value)
+{
+    ZaphodDMAState  *zds= (ZaphodDMAState *)opaque;
+    uint8_t         *reg;
+
+    value&= 0xff;
+
+    if (zds->follow_pos < zds->follow_count)
+    {   /* parameter byte for the last base register written */
+        reg= zds->follow[zds->follow_pos++];
+        *reg= value;
+
+        if (reg == &zds->int_ctrl)
+        {
+            if (value & DMA_INT_PULSE_CTRL)
+                zaphod_dma_follow(zds, &zds->pulse);
+            if (value & DMA_INT_VECTOR)
+                zaphod_dma_follow(zds, &zds->vector);
+        }
+        else if (reg == &zds->timing_b && (value & DMA_TIMING_PRESCALER))
+        {
+            zaphod_dma_follow(zds, &zds->prescaler);
+        }
+        return;
+    }
+
+    zds->follow_count= zds->follow_pos= 0;
+
+    if (!(value & 0x80))
+    {
+        if ((value & 0x03) == 0 && (value & 0x04))
+        {   /* WR1: port A configuration */
+            zds->wr1= value;
+            if (value & DMA_WR12_TIMING)
+                zaphod_dma_follow(zds, &zds->timing_a);
+        }
+        else if ((value & 0x03) == 0)
+        {   /* WR2: port B configuration */
+            zds->wr2= value;
+            if (value & DMA_WR12_TIMING)
+                zaphod_dma_follow(zds, &zds->timing_b);
+        }
+        else
+        {   /* WR0: operation, direction, port A address, length */
+            zds->wr0= value;
+            if (value & DMA_WR0_A_LO)
+                zaphod_dma_follow(zds, &zds->start_a[0]);
+            if (value & DMA_WR0_A_HI)
+                zaphod_dma_follow(zds, &zds->start_a[1]);
+            if (value & DMA_WR0_LEN_LO)
+                zaphod_dma_follow(zds, &zds->block_len[0]);
+            if (value & DMA_WR0_LEN_HI)
+                zaphod_dma_follow(zds, &zds->block_len[1]);
+        }
+        return;
+    }
+
+    switch (value & 0x03)
+    {
+    case 0x00:      /* WR3: match, interrupt and DMA enables */
+        zds->wr3= value;
+        if (value & DMA_WR3_MASK)
+            zaphod_dma_follow(zds, &zds->mask);
+        if (value & DMA_WR3_MATCH)
+            zaphod_dma_follow(zds, &zds->match);
+        zaphod_dma_update_irq(zds);
+        if (value & DMA_WR3_ENABLE)
+            zaphod_dma_start(zds);
+        break;
+    case 0x01:      /* WR4: mode, port B address, interrupt control */
+        zds->wr4= value;
+        if (value & DMA_WR4_B_LO)
+            zaphod_dma_follow(zds, &zds->start_b[0]);
+        if (value & DMA_WR4_B_HI)
+            zaphod_dma_follow(zds, &zds->start_b[1]);
+        if (value & DMA_WR4_INT_CTRL)
+            zaphod_dma_follow(zds, &zds->int_ctrl);
+        break;
+    case 0x02:      /* WR5: ready/wait configuration, auto restart */
+        zds->wr5= value;
+        break;
+    default:        /* WR6: command */
+        zaphod_dma_command(zds, value);
+        break;
+    }
+}
+
+static uint32_t zaphod_dma_read(void *opaque, uint32_t addr)
+{
+    ZaphodDMAState  *zds= (ZaphodDMAState *)opaque;
+    uint8_t         value;
+
+    if (zds->read_count == 0)
+        return zds->status;
+
+    value= zds->read_regs[zds->read_pos++];
+    if (zds->read_pos == zds->read_count)
+        zds->read_pos= 0;
+    return value;
+}
+
+static const MemoryRegionPortio zaphod_dma_portio[] = {
+    { 0x00, 1, 1,
+                .read = zaphod_dma_read,
+                .write = zaphod_dma_write
+                },
+    PORTIO_END_OF_LIST()
+};
+
+
+static void zaphod_dma_realizefn(DeviceState *dev, Error **errp)
+{
+    ZaphodDMAState  *zds= ZAPHOD_DMA(dev);
+
+    if (zds->iobase > 0xff)
+    {
+        error_setg(errp, "iobase must be below 0x100");
+        return;
+    }
+
+    zds->done_timer= timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                zaphod_dma_timer_cb, zds);
+
+    zds->ioports= g_new(PortioList, 1);
+    portio_list_init(zds->ioports, OBJECT(zds), zaphod_dma_portio,
+                    zds, "zaphod.dma");
+    portio_list_add(zds->ioports, get_system_io(), zds->iobase);
+
+    zaphod_dma_reset(zds);
+    qemu_register_reset(zaphod_dma_reset, zds);
+}
+
+static void zaphod_dma_unrealizefn(DeviceState *dev)
+{
+    ZaphodDMAState  *zds= ZAPHOD_DMA(dev);
+
+    qemu_unregister_reset(zaphod_dma_reset, zds);
+    timer_free(zds->done_timer);
+}
+
+
+static Property zaphod_dma_properties[]= {
+    /* properties can be set with '-global zaphod-dma.VAR=VAL' */
+    DEFINE_PROP_UINT32("iobase", ZaphodDMAState, iobase,
+                        ZAPHOD_DMA_IOBASE_DEFAULT),
+    /* e.g. 7372800 for Searle's clock; 0 completes transfers at once */
+    DEFINE_PROP_UINT32("clock-hz", ZaphodDMAState, clock_hz, 0),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void zaphod_dma_class_init(ObjectClass *oc, void *data)
+{
+    DeviceClass *dc= DEVICE_CLASS(oc);
+
+    dc->desc= "Zaphod Z80 DMA controller";
+    dc->realize= zaphod_dma_realizefn;
+    dc->unrealize= zaphod_dma_unrealizefn;
+#if QEMU_VERSION_MAJOR < 5
+    dc->props= zaphod_dma_properties;
+#else
+    device_class_set_props(dc, zaphod_dma_properties);
+#endif
+    set_bit(DEVICE_CATEGORY_MISC, dc->categories);
+}
+
+static void zaphod_dma_instance_init(Object *obj)
+{
+    ZaphodDMAState  *zds= ZAPHOD_DMA(obj);
+
+    /* connected to the board by the IOCore */
+    qdev_init_gpio_out(DEVICE(obj), &zds->irq, 1);
+}
+
+
+static const TypeInfo zaphod_dma_info= {
+    .name= TYPE_ZAPHOD_DMA,
+    .parent= TYPE_DEVICE,
+    /* For ZaphodDMAClass with virtual functions:
+    .class_size= sizeof(ZaphodDMAClass),
+     */
+    .class_init= zaphod_dma_class_init,
+    .instance_size= sizeof(ZaphodDMAState),
+    .instance_init= zaphod_dma_instance_init
+};
+
+static void zaphod_dma_register_types(void)
+{
+    type_register_static(&zaphod_dma_info);
+}
+
+type_init(zaphod_dma_register_types)
@@ -0,0 +1,131 @@
+/*
+ * QEmu Zaphod board - Z80 DMA support
+ * vim: ft=c sw=4 ts=4 et :
+ *
+ * [...William Towle c. 2013-2022, under GPL...]
+ */
+
+
+#ifndef HW_Z80_ZAPHOD_DMA_H
+#define HW_Z80_ZAPHOD_DMA_H
+
+#include "exec/ioport.h"
+#include "hw/irq.h"
+#include "qemu/timer.h"
+
+
+#define ZAPHOD_DMA_IOBASE_DEFAULT   0x0b
+
+/* Write register group, from the base register byte */
+#define DMA_WR0_TRANSFER        0x01
+#define DMA_WR0_SEARCH          0x02
+#define DMA_WR0_A_TO_B          0x04
+#define DMA_WR0_A_LO            0x08    /* these follow the base byte */
+#define DMA_WR0_A_HI            0x10
+#define DMA_WR0_LEN_LO          0x20
+#define DMA_WR0_LEN_HI          0x40
+
+#define DMA_WR12_IO             0x08    /* port is I/O, not memory */
+#define DMA_WR12_MODE_MASK      0x30
+#define DMA_WR12_MODE_DEC       0x00
+#define DMA_WR12_MODE_INC       0x10    /* 1x: fixed address */
+#define DMA_WR12_TIMING         0x40
+#define DMA_TIMING_CYCLES_MASK  0x03    /* 00: 4, 01: 3, 10: 2 */
+#define DMA_TIMING_STANDARD     0xff    /* not programmed since reset */
+#define DMA_TIMING_PRESCALER    0x20    /* port B only */
+
+#define DMA_WR3_STOP_ON_MATCH   0x04
+#define DMA_WR3_MASK            0x08
+#define DMA_WR3_MATCH           0x10
+#define DMA_WR3_INT_ENABLE      0x20
+#define DMA_WR3_ENABLE          0x40
+
+#define DMA_WR4_B_LO            0x04
+#define DMA_WR4_B_HI            0x08
+#define DMA_WR4_INT_CTRL        0x10
+
+#define DMA_INT_ON_MATCH        0x01
+#define DMA_INT_ON_EOB          0x02
+#define DMA_INT_PULSE           0x04
+#define DMA_INT_PULSE_CTRL      0x08    /* these follow the control byte */
+#define DMA_INT_VECTOR          0x10
+#define DMA_INT_STATUS_VECTOR   0x20
+
+#define DMA_WR5_AUTO_RESTART    0x20
+
+/* WR6 commands */
+#define DMA_CMD_RESET           0xc3
+#define DMA_CMD_RESET_A_TIMING  0xc7
+#define DMA_CMD_RESET_B_TIMING  0xcb
+#define DMA_CMD_LOAD            0xcf
+#define DMA_CMD_CONTINUE        0xd3
+#define DMA_CMD_DISABLE_INT     0xaf
+#define DMA_CMD_ENABLE_INT      0xab
+#define DMA_CMD_RESET_DISABLE_INT 0xa3
+#define DMA_CMD_ENABLE_AFTER_RETI 0xb7
+#define DMA_CMD_READ_STATUS     0xbf
+#define DMA_CMD_REINIT_STATUS   0x8b
+#define DMA_CMD_READ_SEQUENCE   0xa7
+#define DMA_CMD_FORCE_READY     0xb3
+#define DMA_CMD_ENABLE          0x87
+#define DMA_CMD_DISABLE         0x83
+#define DMA_CMD_READ_MASK       0xbb
+
+/* RR0 status; the "NO_" bits are active low */
+#define DMA_RR0_OCCURRED        0x01
+#define DMA_RR0_NO_READY        0x02    /* RDY is taken as always active */
+#define DMA_RR0_NO_IP           0x08
+#define DMA_RR0_NO_MATCH        0x10
+#define DMA_RR0_NO_EOB          0x20
+#define DMA_RR0_RESET           (DMA_RR0_NO_IP | DMA_RR0_NO_MATCH | DMA_RR0_NO_EOB)
+
+#define ZAPHOD_DMA_MAX_FOLLOW   8
+
+
+typedef DeviceClass ZaphodDMAClass;
+
+typedef struct {
+    DeviceState     parent;
+
+    uint32_t        iobase;
+    uint32_t        clock_hz;       /* 0 means transfers are instant */
+    PortioList      *ioports;
+    qemu_irq        irq;
+    QEMUTimer       *done_timer;
+
+    /* write registers */
+    uint8_t         wr0, wr1, wr2, wr3, wr4, wr5;
+    uint8_t         timing_a, timing_b, prescaler;
+    uint8_t         mask, match;
+    uint8_t         int_ctrl, pulse, vector;
+    uint8_t         start_a[2], start_b[2], block_len[2];  /* lo, hi */
+    uint8_t         *follow[ZAPHOD_DMA_MAX_FOLLOW];
+    int             follow_count, follow_pos;
+
+    /* read registers */
+    uint8_t         read_mask;
+    uint8_t         read_regs[7];
+    int             read_count, read_pos;
+
+    /* counters and status */
+    uint16_t        addr_a, addr_b;
+    uint32_t        byte_count;     /* up to 0x10000 for a full block */
+    uint8_t         status;
+    bool            enabled, busy;
+    bool            ip;
+} ZaphodDMAState;
+
+
+#define TYPE_ZAPHOD_DMA "zaphod-dma"
+
+#define ZAPHOD_DMA_GET_CLASS(obj) \
+    OBJECT_GET_CLASS(ZaphodDMAClass, obj, TYPE_ZAPHOD_DMA)
+#define ZAPHOD_DMA_CLASS(oc) \
+    OBJECT_CLASS_CHECK(ZaphodDMAClass, oc, TYPE_ZAPHOD_DMA)
+#define ZAPHOD_DMA(obj) \
+    OBJECT_CHECK(ZaphodDMAState, obj, TYPE_ZAPHOD_DMA)
+
+
+uint8_t zaphod_dma_irq_ack(void *opaque);
+
+#endif  /* HW_Z80_ZAPHOD_DMA_H */
@@ -0,0 +1,527 @@
+/*
+ * QEmu Zaphod board - host I/O bridge support
+ * vim: ft=c sw=4 ts=4 et :
+ *
+ * [...William Towle c. 2013-2022, under GPL...]
+ */
+
+
+#include "qemu/osdep.h"
+#include "zaphod.h"
+
+#include "qemu/error-report.h"
+#include "exec/address-spaces.h"
+#include "block/aio.h"
+#include "block/thread-pool.h"
+#include "hw/qdev-properties.h"
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+#include "qemu/main-loop.h"
+#include "sysemu/reset.h"
+
+
+//#define EMIT_DEBUG ZAPHOD_DEBUG
+#define EMIT_DEBUG 0
+#define DPRINTF(fmt, ...) \
+    do { if (EMIT_DEBUG) error_printf("zaphod_hostio: " fmt , ## __VA_ARGS__); } while(0)
+
+
+/* Paravirtual bridge to host files, for moving test fixtures and
+ * results in and out of a guest without a UART in the way. The guest
+ * writes the address of a request block (see zaphod_hostio.h); the
+ * device reads it, runs the host side of the request on QEMU's thread
+ * pool, then copies any data straight into guest RAM and writes back
+ * the status. Completion sets DONE in the status port and, if enabled,
+ * raises /INT with a programmable vector.
+ *
+ * Files are opened by plain name within the "root" directory, and
+ * only if one is given. Handle 0 is the console ("chardev"), which is
+ * written synchronously. One request is in flight at a time, and
+ * writes to the address ports are ignored until it completes.
+ */
+
+struct ZaphodHostIORequest {
+    ZaphodHostIOState   *zhs;       /* NULL if the device was reset */
+    uint8_t             opcode;
+    uint8_t             handle;
+    uint16_t            blk_addr;   /* request block, for the results */
+    uint16_t            buf_addr;
+    uint16_t            len;
+    uint32_t            offset;
+
+    int                 fd;
+    bool                close_fd;   /* reset meanwhile: close when done */
+    int                 oflags;
+    char                *path;
+    uint8_t             *buf;
+    int64_t             size;
+};
+
+
+static void zaphod_hostio_update_irq(ZaphodHostIOState *zhs)
+{
+    qemu_set_irq(zhs->irq, (zhs->status & HOSTIO_STAT_DONE)
+                            && (zhs->control & HOSTIO_CTRL_INT_ENABLE));
+}
+
+/* Called by the board on interrupt acknowledge. The interrupt stays
+ * pending until the guest reads the status port
+ */
+uint8_t zaphod_hostio_irq_ack(void *opaque)
+{
+    return ZAPHOD_HOSTIO(opaque)->vector;
+}
+
+static void zaphod_hostio_free_request(ZaphodHostIORequest *req)
+{
+    g_free(req->path);
+    g_free(req->buf);
+    g_free(req);
+}
+
+/* Write back the results and signal completion */
+static void zaphod_hostio_complete(ZaphodHostIOState *zhs,
+                                    ZaphodHostIORequest *req, uint8_t status)
+{
+    uint16_t    addr= req->blk_addr;
+
+    address_space_stb(&address_space_memory, addr + 1, req->handle,
+                        MEMTXATTRS_UNSPECIFIED, NULL);
+    address_space_stb(&address_space_memory, addr + 2, status,
+                        MEMTXATTRS_UNSPECIFIED, NULL);
+    address_space_stw_le(&address_space_memory, addr + 6, req->len,
+                        MEMTXATTRS_UNSPECIFIED, NULL);
+    address_space_stl_le(&address_space_memory, addr + 8, req->offset,
+                        MEMTXATTRS_UNSPECIFIED, NULL);
+
+    zhs->status= HOSTIO_STAT_DONE;
+    if (status != HOSTIO_OK)
+        zhs->status|= HOSTIO_STAT_ERROR;
+    zaphod_hostio_update_irq(zhs);
+#if 1   /* WmT - TRACE */
+;DPRINTF("%s(): opcode 0x%02x handle %u status 0x%02x len %u\n", __func__, req->opcode, req->handle, status, req->len);
+#endif
+}
+
+
+/* Host side, on a thread pool worker */
+
+static int zaphod_hostio_worker(void *opaque)
+{
+    ZaphodHostIORequest *req= (ZaphodHostIORequest *)opaque;
+    struct stat         st;
+    size_t              done= 0;
+    ssize_t             ret;
+
+    switch (req->opcode)
+    {
+    case HOSTIO_OP_OPEN:
+        ret= qemu_open(req->path, req->oflags, 0644);
+        return (ret < 0) ? -errno : ret;
+
+    case HOSTIO_OP_CLOSE:
+        return (close(req->fd) < 0) ? -errno : 0;
+
+    case HOSTIO_OP_READ:
+        while (done < req->len)
+        {
+            ret= pread(req->fd, req->buf + done, req->len - done,
+                        req->offset + done);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret < 0)
+                return -errno;
+            if (ret == 0)       /* end of file */
+                break;
+            done+= ret;
+        }
+        return done;
+
+    case HOSTIO_OP_WRITE:
+        while (done < req->len)
+        {
+            ret= pwrite(req->fd, req->buf + done, req->len - done,
+                        req->offset + done);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret < 0)
+                return -errno;
+            done+= ret;
+        }
+        return done;
+
+    case HOSTIO_OP_SIZE:
+        if (fstat(req->fd, &st) < 0)
+            return -errno;
+        req->size= st.st_size;
+        return 0;
+    }
+
+    return -EINVAL;
+}
+
+/* Completion, back in the main loop */
+static void zaphod_hostio_done(void *opaque, int ret)
+{
+    ZaphodHostIORequest *req= (ZaphodHostIORequest *)opaque;
+    ZaphodHostIOState   *zhs= req->zhs;
+    uint8_t             status= HOSTIO_OK;
+
+    if (!zhs)
+    {   /* reset while in flight: just release host resources */
+        if (req->opcode == HOSTIO_OP_OPEN && ret >= 0)
+            close(ret);
+        if (req->close_fd)
+            close(req->fd);
+        zaphod_hostio_free_request(req);
+        return;
+    }
+    zhs->req= NULL;
+
+    if (ret < 0)
+    {
+        status= (ret == -ENOENT || ret == -EACCES || ret == -ELOOP)
+                    ? HOSTIO_ERR_NO_FILE : HOSTIO_ERR_IO;
+        req->len= 0;
+    }
+    else switch (req->opcode)
+    {
+    case HOSTIO_OP_OPEN:
+        zhs->fd[req->handle]= ret;
+        break;
+    case HOSTIO_OP_READ:
+        address_space_write(&address_space_memory, req->buf_addr,
+                            MEMTXATTRS_UNSPECIFIED, req->buf, ret);
+        req->len= ret;
+        break;
+    case HOSTIO_OP_WRITE:
+        req->len= ret;
+        break;
+    case HOSTIO_OP_SIZE:
+        req->offset= MIN(req->size, UINT32_MAX);
+        break;
+    }
+
+    zaphod_hostio_complete(zhs, req, status);
+    zaphod_hostio_free_request(req);
+}
+
+
+/* Guest side */
+
+static uint8_t zaphod_hostio_open_path(ZaphodHostIOState *zhs,
+                                        ZaphodHostIORequest *req)
+{
+    char    *name;
+    int     handle;
+
+    if (!zhs->root)
+        return HOSTIO_ERR_NO_FILE;
+
+    for (handle= 1; handle < ZAPHOD_HOSTIO_HANDLES; handle++)
+        if (zhs->fd[handle] < 0)
+            break;
+    if (handle == ZAPHOD_HOSTIO_HANDLES)
+        return HOSTIO_ERR_HANDLE;
+
+    /* a plain name: no directories, and nothing outside "root" */
+    name= g_malloc0(req->len + 1);
+    address_space_read(&address_space_memory, req->buf_addr,
+                        MEMTXATTRS_UNSPECIFIED, name, req->len);
+    if (req->len == 0 || strlen(name) != req->len || strchr(name, '/')
+            || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+    {
+        g_free(name);
+        return HOSTIO_ERR_NAME;
+    }
+
+    req->path= g_build_filename(zhs->root, name, NULL);
+    g_free(name);
+    req->handle= handle;
+    return HOSTIO_OK;
+}
+
+static uint8_t zaphod_hostio_prepare(ZaphodHostIOState *zhs,
+                                        ZaphodHostIORequest *req)
+{
+    switch (req->opcode)
+    {
+    case HOSTIO_OP_OPEN:
+    case HOSTIO_OP_READ:
+    case HOSTIO_OP_WRITE:
+        if (req->buf_addr + req->len > Z80_MAX_RAM_SIZE)
+            return HOSTIO_ERR_RANGE;
+        break;
+    case HOSTIO_OP_CLOSE:
+    case HOSTIO_OP_SIZE:
+        break;
+    default:
+        return HOSTIO_ERR_OPCODE;
+    }
+
+    if (req->opcode == HOSTIO_OP_OPEN)
+        return zaphod_hostio_open_path(zhs, req);
+
+    if (req->handle == 0 && req->opcode != HOSTIO_OP_WRITE)
+        return HOSTIO_ERR_HANDLE;
+    if (req->handle >= ZAPHOD_HOSTIO_HANDLES
+            || (req->handle > 0 && zhs->fd[req->handle] < 0))
+        return HOSTIO_ERR_HANDLE;
+
+    req->fd= zhs->fd[req->handle];
+    if (req->opcode == HOSTIO_OP_CLOSE)
+        zhs->fd[req->handle]= -1;
+
+    if (req->opcode == HOSTIO_OP_READ || req->opcode == HOSTIO_OP_WRITE)
+    {
+        req->buf= g_malloc0(req->len);
+        if (req->opcode == HOSTIO_OP_WRITE)
+            address_space_read(&address_space_memory, req->buf_addr,
+                                MEMTXATTRS_UNSPECIFIED, req->buf, req->len);
+    }
+    return HOSTIO_OK;
+}
+
+static void zaphod_hostio_start(ZaphodHostIOState *zhs)
+{
+    ZaphodHostIORequest *req;
+    uint8_t             blk[HOSTIO_REQ_SIZE];
+    uint8_t             status;
+
+    if (zhs->status & HOSTIO_STAT_BUSY)
+        return;                     /* one request at a time */
+
+    if (zhs->req_addr > Z80_MAX_RAM_SIZE - HOSTIO_REQ_SIZE)
+    {   /* nowhere to write the results */
+        zhs->status= HOSTIO_STAT_DONE | HOSTIO_STAT_ERROR;
+        zaphod_hostio_update_irq(zhs);
+        return;
+    }
+
+    address_space_read(&address_space_memory, zhs->req_addr,
+                        MEMTXATTRS_UNSPECIFIED, blk, sizeof(blk));
+    req= g_new0(ZaphodHostIORequest, 1);
+    req->zhs= zhs;
+    req->opcode= blk[0];
+    req->handle= blk[1];
+    req->blk_addr= zhs->req_addr;
+    req->buf_addr= lduw_le_p(&blk[4]);
+    req->len= lduw_le_p(&blk[6]);
+    req->offset= ldl_le_p(&blk[8]);
+    req->fd= -1;
+    switch (blk[3])
+    {
+    case HOSTIO_OPEN_WRITE:
+        req->oflags= O_WRONLY | O_CREAT | O_TRUNC;
+        break;
+    case HOSTIO_OPEN_UPDATE:
+        req->oflags= O_RDWR | O_CREAT;
+        break;
+    default:
+        req->oflags= O_RDONLY;
+    }
+    req->oflags|= O_NOFOLLOW;
+
+    status= zaphod_hostio_prepare(zhs, req);
+    if (status != HOSTIO_OK)
+    {
+        req->len= 0;
+        zaphod_hostio_complete(zhs, req, status);
+        zaphod_hostio_free_request(req);
+        return;
+    }
+
+    if (req->opcode == HOSTIO_OP_WRITE && req->handle == 0)
+    {   /* console: unconnected means discarded */
+        if (qemu_chr_fe_backend_connected(&zhs->chr))
+            qemu_chr_fe_write_all(&zhs->chr, req->buf, req->len);
+        zaphod_hostio_complete(zhs, req, HOSTIO_OK);
+        zaphod_hostio_free_request(req);
+        return;
+    }
+
+    zhs->status= HOSTIO_STAT_BUSY;
+    zaphod_hostio_update_irq(zhs);
+    zhs->req= req;
+    thread_pool_submit_aio(aio_get_thread_pool(qemu_get_aio_context()),
+                            zaphod_hostio_worker, req,
+                            zaphod_hostio_done, req);
+}
+
+static uint32_t zaphod_hostio_read(void *opaque, uint32_t addr)
+{
+    ZaphodHostIOState   *zhs= (ZaphodHostIOState *)opaque;
+    uint8_t             value;
+
+    switch (addr & 0x03)
+    {
+    case HOSTIO_PORT_ADDR_LO:
+        value= zhs->status;
+        zhs->status&= ~HOSTIO_STAT_DONE;
+        zaphod_hostio_update_irq(zhs);
+        return value;
+    case HOSTIO_PORT_ADDR_HI:
+        return zhs->req_addr >> 8;
+    case HOSTIO_PORT_CONTROL:
+        return zhs->control;
+    default:
+        return zhs->vector;
+    }
+}
+
+static void zaphod_hostio_write(void *opaque, uint32_t addr, uint32_t value)
+{
+    ZaphodHostIOState   *zhs= (ZaphodHostIOState *)opaque;
+
+    value&= 0xff;
+    switch (addr & 0x03)
+    {
+    case HOSTIO_PORT_ADDR_LO:
+        /* the address is fixed while a request is in flight */
+        if (zhs->status & HOSTIO_STAT_BUSY)
+            break;
+        zhs->req_addr= (zhs->req_addr & 0xff00) | value;
+        break;
+    case HOSTIO_PORT_ADDR_HI:
+        if (zhs->status & HOSTIO_STAT_BUSY)
+            break;
+        zhs->req_addr= (zhs->req_addr & 0x00ff) | (value << 8);
+        zaphod_hostio_start(zhs);
+        break;
+    case HOSTIO_PORT_CONTROL:
+        zhs->control= value;
+        zaphod_hostio_update_irq(zhs);
+        break;
+    default:
+        zhs->vector= value;
+    }
+}
+
+static const MemoryRegionPortio zaphod_hostio_portio[] = {
+    { 0x00, 4, 1,
+                .read = zaphod_hostio_read,
+                .write = zaphod_hostio_write
+                },
+    PORTIO_END_OF_LIST()
+};
+
+
+static void zaphod_hostio_reset(void *opaque)
+{
+    ZaphodHostIOState   *zhs= (ZaphodHostIOState *)opaque;
+    ZaphodHostIORequest *req= zhs->req;
+    int                 n;
+
+    /* an in-flight request completes, but on its own */
+    if (req)
+    {
+        req->zhs= NULL;
+        zhs->req= NULL;
+    }
+
+    for (n= 1; n < ZAPHOD_HOSTIO_HANDLES; n++)
+    {
+        if (zhs->fd[n] < 0)
+            continue;
+        if (req && req->fd == zhs->fd[n])
+            req->close_fd= true;
+        else
+            close(zhs->fd[n]);
+        zhs->fd[n]= -1;
+    }
+
+    zhs->req_addr= 0;
+    zhs->status= 0;
+    zhs->control= 0;
+    zhs->vector= 0;
+    zaphod_hostio_update_irq(zhs);
+}
+
+static void zaphod_hostio_realizefn(DeviceState *dev, Error **errp)
+{
+    ZaphodHostIOState   *zhs= ZAPHOD_HOSTIO(dev);
+    int                 n;
+
+    if (zhs->iobase & 0x03 || zhs->iobase > 0xfc)
+    {
+        error_setg(errp, "iobase must be a multiple of 4 below 0x100");
+        return;
+    }
+    if (zhs->root && !g_file_test(zhs->root, G_FILE_TEST_IS_DIR))
+    {
+        error_setg(errp, "root '%s' is not a directory", zhs->root);
+        return;
+    }
+
+    for (n= 0; n < ZAPHOD_HOSTIO_HANDLES; n++)
+        zhs->fd[n]= -1;
+
+    zhs->ioports= g_new(PortioList, 1);
+    portio_list_init(zhs->ioports, OBJECT(zhs), zaphod_hostio_portio,
+                    zhs, "zaphod.hostio");
+    portio_list_add(zhs->ioports, get_system_io(), zhs->iobase);
+
+    zaphod_hostio_reset(zhs);
+    qemu_register_reset(zaphod_hostio_reset, zhs);
+}
+
+static void zaphod_hostio_unrealizefn(DeviceState *dev)
+{
+    ZaphodHostIOState   *zhs= ZAPHOD_HOSTIO(dev);
+
+    qemu_unregister_reset(zaphod_hostio_reset, zhs);
+    zaphod_hostio_reset(zhs);
+    qemu_chr_fe_deinit(&zhs->chr, false);
+}
+
+
+static Property zaphod_hostio_properties[]= {
+    /* properties can be set with '-global zaphod-hostio.VAR=VAL' */
+    DEFINE_PROP_UINT32("iobase", ZaphodHostIOState, iobase,
+                        ZAPHOD_HOSTIO_IOBASE_DEFAULT),
+    DEFINE_PROP_STRING("root", ZaphodHostIOState, root),
+    DEFINE_PROP_CHR("chardev", ZaphodHostIOState, chr),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void zaphod_hostio_class_init(ObjectClass *oc, void *data)
+{
+    DeviceClass *dc= DEVICE_CLASS(oc);
+
+    dc->desc= "Zaphod host I/O bridge";
+    dc->realize= zaphod_hostio_realizefn;
+    dc->unrealize= zaphod_hostio_unrealizefn;
+#if QEMU_VERSION_MAJOR < 5
+    dc->props= zaphod_hostio_properties;
+#else
+    device_class_set_props(dc, zaphod_hostio_properties);
+#endif
+    set_bit(DEVICE_CATEGORY_MISC, dc->categories);
+}
+
+static void zaphod_hostio_instance_init(Object *obj)
+{
+    ZaphodHostIOState   *zhs= ZAPHOD_HOSTIO(obj);
+
+    /* connected to the board by the IOCore */
+    qdev_init_gpio_out(DEVICE(obj), &zhs->irq, 1);
+}
+
+
+static const TypeInfo zaphod_hostio_info= {
+    .name= TYPE_ZAPHOD_HOSTIO,
+    .parent= TYPE_DEVICE,
+    /* For ZaphodHostIOClass with virtual functions:
+    .class_size= sizeof(ZaphodHostIOClass),
+     */
+    .class_init= zaphod_hostio_class_init,
+    .instance_size= sizeof(ZaphodHostIOState),
+    .instance_init= zaphod_hostio_instance_init
+};
+
+static void zaphod_hostio_register_types(void)
+{
+    type_register_static(&zaphod_hostio_info);
+}
+
+type_init(zaphod_hostio_register_types)
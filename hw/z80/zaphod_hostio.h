@@ -0,0 +1,93 @@
+/*
+ * QEmu Zaphod board - host I/O bridge support
+ * vim: ft=c sw=4 ts=4 et :
+ *
+ * [...William Towle c. 2013-2022, under GPL...]
+ */
+
+
+#ifndef HW_Z80_ZAPHOD_HOSTIO_H
+#define HW_Z80_ZAPHOD_HOSTIO_H
+
+#include "chardev/char-fe.h"
+#include "exec/ioport.h"
+#include "hw/irq.h"
+
+
+#define ZAPHOD_HOSTIO_IOBASE_DEFAULT    0x0c
+#define ZAPHOD_HOSTIO_HANDLES           8       /* 0 is the console */
+
+/* Ports, relative to iobase */
+#define HOSTIO_PORT_ADDR_LO     0x00    /* W: request block address; R: status */
+#define HOSTIO_PORT_ADDR_HI     0x01    /* W: ... and start the request */
+#define HOSTIO_PORT_CONTROL     0x02
+#define HOSTIO_PORT_VECTOR      0x03
+
+/* Status port (reading it clears DONE and the interrupt) */
+#define HOSTIO_STAT_BUSY        0x01
+#define HOSTIO_STAT_DONE        0x02
+#define HOSTIO_STAT_ERROR       0x80    /* last request failed */
+
+#define HOSTIO_CTRL_INT_ENABLE  0x01
+
+/* Request block in guest memory, little-endian:
+ * +0 opcode, +1 handle, +2 status (out), +3 flags,
+ * +4 buffer address, +6 length (in/out), +8 file offset (32 bits)
+ */
+#define HOSTIO_REQ_SIZE         12
+
+#define HOSTIO_OP_OPEN          0x01    /* buffer/length: file name */
+#define HOSTIO_OP_CLOSE         0x02
+#define HOSTIO_OP_READ          0x03
+#define HOSTIO_OP_WRITE         0x04
+#define HOSTIO_OP_SIZE          0x05    /* result in the offset field */
+
+#define HOSTIO_OPEN_READ        0x00
+#define HOSTIO_OPEN_WRITE       0x01    /* create/truncate */
+#define HOSTIO_OPEN_UPDATE      0x02    /* read/write, create */
+
+#define HOSTIO_OK               0x00
+#define HOSTIO_ERR_OPCODE       0x01
+#define HOSTIO_ERR_HANDLE       0x02
+#define HOSTIO_ERR_RANGE        0x03    /* buffer runs past 64KiB */
+#define HOSTIO_ERR_NAME         0x04
+#define HOSTIO_ERR_NO_FILE      0x05
+#define HOSTIO_ERR_IO           0x06
+
+
+typedef struct ZaphodHostIORequest ZaphodHostIORequest;
+
+typedef DeviceClass ZaphodHostIOClass;
+
+typedef struct {
+    DeviceState     parent;
+
+    uint32_t        iobase;
+    char            *root;          /* host directory for OPEN */
+    CharBackend     chr;            /* handle 0: console output */
+    PortioList      *ioports;
+    qemu_irq        irq;
+
+    uint16_t        req_addr;
+    uint8_t         status;
+    uint8_t         control;
+    uint8_t         vector;
+
+    int             fd[ZAPHOD_HOSTIO_HANDLES];
+    ZaphodHostIORequest *req;       /* in flight on the thread pool */
+} ZaphodHostIOState;
+
+
+#define TYPE_ZAPHOD_HOSTIO "zaphod-hostio"
+
+#define ZAPHOD_HOSTIO_GET_CLASS(obj) \
+    OBJECT_GET_CLASS(ZaphodHostIOClass, obj, TYPE_ZAPHOD_HOSTIO)
+#define ZAPHOD_HOSTIO_CLASS(oc) \
+    OBJECT_CLASS_CHECK(ZaphodHostIOClass, oc, TYPE_ZAPHOD_HOSTIO)
+#define ZAPHOD_HOSTIO(obj) \
+    OBJECT_CHECK(ZaphodHostIOState, obj, TYPE_ZAPHOD_HOSTIO)
+
+
+uint8_t zaphod_hostio_irq_ack(void *opaque);
+
+#endif  /* HW_Z80_ZAPHOD_HOSTIO_H */
@@ -9,6 +9,7 @@
 #include "qemu/osdep.h"
 #include "zaphod.h"
 #include "zaphod_uart.h"
+#include "zaphod_keymap.h"
 
 #include "qapi/error.h"
 #include "exec/address-spaces.h"
@@ -26,7 +27,8 @@
  * Handles IO ports for 'stdio' and ACIA input, as expected by the
  * "teletype" ROM for the Phil Brown emulator and the BASIC ROM for
  * the Grant Searle board emulation respectively.
- * The IRQ for the MC6850 UART is managed here, and the 'inkey'
+ * The MC6850 registers, and the IRQ they drive, are modelled in the
+ * UART code; the IRQ line is connected to the board here. The 'inkey'
  * value shared by UART and corresponding screen is part of the UART
  * code.
  */
@@ -36,15 +38,20 @@
 static
 int zaphod_iocore_can_receive_stdio(void *opaque)
 {
-    return zaphod_uart_can_receive(opaque);
+    ZaphodIOCoreState *zis= (ZaphodIOCoreState *)opaque;
+
+    return zis->uart_stdio ? zaphod_uart_can_receive(zis->uart_stdio) : 0;
 }
 
 static
 void zaphod_iocore_receive_stdio(void *opaque, const uint8_t *buf, int len)
 {
     ZaphodIOCoreState *zis= (ZaphodIOCoreState *)opaque;
+    int n;
 
-    zaphod_uart_set_inkey(zis->uart_stdio, buf[0], true);
+    /* can_receive() limits 'len' to what the FIFO has room for */
+    for (n= 0; n < len; n++)
+        zaphod_uart_set_inkey(zis->uart_stdio, buf[n], true);
 }
 
 
@@ -53,30 +60,35 @@ void zaphod_iocore_receive_stdio(void *opaque, const uint8_t *buf, int len)
 static
 int zaphod_iocore_can_receive_acia(void *opaque)
 {
-    return zaphod_uart_can_receive(opaque);
+    ZaphodIOCoreState *zis= (ZaphodIOCoreState *)opaque;
+
+    return zis->uart_acia ? zaphod_uart_can_receive(zis->uart_acia) : 0;
 }
 
 static
 void zaphod_iocore_receive_acia(void *opaque, const uint8_t *buf, int len)
 {
     ZaphodIOCoreState *zis= (ZaphodIOCoreState *)opaque;
+    int n;
 
-#if QEMU_VERSION_MAJOR >= 5 /* possibly `SDL_MAJOR_VERSION >= 2` ? */
-    if (buf[0] == '\n')
+    /* can_receive() limits 'len' to what the FIFO has room for */
+    for (n= 0; n < len; n++)
     {
-        /* QEmu's SDL v2 support introduces sdl2_process_key(), which
-         * injects '\n' in the input stream for Q_KEY_CODE_RET rather
-         * than '\r' as before. Send the latter.
-         */
-        zaphod_uart_set_inkey(zis->uart_acia, '\r', true);
-    }
-    else
+#if QEMU_VERSION_MAJOR >= 5 /* possibly `SDL_MAJOR_VERSION >= 2` ? */
+        if (buf[n] == '\n')
+        {
+            /* QEmu's SDL v2 support introduces sdl2_process_key(), which
+             * injects '\n' in the input stream for Q_KEY_CODE_RET rather
+             * than '\r' as before. Send the latter.
+             */
+            zaphod_uart_set_inkey(zis->uart_acia, '\r', true);
+        }
+        else
 #endif
-    {
-        zaphod_uart_set_inkey(zis->uart_acia, buf[0], true);
+        {
+            zaphod_uart_set_inkey(zis->uart_acia, buf[n], true);
+        }
     }
-    if (zis->irq_acia)
-        qemu_irq_raise(*zis->irq_acia);
 }
 
 
@@ -166,29 +178,20 @@ static uint32_t zaphod_iocore_read_acia(void *opaque, uint32_t addr)
         }
     }
 
-    switch (addr)
+    /* RS is A0; the remaining bits are mirrored across 0x80-0xbf */
+    switch (addr & 0x01)
     {
-    case 0x80:      /* ACIA: read UART PortStatus */
+    case 0x00:      /* ACIA: read UART PortStatus */
         if (vc_present)
             return zaphod_uart_portstatus(zus);
         else
-            return 0x0f;
+            return ACIA_SR_TDRE;
 
-    case 0x81:      /* ACIA: read UART RxData */
-        value= 0x00;
-        if (vc_present)
-        {
+    default:        /* ACIA: read UART RxData */
+        value= 0xff;
+        if (vc_present && zaphod_uart_has_inkey(zus))
             value= zaphod_uart_get_inkey(zus, true);
-            if (zis->irq_acia)
-                qemu_irq_lower(*zis->irq_acia);
-        }
-        return value? value : 0xff;
-
-    default:
-#if 1   /* WmT - TRACE */
-;DPRINTF("DEBUG: %s() Unexpected read, with port=%d\n", __func__, addr);
-#endif
-        return 0x00;
+        return value;
     }
 }
 
@@ -209,32 +212,27 @@ static void zaphod_iocore_write_acia(void *opaque, uint32_t addr, uint32_t value
 {
     ZaphodIOCoreState   *zis= (ZaphodIOCoreState *)opaque;
 
-    switch (addr)
+    switch (addr & 0x01)
     {
-    case 0x80:      /* ACIA: write UART PortControl */
-        /* Received byte controls baud rate, encoding, and which
-         * status events trigger the interrupt. The Zaphod machines do
-         * not need these to be emulated
+    case 0x00:      /* ACIA: write UART PortControl */
+        /* Received byte selects clock divide, word format, RTS and
+         * which status events trigger the interrupt
          */
-//;DPRINTF("DEBUG: %s() write ACIA PortControl (port 0x%02x) is a NOP <- value %d\n", __func__, addr, value);
+        if (zis->uart_acia)
+            zaphod_uart_set_control(zis->uart_acia, value & 0xff);
         break;
-    case 0x81:      /* ACIA: write UART TxData */
+    default:        /* ACIA: write UART TxData */
 //;DPRINTF("DEBUG: %s() write ACIA UART TxData (port 0x%02x) -> ch-value=%d\n", __func__, addr, value);
         zaphod_iocore_putchar_acia(zis, value & 0xff);
         break;
-    default:
-#if 1   /* WmT - TRACE */
-;DPRINTF("DEBUG: %s() Unexpected write, port 0x%02x, value %d\n", __func__, addr, value);
-#endif
-        break;
     }
 }
 
 static const MemoryRegionPortio zaphod_iocore_portio_acia[] = {
-    /* TODO: 0x80-0x81 apply to Grant Searle BASIC ROM but hardware
+    /* Grant Searle's BASIC ROM uses 0x80-0x81, but the hardware
      * decodes all of 0x80-0xbf [with even/odd ports equivalent]
      */
-    { 0x80, 2, 1,
+    { 0x80, 0x40, 1,
                 .read = zaphod_iocore_read_acia,
                 .write = zaphod_iocore_write_acia
                 },
@@ -243,249 +241,66 @@ static const MemoryRegionPortio zaphod_iocore_portio_acia[] = {
 
 
 #if 1   /* keyboard I/O */
-#if 1
-/* Tables for mapping qcode of keypress to corresponding ascii
- * TODO: must account for modifier keys
+/* Key events are translated by the table in zaphod_keymap.c, and
+ * each key's bytes are queued as one unit to the UART whose screen
+ * has focus
  */
-#define NO_KEY                  0xff
-
-static const uint8_t qcode_to_ascii[]= {
-    [0 ... 0xff]                = NO_KEY,
-
-    /* TODO: '`' */
-    [Q_KEY_CODE_1]              = '1',
-    [Q_KEY_CODE_2]              = '2',
-    [Q_KEY_CODE_3]              = '3',
-    [Q_KEY_CODE_4]              = '4',
-    [Q_KEY_CODE_5]              = '5',
-    [Q_KEY_CODE_6]              = '6',
-    [Q_KEY_CODE_7]              = '7',
-    [Q_KEY_CODE_8]              = '8',
-    [Q_KEY_CODE_9]              = '9',
-    [Q_KEY_CODE_0]              = '0',
-    /* TODO: '-', '=' */
-    [Q_KEY_CODE_BACKSPACE]      = 127,
-
-    [Q_KEY_CODE_Q]              = 'q',
-    [Q_KEY_CODE_W]              = 'w',
-    [Q_KEY_CODE_E]              = 'e',
-    [Q_KEY_CODE_R]              = 'r',
-    [Q_KEY_CODE_T]              = 't',
-    [Q_KEY_CODE_Y]              = 'y',
-    [Q_KEY_CODE_U]              = 'u',
-    [Q_KEY_CODE_I]              = 'i',
-    [Q_KEY_CODE_O]              = 'o',
-    [Q_KEY_CODE_P]              = 'p',
-    /* TODO: '[', ']' */
-
-    [Q_KEY_CODE_A]              = 'a',
-    [Q_KEY_CODE_S]              = 's',
-    [Q_KEY_CODE_D]              = 'd',
-    [Q_KEY_CODE_F]              = 'f',
-    [Q_KEY_CODE_G]              = 'g',
-    [Q_KEY_CODE_H]              = 'h',
-    [Q_KEY_CODE_J]              = 'j',
-    [Q_KEY_CODE_K]              = 'k',
-    [Q_KEY_CODE_L]              = 'l',
-    /* TODO: ';', '\'', '#' */
-    [Q_KEY_CODE_RET]            = '\r',
-
-    [Q_KEY_CODE_Z]              = 'z',
-    [Q_KEY_CODE_X]              = 'x',
-    [Q_KEY_CODE_C]              = 'c',
-    [Q_KEY_CODE_V]              = 'v',
-    [Q_KEY_CODE_B]              = 'b',
-    [Q_KEY_CODE_N]              = 'n',
-    [Q_KEY_CODE_M]              = 'm',
-    /* TODO: ',', '.', '/' */
-
-    [Q_KEY_CODE_SPC]            = ' '
-};
-static const uint8_t shift_qcode_to_ascii[]= {
-    [0 ... 0xff]                = NO_KEY,
-
-    /* TODO: '`' */
-    [Q_KEY_CODE_1]              = '!',
-    [Q_KEY_CODE_2]              = '"',
-    [Q_KEY_CODE_3]              = '\xa3',   /* UK pound */
-    [Q_KEY_CODE_4]              = '$',
-    [Q_KEY_CODE_5]              = '%',
-    [Q_KEY_CODE_6]              = '^',
-    [Q_KEY_CODE_7]              = '&',
-    [Q_KEY_CODE_8]              = '*',
-    [Q_KEY_CODE_9]              = '(',
-    [Q_KEY_CODE_0]              = ')',
-    /* TODO: '-', '=' */
-    [Q_KEY_CODE_BACKSPACE]      = 127,
-
-    [Q_KEY_CODE_Q]              = 'Q',
-    [Q_KEY_CODE_W]              = 'W',
-    [Q_KEY_CODE_E]              = 'E',
-    [Q_KEY_CODE_R]              = 'R',
-    [Q_KEY_CODE_T]              = 'T',
-    [Q_KEY_CODE_Y]              = 'Y',
-    [Q_KEY_CODE_U]              = 'U',
-    [Q_KEY_CODE_I]              = 'I',
-    [Q_KEY_CODE_O]              = 'O',
-    [Q_KEY_CODE_P]              = 'P',
-    /* TODO: '[', ']' */
-
-    [Q_KEY_CODE_A]              = 'A',
-    [Q_KEY_CODE_S]              = 'S',
-    [Q_KEY_CODE_D]              = 'D',
-    [Q_KEY_CODE_F]              = 'F',
-    [Q_KEY_CODE_G]              = 'G',
-    [Q_KEY_CODE_H]              = 'H',
-    [Q_KEY_CODE_J]              = 'J',
-    [Q_KEY_CODE_K]              = 'K',
-    [Q_KEY_CODE_L]              = 'L',
-    /* TODO: ';', '\'', '#' */
-    [Q_KEY_CODE_RET]            = '\r',
-
-    [Q_KEY_CODE_Z]              = 'Z',
-    [Q_KEY_CODE_X]              = 'X',
-    [Q_KEY_CODE_C]              = 'C',
-    [Q_KEY_CODE_V]              = 'V',
-    [Q_KEY_CODE_B]              = 'B',
-    [Q_KEY_CODE_N]              = 'N',
-    [Q_KEY_CODE_M]              = 'M',
-    /* TODO: ',', '.', '/' */
-
-    [Q_KEY_CODE_SPC]            = ' '
-};
-#else   /* previous keyboard I/O */
-static const uint8_t keycode_to_asciilc[128]= {
-    /* keymap for UK QWERTY keyboard - NB. repo.or.cz uses its
-     * callback to translate keycode to row and column [as per the
-     * Spectrum's keyboard electronics]. When feeding input to our
-     * sercon or MC6850 input streams, we want ASCII.
-     * (FIXME: this is (unintentionally) partial, and the handler
-     * (also) lacks code to sense/track/apply modifier keys)
-     */
-      0,  0,'1','2','3','4','5','6',
-    '7','8','9','0',  0,  0,  0,  0,
-    'q','w','e','r','t','y','u','i',
-    'o','p',  0,  0, 13,  0,'a','s',
-    'd','f','g','h','j','k','l',  0,
-      0,  0,  0,  0,'z','x','c','v',
-    'b','n','m',  0,  0,  0,  0,  0,
-      0,' ',  0,  0,  0,  0,  0,  0,
-
-      0,  0,  0,  0,  0,  0,  0,  0,
-      0,  0,  0,  0,  0,  0,  0,  0,
-      0,  0,  0,  0,  0,  0,  0,  0,
-      0,  0,  0,  0,  0,  0,  0,  0,
-
-      0,  0,  0,  0,  0,  0,  0,  0,
-      0,  0,  0,  0,  0,  0,  0,  0,
-      0,  0,  0,  0,  0,  0,  0,  0,
-      0,  0,  0,  0,  0,  0,  0,  0,
-};
-#endif
-
 static void zaphod_kbd_event(DeviceState *dev, QemuConsole *src,
                              InputEvent *evt)
 {
     ZaphodIOCoreState   *zis= ZAPHOD_IOCORE(dev);
-    InputKeyEvent *key;
-    int qcode, modifier_bit, scancodes[3], count;
+    ZaphodUARTState     *uart;
+    InputKeyEvent       *key;
+    uint8_t             seq[ZAPHOD_KEYMAP_SEQ_MAX];
+    int                 qcode, modifier_bit, len;
 
     assert(evt->type == INPUT_EVENT_KIND_KEY);
     key= evt->u.key.data;
-    qcode = qemu_input_key_value_to_qcode(key->key);
+    qcode= qemu_input_key_value_to_qcode(key->key);
 
-    modifier_bit= 0;
-    switch (qcode)
+    if ((modifier_bit= zaphod_keymap_modifier(qcode)) != 0)
     {
-    case Q_KEY_CODE_SHIFT:
-        modifier_bit= 1;
-        break;
-    case Q_KEY_CODE_SHIFT_R:
-        modifier_bit= 2;
-        break;
-
-    /* TODO: other modifiers? */
-
-    default:
-        break;  /* fall through to inject ASCII for key */
+        if (modifier_bit & ZAPHOD_KBD_MOD_LOCKS)
+        {
+            if (key->down)
+                zis->modifiers^= modifier_bit;
+        }
+        else
+        {
+            zis->modifiers&= ~modifier_bit;
+            if (key->down)
+                zis->modifiers|= modifier_bit;
+        }
+        return;
     }
 
-    if (modifier_bit)
-    {
-        zis->modifiers&= ~modifier_bit;
-        if (key->down)
-            zis->modifiers|= modifier_bit;
-    }
-    else if (zis->screen_stdio || zis->screen_acia)
-    {
-        /* Put character - convert to ASCII and inject into ACIA or
-         * stdio stream via the relevant chardev's receive functions.
-         * TODO: rewrite as 'else' case of modifier adjust test
-         */
+    /* key-up events carry no input now the UARTs have FIFOs */
+    if (!key->down)
+        return;
+    if (!zis->screen_stdio && !zis->screen_acia)
+        return;
 
-        count = qemu_input_key_value_to_scancode(key->key,
-                                                 key->down,
-                                                 scancodes);
-        if (count == 1) /* single-byte XT scancode */
-        {
-            ZaphodMachineState  *zms= zis->board;
-
-            if (!key->down)
-            {
-                if (src == zis->screen_acia->display)
-                    zaphod_uart_set_inkey(zis->uart_acia, 0, false);
-                else
-                    zaphod_uart_set_inkey(zis->uart_stdio, 0, false);
-            }
-            else
-            {
-              const uint8_t     *conv_table= qcode_to_ascii;
-              int               conv_table_size;
-              uint8_t           ch= NO_KEY;
 #if QEMU_VERSION_MAJOR == 2 /* bug? src parameter always NULL */
-              ZaphodUARTState   *uart_mux;
+    uart= zis->uart_acia ? zis->uart_acia : zis->uart_stdio;
+#else
+    if (zis->uart_acia && (!zis->uart_stdio
+            || (zis->screen_acia && src == zis->screen_acia->display)))
+        uart= zis->uart_acia;
+    else
+        uart= zis->uart_stdio;
 #endif
+    if (!uart)
+        return;
 
-                if (zis->modifiers & 3)
-                {
-                    conv_table= shift_qcode_to_ascii;
-                    conv_table_size= sizeof shift_qcode_to_ascii
-                                    / sizeof shift_qcode_to_ascii[0];
-                }
-                else
-                {
-                    conv_table_size= sizeof qcode_to_ascii
-                                    / sizeof qcode_to_ascii[0];
-                }
-
-                if (qcode < conv_table_size)
-                {
-                    ch= conv_table[qcode];
+    len= zaphod_keymap_translate(qcode, zis->modifiers, seq);
 #if 1   /* WmT - TRACE */
-;DPRINTF("*** INFO: key-down event (scancode %d, val %d) from source device %p ***\n", scancodes[0], ch, dev);
-#endif
-                }
-
-#if QEMU_VERSION_MAJOR == 2
-                if ( (ch != NO_KEY) && (uart_mux= zis->uart_acia) != NULL )
-#else
-                if ( (ch != NO_KEY) && (src == zis->screen_acia->display) )
+;DPRINTF("*** INFO: key-down event (qcode %d, %d byte(s)) from source device %p ***\n", qcode, len, dev);
 #endif
-                {
-                    if (zaphod_iocore_can_receive_acia(zms->iocore))
-                        zaphod_iocore_receive_acia(zms->iocore, &ch, 1);
-                }
-#if QEMU_VERSION_MAJOR == 2
-                else if ( (ch != NO_KEY) && (uart_mux= zis->uart_stdio) != NULL )
-#else
-                if ( (ch != NO_KEY) && (src == zis->screen_stdio->display) )
+    if (len > 0 && !zaphod_uart_push_input(uart, seq, len))
+    {
+#if 1   /* WmT - TRACE */
+;DPRINTF("WARNING: %s() RX FIFO full - key dropped\n", __func__);
 #endif
-                {
-                    if (zaphod_iocore_can_receive_stdio(zms->iocore))
-                        zaphod_iocore_receive_stdio(zms->iocore, &ch, 1);
-                }
-            }
-        }
     }
 }
 
@@ -569,10 +384,16 @@ static void zaphod_iocore_realizefn(DeviceState *dev, Error **errp)
 
     /* ACIA setup */
 
-    zis->ioports_acia = g_new(PortioList, 1);
-    portio_list_init(zis->ioports_acia, OBJECT(zis), zaphod_iocore_portio_acia,
-                    zis, "zaphod.acia");
-    portio_list_add(zis->ioports_acia, get_system_io(), 0x00);
+#ifdef CONFIG_ZAPHOD_HAS_SIO
+    /* the SIO decodes the ACIA's ports */
+    if (!zis->sio)
+#endif
+    {
+        zis->ioports_acia = g_new(PortioList, 1);
+        portio_list_init(zis->ioports_acia, OBJECT(zis), zaphod_iocore_portio_acia,
+                        zis, "zaphod.acia");
+        portio_list_add(zis->ioports_acia, get_system_io(), 0x00);
+    }
 
     if (zis->has_acia)
     {
@@ -587,8 +408,62 @@ static void zaphod_iocore_realizefn(DeviceState *dev, Error **errp)
                     NULL,
                     NULL, zis, NULL, true);
 
-        zis->irq_acia= qemu_allocate_irqs(zaphod_interrupt_request, zis->board, 1);
+        zis->irq_acia= qemu_allocate_irq(zaphod_interrupt_request,
+                                        zis->board, ZAPHOD_IRQ_ACIA);
+        qdev_connect_gpio_out(DEVICE(zis->uart_acia), 0, zis->irq_acia);
+    }
+
+#ifdef CONFIG_ZAPHOD_HAS_DMA
+    if (zis->dma)
+    {
+        qdev_realize(DEVICE(zis->dma), NULL, &error_fatal);
+
+        zis->irq_dma= qemu_allocate_irq(zaphod_interrupt_request,
+                                        zis->board, ZAPHOD_IRQ_DMA);
+        qdev_connect_gpio_out(DEVICE(zis->dma), 0, zis->irq_dma);
+        zaphod_set_irq_ack(zis->board, ZAPHOD_IRQ_DMA,
+                            zaphod_dma_irq_ack, zis->dma);
+    }
+#endif
+
+#ifdef CONFIG_ZAPHOD_HAS_CTC
+    if (zis->ctc)
+    {
+        qdev_realize(DEVICE(zis->ctc), NULL, &error_fatal);
+
+        zis->irq_ctc= qemu_allocate_irq(zaphod_interrupt_request,
+                                        zis->board, ZAPHOD_IRQ_CTC);
+        qdev_connect_gpio_out(DEVICE(zis->ctc), 0, zis->irq_ctc);
+        zaphod_set_irq_ack(zis->board, ZAPHOD_IRQ_CTC,
+                            zaphod_ctc_irq_ack, zis->ctc);
     }
+#endif
+
+#ifdef CONFIG_ZAPHOD_HAS_SIO
+    if (zis->sio)
+    {
+        qdev_realize(DEVICE(zis->sio), NULL, &error_fatal);
+
+        zis->irq_sio= qemu_allocate_irq(zaphod_interrupt_request,
+                                        zis->board, ZAPHOD_IRQ_SIO);
+        qdev_connect_gpio_out(DEVICE(zis->sio), 0, zis->irq_sio);
+        zaphod_set_irq_ack(zis->board, ZAPHOD_IRQ_SIO,
+                            zaphod_sio_irq_ack, zis->sio);
+    }
+#endif
+
+#ifdef CONFIG_ZAPHOD_HAS_HOSTIO
+    if (zis->hostio)
+    {
+        qdev_realize(DEVICE(zis->hostio), NULL, &error_fatal);
+
+        zis->irq_hostio= qemu_allocate_irq(zaphod_interrupt_request,
+                                        zis->board, ZAPHOD_IRQ_HOSTIO);
+        qdev_connect_gpio_out(DEVICE(zis->hostio), 0, zis->irq_hostio);
+        zaphod_set_irq_ack(zis->board, ZAPHOD_IRQ_HOSTIO,
+                            zaphod_hostio_irq_ack, zis->hostio);
+    }
+#endif
 
 #if 1   /* keyboard I/O */
     zis->ihs= qemu_input_handler_register(dev, &zaphod_kbd_handler);
@@ -12,6 +12,18 @@
 #include "zaphod.h"
 #include "zaphod_screen.h"
 #include "zaphod_uart.h"
+#ifdef CONFIG_ZAPHOD_HAS_DMA
+#include "zaphod_dma.h"
+#endif
+#ifdef CONFIG_ZAPHOD_HAS_CTC
+#include "zaphod_ctc.h"
+#endif
+#ifdef CONFIG_ZAPHOD_HAS_SIO
+#include "zaphod_sio.h"
+#endif
+#ifdef CONFIG_ZAPHOD_HAS_HOSTIO
+#include "zaphod_hostio.h"
+#endif
 
 #include "exec/ioport.h"
 #include "hw/irq.h"
@@ -31,10 +43,26 @@ typedef struct {
     bool                has_stdio, has_acia;
     PortioList          *ioports_stdio;
     PortioList          *ioports_acia;
-    qemu_irq            *irq_acia;
+    qemu_irq            irq_acia;
 #ifdef CONFIG_ZAPHOD_HAS_UART
     ZaphodUARTState     *uart_stdio;
     ZaphodUARTState     *uart_acia;
+#endif
+#ifdef CONFIG_ZAPHOD_HAS_DMA
+    ZaphodDMAState      *dma;
+    qemu_irq            irq_dma;
+#endif
+#ifdef CONFIG_ZAPHOD_HAS_CTC
+    ZaphodCTCState      *ctc;
+    qemu_irq            irq_ctc;
+#endif
+#ifdef CONFIG_ZAPHOD_HAS_SIO
+    ZaphodSIOState      *sio;
+    qemu_irq            irq_sio;
+#endif
+#ifdef CONFIG_ZAPHOD_HAS_HOSTIO
+    ZaphodHostIOState   *hostio;
+    qemu_irq            irq_hostio;
 #endif
     ZaphodScreenState	*screen_stdio;
     ZaphodScreenState	*screen_acia;
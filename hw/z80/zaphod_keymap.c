@@ -0,0 +1,195 @@
+/*
+ * QEmu Zaphod board - keyboard mapping support
+ * vim: ft=c sw=4 ts=4 et :
+ *
+ * [...William Towle c. 2013-2022, under GPL...]
+ */
+
+
+#include "qemu/osdep.h"
+#include "zaphod_keymap.h"
+
+#include "qapi/qapi-types-ui.h"
+
+
+/* Key presses become the bytes a UK-layout serial terminal would
+ * send: one lookup by qcode gives the unshifted and shifted
+ * characters, or a VT220/ANSI sequence for keys without one. Control
+ * folds '@'..'_' and letters to 0x00-0x1f, Caps Lock swaps the case
+ * of letters only, and Alt prefixes ESC (as xterm's "metaSendsEscape")
+ */
+
+typedef struct {
+    uint8_t     plain;
+    uint8_t     shift;
+    const char  *seq;               /* instead, if set */
+} ZaphodKeymapEntry;
+
+#define KEY(q, p, s)    [Q_KEY_CODE_##q] = { (p), (s), NULL }
+#define SEQ(q, str)     [Q_KEY_CODE_##q] = { 0, 0, (str) }
+#define ESC             "\033"
+
+static const ZaphodKeymapEntry zaphod_keymap[Q_KEY_CODE__MAX]= {
+    KEY(GRAVE_ACCENT,   '`',    0xac),      /* UK: not sign */
+    KEY(1,              '1',    '!'),
+    KEY(2,              '2',    '"'),
+    KEY(3,              '3',    0xa3),      /* UK pound */
+    KEY(4,              '4',    '$'),
+    KEY(5,              '5',    '%'),
+    KEY(6,              '6',    '^'),
+    KEY(7,              '7',    '&'),
+    KEY(8,              '8',    '*'),
+    KEY(9,              '9',    '('),
+    KEY(0,              '0',    ')'),
+    KEY(MINUS,          '-',    '_'),
+    KEY(EQUAL,          '=',    '+'),
+    KEY(BACKSPACE,      127,    127),
+
+    KEY(TAB,            '\t',   '\t'),
+    KEY(Q,              'q',    'Q'),
+    KEY(W,              'w',    'W'),
+    KEY(E,              'e',    'E'),
+    KEY(R,              'r',    'R'),
+    KEY(T,              't',    'T'),
+    KEY(Y,              'y',    'Y'),
+    KEY(U,              'u',    'U'),
+    KEY(I,              'i',    'I'),
+    KEY(O,              'o',    'O'),
+    KEY(P,              'p',    'P'),
+    KEY(BRACKET_LEFT,   '[',    '{'),
+    KEY(BRACKET_RIGHT,  ']',    '}'),
+    KEY(RET,            '\r',   '\r'),
+
+    KEY(A,              'a',    'A'),
+    KEY(S,              's',    'S'),
+    KEY(D,              'd',    'D'),
+    KEY(F,              'f',    'F'),
+    KEY(G,              'g',    'G'),
+    KEY(H,              'h',    'H'),
+    KEY(J,              'j',    'J'),
+    KEY(K,              'k',    'K'),
+    KEY(L,              'l',    'L'),
+    KEY(SEMICOLON,      ';',    ':'),
+    KEY(APOSTROPHE,     '\'',   '@'),
+    KEY(BACKSLASH,      '#',    '~'),       /* UK: key by Return */
+
+    KEY(LESS,           '\\',   '|'),       /* UK: key by left Shift */
+    KEY(Z,              'z',    'Z'),
+    KEY(X,              'x',    'X'),
+    KEY(C,              'c',    'C'),
+    KEY(V,              'v',    'V'),
+    KEY(B,              'b',    'B'),
+    KEY(N,              'n',    'N'),
+    KEY(M,              'm',    'M'),
+    KEY(COMMA,          ',',    '<'),
+    KEY(DOT,            '.',    '>'),
+    KEY(SLASH,          '/',    '?'),
+    KEY(SPC,            ' ',    ' '),
+    KEY(ESC,            0x1b,   0x1b),
+
+    /* keypad: as if Num Lock is on */
+    KEY(KP_0,           '0',    '0'),
+    KEY(KP_1,           '1',    '1'),
+    KEY(KP_2,           '2',    '2'),
+    KEY(KP_3,           '3',    '3'),
+    KEY(KP_4,           '4',    '4'),
+    KEY(KP_5,           '5',    '5'),
+    KEY(KP_6,           '6',    '6'),
+    KEY(KP_7,           '7',    '7'),
+    KEY(KP_8,           '8',    '8'),
+    KEY(KP_9,           '9',    '9'),
+    KEY(KP_DECIMAL,     '.',    '.'),
+    KEY(KP_DIVIDE,      '/',    '/'),
+    KEY(KP_MULTIPLY,    '*',    '*'),
+    KEY(KP_SUBTRACT,    '-',    '-'),
+    KEY(KP_ADD,         '+',    '+'),
+    KEY(KP_ENTER,       '\r',   '\r'),
+    KEY(KP_EQUALS,      '=',    '='),
+
+    SEQ(UP,             ESC "[A"),
+    SEQ(DOWN,           ESC "[B"),
+    SEQ(RIGHT,          ESC "[C"),
+    SEQ(LEFT,           ESC "[D"),
+    SEQ(HOME,           ESC "[1~"),
+    SEQ(INSERT,         ESC "[2~"),
+    SEQ(DELETE,         ESC "[3~"),
+    SEQ(END,            ESC "[4~"),
+    SEQ(PGUP,           ESC "[5~"),
+    SEQ(PGDN,           ESC "[6~"),
+    SEQ(F1,             ESC "OP"),
+    SEQ(F2,             ESC "OQ"),
+    SEQ(F3,             ESC "OR"),
+    SEQ(F4,             ESC "OS"),
+    SEQ(F5,             ESC "[15~"),
+    SEQ(F6,             ESC "[17~"),
+    SEQ(F7,             ESC "[18~"),
+    SEQ(F8,             ESC "[19~"),
+    SEQ(F9,             ESC "[20~"),
+    SEQ(F10,            ESC "[21~"),
+    SEQ(F11,            ESC "[23~"),
+    SEQ(F12,            ESC "[24~"),
+};
+
+/* Returns the modifier bit for a modifier key, or 0 */
+int zaphod_keymap_modifier(int qcode)
+{
+    switch (qcode)
+    {
+    case Q_KEY_CODE_SHIFT:      return ZAPHOD_KBD_MOD_SHIFT_L;
+    case Q_KEY_CODE_SHIFT_R:    return ZAPHOD_KBD_MOD_SHIFT_R;
+    case Q_KEY_CODE_CTRL:       return ZAPHOD_KBD_MOD_CTRL_L;
+    case Q_KEY_CODE_CTRL_R:     return ZAPHOD_KBD_MOD_CTRL_R;
+    case Q_KEY_CODE_ALT:        return ZAPHOD_KBD_MOD_ALT_L;
+    case Q_KEY_CODE_ALT_R:      return ZAPHOD_KBD_MOD_ALT_R;
+    case Q_KEY_CODE_CAPS_LOCK:  return ZAPHOD_KBD_MOD_CAPS_LOCK;
+    default:                    return 0;
+    }
+}
+
+/* Fills 'buf' (ZAPHOD_KEYMAP_SEQ_MAX bytes) with what a key-down of
+ * 'qcode' sends, returning its length - 0 for an unmapped key
+ */
+int zaphod_keymap_translate(int qcode, int modifiers, uint8_t *buf)
+{
+    const ZaphodKeymapEntry *ent;
+    bool                    shift;
+    uint8_t                 ch;
+    int                     len= 0;
+
+    if (qcode <= 0 || qcode >= Q_KEY_CODE__MAX)
+        return 0;
+    ent= &zaphod_keymap[qcode];
+    if (!ent->plain && !ent->seq)
+        return 0;
+
+    if (modifiers & ZAPHOD_KBD_MOD_ALT)
+        buf[len++]= 0x1b;
+
+    if (ent->seq)
+    {
+        size_t  n= strlen(ent->seq);
+
+        memcpy(&buf[len], ent->seq, n);
+        return len + n;
+    }
+
+    shift= (modifiers & ZAPHOD_KBD_MOD_SHIFT) != 0;
+    if ((modifiers & ZAPHOD_KBD_MOD_CAPS_LOCK) && g_ascii_isalpha(ent->plain))
+        shift= !shift;
+    ch= shift ? ent->shift : ent->plain;
+
+    if (modifiers & ZAPHOD_KBD_MOD_CTRL)
+    {
+        if (ch >= '@' && ch < 0x7f)
+            ch&= 0x1f;
+        else if (ch == ' ' || ch == '2')
+            ch= 0x00;       /* Ctrl-@ */
+        else if (ch == '6')
+            ch= 0x1e;       /* Ctrl-^ */
+        else if (ch == '-' || ch == '/')
+            ch= 0x1f;       /* Ctrl-_ */
+    }
+
+    buf[len++]= ch;
+    return len;
+}
@@ -0,0 +1,34 @@
+/*
+ * QEmu Zaphod board - keyboard mapping support
+ * vim: ft=c sw=4 ts=4 et :
+ *
+ * [...William Towle c. 2013-2022, under GPL...]
+ */
+
+
+#ifndef HW_Z80_ZAPHOD_KEYMAP_H
+#define HW_Z80_ZAPHOD_KEYMAP_H
+
+
+/* Modifier state, as tracked by the IOCore */
+#define ZAPHOD_KBD_MOD_SHIFT_L      0x01
+#define ZAPHOD_KBD_MOD_SHIFT_R      0x02
+#define ZAPHOD_KBD_MOD_CTRL_L       0x04
+#define ZAPHOD_KBD_MOD_CTRL_R       0x08
+#define ZAPHOD_KBD_MOD_ALT_L        0x10
+#define ZAPHOD_KBD_MOD_ALT_R        0x20
+#define ZAPHOD_KBD_MOD_CAPS_LOCK    0x40    /* toggled on key down */
+
+#define ZAPHOD_KBD_MOD_SHIFT        (ZAPHOD_KBD_MOD_SHIFT_L | ZAPHOD_KBD_MOD_SHIFT_R)
+#define ZAPHOD_KBD_MOD_CTRL         (ZAPHOD_KBD_MOD_CTRL_L | ZAPHOD_KBD_MOD_CTRL_R)
+#define ZAPHOD_KBD_MOD_ALT          (ZAPHOD_KBD_MOD_ALT_L | ZAPHOD_KBD_MOD_ALT_R)
+#define ZAPHOD_KBD_MOD_LOCKS        ZAPHOD_KBD_MOD_CAPS_LOCK
+
+/* Longest byte sequence for one key: Alt (ESC) plus "ESC [ 2 4 ~" */
+#define ZAPHOD_KEYMAP_SEQ_MAX       8
+
+
+int zaphod_keymap_modifier(int qcode);
+int zaphod_keymap_translate(int qcode, int modifiers, uint8_t *buf);
+
+#endif  /* HW_Z80_ZAPHOD_KEYMAP_H */
@@ -11,7 +11,11 @@
 
 #include "include/sysemu/reset.h"
 #include "hw/qdev-properties.h"
+#include "qemu/ctype.h"
 #include "ui/console.h"
+#include "ui/pixel_ops.h"
+#include "qapi/qapi-commands-misc-target.h"
+#include "qapi/qapi-events-misc-target.h"
 
 
 /* Implements a monochrome display at 25x80 text resolution (Phil
@@ -30,6 +34,10 @@
 
 
 #define ZAPHOD_TEXT_CURSOR_PERIOD_MS       (1000 * 2 * 16 / 60)
+/* stop blinking (with the cursor shown) after this long without output */
+#define ZAPHOD_TEXT_CURSOR_IDLE_BLINKS      (2 * 10000 / ZAPHOD_TEXT_CURSOR_PERIOD_MS)
+/* minimum interval between ZAPHOD_SCREEN_UPDATE events for a row */
+#define ZAPHOD_TEXT_EVENT_INTERVAL_MS       50
 
 #include "ui/vgafont.h"           /* vgafont16 - 16x8 */
 #define FONT_HEIGHT    16
@@ -43,107 +51,164 @@ uint8_t zaphod_rgb_palette[][3]= {
 };
 
 
-static
-void zaphod_screen_toggle_cursor(void *opaque, int row, int col)
+/* Glyph cache: every text character and every graphics block, as
+ * rows of 32bpp pixels in the current colours. Cells are drawn by
+ * copying rows, and the cache is rebuilt when the colours change
+ */
+#define GLYPH_PIXELS            (FONT_HEIGHT * FONT_WIDTH)
+#define GLYPH_TEXT(ch)          (ch)
+#define GLYPH_BOLD(ch)          (256 + (ch))
+#define GLYPH_GRAPHIC(data)     (512 + (data))
+#define GLYPH_COUNT             (3 * 256)
+
+static void zaphod_screen_expand_row(uint32_t *dst, uint8_t bits,
+                                        uint32_t fg, uint32_t bg)
 {
-    ZaphodScreenState   *zss= ZAPHOD_SCREEN(opaque);
-    DisplaySurface      *ds = qemu_console_surface(zss->display);
-    int                 bypp= (surface_bits_per_pixel(ds) + 7) >> 3;
-    uint8_t             *dmem;
-    int                 ix, iy;
+    uint8_t bitmask;
 
-    dmem= surface_data(ds);
-    dmem+= col * FONT_WIDTH * bypp;
-    dmem+= row * FONT_HEIGHT * surface_stride(ds);
+    for (bitmask= 0x80; bitmask; bitmask>>= 1)
+        *(dst++)= (bits & bitmask)? fg : bg;
+}
 
-    for (ix= 0; ix < FONT_HEIGHT; ix++)
+static void zaphod_screen_build_glyphs(ZaphodScreenState *zss)
+{
+    uint32_t    fg, bg;
+    uint32_t    *glyph;
+    int         n, ix;
+
+    fg= rgb_to_pixel32(zss->rgb_fg[0], zss->rgb_fg[1], zss->rgb_fg[2]);
+    bg= rgb_to_pixel32(zss->rgb_bg[0], zss->rgb_bg[1], zss->rgb_bg[2]);
+
+    if (!zss->glyph_cache)
+        zss->glyph_cache= g_new(uint32_t, GLYPH_COUNT * GLYPH_PIXELS);
+
+    for (n= 0; n < 256; n++)
     {
-        /* for bypp = 4 */
-        for (iy= 0; iy < FONT_WIDTH * bypp; iy+= bypp)
+        /* text, using QEmu's VGA font */
+        glyph= zss->glyph_cache + GLYPH_TEXT(n) * GLYPH_PIXELS;
+        for (ix= 0; ix < FONT_HEIGHT; ix++)
+            zaphod_screen_expand_row(glyph + ix * FONT_WIDTH,
+                                        vgafont16[n * FONT_HEIGHT + ix],
+                                        fg, bg);
+
+        /* bold, by smearing each row one pixel right */
+        glyph= zss->glyph_cache + GLYPH_BOLD(n) * GLYPH_PIXELS;
+        for (ix= 0; ix < FONT_HEIGHT; ix++)
         {
-            *(dmem + iy)^= zss->rgb_bg[2] ^ zss->rgb_fg[2];
-            *(dmem + iy+1)^= zss->rgb_bg[1] ^ zss->rgb_fg[1];
-            *(dmem + iy+2)^= zss->rgb_bg[0] ^ zss->rgb_fg[0];
+            uint8_t bits= vgafont16[n * FONT_HEIGHT + ix];
+
+            zaphod_screen_expand_row(glyph + ix * FONT_WIDTH,
+                                        bits | (bits >> 1), fg, bg);
+        }
+
+        /* For screen lines marked with ZAPHOD_SCREEN_ATTR_GRAPH.
+         * The byte for each cell represents a 2x4 pixel block in which
+         * bit 0 is top left and bit 7 bottom right)
+         */
+        glyph= zss->glyph_cache + GLYPH_GRAPHIC(n) * GLYPH_PIXELS;
+        for (ix= 0; ix < FONT_HEIGHT; ix++)
+        {
+            uint8_t data= n >> (2 * (ix / 4));
+            uint8_t line;
+
+            line= (data & 0x01)? 0xf0 : 0x00;
+            line+= (data & 0x02)? 0x0f : 0x00;
+            zaphod_screen_expand_row(glyph + ix * FONT_WIDTH, line, fg, bg);
         }
-        dmem+= surface_stride(ds);
     }
 
-    /* update display to redraw cursor in given location */
-    dpy_gfx_update(zss->display,
-            col * FONT_WIDTH,
-            row * FONT_HEIGHT,
-            FONT_WIDTH, FONT_HEIGHT);
+    zss->glyph_xor= fg ^ bg;
+    zss->glyph_fg= zss->rgb_fg;
+    zss->glyph_bg= zss->rgb_bg;
+}
+
+/* Rows without ZAPHOD_SCREEN_ATTR_80COL show 40 double-width columns */
+static int zaphod_screen_row_scale(ZaphodScreenState *zss, int row)
+{
+    return (zss->row_attr[row]
+                & (ZAPHOD_SCREEN_ATTR_80COL | ZAPHOD_SCREEN_ATTR_GRAPH))? 1 : 2;
+}
+
+static int zaphod_screen_row_cols(ZaphodScreenState *zss, int row)
+{
+    return ZAPHOD_TEXT_COLS / zaphod_screen_row_scale(zss, row);
+}
+
+/* Move the rendered text up by the number of rows scrolled since the
+ * last update, so only rows whose content changed need drawing again
+ */
+static void zaphod_screen_blit_scroll(ZaphodScreenState *zss)
+{
+    DisplaySurface  *ds= qemu_console_surface(zss->display);
+    int             stride= surface_stride(ds);
+    int             shift= zss->scroll_pending * FONT_HEIGHT;
+    uint8_t         *dmem= surface_data(ds);
+
+    memmove(dmem, dmem + shift * stride,
+            (ZAPHOD_TEXT_ROWS * FONT_HEIGHT - shift) * stride);
+    zss->scroll_pending= 0;
 }
 
 static
-void zaphod_screen_draw_char(void *opaque, int row, int col, char ch)
+void zaphod_screen_toggle_cursor(void *opaque, int row, int col)
 {
-    //ZaphodScreenState   *zss= ZAPHOD_SCREEN(opaque);
-    ZaphodScreenState   *zss= (ZaphodScreenState *)opaque;
-    DisplaySurface      *ds = qemu_console_surface(zss->display);
-    int                 bypp= (surface_bits_per_pixel(ds) + 7) >> 3;
-    int                 r_incr, c_incr, ix;
-    uint8_t             *dmem_start;
-    const uint8_t       *font_ptr;
+    ZaphodScreenState   *zss= ZAPHOD_SCREEN(opaque);
+    DisplaySurface      *ds;
+    int                 bypp;
+    uint8_t             *dmem;
+    int                 ix, iy, width;
 
-    /* Render lines of regular text using QEmu's VGA font.
-     * TODO: needs attribute (double height/width, bold) support here
-     */
+    if (!zss->display)
+        return;     /* text-only */
+
+    ds= qemu_console_surface(zss->display);
+    bypp= (surface_bits_per_pixel(ds) + 7) >> 3;
     if (unlikely (bypp != 4))
-    {
-        DPRINTF("INFO: Unexpected state in %s() - bypp != 4\n", __func__);
         return;
-    }
-    else if (unlikely(is_surface_bgr(ds)))
+
+    /* a deferred scroll must land first, or we'd XOR the wrong cell */
+    if (zss->scroll_pending)
     {
-        DPRINTF("INFO: Unexpected state in %s() - is_surface_bgr() true\n", __func__);
-        return;
+        zaphod_screen_blit_scroll(zss);
+        dpy_gfx_update_full(zss->display);
     }
 
-    c_incr= FONT_WIDTH * bypp;
-    r_incr= FONT_HEIGHT * surface_stride(ds);
-
-    dmem_start= surface_data(ds);
-    dmem_start+= col * c_incr;
-    dmem_start+= row * r_incr;
-    font_ptr= vgafont16 + FONT_HEIGHT * ch;
+    width= FONT_WIDTH * zaphod_screen_row_scale(zss, row);
+    dmem= surface_data(ds);
+    dmem+= col * width * bypp;
+    dmem+= row * FONT_HEIGHT * surface_stride(ds);
 
     for (ix= 0; ix < FONT_HEIGHT; ix++)
     {
-        uint8_t *dmem= dmem_start;
-        uint8_t bitmask;
-
-        for (bitmask= 0x80; bitmask; bitmask>>= 1)
-        {
-            /* for depth 32 - sets BGR+A */
-            *(dmem++)=      (*font_ptr & bitmask)?
-                      zss->rgb_fg[2] : zss->rgb_bg[2];
-            *(dmem++)=      (*font_ptr & bitmask)?
-                      zss->rgb_fg[1] : zss->rgb_bg[1];
-            *(dmem++)=      (*font_ptr & bitmask)?
-                      zss->rgb_fg[0] : zss->rgb_bg[0];
-            *(dmem++)=      0;
-        }
+        uint32_t    *pixel= (uint32_t *)dmem;
 
-        font_ptr++;
-        dmem_start+= surface_stride(ds);
+        for (iy= 0; iy < width; iy++)
+            pixel[iy]^= zss->glyph_xor;
+        dmem+= surface_stride(ds);
     }
+
+    /* update display to redraw cursor in given location */
+    dpy_gfx_update(zss->display,
+            col * width,
+            row * FONT_HEIGHT,
+            width, FONT_HEIGHT);
 }
 
+/* Draw one cell, applying the row's attributes: double width (for
+ * 40-column rows) and double height (top or bottom half) are done by
+ * repeating pixels and rows of the cached glyph
+ */
 static
-void zaphod_screen_draw_graphic(void *opaque, int row, int col, uint8_t data)
+void zaphod_screen_draw_glyph(ZaphodScreenState *zss, int row, int col,
+                                int glyph_index, uint8_t attr)
 {
-    //ZaphodScreenState   *zss= ZAPHOD_SCREEN(opaque);
-    ZaphodScreenState   *zss= (ZaphodScreenState *)opaque;
     DisplaySurface      *ds = qemu_console_surface(zss->display);
     int                 bypp= (surface_bits_per_pixel(ds) + 7) >> 3;
-    int                 r_incr, c_incr, ix;
-    uint8_t             *dmem_start;
+    int                 scale= zaphod_screen_row_scale(zss, row);
+    int                 stride, ix, iy;
+    uint8_t             *dmem;
+    const uint32_t      *glyph;
 
-    /* For screen lines marked with ZAPHOD_SCREEN_ATTR_GRAPH.
-     * The byte for each cell represents a 2x4 pixel block in which
-     * bit 0 is top left and bit 7 bottom right)
-     */
     if (unlikely (bypp != 4))
     {
         DPRINTF("INFO: Unexpected state in %s() - bypp != 4\n", __func__);
@@ -155,125 +220,240 @@ void zaphod_screen_draw_graphic(void *opaque, int row, int col, uint8_t data)
         return;
     }
 
-    c_incr= FONT_WIDTH * bypp;
-    r_incr= FONT_HEIGHT * surface_stride(ds);
+    if (unlikely(zss->glyph_fg != zss->rgb_fg || zss->glyph_bg != zss->rgb_bg))
+        zaphod_screen_build_glyphs(zss);
 
-    dmem_start= surface_data(ds);
-    dmem_start+= col * c_incr;
-    dmem_start+= row * r_incr;
+    stride= surface_stride(ds);
+    dmem= surface_data(ds);
+    dmem+= col * scale * FONT_WIDTH * bypp;
+    dmem+= row * FONT_HEIGHT * stride;
+    glyph= zss->glyph_cache + glyph_index * GLYPH_PIXELS;
 
     for (ix= 0; ix < FONT_HEIGHT; ix++)
     {
-        uint8_t *dmem= dmem_start;
-        uint8_t line;
-        uint8_t bitmask;
+        const uint32_t  *line= glyph + ix * FONT_WIDTH;
 
-        line= (data & 0x01)? 0xf0 : 0x00;
-        line+= (data & 0x02)? 0x0f : 0x00;
-
-        for (bitmask= 0x80; bitmask; bitmask>>= 1)
+        if (attr & ZAPHOD_SCREEN_ATTR_DHEIGHT)
         {
-            /* for depth 32 - assumes BGR+A */
-            *(dmem++)=      (line & bitmask)?
-                      zss->rgb_fg[2] : zss->rgb_bg[2];
-            *(dmem++)=      (line & bitmask)?
-                      zss->rgb_fg[1] : zss->rgb_bg[1];
-            *(dmem++)=      (line & bitmask)?
-                      zss->rgb_fg[0] : zss->rgb_bg[0];
-            *(dmem++)=      0;
+            line= glyph + (ix / 2) * FONT_WIDTH;
+            if (attr & ZAPHOD_SCREEN_ATTR_DLOWER)
+                line+= (FONT_HEIGHT / 2) * FONT_WIDTH;
         }
 
-        dmem_start+= surface_stride(ds);
-        if ((ix & 0x03) == 3) data>>= 2;
+        if (scale == 1)
+            memcpy(dmem, line, FONT_WIDTH * sizeof(uint32_t));
+        else
+        {
+            uint32_t    *pixel= (uint32_t *)dmem;
+
+            for (iy= 0; iy < FONT_WIDTH; iy++)
+                pixel[2 * iy]= pixel[2 * iy + 1]= line[iy];
+        }
+        dmem+= stride;
     }
 }
 
 static void zaphod_screen_redraw_row(ZaphodScreenState *zss,
                             int row, int minc, int maxc)
 {
-    int col;
+    uint8_t attr= zss->row_attr[row];
+    int     col;
 
-    /* TODO: Assume a fixed display size for now (ie. omit attribute
-     * support until later). Grant Searle documents attributes as
-     * follows:
+    /* Grant Searle documents attributes as follows:
      * - 0x80: graphics characters (bit 0 top left, bit 7 bottom right)
-     * - 0x04: double height (has top half/bottom half internally)
+     * - 0x04: double height (has top half/bottom half internally -
+     *   here, 0x08 selects the bottom half)
      * - 0x02: bold
      * - 0x01: use 80 chars (40 otherwise)
      */
+    maxc= MIN(maxc, zaphod_screen_row_cols(zss, row) - 1);
 
     for (col= minc; col <= maxc; col++)
-        switch(zss->row_attr[row])
-        {
-        case ZAPHOD_SCREEN_ATTR_80COL:
-            zaphod_screen_draw_char(zss, row, col, zss->char_grid[row][col]);
-            break;
-        case ZAPHOD_SCREEN_ATTR_GRAPH:
+    {
+        uint8_t ch= zss->char_grid[row][col];
+
+        if (attr & ZAPHOD_SCREEN_ATTR_GRAPH)
+            zaphod_screen_draw_glyph(zss, row, col, GLYPH_GRAPHIC(ch), 0);
+        else if (attr & ZAPHOD_SCREEN_ATTR_BOLD)
+            zaphod_screen_draw_glyph(zss, row, col, GLYPH_BOLD(ch), attr);
+        else
+            zaphod_screen_draw_glyph(zss, row, col, GLYPH_TEXT(ch), attr);
+    }
+}
 
-            zaphod_screen_draw_graphic(zss, row, col, zss->char_grid[row][col]);
-            break;
-        /* INCOMPLETE */
+
+/* Text-only screens report changed rows as QMP events, gathered up
+ * and sent from a timer so a busy guest doesn't flood the monitor
+ */
+#define ZAPHOD_TEXT_ALL_ROWS    ((1u << ZAPHOD_TEXT_ROWS) - 1)
+
+static void zaphod_screen_text_changed(ZaphodScreenState *zss,
+                                        uint32_t rows)
+{
+    zss->text_dirty_rows|= rows;
+    if (zss->text_timer && !timer_pending(zss->text_timer))
+        timer_mod(zss->text_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME)
+                                    + ZAPHOD_TEXT_EVENT_INTERVAL_MS);
+}
+
+static char *zaphod_screen_row_text(ZaphodScreenState *zss, int row)
+{
+    char    *text= g_malloc(ZAPHOD_TEXT_COLS + 1);
+    int     col, len= 0;
+
+    for (col= 0; col < ZAPHOD_TEXT_COLS; col++)
+    {
+        uint8_t ch= zss->char_grid[row][col];
+
+        if (ch == '\0')
+            text[col]= ' ';
+        else
+        {
+            text[col]= qemu_isprint(ch)? ch : '.';
+            len= col + 1;
         }
+    }
+    text[len]= '\0';
+    return text;
 }
 
+static void zaphod_screen_send_text(void *opaque)
+{
+    ZaphodScreenState *zss= ZAPHOD_SCREEN(opaque);
+    char    *path= object_get_canonical_path(OBJECT(zss));
+    int     row;
+
+    for (row= 0; row < ZAPHOD_TEXT_ROWS; row++)
+    {
+        char    *text;
+
+        if (!(zss->text_dirty_rows & (1u << row)))
+            continue;
+
+        text= zaphod_screen_row_text(zss, row);
+        qapi_event_send_zaphod_screen_update(path, row, text,
+                                            zss->row_attr[row]);
+        g_free(text);
+    }
+    zss->text_dirty_rows= 0;
+    g_free(path);
+}
 
 static void zaphod_screen_invalidate_display(void *opaque)
 {
     ZaphodScreenState  *zss= (ZaphodScreenState *)opaque;
+    int row;
 
     /* set state to trigger full update later */
-    zss->dirty_minr= zss->dirty_minc= 0;
-    zss->dirty_maxr= ZAPHOD_TEXT_ROWS-1;
-    zss->dirty_maxc= ZAPHOD_TEXT_COLS-1;
+    for (row= 0; row < ZAPHOD_TEXT_ROWS; row++)
+    {
+        zss->dirty_minc[row]= 0;
+        zss->dirty_maxc[row]= ZAPHOD_TEXT_COLS-1;
+    }
+    zss->scroll_pending= 0;
+    zaphod_screen_text_changed(zss, ZAPHOD_TEXT_ALL_ROWS);
+}
+
+static void zaphod_screen_flush_cursor(ZaphodScreenState *zss)
+{
+    if (zss->cursor_dirty)
+    {
+        /* cursor moved, was erased, or changed visibility status */
+        zaphod_screen_toggle_cursor(zss,
+                             zss->curs_posr, zss->curs_posc);
+        zss->cursor_dirty= false;
+    }
 }
 
 static void zaphod_screen_update_display(void *opaque)
 {
     ZaphodScreenState *zss= ZAPHOD_SCREEN(opaque);
-    int64_t now;
+    bool    full_update= false;
+    int     row, span_start= -1, span_minc= 0, span_maxc= 0;
+    int     scale;
 
     /* align QEmu window content with the simulated display */
 
-    if (zss->dirty_minr > -1)
+    if (zss->scroll_pending)
     {
-        int row;
+        zaphod_screen_blit_scroll(zss);
+        full_update= true;
+    }
 
-        /* Update the display surface where "dirty" region applies.
-         * If this obliterates the cursor we repaint it too.
-         */
-        for (row= zss->dirty_minr; row <= zss->dirty_maxr; row++)
-            zaphod_screen_redraw_row(zss, row,
-                                zss->dirty_minc, zss->dirty_maxc);
+    /* Update the display surface where "dirty" spans apply, and tell
+     * the UI once per run of consecutive dirty rows (or once overall,
+     * after a scroll). If this obliterates the cursor we repaint it too.
+     */
+    for (row= 0; row <= ZAPHOD_TEXT_ROWS; row++)
+    {
+        int minc= (row < ZAPHOD_TEXT_ROWS)? zss->dirty_minc[row] : -1;
+        int maxc;
+
+        if (minc < 0)
+        {
+            if (span_start >= 0 && !full_update)
+                dpy_gfx_update(zss->display,
+                        span_minc * FONT_WIDTH,
+                        span_start * FONT_HEIGHT,
+                        (span_maxc - span_minc + 1) * FONT_WIDTH,
+                        (row - span_start) * FONT_HEIGHT
+                        );
+            span_start= -1;
+            continue;
+        }
 
-        dpy_gfx_update(zss->display,
-                zss->dirty_minc * FONT_WIDTH,
-                zss->dirty_minr * FONT_HEIGHT,
-                (zss->dirty_maxc - zss->dirty_minc + 1) * FONT_WIDTH,
-                (zss->dirty_maxr - zss->dirty_minr + 1) * FONT_HEIGHT
-                );
+        maxc= zss->dirty_maxc[row];
+        zaphod_screen_redraw_row(zss, row, minc, maxc);
 
         /* prepare to redraw cursor if it was erased? */
-        if ( (zss->curs_posr >= zss->dirty_minr)
-            && (zss->curs_posr <= zss->dirty_maxr)
-            && (zss->curs_posc >= zss->dirty_minc)
-            && (zss->curs_posc <= zss->dirty_maxc)
+        if ( (zss->curs_posr == row)
+            && (zss->curs_posc >= minc)
+            && (zss->curs_posc <= maxc)
             )
         {
             zss->cursor_dirty|= zss->cursor_visible;
         }
 
-        zss->dirty_minr= zss->dirty_maxr= -1;
-        zss->dirty_minc= zss->dirty_maxc= -1;
+        /* spans are reported in 80-column cells */
+        scale= zaphod_screen_row_scale(zss, row);
+        minc*= scale;
+        maxc= MIN(maxc * scale + scale - 1, ZAPHOD_TEXT_COLS-1);
+
+        if (span_start < 0)
+        {
+            span_start= row;
+            span_minc= minc;
+            span_maxc= maxc;
+        }
+        else
+        {
+            span_minc= MIN(span_minc, minc);
+            span_maxc= MAX(span_maxc, maxc);
+        }
+        zss->dirty_minc[row]= zss->dirty_maxc[row]= -1;
     }
 
-    /* Handle cursor blink if its timer expired */
+    if (full_update)
+        dpy_gfx_update_full(zss->display);
 
-    //now = qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL);
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    zaphod_screen_flush_cursor(zss);
+}
 
-    if (now >= zss->cursor_blink_time)
+/* Cursor blink. This runs from its own timer so that a static screen
+ * causes no display updates, letting the UI drop to its idle refresh
+ * rate; blinking stops after a spell without output, or if nothing is
+ * watching the display closely enough to see it
+ */
+static void zaphod_screen_blink_cursor(void *opaque)
+{
+    ZaphodScreenState *zss= ZAPHOD_SCREEN(opaque);
+    bool    idle;
+
+    idle= zss->ui_interval >= GUI_REFRESH_INTERVAL_IDLE
+            || ++zss->cursor_idle_blinks >= ZAPHOD_TEXT_CURSOR_IDLE_BLINKS;
+
+    if (!idle || !zss->cursor_visible)
     {
-        zss->cursor_blink_time= now + ZAPHOD_TEXT_CURSOR_PERIOD_MS / 2;
         zss->cursor_visible= !zss->cursor_visible;
 
         /* Adjust 'cursor_dirty' state here so the "blink" step is
@@ -282,20 +462,37 @@ static void zaphod_screen_update_display(void *opaque)
          *   - dirty (was just erased)? unset flag [do nothing below]
          */
         zss->cursor_dirty^= !zss->cursor_dirty || !zss->cursor_visible;
+        zaphod_screen_flush_cursor(zss);
     }
 
-    if (zss->cursor_dirty)
-    {
-        /* cursor moved, was erased, or changed visibility status */
-        zaphod_screen_toggle_cursor(opaque,
-                             zss->curs_posr, zss->curs_posc);
-        zss->cursor_dirty= false;
-    }
+    if (idle && zss->cursor_visible)
+        return;     /* zaphod_screen_wake_cursor() restarts us */
+
+    timer_mod(zss->cursor_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME)
+                                    + ZAPHOD_TEXT_CURSOR_PERIOD_MS / 2);
+}
+
+static void zaphod_screen_wake_cursor(ZaphodScreenState *zss)
+{
+    zss->cursor_idle_blinks= 0;
+    if (zss->cursor_timer && !timer_pending(zss->cursor_timer))
+        timer_mod(zss->cursor_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME)
+                                        + ZAPHOD_TEXT_CURSOR_PERIOD_MS / 2);
+}
+
+static void zaphod_screen_update_interval(void *opaque, uint64_t interval)
+{
+    ZaphodScreenState *zss= ZAPHOD_SCREEN(opaque);
+
+    zss->ui_interval= interval;
+    if (interval < GUI_REFRESH_INTERVAL_IDLE)
+        zaphod_screen_wake_cursor(zss);
 }
 
 static const GraphicHwOps zaphod_screen_ops= {
     .invalidate     = zaphod_screen_invalidate_display,
     .gfx_update     = zaphod_screen_update_display,
+    .update_interval= zaphod_screen_update_interval,
 };
 
 
@@ -304,35 +501,46 @@ static const GraphicHwOps zaphod_screen_ops= {
 static void zaphod_screen_scroll(void *opaque)
 {
     ZaphodScreenState *zss= (ZaphodScreenState *)opaque;
-    int row, col;
+    int last= ZAPHOD_TEXT_ROWS - 1;
 
     /* Display full - scroll */
-    for (col= 0; col < ZAPHOD_TEXT_COLS; col++)
-    {
-        for (row= 0; row < ZAPHOD_TEXT_ROWS - 1; row++)
-            zss->char_grid[row][col]= zss->char_grid[row+1][col];
-        zss->char_grid[ZAPHOD_TEXT_ROWS-1][col]= 0;
-    }
+    memmove(zss->char_grid[0], zss->char_grid[1],
+            last * sizeof(zss->char_grid[0]));
+    memset(zss->char_grid[last], 0, sizeof(zss->char_grid[last]));
 
     /* Adjust attributes - duplicating last row's */
-    for (row= 0; row < ZAPHOD_TEXT_ROWS - 1; row++)
-        zss->row_attr[row]= zss->row_attr[row+1];
+    memmove(&zss->row_attr[0], &zss->row_attr[1],
+            last * sizeof(zss->row_attr[0]));
 
-    zaphod_screen_invalidate_display(zss);
+    /* Rendered rows move with their text at the next update, so the
+     * pending dirty spans move too; only the new line is drawn afresh
+     */
+    memmove(&zss->dirty_minc[0], &zss->dirty_minc[1],
+            last * sizeof(zss->dirty_minc[0]));
+    memmove(&zss->dirty_maxc[0], &zss->dirty_maxc[1],
+            last * sizeof(zss->dirty_maxc[0]));
+    zss->dirty_minc[last]= 0;
+    zss->dirty_maxc[last]= ZAPHOD_TEXT_COLS-1;
+
+    zaphod_screen_text_changed(zss, ZAPHOD_TEXT_ALL_ROWS);
+
+    if (zss->scroll_pending < last)
+        zss->scroll_pending++;
+    else
+    {   /* nothing left on screen worth blitting */
+        zaphod_screen_invalidate_display(zss);
+    }
 }
 
 static void zaphod_screen_mark_dirty(void *opaque, int r,int c)
 {
     ZaphodScreenState *zss= (ZaphodScreenState *)opaque;
 
-    if (zss->dirty_maxr < r)
-        zss->dirty_maxr= r;
-    if (zss->dirty_maxc < c)
-        zss->dirty_maxc= c;
-    if ((zss->dirty_minr > r) || (zss->dirty_minr == -1))
-        zss->dirty_minr= r;
-    if ((zss->dirty_minc > c) || (zss->dirty_minc == -1))
-        zss->dirty_minc= c;
+    if (zss->dirty_maxc[r] < c)
+        zss->dirty_maxc[r]= c;
+    if ((zss->dirty_minc[r] > c) || (zss->dirty_minc[r] == -1))
+        zss->dirty_minc[r]= c;
+    zaphod_screen_text_changed(zss, 1u << r);
 }
 
 static void zaphod_screen_clear(ZaphodScreenState *zss)
@@ -347,76 +555,494 @@ static void zaphod_screen_clear(ZaphodScreenState *zss)
     zss->curs_posr= zss->curs_posc= 0;
 }
 
-void zaphod_screen_putchar(ZaphodScreenState *zss, uint8_t ch)
+/* Cursor movement and editing, shared by control codes and escapes */
+
+static void zaphod_screen_move_cursor(ZaphodScreenState *zss, int row, int col)
 {
-    /* TODO: need to handle escape sequences sanely - Phil Brown's
-     * documentation says "an OUT to port 1 will display the
-     * appropriate character on the console screen" and lists
-     * "escape codes" of:
-     * - ESC 0 - to clear the console screen
-     * - ESC 1 x y - to move the cursor position to x,y
-     * - ESC 2 - to clear to end of line from the current position
-     * Grant Searle has custom codes including changing [per-line]
-     * attributes and set/unset/toggle pixels
-     */
-    switch(ch)
+    /* leave the old position to be redrawn without the cursor */
+    if (zss->cursor_visible)
+        zaphod_screen_mark_dirty(zss, zss->curs_posr, zss->curs_posc);
+
+    zss->curs_posr= MAX(0, MIN(row, ZAPHOD_TEXT_ROWS-1));
+    zss->curs_posc= MAX(0, MIN(col, zaphod_screen_row_cols(zss, zss->curs_posr)-1));
+    zss->cursor_dirty|= zss->cursor_visible;
+}
+
+static void zaphod_screen_index(ZaphodScreenState *zss)
+{
+    if (zss->curs_posr < ZAPHOD_TEXT_ROWS-1)
     {
-    case '\a':  /* BEL (bell, 0x07) */
-        /* ignore */
+        zaphod_screen_move_cursor(zss, zss->curs_posr+1, zss->curs_posc);
         return;
-    case '\b':  /* BS (backspace, 0x08) */
-        if (zss->cursor_visible)
-            zaphod_screen_mark_dirty(zss, zss->curs_posr, zss->curs_posc);
-        if (zss->curs_posc > 0)
-            zss->curs_posc--;
-        zss->cursor_dirty|= zss->cursor_visible;
+    }
+
+    if (zss->cursor_visible)
+        zaphod_screen_mark_dirty(zss, zss->curs_posr, zss->curs_posc);
+    zaphod_screen_scroll(zss);
+    zss->cursor_dirty|= zss->cursor_visible;
+}
+
+static void zaphod_screen_reverse_index(ZaphodScreenState *zss)
+{
+    int last= ZAPHOD_TEXT_ROWS - 1;
+
+    if (zss->curs_posr > 0)
+    {
+        zaphod_screen_move_cursor(zss, zss->curs_posr-1, zss->curs_posc);
         return;
-    case '\r':  /* CR (carriage return, 0x0D) */
-        if (zss->cursor_visible)
-            zaphod_screen_mark_dirty(zss, zss->curs_posr, zss->curs_posc);
-        zss->curs_posc= 0;
-        zss->cursor_dirty|= zss->cursor_visible;
+    }
+
+    /* scroll down - rare enough to simply redraw everything */
+    memmove(zss->char_grid[1], zss->char_grid[0],
+            last * sizeof(zss->char_grid[0]));
+    memset(zss->char_grid[0], 0, sizeof(zss->char_grid[0]));
+    memmove(&zss->row_attr[1], &zss->row_attr[0],
+            last * sizeof(zss->row_attr[0]));
+    zaphod_screen_invalidate_display(zss);
+    zss->cursor_dirty|= zss->cursor_visible;
+}
+
+static void zaphod_screen_clear_span(ZaphodScreenState *zss,
+                                        int row, int minc, int maxc)
+{
+    memset(&zss->char_grid[row][minc], 0, maxc - minc + 1);
+    zaphod_screen_mark_dirty(zss, row, minc);
+    zaphod_screen_mark_dirty(zss, row, maxc);
+}
+
+static void zaphod_screen_clear_rows(ZaphodScreenState *zss,
+                                        int minr, int maxr)
+{
+    int row;
+
+    for (row= minr; row <= maxr; row++)
+        zaphod_screen_clear_span(zss, row, 0, ZAPHOD_TEXT_COLS-1);
+}
+
+static void zaphod_screen_clear_screen(ZaphodScreenState *zss)
+{
+    zaphod_screen_clear(zss);
+    zaphod_screen_invalidate_display(zss);
+    zss->cursor_dirty|= zss->cursor_visible;
+}
+
+static void zaphod_screen_set_attr(ZaphodScreenState *zss, int row,
+                                    uint8_t attr)
+{
+    uint8_t was= zss->row_attr[row];
+
+    attr&= ZAPHOD_SCREEN_ATTR_MASK;
+    if (attr == was)
         return;
-    case '\n':  /* NL (newline, 0x0A) */
-        if (zss->cursor_visible)
-            zaphod_screen_mark_dirty(zss, zss->curs_posr, zss->curs_posc);
-        if (++zss->curs_posr == ZAPHOD_TEXT_ROWS)
+
+    zss->row_attr[row]= attr;
+    if ((attr ^ was) & ZAPHOD_SCREEN_ATTR_GRAPH)
+        memset(zss->char_grid[row], 0, sizeof(zss->char_grid[row]));
+    zaphod_screen_mark_dirty(zss, row, 0);
+    zaphod_screen_mark_dirty(zss, row, ZAPHOD_TEXT_COLS-1);
+
+    /* the row may have narrowed under the cursor */
+    if (row == zss->curs_posr)
+        zaphod_screen_move_cursor(zss, zss->curs_posr, zss->curs_posc);
+}
+
+/* Block graphics: 160x100 pixels, each cell's byte holding a 2x4
+ * block with bit 0 top left and bit 7 bottom right
+ */
+enum { PIXEL_SET, PIXEL_CLEAR, PIXEL_TOGGLE };
+
+static void zaphod_screen_pixel(ZaphodScreenState *zss, int x, int y, int op)
+{
+    int     row= y / 4, col= x / 2;
+    uint8_t bit= 1 << ((y % 4) * 2 + (x % 2));
+
+    if (x >= ZAPHOD_TEXT_COLS * 2 || y >= ZAPHOD_TEXT_ROWS * 4)
+        return;
+
+    if (!(zss->row_attr[row] & ZAPHOD_SCREEN_ATTR_GRAPH))
+        zaphod_screen_set_attr(zss, row, ZAPHOD_SCREEN_ATTR_GRAPH);
+
+    switch (op)
+    {
+    case PIXEL_SET:
+        zss->char_grid[row][col]|= bit;
+        break;
+    case PIXEL_CLEAR:
+        zss->char_grid[row][col]&= ~bit;
+        break;
+    default:
+        zss->char_grid[row][col]^= bit;
+        break;
+    }
+    zaphod_screen_mark_dirty(zss, row, col);
+}
+
+
+/* Escape sequences. One state machine handles:
+ * - Phil Brown's codes: "ESC 0" clears the screen, "ESC 1 x y" moves
+ *   the cursor to column x, row y, and "ESC 2" clears to end of line
+ * - Grant Searle's attribute and graphics codes (not on the simple
+ *   screen): "ESC 3 a" sets the current row's attributes, and
+ *   "ESC 4/5/6 x y" set/clear/toggle the block graphics pixel at x,y
+ * - a VT52 subset: cursor keys, home, erase, reverse index and
+ *   direct cursor address
+ * - an ANSI subset via CSI: cursor movement and positioning, erase in
+ *   display and line, and save/restore cursor (SGR is accepted but
+ *   has no per-character attributes to act on)
+ * Arguments to the first two sets are raw bytes
+ */
+enum {
+    ZAPHOD_ESC_NONE= 0,
+    ZAPHOD_ESC_SEEN,        /* ESC received */
+    ZAPHOD_ESC_ARGS,        /* collecting raw argument bytes */
+    ZAPHOD_ESC_CSI,         /* ESC [ parameters */
+    ZAPHOD_ESC_CSI_IGNORE   /* private or unsupported CSI sequence */
+};
+
+typedef struct {
+    uint8_t     ch;             /* byte following ESC */
+    uint8_t     nargs;          /* raw argument bytes to collect */
+    bool        searle;         /* not on the simple screen */
+    void        (*fn)(ZaphodScreenState *zss, const uint8_t *args);
+} ZaphodScreenEscape;
+
+typedef struct {
+    uint8_t     final;
+    void        (*fn)(ZaphodScreenState *zss, const int *params, int n);
+} ZaphodScreenCSI;
+
+static void esc_clear_screen(ZaphodScreenState *zss, const uint8_t *args)
+{
+    zaphod_screen_clear_screen(zss);
+}
+
+static void esc_goto_xy(ZaphodScreenState *zss, const uint8_t *args)
+{
+    zaphod_screen_move_cursor(zss, args[1], args[0]);
+}
+
+static void esc_clear_eol(ZaphodScreenState *zss, const uint8_t *args)
+{
+    zaphod_screen_clear_span(zss, zss->curs_posr, zss->curs_posc,
+                                ZAPHOD_TEXT_COLS-1);
+}
+
+static void esc_clear_eos(ZaphodScreenState *zss, const uint8_t *args)
+{
+    esc_clear_eol(zss, args);
+    if (zss->curs_posr < ZAPHOD_TEXT_ROWS-1)
+        zaphod_screen_clear_rows(zss, zss->curs_posr+1, ZAPHOD_TEXT_ROWS-1);
+}
+
+static void esc_set_attr(ZaphodScreenState *zss, const uint8_t *args)
+{
+    zaphod_screen_set_attr(zss, zss->curs_posr, args[0]);
+}
+
+static void esc_pixel_set(ZaphodScreenState *zss, const uint8_t *args)
+{
+    zaphod_screen_pixel(zss, args[0], args[1], PIXEL_SET);
+}
+
+static void esc_pixel_clear(ZaphodScreenState *zss, const uint8_t *args)
+{
+    zaphod_screen_pixel(zss, args[0], args[1], PIXEL_CLEAR);
+}
+
+static void esc_pixel_toggle(ZaphodScreenState *zss, const uint8_t *args)
+{
+    zaphod_screen_pixel(zss, args[0], args[1], PIXEL_TOGGLE);
+}
+
+static void esc_up(ZaphodScreenState *zss, const uint8_t *args)
+{
+    zaphod_screen_move_cursor(zss, zss->curs_posr-1, zss->curs_posc);
+}
+
+static void esc_down(ZaphodScreenState *zss, const uint8_t *args)
+{
+    zaphod_screen_move_cursor(zss, zss->curs_posr+1, zss->curs_posc);
+}
+
+static void esc_right(ZaphodScreenState *zss, const uint8_t *args)
+{
+    zaphod_screen_move_cursor(zss, zss->curs_posr, zss->curs_posc+1);
+}
+
+static void esc_left(ZaphodScreenState *zss, const uint8_t *args)
+{
+    zaphod_screen_move_cursor(zss, zss->curs_posr, zss->curs_posc-1);
+}
+
+static void esc_home(ZaphodScreenState *zss, const uint8_t *args)
+{
+    zaphod_screen_move_cursor(zss, 0, 0);
+}
+
+static void esc_reverse_index(ZaphodScreenState *zss, const uint8_t *args)
+{
+    zaphod_screen_reverse_index(zss);
+}
+
+static void esc_vt52_goto(ZaphodScreenState *zss, const uint8_t *args)
+{
+    zaphod_screen_move_cursor(zss, args[0] - ' ', args[1] - ' ');
+}
+
+static const ZaphodScreenEscape zaphod_screen_escapes[]= {
+    /* Phil Brown */
+    { '0', 0, false,    esc_clear_screen },
+    { '1', 2, false,    esc_goto_xy },
+    { '2', 0, false,    esc_clear_eol },
+    /* Grant Searle */
+    { '3', 1, true,     esc_set_attr },
+    { '4', 2, true,     esc_pixel_set },
+    { '5', 2, true,     esc_pixel_clear },
+    { '6', 2, true,     esc_pixel_toggle },
+    /* VT52 */
+    { 'A', 0, false,    esc_up },
+    { 'B', 0, false,    esc_down },
+    { 'C', 0, false,    esc_right },
+    { 'D', 0, false,    esc_left },
+    { 'H', 0, false,    esc_home },
+    { 'I', 0, false,    esc_reverse_index },
+    { 'J', 0, false,    esc_clear_eos },
+    { 'K', 0, false,    esc_clear_eol },
+    { 'Y', 2, false,    esc_vt52_goto },
+};
+
+#define CSI_PARAM(i, def)   ((n > (i) && params[i])? params[i] : (def))
+
+static void csi_cursor_up(ZaphodScreenState *zss, const int *params, int n)
+{
+    zaphod_screen_move_cursor(zss, zss->curs_posr - CSI_PARAM(0, 1),
+                                zss->curs_posc);
+}
+
+static void csi_cursor_down(ZaphodScreenState *zss, const int *params, int n)
+{
+    zaphod_screen_move_cursor(zss, zss->curs_posr + CSI_PARAM(0, 1),
+                                zss->curs_posc);
+}
+
+static void csi_cursor_right(ZaphodScreenState *zss, const int *params, int n)
+{
+    zaphod_screen_move_cursor(zss, zss->curs_posr,
+                                zss->curs_posc + CSI_PARAM(0, 1));
+}
+
+static void csi_cursor_left(ZaphodScreenState *zss, const int *params, int n)
+{
+    zaphod_screen_move_cursor(zss, zss->curs_posr,
+                                zss->curs_posc - CSI_PARAM(0, 1));
+}
+
+static void csi_cursor_pos(ZaphodScreenState *zss, const int *params, int n)
+{
+    /* ANSI rows and columns count from 1 */
+    zaphod_screen_move_cursor(zss, CSI_PARAM(0, 1) - 1, CSI_PARAM(1, 1) - 1);
+}
+
+static void csi_erase_display(ZaphodScreenState *zss, const int *params, int n)
+{
+    switch (CSI_PARAM(0, 0))
+    {
+    case 0:     /* cursor to end */
+        esc_clear_eos(zss, NULL);
+        break;
+    case 1:     /* start to cursor */
+        if (zss->curs_posr > 0)
+            zaphod_screen_clear_rows(zss, 0, zss->curs_posr-1);
+        zaphod_screen_clear_span(zss, zss->curs_posr, 0, zss->curs_posc);
+        break;
+    default:    /* all; the cursor stays put */
+        zaphod_screen_clear_rows(zss, 0, ZAPHOD_TEXT_ROWS-1);
+        break;
+    }
+}
+
+static void csi_erase_line(ZaphodScreenState *zss, const int *params, int n)
+{
+    switch (CSI_PARAM(0, 0))
+    {
+    case 0:
+        esc_clear_eol(zss, NULL);
+        break;
+    case 1:
+        zaphod_screen_clear_span(zss, zss->curs_posr, 0, zss->curs_posc);
+        break;
+    default:
+        zaphod_screen_clear_span(zss, zss->curs_posr, 0, ZAPHOD_TEXT_COLS-1);
+        break;
+    }
+}
+
+static void csi_sgr(ZaphodScreenState *zss, const int *params, int n)
+{
+    /* attributes are per row here, so there is nothing to select */
+}
+
+static void csi_save_cursor(ZaphodScreenState *zss, const int *params, int n)
+{
+    zss->saved_posr= zss->curs_posr;
+    zss->saved_posc= zss->curs_posc;
+}
+
+static void csi_restore_cursor(ZaphodScreenState *zss, const int *params, int n)
+{
+    zaphod_screen_move_cursor(zss, zss->saved_posr, zss->saved_posc);
+}
+
+static const ZaphodScreenCSI zaphod_screen_csis[]= {
+    { 'A', csi_cursor_up },
+    { 'B', csi_cursor_down },
+    { 'C', csi_cursor_right },
+    { 'D', csi_cursor_left },
+    { 'H', csi_cursor_pos },
+    { 'f', csi_cursor_pos },
+    { 'J', csi_erase_display },
+    { 'K', csi_erase_line },
+    { 'm', csi_sgr },
+    { 's', csi_save_cursor },
+    { 'u', csi_restore_cursor },
+};
+
+static void zaphod_screen_esc_start(ZaphodScreenState *zss, uint8_t ch)
+{
+    int n;
+
+    zss->esc_state= ZAPHOD_ESC_NONE;
+    if (ch == '[')
+    {
+        zss->esc_state= ZAPHOD_ESC_CSI;
+        zss->csi_nparams= 0;
+        memset(zss->csi_params, 0, sizeof(zss->csi_params));
+        return;
+    }
+
+    for (n= 0; n < ARRAY_SIZE(zaphod_screen_escapes); n++)
+    {
+        const ZaphodScreenEscape *esc= &zaphod_screen_escapes[n];
+
+        if (esc->ch != ch)
+            continue;
+        if (esc->searle && zss->simple_escape_codes)
+            break;
+
+        if (esc->nargs == 0)
+            esc->fn(zss, NULL);
+        else
         {
-            zaphod_screen_scroll(zss);
-            zss->curs_posr= ZAPHOD_TEXT_ROWS-1;
+            zss->esc_state= ZAPHOD_ESC_ARGS;
+            zss->esc_index= n;
+            zss->esc_argc= 0;
         }
         return;
-    case '\f':  /* FF (formfeed, 0x0C) */
-        zaphod_screen_clear(zss);
-        zaphod_screen_mark_dirty(zss, 0,0);
-        zaphod_screen_mark_dirty(zss, ZAPHOD_TEXT_ROWS-1,ZAPHOD_TEXT_COLS-1);
-        zss->cursor_dirty|= zss->cursor_visible;
+    }
+#if 1   /* WmT - TRACE */
+;DPRINTF("INFO: %s() ignoring unsupported ESC 0x%02x\n", __func__, ch);
+#endif
+}
+
+static void zaphod_screen_esc_arg(ZaphodScreenState *zss, uint8_t ch)
+{
+    const ZaphodScreenEscape *esc= &zaphod_screen_escapes[zss->esc_index];
+
+    zss->esc_args[zss->esc_argc++]= ch;
+    if (zss->esc_argc == esc->nargs)
+    {
+        zss->esc_state= ZAPHOD_ESC_NONE;
+        esc->fn(zss, zss->esc_args);
+    }
+}
+
+static void zaphod_screen_csi_byte(ZaphodScreenState *zss, uint8_t ch)
+{
+    int n;
+
+    if (ch >= '0' && ch <= '9')
+    {
+        int *param= &zss->csi_params[MIN(zss->csi_nparams, ZAPHOD_ESC_MAX_ARGS-1)];
+
+        *param= MIN(*param * 10 + (ch - '0'), 9999);
+        return;
+    }
+    if (ch == ';')
+    {
+        zss->csi_nparams++;
+        return;
+    }
+    if (ch < 0x40 || ch > 0x7e)
+    {   /* private marker or intermediate byte */
+        zss->esc_state= ZAPHOD_ESC_CSI_IGNORE;
         return;
-#if 1   /* HACK - reveal unhandled control codes */
+    }
+
+    /* final byte */
+    if (zss->esc_state == ZAPHOD_ESC_CSI)
+    {
+        int nparams= MIN(zss->csi_nparams + 1, ZAPHOD_ESC_MAX_ARGS);
+
+        for (n= 0; n < ARRAY_SIZE(zaphod_screen_csis); n++)
+            if (zaphod_screen_csis[n].final == ch)
+            {
+                zss->esc_state= ZAPHOD_ESC_NONE;
+                zaphod_screen_csis[n].fn(zss, zss->csi_params, nparams);
+                return;
+            }
+#if 1   /* WmT - TRACE */
+;DPRINTF("INFO: %s() ignoring unsupported CSI final 0x%02x\n", __func__, ch);
+#endif
+    }
+    zss->esc_state= ZAPHOD_ESC_NONE;
+}
+
+
+static void zaphod_screen_control(ZaphodScreenState *zss, uint8_t ch)
+{
+    switch(ch)
+    {
+    case '\a':  /* BEL (bell, 0x07) */
+        /* ignore */
+        break;
+    case '\b':  /* BS (backspace, 0x08) */
+        zaphod_screen_move_cursor(zss, zss->curs_posr, zss->curs_posc-1);
+        break;
+    case '\t':  /* HT (tab, 0x09) - stops every 8 columns */
+        zaphod_screen_move_cursor(zss, zss->curs_posr,
+                                    (zss->curs_posc | 7) + 1);
+        break;
+    case '\n':  /* NL (newline, 0x0A) */
+        zaphod_screen_index(zss);
+        break;
+    case '\f':  /* FF (formfeed, 0x0C) */
+        zaphod_screen_clear_screen(zss);
+        break;
+    case '\r':  /* CR (carriage return, 0x0D) */
+        zaphod_screen_move_cursor(zss, zss->curs_posr, 0);
+        break;
+    case 0x1b:  /* ESC */
+        zss->esc_state= ZAPHOD_ESC_SEEN;
+        break;
     default:
-        if (!isprint(ch))
-        {
-            uint8_t nyb_hi, nyb_lo;
-
-            nyb_hi= (ch & 0xf0) >> 4;
-            nyb_lo= ch & 0x0f;
-            nyb_hi+= (nyb_hi > 9)? 'A' - 10 : '0';
-            nyb_lo+= (nyb_lo > 9)? 'A' - 10 : '0';
-
-            zaphod_screen_putchar(zss, '[');
-            zaphod_screen_putchar(zss, nyb_hi);
-            zaphod_screen_putchar(zss, nyb_lo);
-            zaphod_screen_putchar(zss, ']');
-            zaphod_screen_putchar(zss, '*');
-            return;
-        }
+#if 1   /* WmT - TRACE */
+;DPRINTF("INFO: %s() ignoring control code 0x%02x\n", __func__, ch);
 #endif
+        break;
     }
+}
+
+static void zaphod_screen_print(ZaphodScreenState *zss, uint8_t ch)
+{
+    int row= zss->curs_posr;
+
+    /* text written to a graphics row turns it back into a text row */
+    if (zss->row_attr[row] & ZAPHOD_SCREEN_ATTR_GRAPH)
+        zaphod_screen_set_attr(zss, row, ZAPHOD_SCREEN_ATTR_80COL);
 
     /* update grid and state for dirty region */
-    zss->row_attr[zss->curs_posr]= ZAPHOD_SCREEN_ATTR_80COL;
-    zss->char_grid[zss->curs_posr][zss->curs_posc]= ch;
-    zaphod_screen_mark_dirty(zss, zss->curs_posr, zss->curs_posc);
+    zss->char_grid[row][zss->curs_posc]= ch;
+    zaphod_screen_mark_dirty(zss, row, zss->curs_posc);
 
     /* TODO: if the cursor position changes when flagged visible,
      * mark it as dirty; the next update will put new text in its
@@ -436,15 +1062,53 @@ void zaphod_screen_putchar(ZaphodScreenState *zss, uint8_t ch)
     }
 #endif
 
-    if (++zss->curs_posc == ZAPHOD_TEXT_COLS)
+    if (++zss->curs_posc == zaphod_screen_row_cols(zss, row))
     {
         zss->curs_posc= 0;
-        if (++zss->curs_posr == ZAPHOD_TEXT_ROWS)
+        zaphod_screen_index(zss);
+    }
+}
+
+void zaphod_screen_putchar(ZaphodScreenState *zss, uint8_t ch)
+{
+    /* Phil Brown's documentation says "an OUT to port 1 will display
+     * the appropriate character on the console screen"; the control
+     * codes and escape sequences understood are described above
+     */
+    zaphod_screen_wake_cursor(zss);
+
+    if (zss->esc_state != ZAPHOD_ESC_NONE)
+    {
+        if (ch == 0x18 || ch == 0x1a)
+        {   /* CAN, SUB - abandon the sequence */
+            zss->esc_state= ZAPHOD_ESC_NONE;
+            return;
+        }
+
+        switch (zss->esc_state)
         {
-            zaphod_screen_scroll(zss);
-            zss->curs_posr= ZAPHOD_TEXT_ROWS-1;
+        case ZAPHOD_ESC_SEEN:
+            zaphod_screen_esc_start(zss, ch);
+            return;
+        case ZAPHOD_ESC_ARGS:
+            /* raw arguments may be any byte value, ESC included */
+            zaphod_screen_esc_arg(zss, ch);
+            return;
+        default:
+            if (ch == 0x1b)
+            {   /* restart */
+                zss->esc_state= ZAPHOD_ESC_SEEN;
+                return;
+            }
+            zaphod_screen_csi_byte(zss, ch);
+            return;
         }
     }
+
+    if (ch < 0x20 || ch == 0x7f)
+        zaphod_screen_control(zss, ch);
+    else
+        zaphod_screen_print(zss, ch);
 }
 
 
@@ -454,16 +1118,27 @@ static void zaphod_screen_reset(void *opaque)
 
     zaphod_screen_clear(zss);
     zss->cursor_visible= zss->cursor_dirty= false;
-    zss->cursor_blink_time= 0;
+    zaphod_screen_wake_cursor(zss);
+    zss->esc_state= ZAPHOD_ESC_NONE;
+    zss->saved_posr= zss->saved_posc= 0;
 
-    zss->dirty_minr= zss->dirty_maxr= -1;
-    zss->dirty_minc= zss->dirty_maxc= -1;
+    memset(zss->dirty_minc, -1, sizeof(zss->dirty_minc));
+    memset(zss->dirty_maxc, -1, sizeof(zss->dirty_maxc));
+    zss->scroll_pending= 0;
 }
 
 static void zaphod_screen_realizefn(DeviceState *dev, Error **errp)
 {
     ZaphodScreenState *zss= ZAPHOD_SCREEN(dev);
 
+    if (zss->text_only)
+    {   /* no console or rendering; changes are reported over QMP */
+        zss->text_timer= timer_new_ms(QEMU_CLOCK_REALTIME,
+                                        zaphod_screen_send_text, zss);
+        qemu_register_reset(zaphod_screen_reset, zss);
+        return;
+    }
+
     /* NB. our text mode is essentially VGA-like; is QEmu's
      * common display code useful?
      */
@@ -481,20 +1156,74 @@ static void zaphod_screen_realizefn(DeviceState *dev, Error **errp)
         zss->rgb_fg= zaphod_rgb_palette[1];
     else
         zss->rgb_fg= zaphod_rgb_palette[2];
+    zaphod_screen_build_glyphs(zss);
 
     qemu_console_resize(zss->display,
                         FONT_WIDTH * ZAPHOD_TEXT_COLS,
                         FONT_HEIGHT * ZAPHOD_TEXT_ROWS);
 
+    zss->ui_interval= GUI_REFRESH_INTERVAL_DEFAULT;
+    zss->cursor_timer= timer_new_ms(QEMU_CLOCK_REALTIME,
+                                    zaphod_screen_blink_cursor, zss);
+
     qemu_register_reset(zaphod_screen_reset, zss);
 }
 
 
+static int zaphod_screen_query_one(Object *obj, void *opaque)
+{
+    ZaphodScreenInfoList    ***tail= opaque;
+    ZaphodScreenInfoList    *elem;
+    ZaphodScreenRowList     **row_tail;
+    ZaphodScreenState       *zss;
+    ZaphodScreenInfo        *info;
+    int                     row;
+
+    if (!object_dynamic_cast(obj, TYPE_ZAPHOD_SCREEN))
+        return 0;
+    zss= ZAPHOD_SCREEN(obj);
+
+    info= g_new0(ZaphodScreenInfo, 1);
+    info->path= object_get_canonical_path(obj);
+    info->cursor_row= zss->curs_posr;
+    info->cursor_col= zss->curs_posc;
+
+    row_tail= &info->rows;
+    for (row= 0; row < ZAPHOD_TEXT_ROWS; row++)
+    {
+        ZaphodScreenRowList *row_elem= g_new0(ZaphodScreenRowList, 1);
+
+        row_elem->value= g_new0(ZaphodScreenRow, 1);
+        row_elem->value->text= zaphod_screen_row_text(zss, row);
+        row_elem->value->attr= zss->row_attr[row];
+        *row_tail= row_elem;
+        row_tail= &row_elem->next;
+    }
+
+    elem= g_new0(ZaphodScreenInfoList, 1);
+    elem->value= info;
+    **tail= elem;
+    *tail= &elem->next;
+    return 0;
+}
+
+ZaphodScreenInfoList *qmp_query_zaphod_screen(Error **errp)
+{
+    ZaphodScreenInfoList    *head= NULL;
+    ZaphodScreenInfoList    **tail= &head;
+
+    object_child_foreach_recursive(object_get_root(),
+                                    zaphod_screen_query_one, &tail);
+    return head;
+}
+
+
 static Property zaphod_screen_properties[] = {
     /* Properties for device "zaphod-screen"
      * Can set with '-global zaphod-screen.NAME=VALUE'
      */
     DEFINE_PROP_BOOL("simple-escape-codes", ZaphodScreenState, simple_escape_codes, false),
+    DEFINE_PROP_BOOL("text-only", ZaphodScreenState, text_only, false),
     DEFINE_PROP_END_OF_LIST()
 };
 
@@ -10,35 +10,55 @@
 #define HW_Z80_ZAPHOD_SCREEN_H
 
 #include "zaphod.h"
+#include "qemu/timer.h"
 
 #define ZAPHOD_TEXT_ROWS	25
 #define ZAPHOD_TEXT_COLS	80
 
+#define ZAPHOD_ESC_MAX_ARGS 4
+
 typedef DeviceClass ZaphodScreenClass;
 
 
 typedef enum {
-    ZAPHOD_SCREEN_ATTR_80COL = 0x01,
-    /* TODO:
-     * - 0x02: bold
-     * - 0x04: double height (internally, top half/bottom half)
-     * - 0x80: 2x4 graphics block (bit 0 top left, bit 7 bottom right)
-     */
-    ZAPHOD_SCREEN_ATTR_GRAPH = 0x80
+    ZAPHOD_SCREEN_ATTR_80COL = 0x01,    /* 40 double-width columns if clear */
+    ZAPHOD_SCREEN_ATTR_BOLD = 0x02,
+    ZAPHOD_SCREEN_ATTR_DHEIGHT = 0x04,  /* double height, top half... */
+    ZAPHOD_SCREEN_ATTR_DLOWER = 0x08,   /* ...or bottom half */
+    ZAPHOD_SCREEN_ATTR_GRAPH = 0x80,    /* 2x4 graphics block (bit 0 top
+                                         * left, bit 7 bottom right) */
+    ZAPHOD_SCREEN_ATTR_MASK = 0x8f
 } zaphod_screen_attr_t;
 
 typedef struct {
     DeviceState     parent;
 
     bool            simple_escape_codes;
+    bool            text_only;          /* no rendering; QMP events */
 
     QemuConsole     *display;
     bool            cursor_visible, cursor_dirty;
-    int64_t         cursor_blink_time;    /* millisec */
+    QEMUTimer       *cursor_timer;
+    int             cursor_idle_blinks; /* since the last output */
+    uint64_t        ui_interval;        /* UI refresh period, millisec */
+    QEMUTimer       *text_timer;        /* text-only: sends row events */
+    uint32_t        text_dirty_rows;    /* bit per row, for events */
     uint8_t         *rgb_bg, *rgb_fg;
-    int             dirty_minr, dirty_maxr;
-    int             dirty_minc, dirty_maxc;
+    uint32_t        *glyph_cache;       /* pre-rendered cells */
+    const uint8_t   *glyph_bg, *glyph_fg;   /* colours they use */
+    uint32_t        glyph_xor;          /* toggles a pixel fg <-> bg */
+    int             dirty_minc[ZAPHOD_TEXT_ROWS];   /* -1: row clean */
+    int             dirty_maxc[ZAPHOD_TEXT_ROWS];
+    int             scroll_pending;     /* rows to blit up at next update */
     int             curs_posr, curs_posc;
+    int             saved_posr, saved_posc;
+    /* escape sequence parser (see zaphod_screen_putchar()) */
+    uint8_t         esc_state;
+    uint8_t         esc_index;          /* entry awaiting arguments */
+    uint8_t         esc_argc;
+    uint8_t         esc_args[ZAPHOD_ESC_MAX_ARGS];
+    int             csi_params[ZAPHOD_ESC_MAX_ARGS];
+    int             csi_nparams;
     zaphod_screen_attr_t row_attr[ZAPHOD_TEXT_ROWS];
     uint8_t         char_grid[ZAPHOD_TEXT_ROWS][ZAPHOD_TEXT_COLS];
 } ZaphodScreenState;
@@ -0,0 +1,439 @@
+/*
+ * QEmu Zaphod board - Z80 SIO support
+ * vim: ft=c sw=4 ts=4 et :
+ *
+ * [...William Towle c. 2013-2022, under GPL...]
+ */
+
+
+#include "qemu/osdep.h"
+#include "zaphod.h"
+
+#include "qemu/error-report.h"
+#include "exec/address-spaces.h"
+#include "hw/qdev-properties.h"
+#include "qapi/error.h"
+#include "sysemu/reset.h"
+
+
+//#define EMIT_DEBUG ZAPHOD_DEBUG
+#define EMIT_DEBUG 0
+#define DPRINTF(fmt, ...) \
+    do { if (EMIT_DEBUG) error_printf("zaphod_sio: " fmt , ## __VA_ARGS__); } while(0)
+
+
+/* Zilog Z80 SIO/2 model, asynchronous modes only. Each channel has
+ * its own chardev, and its 3-byte receive FIFO is only offered as
+ * much input as it has room for, so nothing is lost when the guest
+ * falls behind. Modem inputs (/DCD, /CTS) read as asserted and never
+ * change, so there are no external/status interrupts; as with the
+ * other Zaphod daisy chain devices, interrupt-under-service is not
+ * tracked and 'Return from Int' does nothing.
+ */
+
+/* Status-affects-vector codes for D3-D1, in priority order below */
+enum {
+    SIO_VEC_B_TX, SIO_VEC_B_EXT, SIO_VEC_B_RX, SIO_VEC_B_SPECIAL,
+    SIO_VEC_A_TX, SIO_VEC_A_EXT, SIO_VEC_A_RX, SIO_VEC_A_SPECIAL
+};
+
+
+/* Interrupts */
+
+static bool zaphod_sio_rx_ip(ZaphodSIOChannel *ch)
+{
+    switch (ch->wr[1] & SIO_WR1_RX_INT_MASK)
+    {
+    case SIO_WR1_RX_INT_FIRST:
+        return ch->rx_first_ip;
+    case SIO_WR1_RX_INT_ALL_PAR:
+    case SIO_WR1_RX_INT_ALL:
+        return !fifo8_is_empty(&ch->rx_fifo);
+    default:
+        return false;
+    }
+}
+
+static bool zaphod_sio_tx_ip(ZaphodSIOChannel *ch)
+{
+    return ch->tx_ip && (ch->wr[1] & SIO_WR1_TX_INT);
+}
+
+/* Highest priority source's vector code, or -1 if none is pending */
+static int zaphod_sio_pending(ZaphodSIOState *zss)
+{
+    ZaphodSIOChannel    *a= &zss->ch[0], *b= &zss->ch[1];
+
+    if (zaphod_sio_rx_ip(a))
+        return a->overrun ? SIO_VEC_A_SPECIAL : SIO_VEC_A_RX;
+    if (zaphod_sio_tx_ip(a))
+        return SIO_VEC_A_TX;
+    if (zaphod_sio_rx_ip(b))
+        return b->overrun ? SIO_VEC_B_SPECIAL : SIO_VEC_B_RX;
+    if (zaphod_sio_tx_ip(b))
+        return SIO_VEC_B_TX;
+    return -1;
+}
+
+static uint8_t zaphod_sio_vector(ZaphodSIOState *zss)
+{
+    ZaphodSIOChannel    *b= &zss->ch[1];
+    int                 code= zaphod_sio_pending(zss);
+
+    if (!(b->wr[1] & SIO_WR1_STATUS_VECTOR))
+        return b->wr[2];
+
+    /* with nothing pending, RR2 reads as for a channel B special */
+    if (code < 0)
+        code= SIO_VEC_B_SPECIAL;
+    return (b->wr[2] & 0xf1) | (code << 1);
+}
+
+static void zaphod_sio_update_irq(ZaphodSIOState *zss)
+{
+    qemu_set_irq(zss->irq, zaphod_sio_pending(zss) >= 0);
+}
+
+/* Called by the board on interrupt acknowledge. Sources stay pending
+ * until serviced, by reading data or resetting the TX interrupt
+ */
+uint8_t zaphod_sio_irq_ack(void *opaque)
+{
+    return zaphod_sio_vector(ZAPHOD_SIO(opaque));
+}
+
+
+/* Transmit */
+
+static void zaphod_sio_tx(ZaphodSIOChannel *ch);
+
+static gboolean zaphod_sio_tx_watch(void *do_not_use, GIOCondition cond,
+                                    void *opaque)
+{
+    ZaphodSIOChannel    *ch= (ZaphodSIOChannel *)opaque;
+
+    ch->tx_watch_tag= 0;
+    zaphod_sio_tx(ch);
+    return FALSE;
+}
+
+static void zaphod_sio_tx(ZaphodSIOChannel *ch)
+{
+    if (!ch->tx_full || !(ch->wr[5] & SIO_WR5_TX_ENABLE) || ch->tx_watch_tag)
+        return;
+
+    if (qemu_chr_fe_backend_connected(&ch->chr)
+            && qemu_chr_fe_write(&ch->chr, &ch->tx_data, 1) != 1)
+    {   /* backend is full: hold the byte (and TX empty) until it drains */
+        ch->tx_watch_tag= qemu_chr_fe_add_watch(&ch->chr,
+                                    G_IO_OUT | G_IO_HUP,
+                                    zaphod_sio_tx_watch, ch);
+        if (ch->tx_watch_tag)
+            return;
+    }
+
+    ch->tx_full= false;
+    ch->tx_ip= true;
+    zaphod_sio_update_irq(ch->sio);
+}
+
+
+/* Receive */
+
+static int zaphod_sio_can_receive(void *opaque)
+{
+    ZaphodSIOChannel    *ch= (ZaphodSIOChannel *)opaque;
+
+    if (!(ch->wr[3] & SIO_WR3_RX_ENABLE))
+        return 0;
+    return fifo8_num_free(&ch->rx_fifo);
+}
+
+static void zaphod_sio_receive(void *opaque, const uint8_t *buf, int len)
+{
+    ZaphodSIOChannel    *ch= (ZaphodSIOChannel *)opaque;
+    uint32_t            room= fifo8_num_free(&ch->rx_fifo);
+
+    /* can_receive() limits 'len' to the space in the FIFO */
+    if (len > room)
+    {
+        ch->overrun= true;
+        len= room;
+    }
+    fifo8_push_all(&ch->rx_fifo, buf, len);
+
+    if (ch->rx_first && len > 0)
+    {
+        ch->rx_first= false;
+        ch->rx_first_ip= true;
+    }
+    zaphod_sio_update_irq(ch->sio);
+}
+
+static uint8_t zaphod_sio_read_data(ZaphodSIOChannel *ch)
+{
+    uint8_t value= 0xff;
+
+    if (!fifo8_is_empty(&ch->rx_fifo))
+        value= fifo8_pop(&ch->rx_fifo);
+    ch->rx_first_ip= false;
+
+    zaphod_sio_update_irq(ch->sio);
+    qemu_chr_fe_accept_input(&ch->chr);
+    return value;
+}
+
+
+/* Registers */
+
+static void zaphod_sio_channel_reset(ZaphodSIOChannel *ch)
+{
+    uint8_t vector= ch->wr[2];
+
+    if (ch->tx_watch_tag)
+    {
+        g_source_remove(ch->tx_watch_tag);
+        ch->tx_watch_tag= 0;
+    }
+
+    memset(ch->wr, 0, sizeof(ch->wr));
+    ch->wr[2]= vector;              /* not affected by a channel reset */
+    ch->ptr= 0;
+    fifo8_reset(&ch->rx_fifo);
+    ch->rx_first= ch->rx_first_ip= false;
+    ch->overrun= false;
+    ch->tx_full= ch->tx_ip= false;
+}
+
+static void zaphod_sio_command(ZaphodSIOChannel *ch, uint8_t cmd)
+{
+    switch (cmd)
+    {
+    case SIO_CMD_CHANNEL_RESET:
+        zaphod_sio_channel_reset(ch);
+        break;
+    case SIO_CMD_INT_NEXT_RX:
+        ch->rx_first= true;
+        break;
+    case SIO_CMD_RESET_TX_INT:
+        ch->tx_ip= false;
+        break;
+    case SIO_CMD_ERROR_RESET:
+        ch->overrun= false;
+        break;
+    default:        /* no external/status changes, IUS, or SDLC */
+        break;
+    }
+}
+
+static void zaphod_sio_write_ctrl(ZaphodSIOChannel *ch, uint8_t value)
+{
+    int     reg= ch->ptr;
+
+    ch->ptr= 0;
+    if (reg == 0)
+    {
+        ch->ptr= value & SIO_WR0_PTR_MASK;
+        zaphod_sio_command(ch, value & SIO_WR0_CMD_MASK);
+    }
+    else
+    {
+        ch->wr[reg]= value;
+    }
+
+    switch (reg)
+    {
+    case 3:         /* receiver may now be enabled */
+        qemu_chr_fe_accept_input(&ch->chr);
+        break;
+    case 5:         /* transmitter may now be enabled */
+        zaphod_sio_tx(ch);
+        break;
+    }
+    zaphod_sio_update_irq(ch->sio);
+}
+
+static uint8_t zaphod_sio_read_ctrl(ZaphodSIOChannel *ch)
+{
+    ZaphodSIOState  *zss= ch->sio;
+    int             reg= ch->ptr;
+    uint8_t         value;
+
+    ch->ptr= 0;
+    switch (reg)
+    {
+    case 0:
+        value= SIO_RR0_DCD | SIO_RR0_CTS;
+        if (!fifo8_is_empty(&ch->rx_fifo))
+            value|= SIO_RR0_RX_AVAIL;
+        if (!ch->tx_full)
+            value|= SIO_RR0_TX_EMPTY;
+        if (ch->index == 0 && zaphod_sio_pending(zss) >= 0)
+            value|= SIO_RR0_INT_PENDING;
+        return value;
+    case 1:
+        value= ch->tx_full ? 0 : SIO_RR1_ALL_SENT;
+        if (ch->overrun)
+            value|= SIO_RR1_OVERRUN;
+        return value;
+    case 2:
+        if (ch->index == 1)
+            return zaphod_sio_vector(zss);
+        /* fall through */
+    default:
+        return 0xff;
+    }
+}
+
+static uint32_t zaphod_sio_read(void *opaque, uint32_t addr)
+{
+    ZaphodSIOState      *zss= (ZaphodSIOState *)opaque;
+    ZaphodSIOChannel    *ch= &zss->ch[(addr >> 1) & 0x01];
+
+    if (addr & 0x01)
+        return zaphod_sio_read_data(ch);
+    return zaphod_sio_read_ctrl(ch);
+}
+
+static void zaphod_sio_write(void *opaque, uint32_t addr, uint32_t value)
+{
+    ZaphodSIOState      *zss= (ZaphodSIOState *)opaque;
+    ZaphodSIOChannel    *ch= &zss->ch[(addr >> 1) & 0x01];
+
+    if (!(addr & 0x01))
+    {
+        zaphod_sio_write_ctrl(ch, value & 0xff);
+        return;
+    }
+
+    /* NB: a byte written while the last is still pending replaces it */
+    ch->tx_data= value & 0xff;
+    ch->tx_full= true;
+    ch->tx_ip= false;
+    zaphod_sio_tx(ch);
+    zaphod_sio_update_irq(zss);
+}
+
+static const MemoryRegionPortio zaphod_sio_portio[] = {
+    { 0x00, 4, 1,
+                .read = zaphod_sio_read,
+                .write = zaphod_sio_write
+                },
+    PORTIO_END_OF_LIST()
+};
+
+
+static void zaphod_sio_reset(void *opaque)
+{
+    ZaphodSIOState  *zss= (ZaphodSIOState *)opaque;
+    int             n;
+
+    for (n= 0; n < ZAPHOD_SIO_CHANNELS; n++)
+    {
+        zaphod_sio_channel_reset(&zss->ch[n]);
+        zss->ch[n].wr[2]= 0;
+    }
+    zaphod_sio_update_irq(zss);
+}
+
+static void zaphod_sio_realizefn(DeviceState *dev, Error **errp)
+{
+    ZaphodSIOState  *zss= ZAPHOD_SIO(dev);
+    int             n;
+
+    if (zss->iobase & 0x03 || zss->iobase > 0xfc)
+    {
+        error_setg(errp, "iobase must be a multiple of 4 below 0x100");
+        return;
+    }
+
+    for (n= 0; n < ZAPHOD_SIO_CHANNELS; n++)
+    {
+        ZaphodSIOChannel    *ch= &zss->ch[n];
+
+        ch->sio= zss;
+        ch->index= n;
+        fifo8_create(&ch->rx_fifo, ZAPHOD_SIO_RX_FIFO_DEPTH);
+        qemu_chr_fe_set_handlers(&ch->chr,
+                    zaphod_sio_can_receive, zaphod_sio_receive,
+                    NULL,
+                    NULL, ch, NULL, true);
+    }
+
+    zss->ioports= g_new(PortioList, 1);
+    portio_list_init(zss->ioports, OBJECT(zss), zaphod_sio_portio,
+                    zss, "zaphod.sio");
+    portio_list_add(zss->ioports, get_system_io(), zss->iobase);
+
+    zaphod_sio_reset(zss);
+    qemu_register_reset(zaphod_sio_reset, zss);
+}
+
+static void zaphod_sio_unrealizefn(DeviceState *dev)
+{
+    ZaphodSIOState  *zss= ZAPHOD_SIO(dev);
+    int             n;
+
+    qemu_unregister_reset(zaphod_sio_reset, zss);
+    for (n= 0; n < ZAPHOD_SIO_CHANNELS; n++)
+    {
+        ZaphodSIOChannel    *ch= &zss->ch[n];
+
+        if (ch->tx_watch_tag)
+            g_source_remove(ch->tx_watch_tag);
+        qemu_chr_fe_deinit(&ch->chr, false);
+        fifo8_destroy(&ch->rx_fifo);
+    }
+}
+
+
+static Property zaphod_sio_properties[]= {
+    /* properties can be set with '-global zaphod-sio.VAR=VAL' */
+    DEFINE_PROP_CHR("chardev-a", ZaphodSIOState, ch[0].chr),
+    DEFINE_PROP_CHR("chardev-b", ZaphodSIOState, ch[1].chr),
+    DEFINE_PROP_UINT32("iobase", ZaphodSIOState, iobase,
+                        ZAPHOD_SIO_IOBASE_DEFAULT),
+    DEFINE_PROP_END_OF_LIST()
+};
+
+static void zaphod_sio_class_init(ObjectClass *oc, void *data)
+{
+    DeviceClass *dc= DEVICE_CLASS(oc);
+
+    dc->desc= "Zaphod Z80 SIO/2 serial controller";
+    dc->realize= zaphod_sio_realizefn;
+    dc->unrealize= zaphod_sio_unrealizefn;
+#if QEMU_VERSION_MAJOR < 5
+    dc->props= zaphod_sio_properties;
+#else
+    device_class_set_props(dc, zaphod_sio_properties);
+#endif
+    set_bit(DEVICE_CATEGORY_INPUT, dc->categories);
+}
+
+static void zaphod_sio_instance_init(Object *obj)
+{
+    ZaphodSIOState  *zss= ZAPHOD_SIO(obj);
+
+    /* connected to the board by the IOCore */
+    qdev_init_gpio_out(DEVICE(obj), &zss->irq, 1);
+}
+
+
+static const TypeInfo zaphod_sio_info= {
+    .name= TYPE_ZAPHOD_SIO,
+    .parent= TYPE_DEVICE,
+    /* For ZaphodSIOClass with virtual functions:
+    .class_size= sizeof(ZaphodSIOClass),
+     */
+    .class_init= zaphod_sio_class_init,
+    .instance_size= sizeof(ZaphodSIOState),
+    .instance_init= zaphod_sio_instance_init
+};
+
+static void zaphod_sio_register_types(void)
+{
+    type_register_static(&zaphod_sio_info);
+}
+
+type_init(zaphod_sio_register_types)
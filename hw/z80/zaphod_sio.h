@@ -0,0 +1,105 @@
+/*
+ * QEmu Zaphod board - Z80 SIO support
+ * vim: ft=c sw=4 ts=4 et :
+ *
+ * [...William Towle c. 2013-2022, under GPL...]
+ */
+
+
+#ifndef HW_Z80_ZAPHOD_SIO_H
+#define HW_Z80_ZAPHOD_SIO_H
+
+#include "chardev/char-fe.h"
+#include "exec/ioport.h"
+#include "hw/irq.h"
+#include "qemu/fifo8.h"
+
+
+/* RC2014 layout: A control, A data, B control, B data */
+#define ZAPHOD_SIO_IOBASE_DEFAULT   0x80
+#define ZAPHOD_SIO_RX_FIFO_DEPTH    3
+#define ZAPHOD_SIO_CHANNELS         2
+
+/* WR0: register pointer and command */
+#define SIO_WR0_PTR_MASK        0x07
+#define SIO_WR0_CMD_MASK        0x38
+#define SIO_CMD_NULL            0x00
+#define SIO_CMD_SEND_ABORT      0x08
+#define SIO_CMD_RESET_EXT_INT   0x10
+#define SIO_CMD_CHANNEL_RESET   0x18
+#define SIO_CMD_INT_NEXT_RX     0x20
+#define SIO_CMD_RESET_TX_INT    0x28
+#define SIO_CMD_ERROR_RESET     0x30
+#define SIO_CMD_RETI            0x38    /* channel A only */
+
+/* WR1: interrupt control */
+#define SIO_WR1_EXT_INT         0x01
+#define SIO_WR1_TX_INT          0x02
+#define SIO_WR1_STATUS_VECTOR   0x04    /* channel B only */
+#define SIO_WR1_RX_INT_MASK     0x18
+#define SIO_WR1_RX_INT_FIRST    0x08
+#define SIO_WR1_RX_INT_ALL_PAR  0x10
+#define SIO_WR1_RX_INT_ALL      0x18
+
+#define SIO_WR3_RX_ENABLE       0x01
+#define SIO_WR5_TX_ENABLE       0x08
+
+/* RR0: buffer and line status */
+#define SIO_RR0_RX_AVAIL        0x01
+#define SIO_RR0_INT_PENDING     0x02    /* channel A only */
+#define SIO_RR0_TX_EMPTY        0x04
+#define SIO_RR0_DCD             0x08
+#define SIO_RR0_CTS             0x20
+
+/* RR1: special receive conditions */
+#define SIO_RR1_ALL_SENT        0x01
+#define SIO_RR1_OVERRUN         0x20
+
+
+typedef struct ZaphodSIOState ZaphodSIOState;
+
+typedef struct {
+    ZaphodSIOState  *sio;
+    int             index;
+
+    CharBackend     chr;
+    uint8_t         wr[8];
+    uint8_t         ptr;            /* register for next control access */
+
+    Fifo8           rx_fifo;
+    bool            rx_first;       /* 'interrupt on next char' armed */
+    bool            rx_first_ip;
+    bool            overrun;
+
+    uint8_t         tx_data;
+    bool            tx_full;
+    bool            tx_ip;
+    guint           tx_watch_tag;
+} ZaphodSIOChannel;
+
+typedef DeviceClass ZaphodSIOClass;
+
+struct ZaphodSIOState {
+    DeviceState     parent;
+
+    uint32_t        iobase;
+    PortioList      *ioports;
+    qemu_irq        irq;
+
+    ZaphodSIOChannel ch[ZAPHOD_SIO_CHANNELS];
+};
+
+
+#define TYPE_ZAPHOD_SIO "zaphod-sio"
+
+#define ZAPHOD_SIO_GET_CLASS(obj) \
+    OBJECT_GET_CLASS(ZaphodSIOClass, obj, TYPE_ZAPHOD_SIO)
+#define ZAPHOD_SIO_CLASS(oc) \
+    OBJECT_CLASS_CHECK(ZaphodSIOClass, oc, TYPE_ZAPHOD_SIO)
+#define ZAPHOD_SIO(obj) \
+    OBJECT_CHECK(ZaphodSIOState, obj, TYPE_ZAPHOD_SIO)
+
+
+uint8_t zaphod_sio_irq_ack(void *opaque);
+
+#endif  /* HW_Z80_ZAPHOD_SIO_H */
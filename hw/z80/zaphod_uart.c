@@ -13,6 +13,9 @@
 #include "sysemu/sysemu.h"
 #include "exec/address-spaces.h"
 #include "hw/qdev-properties.h"
+#include "qapi/error.h"
+#include "qemu/main-loop.h"
+#include "chardev/char-serial.h"
 
 
 //#define EMIT_DEBUG ZAPHOD_DEBUG
@@ -21,34 +24,155 @@
     do { if (EMIT_DEBUG) error_printf("zaphod_uart: " fmt , ## __VA_ARGS__); } while(0)
 
 
+/* MC6850 ACIA model. The stdio UART shares the code, but has no
+ * control/status ports so stays in its reset-time configuration
+ */
+
+static bool zaphod_uart_in_reset(ZaphodUARTState *zus)
+{
+    return (zus->acia_cr & ACIA_CR_DIV_MASK) == ACIA_CR_MASTER_RESET;
+}
+
+static bool zaphod_uart_tdre(ZaphodUARTState *zus)
+{
+    return !zus->tx_busy && !fifo8_is_full(&zus->tx_fifo);
+}
+
+static bool zaphod_uart_irq_pending(ZaphodUARTState *zus)
+{
+    if (zaphod_uart_in_reset(zus))
+        return false;
+
+    if ((zus->acia_cr & ACIA_CR_RIE)
+            && (!fifo8_is_empty(&zus->rx_fifo) || zus->overrun))
+        return true;
+    if ((zus->acia_cr & ACIA_CR_TC_MASK) == ACIA_CR_TC_TIE
+            && zaphod_uart_tdre(zus))
+        return true;
+
+    return false;
+}
+
+static void zaphod_uart_update_irq(ZaphodUARTState *zus)
+{
+    qemu_set_irq(zus->irq, zaphod_uart_irq_pending(zus));
+}
+
+/* Time to shift one character out at the programmed word format and
+ * clock divide ratio, or 0 if pacing is disabled
+ */
+static int64_t zaphod_uart_char_time_ns(ZaphodUARTState *zus)
+{
+    static const int    word_bits[8]= {
+        /* start + data + parity + stop, for CR4:2 = 0..7 */
+        1+7+1+2, 1+7+1+2, 1+7+1+1, 1+7+1+1,
+        1+8+0+2, 1+8+0+1, 1+8+1+1, 1+8+1+1
+    };
+    static const int    divide[4]= { 1, 16, 64, 64 };
+    int                 word;
+
+    if (!zus->clock_hz)
+        return 0;
+
+    word= (zus->acia_cr & ACIA_CR_WORD_MASK) >> ACIA_CR_WORD_SHIFT;
+    return muldiv64(word_bits[word] * divide[zus->acia_cr & ACIA_CR_DIV_MASK],
+                    NANOSECONDS_PER_SECOND, zus->clock_hz);
+}
+
+static void zaphod_uart_tx_timer_cb(void *opaque)
+{
+    ZaphodUARTState *zus= ZAPHOD_UART(opaque);
+
+    zus->tx_busy= false;
+    zaphod_uart_update_irq(zus);
+}
+
+static void zaphod_uart_rx_timer_cb(void *opaque)
+{
+    ZaphodUARTState *zus= ZAPHOD_UART(opaque);
+
+    zus->rx_busy= false;
+    qemu_chr_fe_accept_input(&zus->chr);
+}
+
 int zaphod_uart_portstatus(void *opaque)
 {
     ZaphodUARTState *zus= ZAPHOD_UART(opaque);
     int value;
 
-    value= zus->inkey_valid? 0 : 0x01;  /* RxDataReady */
-    value|= 0x02;                       /* TxDataEmpty (always) */
-    value|= 0x04;                       /* DTD [Data Carrier Detect] */
-    value|= 0x08;                       /* CTS [Clear to Send] */
-    /* FrameErr|Overrun|ParityErr|IrqReq not emulated */
+    /* /DCD and /CTS are tied low (carrier present, clear to send),
+     * and the status register reads as such while in master reset
+     */
+    if (zaphod_uart_in_reset(zus))
+        return 0;
+
+    value= fifo8_is_empty(&zus->rx_fifo)? 0 : ACIA_SR_RDRF;
+    if (zaphod_uart_tdre(zus))
+        value|= ACIA_SR_TDRE;
+    if (zus->overrun)
+        value|= ACIA_SR_OVRN;
+    /* FrameErr|ParityErr not emulated */
+    if (zaphod_uart_irq_pending(zus))
+        value|= ACIA_SR_IRQ;
 
     return value;
 }
 
+void zaphod_uart_set_control(ZaphodUARTState *zus, uint8_t value)
+{
+    bool    was_break= (zus->acia_cr & ACIA_CR_TC_MASK) == ACIA_CR_TC_BREAK;
+    int     break_enable;
+
+#if 1   /* WmT - TRACE */
+;DPRINTF("DEBUG: %s() control register <- 0x%02x\n", __func__, value);
+#endif
+    zus->acia_cr= value;
+
+    if (zaphod_uart_in_reset(zus))
+    {
+        zus->overrun= false;
+        zus->tx_busy= false;
+        timer_del(zus->tx_timer);
+    }
+
+    /* CR6:5 = 11 holds the line in break until changed */
+    break_enable= (zus->acia_cr & ACIA_CR_TC_MASK) == ACIA_CR_TC_BREAK;
+    if (break_enable != was_break)
+        qemu_chr_fe_ioctl(&zus->chr, CHR_IOCTL_SERIAL_SET_BREAK, &break_enable);
+
+    /* RTS may have been lowered, so the host can resume sending */
+    if ((zus->acia_cr & ACIA_CR_TC_MASK) != ACIA_CR_TC_RTS_HIGH)
+        qemu_chr_fe_accept_input(&zus->chr);
+    zaphod_uart_update_irq(zus);
+}
+
+/* Report free space in the RX FIFO, so the chardev layer holds back
+ * anything we can't yet store
+ */
 #if defined(CONFIG_ZAPHOD_HAS_IOCORE)
 int zaphod_uart_can_receive(void *opaque)
 {
-    /* With no FIFO, we can always store something to 'inkey' (and
-     * the device-specific 'opaque' value is redundant
-     */
-    return 1;
+    ZaphodUARTState *zus= ZAPHOD_UART(opaque);
+
+    /* RTS high is the guest asking the host to stop sending */
+    if ((zus->acia_cr & ACIA_CR_TC_MASK) == ACIA_CR_TC_RTS_HIGH)
+        return 0;
+    if (zus->clock_hz)
+        return zus->rx_busy? 0 : MIN(fifo8_num_free(&zus->rx_fifo), 1);
+    return fifo8_num_free(&zus->rx_fifo);
 }
 #else
 static
 int zaphod_uart_can_receive(void *opaque)
 {
-    /* Maybe implement a FIFO queue? */
-    return 1;
+    ZaphodUARTState *zus= ZAPHOD_UART(opaque);
+
+    /* RTS high is the guest asking the host to stop sending */
+    if ((zus->acia_cr & ACIA_CR_TC_MASK) == ACIA_CR_TC_RTS_HIGH)
+        return 0;
+    if (zus->clock_hz)
+        return zus->rx_busy? 0 : MIN(fifo8_num_free(&zus->rx_fifo), 1);
+    return fifo8_num_free(&zus->rx_fifo);
 }
 
 static
@@ -56,60 +180,269 @@ void zaphod_uart_receive(void *opaque, const uint8_t *buf, int len)
 {
     ZaphodUARTState *zus= ZAPHOD_UART(opaque);
 
-    zus->inkey= buf[0];
-    zus->inkey_valid= true;
+    len= MIN(len, fifo8_num_free(&zus->rx_fifo));
+    fifo8_push_all(&zus->rx_fifo, buf, len);
+    zaphod_uart_update_irq(zus);
 }
 #endif
 
+/* Transmit path: guest writes go to the TX FIFO, which is drained
+ * from the main loop - immediately via a bottom half, then via a
+ * chardev watch whenever the backend can't take everything at once
+ */
+static void zaphod_uart_tx_drain(ZaphodUARTState *zus);
+
+static gboolean zaphod_uart_tx_watch(GIOChannel *chan, GIOCondition cond,
+                                        void *opaque)
+{
+    ZaphodUARTState *zus= ZAPHOD_UART(opaque);
+
+    zus->tx_watch_tag= 0;
+    zaphod_uart_tx_drain(zus);
+    return FALSE;
+}
+
+/* Contiguous run at the head of the FIFO (which may wrap) */
+static const uint8_t *zaphod_uart_tx_peek(ZaphodUARTState *zus, uint32_t *len)
+{
+    Fifo8   *fifo= &zus->tx_fifo;
+
+    *len= MIN(fifo->num, fifo->capacity - fifo->head);
+    return &fifo->data[fifo->head];
+}
+
+static void zaphod_uart_tx_flush(ZaphodUARTState *zus)
+{
+    const uint8_t   *buf;
+    uint32_t        len;
+
+    if (zus->tx_watch_tag)
+    {
+        g_source_remove(zus->tx_watch_tag);
+        zus->tx_watch_tag= 0;
+    }
+
+    while (!fifo8_is_empty(&zus->tx_fifo))
+    {
+        buf= zaphod_uart_tx_peek(zus, &len);
+        qemu_chr_fe_write_all(&zus->chr, buf, len);
+        fifo8_pop_buf(&zus->tx_fifo, len, &len);
+    }
+}
+
+static void zaphod_uart_tx_drain(ZaphodUARTState *zus)
+{
+    const uint8_t   *buf;
+    uint32_t        len;
+    int             ret;
+
+    while (!fifo8_is_empty(&zus->tx_fifo))
+    {
+        buf= zaphod_uart_tx_peek(zus, &len);
+        ret= qemu_chr_fe_write(&zus->chr, buf, len);
+        if (ret <= 0)
+            break;
+        fifo8_pop_buf(&zus->tx_fifo, ret, &len);
+    }
+    /* TDRE may have been reasserted */
+    zaphod_uart_update_irq(zus);
+
+    if (!fifo8_is_empty(&zus->tx_fifo) && !zus->tx_watch_tag)
+    {
+        zus->tx_watch_tag= qemu_chr_fe_add_watch(&zus->chr,
+                                    G_IO_OUT | G_IO_HUP,
+                                    zaphod_uart_tx_watch, zus);
+        if (!zus->tx_watch_tag)
+        {   /* backend can't signal when it's writable */
+            zaphod_uart_tx_flush(zus);
+        }
+    }
+}
+
+static void zaphod_uart_tx_bh(void *opaque)
+{
+    ZaphodUARTState *zus= ZAPHOD_UART(opaque);
+
+    if (!zus->tx_watch_tag)
+        zaphod_uart_tx_drain(zus);
+}
+
 void zaphod_uart_putchar(ZaphodUARTState *zus, const unsigned char ch)
 {
     if (unlikely(!qemu_chr_fe_backend_connected(&zus->chr)))
         return;     /* CPU IOPort write without console window */
 
+    if (fifo8_is_full(&zus->tx_fifo))
+    {   /* guest didn't wait for TxDataEmpty (or can't: stdio has
+         * no status port) - make room the slow way
+         */
+        zaphod_uart_tx_flush(zus);
+    }
+
     /* TODO: QEmu's serial console can be sent standard control codes;
      * we will need to handle our non-standard ones specially.
      */
-    qemu_chr_write(zus->chr.chr, &ch, 1, true);
+    fifo8_push(&zus->tx_fifo, ch);
+    if (!zus->tx_watch_tag)
+        qemu_bh_schedule(zus->tx_bh);
+
+    if (zus->clock_hz)
+    {   /* TDRE stays low while the character shifts out */
+        zus->tx_busy= true;
+        timer_mod(zus->tx_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)
+                                    + zaphod_uart_char_time_ns(zus));
+    }
+    zaphod_uart_update_irq(zus);
 }
 
+bool zaphod_uart_has_inkey(void *opaque)
+{
+    ZaphodUARTState *zus= (ZaphodUARTState *)opaque;
+
+    return !fifo8_is_empty(&zus->rx_fifo);
+}
+
+/* Returns the oldest unread character, or 0 if there is none */
 uint8_t zaphod_uart_get_inkey(void *opaque, bool read_and_clear)
 {
     ZaphodUARTState *zus= (ZaphodUARTState *)opaque;
-    uint8_t val= zus->inkey;
+    Fifo8           *fifo= &zus->rx_fifo;
+    uint8_t         val;
 
-    if (read_and_clear)
-    {
-        zus->inkey= '\0';
-        zus->inkey_valid= false;
-    }
+    if (fifo8_is_empty(fifo))
+        return '\0';
+
+    if (!read_and_clear)
+        return fifo->data[fifo->head];
 
+    val= fifo8_pop(fifo);
+    /* reading RxData after the status register clears OVRN */
+    zus->overrun= false;
+    zaphod_uart_update_irq(zus);
+    /* space has been made - let the chardev send more */
+    qemu_chr_fe_accept_input(&zus->chr);
     return val;
 }
 
 void zaphod_uart_set_inkey(void *opaque, uint8_t val, bool is_data)
 {
     ZaphodUARTState *zus= (ZaphodUARTState *)opaque;
-    zus->inkey= val;
+
+    /* key-up events (!is_data) used to clear the single 'inkey'
+     * slot; with a FIFO, that would only lose unread input
+     */
+    if (!is_data)
+        return;
+
+    if (fifo8_is_full(&zus->rx_fifo))
+    {   /* only possible for input bypassing can_receive() */
+        zus->overrun= true;
+    }
+    else
+    {
+        fifo8_push(&zus->rx_fifo, val);
+        if (zus->clock_hz)
+        {
+            zus->rx_busy= true;
+            timer_mod(zus->rx_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)
+                                        + zaphod_uart_char_time_ns(zus));
+        }
+    }
+    zaphod_uart_update_irq(zus);
+}
+
+
+/* Queue a key's whole byte sequence, or none of it, so that a burst
+ * of scripted key events can't leave half an escape sequence behind.
+ * Keyboard input isn't paced at the line rate
+ */
+bool zaphod_uart_push_input(ZaphodUARTState *zus, const uint8_t *buf, int len)
+{
+    if ((zus->acia_cr & ACIA_CR_TC_MASK) == ACIA_CR_TC_RTS_HIGH)
+        return false;
+    if (len > fifo8_num_free(&zus->rx_fifo))
+        return false;
+
+    fifo8_push_all(&zus->rx_fifo, buf, len);
+    zaphod_uart_update_irq(zus);
+    return true;
 }
 
 
 static void zaphod_uart_realizefn(DeviceState *dev, Error **errp)
 {
-    /* Nothing to do here */
+    ZaphodUARTState   *zus= ZAPHOD_UART(dev);
+
+    if (zus->rx_fifo_size == 0)
+    {
+        error_setg(errp, "rx-fifo-size must be non-zero");
+        return;
+    }
+    fifo8_create(&zus->rx_fifo, zus->rx_fifo_size);
+
+    if (zus->tx_fifo_size == 0)
+    {
+        error_setg(errp, "tx-fifo-size must be non-zero");
+        return;
+    }
+    fifo8_create(&zus->tx_fifo, zus->tx_fifo_size);
+    zus->tx_bh= qemu_bh_new(zaphod_uart_tx_bh, zus);
+
+    zus->tx_timer= timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                zaphod_uart_tx_timer_cb, zus);
+    zus->rx_timer= timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                zaphod_uart_rx_timer_cb, zus);
+}
+
+static void zaphod_uart_unrealizefn(DeviceState *dev)
+{
+    ZaphodUARTState   *zus= ZAPHOD_UART(dev);
+
+    if (zus->tx_watch_tag)
+    {
+        g_source_remove(zus->tx_watch_tag);
+        zus->tx_watch_tag= 0;
+    }
+    timer_free(zus->rx_timer);
+    timer_free(zus->tx_timer);
+    qemu_bh_delete(zus->tx_bh);
+    fifo8_destroy(&zus->tx_fifo);
+    fifo8_destroy(&zus->rx_fifo);
 }
 
 static void zaphod_uart_reset(DeviceState *dev)
 {
     ZaphodUARTState   *zus= ZAPHOD_UART(dev);
 
-    zus->inkey= '\0';
-    zus->inkey_valid= false;
+    fifo8_reset(&zus->rx_fifo);
+    if ((zus->acia_cr & ACIA_CR_TC_MASK) == ACIA_CR_TC_BREAK)
+    {   /* end a break in progress */
+        int break_enable= 0;
+
+        qemu_chr_fe_ioctl(&zus->chr, CHR_IOCTL_SERIAL_SET_BREAK, &break_enable);
+    }
+    zus->acia_cr= ACIA_CR_DEFAULT;
+    zus->overrun= false;
+    zus->tx_busy= zus->rx_busy= false;
+    timer_del(zus->tx_timer);
+    timer_del(zus->rx_timer);
+
+    /* let output written before the reset reach the backend */
+    if (qemu_chr_fe_backend_connected(&zus->chr))
+        zaphod_uart_tx_flush(zus);
+    zaphod_uart_update_irq(zus);
 }
 
 
 static Property zaphod_uart_properties[]= {
     /* properties can be set with '-global zaphod-uart.VAR=VAL' */
     DEFINE_PROP_CHR("chardev",  ZaphodUARTState, chr),
+    DEFINE_PROP_UINT32("rx-fifo-size", ZaphodUARTState, rx_fifo_size,
+                        ZAPHOD_UART_RX_FIFO_SIZE_DEFAULT),
+    DEFINE_PROP_UINT32("tx-fifo-size", ZaphodUARTState, tx_fifo_size,
+                        ZAPHOD_UART_TX_FIFO_SIZE_DEFAULT),
+    /* e.g. 7372800 paces Grant Searle's "/64" setting at 115200 baud */
+    DEFINE_PROP_UINT32("clock-hz", ZaphodUARTState, clock_hz, 0),
     DEFINE_PROP_END_OF_LIST()
 };
 
@@ -119,6 +452,7 @@ static void zaphod_uart_class_init(ObjectClass *oc, void *data)
 
     dc->desc= "Zaphod UART device";
     dc->realize= zaphod_uart_realizefn;
+    dc->unrealize= zaphod_uart_unrealizefn;
     dc->reset= zaphod_uart_reset;
 #if QEMU_VERSION_MAJOR < 5
     dc->props= zaphod_uart_properties;
@@ -130,7 +464,10 @@ static void zaphod_uart_class_init(ObjectClass *oc, void *data)
 
 static void zaphod_uart_instance_init(Object *obj)
 {
-    /* Nothing to do here */
+    ZaphodUARTState   *zus= ZAPHOD_UART(obj);
+
+    /* connected by the IOCore for the ACIA; unused for stdio */
+    qdev_init_gpio_out(DEVICE(obj), &zus->irq, 1);
 }
 
 
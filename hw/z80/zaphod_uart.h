@@ -12,6 +12,36 @@
 //#include "zaphod.h"
 
 #include "chardev/char-fe.h"
+#include "hw/irq.h"
+#include "qemu/fifo8.h"
+#include "qemu/timer.h"
+
+
+#define ZAPHOD_UART_RX_FIFO_SIZE_DEFAULT    64
+#define ZAPHOD_UART_TX_FIFO_SIZE_DEFAULT    256
+
+/* MC6850 control register (write, RS=0) */
+#define ACIA_CR_DIV_MASK        0x03    /* 00: /1, 01: /16, 10: /64 */
+#define ACIA_CR_MASTER_RESET    0x03
+#define ACIA_CR_WORD_MASK       0x1c    /* data/parity/stop bits */
+#define ACIA_CR_WORD_SHIFT      2
+#define ACIA_CR_TC_MASK         0x60    /* transmitter control */
+#define ACIA_CR_TC_TIE          0x20    /* RTS low, TX IRQ enabled */
+#define ACIA_CR_TC_RTS_HIGH     0x40    /* RTS high, TX IRQ disabled */
+#define ACIA_CR_TC_BREAK        0x60    /* RTS low, transmit break */
+#define ACIA_CR_RIE             0x80    /* RX IRQ enabled */
+/* 8N1, /64 with RX IRQ enabled - as set by Grant Searle's BASIC ROM */
+#define ACIA_CR_DEFAULT         0x96
+
+/* MC6850 status register (read, RS=0) */
+#define ACIA_SR_RDRF            0x01    /* receive data register full */
+#define ACIA_SR_TDRE            0x02    /* transmit data register empty */
+#define ACIA_SR_DCD             0x04    /* /DCD high: carrier lost */
+#define ACIA_SR_CTS             0x08    /* /CTS high: not clear to send */
+#define ACIA_SR_FE              0x10    /* framing error */
+#define ACIA_SR_OVRN            0x20    /* receiver overrun */
+#define ACIA_SR_PE              0x40    /* parity error */
+#define ACIA_SR_IRQ             0x80    /* /IRQ asserted */
 
 
 typedef DeviceClass ZaphodUARTClass;
@@ -20,8 +50,22 @@ typedef struct {
     DeviceState     parent;
 
     CharBackend     chr;
-    uint8_t         inkey;
-    bool            inkey_valid;
+    Fifo8           rx_fifo;        /* received, not yet read by guest */
+    uint32_t        rx_fifo_size;
+    Fifo8           tx_fifo;        /* written, not yet sent to chardev */
+    uint32_t        tx_fifo_size;
+    QEMUBH          *tx_bh;
+    guint           tx_watch_tag;
+
+    /* MC6850 registers */
+    uint8_t         acia_cr;
+    bool            overrun;
+    qemu_irq        irq;
+
+    /* optional pacing at the programmed character rate */
+    uint32_t        clock_hz;       /* TxCLK/RxCLK; 0 means unthrottled */
+    QEMUTimer       *tx_timer, *rx_timer;
+    bool            tx_busy, rx_busy;
 } ZaphodUARTState;
 
 
@@ -36,10 +80,13 @@ typedef struct {
 
 
 int zaphod_uart_portstatus(void *opaque);
+void zaphod_uart_set_control(ZaphodUARTState *zus, uint8_t value);
 #if defined(CONFIG_ZAPHOD_HAS_IOCORE)
 int zaphod_uart_can_receive(void *opaque);
+bool zaphod_uart_has_inkey(void *opaque);
 uint8_t zaphod_uart_get_inkey(void *opaque, bool read_and_clear);
 void zaphod_uart_set_inkey(void *opaque, uint8_t val, bool is_data);
+bool zaphod_uart_push_input(ZaphodUARTState *zus, const uint8_t *buf, int len);
 #endif
 
 void zaphod_uart_putchar(ZaphodUARTState *zus, const unsigned char ch);
@@ -465,6 +465,7 @@ int print_insn_riscv32          (bfd_vma, disassemble_info*);
 int print_insn_riscv64          (bfd_vma, disassemble_info*);
 int print_insn_rx(bfd_vma, disassemble_info *);
 int print_insn_z80		(bfd_vma, disassemble_info *);
+int print_insn_z80_buf(bfd_vma, const uint8_t *, int, char *, size_t);
 
 #if 0
 /* Fetch the disassembler for a given BFD, if that support is available.  */
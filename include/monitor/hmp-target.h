@@ -48,5 +48,6 @@ void hmp_info_tlb(Monitor *mon, const QDict *qdict);
 void hmp_mce(Monitor *mon, const QDict *qdict);
 void hmp_info_local_apic(Monitor *mon, const QDict *qdict);
 void hmp_info_io_apic(Monitor *mon, const QDict *qdict);
+void hmp_info_tbtrace(Monitor *mon, const QDict *qdict);
 
 #endif /* MONITOR_HMP_TARGET_H */
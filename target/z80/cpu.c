@@ -28,8 +28,10 @@
 #include "qemu/error-report.h"
 #include "exec/exec-all.h"
 #include "qemu/qemu-print.h"
+#include "hw/qdev-properties.h"
 #ifndef CONFIG_USER_ONLY
 #include "sysemu/reset.h"
+#include "exec/address-spaces.h"
 #endif
 
 
@@ -96,6 +98,9 @@ static void z80_cpu_initfn(Object *obj)
     Z80CPU *cpu = Z80_CPU(obj);
 
     cpu_set_cpustate_pointers(cpu);
+#if !defined(CONFIG_USER_ONLY)
+    cpu->io_as = &address_space_io;
+#endif
 }
 
 
@@ -253,10 +258,22 @@ int z80_cpu_pending_interrupt(CPUState *cs, int interrupt_request)
     /* [QEmu v5] return the interrupt designator (or zero if none
      * pending) so that it can be queried.
      * TODO: test/return CPU_INTERRUPT_NMI?
+     * /INT is level sensitive: it stays requested while any device
+     * drives it, but is ignored while IFF1 is clear
      */
+    Z80CPU *cpu = Z80_CPU(cs);
+
+    if (!cpu->env.iff1)
+        return 0;
     return cs->interrupt_request & CPU_INTERRUPT_HARD;
 }
 
+static Property z80_cpu_properties[] = {
+    /* "-cpu z80,tb-trace=off" saves the ring updates */
+    DEFINE_PROP_BOOL("tb-trace", Z80CPU, env.tb_trace, true),
+    DEFINE_PROP_END_OF_LIST()
+};
+
 static void z80_cpu_class_init(ObjectClass *oc, void *data)
 {
     Z80CPUClass *zcc = Z80_CPU_CLASS(oc);
@@ -270,6 +287,7 @@ static void z80_cpu_class_init(ObjectClass *oc, void *data)
                                     &zcc->parent_unrealize);
 
     device_class_set_parent_reset(dc, z80_cpu_reset, &zcc->parent_reset);
+    device_class_set_props(dc, z80_cpu_properties);
     cc->reset_dump_flags = 0;   /* i386: CPU_DUMP_FPU | CPU_DUMP_CCOP */
 
     cc->class_by_name = z80_cpu_class_by_name;
@@ -36,6 +36,11 @@
 #include "cpu-qom.h"
 #include "exec/cpu-defs.h"
 
+/* Z80 systems share no writable memory between CPUs (the Zaphod
+ * cluster's nodes only share ROM), so MTTCG needs no barriers
+ */
+#define TCG_GUEST_DEFAULT_MO    (0)
+
 
 /* Maximum instruction code size */
 #define TARGET_MAX_INSN_SIZE 16     /* from x86, z80 probably 4 (w/ IX+offs) */
@@ -95,9 +100,20 @@ enum {
 
 #define EXCP_ILLOP          0       /* i386: EXCP06_ILLOP (n=6) */
 #define EXCP_KERNEL_TRAP    1
+#define EXCP_INSN_LIMIT     2       /* instruction budget exhausted */
 /* TODO: need conventional exception for handling NMI? */
 
 
+/* Copy/fill loops the translator hands to helper_loop_idiom() */
+enum {
+    Z80_LOOP_COPY_BC,   /* ld a,(hl); ld (de),a; inc hl; inc de;
+                         * dec bc; ld a,b; or c; jr nz */
+    Z80_LOOP_COPY_B,    /* ld a,(hl); ld (de),a; inc hl; inc de; djnz */
+    Z80_LOOP_FILL_BC,   /* ld (hl),r|n; inc hl; dec bc; ld a,b; or c; jr nz */
+    Z80_LOOP_FILL_B     /* ld (hl),r|n; inc hl; djnz */
+};
+
+
 /* TODO: interrupt defines */
 
 #define CPU_NB_REGS 15
@@ -119,6 +135,8 @@ typedef enum {
 
 /* CPUZ80State */
 
+#define Z80_TB_TRACE_SIZE   256     /* power of two */
+
 typedef struct CPUZ80State {
     target_ulong    t0, t1;	/* TODO: moves to DisasContext? */
     target_ulong    a0;
@@ -136,10 +154,26 @@ typedef struct CPUZ80State {
     int exception_is_int;
     //target_ulong exception_next_eip;
 
+    /* execution accounting, when enabled (see 'accounting' below).
+     * Whole blocks are counted as they start, so these are upper
+     * bounds if a block stops early (on an exception, say)
+     */
+    uint64_t        insns;      /* instructions retired */
+    uint64_t        tstates;    /* clock cycles, per documented timings */
+
     struct {} end_reset_fields;
     /* Fields after this point are preserved across CPU reset. */
 
     int model;
+    bool            accounting; /* translate with insns/tstates updates */
+    uint64_t        insn_limit; /* EXCP_INSN_LIMIT past this many insns */
+
+    /* entry PCs of the most recent blocks, for post-mortems; kept
+     * over reset so that a guest which reset itself can be traced
+     */
+    bool            tb_trace;   /* translate with the ring updates */
+    uint32_t        tb_trace_pos;   /* blocks entered (wraps) */
+    uint16_t        tb_trace_ring[Z80_TB_TRACE_SIZE];
 } CPUZ80State;
 
 
@@ -152,6 +186,9 @@ struct Z80CPU {
     /*< public >*/
     CPUNegativeOffsetState neg;
     CPUZ80State env;
+#if !defined(CONFIG_USER_ONLY)
+    AddressSpace *io_as;    /* IN/OUT; a board may give each CPU its own */
+#endif
 };
 
 
@@ -161,9 +198,13 @@ bool z80_cpu_exec_interrupt(CPUState *cpu, int int_req);
 int z80_cpu_pending_interrupt(CPUState *cs, int interrupt_request);
 
 void z80_cpu_dump_state(CPUState *cs, FILE *f, int flags);
+void z80_cpu_dump_tb_trace(CPUState *cs, FILE *f);
 
 #if !defined(CONFIG_USER_ONLY)
 hwaddr z80_cpu_get_phys_page_debug(CPUState *cs, vaddr addr);
+
+/* provided by the board: data bus value for an interrupt acknowledge */
+int cpu_get_pic_interrupt(CPUZ80State *env);
 #endif
 
 
@@ -175,6 +216,14 @@ void z80_cpu_list(void);
 int cpu_z80_signal_handler(int host_signum, void *pinfo, void *puc);
 
 
+#ifndef CONFIG_USER_ONLY
+/* warm_tb.c */
+typedef bool (*Z80WarmFilterFn)(void *opaque, uint16_t pc);
+void z80_cpu_warm_tb_cache(Z80CPU *cpu, const uint16_t *entry, int count,
+                           Z80WarmFilterFn filter, void *opaque);
+#endif
+
+
 /* excp_helper.c */
 bool z80_cpu_tlb_fill(CPUState *cs, vaddr address, int size,
                       MMUAccessType access_type, int mmu_idx,
@@ -64,6 +64,35 @@ void z80_cpu_dump_state(CPUState *cs, FILE *f, int flags)
                     env->imode, env->iff1, env->iff2, env->regs[R_I], env->regs[R_R]);
 }
 
+/* Lists the entry PCs in the TB ring, oldest first. The vCPU may
+ * still be writing it when asked from the monitor, in which case the
+ * oldest entries might already be replaced
+ */
+void z80_cpu_dump_tb_trace(CPUState *cs, FILE *f)
+{
+    CPUZ80State *env= &Z80_CPU(cs)->env;
+    uint32_t pos= atomic_read(&env->tb_trace_pos);
+    uint32_t count= MIN(pos, Z80_TB_TRACE_SIZE);
+    uint32_t n;
+
+    if (!env->tb_trace)
+    {
+        qemu_fprintf(f, "TB trace disabled for CPU#%d\n", cs->cpu_index);
+        return;
+    }
+
+    qemu_fprintf(f, "TB trace for CPU#%d: last %u of %u blocks entered, oldest first\n",
+                    cs->cpu_index, count, pos);
+    for (n= 0; n < count; n++)
+    {
+        uint16_t pc= atomic_read(&env->tb_trace_ring[(pos - count + n) & (Z80_TB_TRACE_SIZE - 1)]);
+
+        qemu_fprintf(f, "%s%04x", (n % 16) ? " " : "  ", pc);
+        if ((n % 16) == 15 || n == count - 1)
+            qemu_fprintf(f, "\n");
+    }
+}
+
 #if !defined(CONFIG_USER_ONLY)
 hwaddr z80_cpu_get_phys_page_debug(CPUState *cs, vaddr addr)
 {
@@ -127,16 +156,20 @@ static void do_interrupt_all(Z80CPU *cpu, int intno)
     /* when an interrupt occurs, iff1 and iff2 are reset, disabling interrupts */
     /* when an NMI occurs, iff1 is reset. iff2 is left unchanged */
 
-    uint8_t d;
+    /* 'intno' is the value on the data bus: 0xff if nothing drives it */
+    uint8_t d = intno;
     switch (env->imode) {
     case 0:
-        /* XXX: assuming 0xff on data bus */
+        /* XXX: only RST opcodes are recognised */
+        if ((d & 0xc7) == 0xc7) {
+            env->pc = d & 0x38;
+            break;
+        }
+        /* fall through */
     case 1:
         env->pc = 0x0038;
         break;
     case 2:
-        /* XXX: assuming 0xff on data bus */
-        d = 0xff;
 #if 0	/* stw_kernel() missing without MMU modes */
         env->pc = lduw_kernel((env->regs[R_I] << 8) | d);
 #else
@@ -157,6 +190,7 @@ void z80_cpu_do_interrupt(CPUState *cs)
      */
     if (cs->exception_index == EXCP_ILLOP)
     {
+        z80_cpu_dump_tb_trace(cs, stderr);
         cpu_abort(cs, "EXCP_ILLOP at pc=0x%04x", env->pc);
     }
 
@@ -189,7 +223,8 @@ void z80_cpu_do_interrupt(CPUState *cs)
         /* successfully delivered */
         env->old_exception = -1;
 #else
-        do_interrupt_all(cpu, cs->exception_index   /* ? intno */);
+        /* exceptions are not bus interrupts: nothing on the bus */
+        do_interrupt_all(cpu, 0xff);
 #endif
     //}
 #endif
@@ -240,14 +275,24 @@ bool z80_cpu_exec_interrupt(CPUState *cs, int interrupt_request)
         break;
 #endif
     case CPU_INTERRUPT_HARD:
-        cs->interrupt_request &= ~CPU_INTERRUPT_HARD;
+        /* NB. CPU_INTERRUPT_HARD is not cleared here: the board
+         * lowers it once no device asserts /INT, and accepting the
+         * interrupt clears IFF1 which masks it meanwhile
+         */
         {   /* NB. for INTERRUPT_HARD (and INTERRUPT_VIRQ),
              * target-i386 determines an 'intno' value to pass to
              * do_interrupt_x86_hardirq() (which wraps
              * do_interrupt_all()). It will be -1 (usermode) or >= 0
              */
             Z80CPU *cpu = Z80_CPU(cs);
-            do_interrupt_all(cpu, 0 /* intno */);
+            int intno = 0xff;
+#if !defined(CONFIG_USER_ONLY)
+            /* only run an acknowledge cycle if it will be taken */
+            if (cpu->env.iff1) {
+                intno = cpu_get_pic_interrupt(&cpu->env);
+            }
+#endif
+            do_interrupt_all(cpu, intno);
         }
         break;
 
@@ -34,6 +34,10 @@ DEF_HELPER_1(reset_inhibit_irq, void, env)
 
 DEF_HELPER_2(movl_pc_im, void, env, int)
 
+#ifdef CONFIG_USER_ONLY
+DEF_HELPER_2(afl_maybe_log, void, env, i32)
+#endif
+
 
 /* In/Out */
 
@@ -45,7 +49,6 @@ DEF_HELPER_1(out_T0_bc, void, env)
 
 /* Misc */
 
-DEF_HELPER_2(bit_T0, void, env, int)
 DEF_HELPER_1(jmp_T0, void, env)
 DEF_HELPER_3(djnz, void, env, int, int)
 
@@ -64,14 +67,6 @@ DEF_HELPER_1(cp_cc, void, env)
 
 /* Rotation/shifts */
 
-DEF_HELPER_1(rlc_T0_cc, void, env)
-DEF_HELPER_1(rrc_T0_cc, void, env)
-DEF_HELPER_1(rl_T0_cc, void, env)
-DEF_HELPER_1(rr_T0_cc, void, env)
-DEF_HELPER_1(sla_T0_cc, void, env)
-DEF_HELPER_1(sra_T0_cc, void, env)
-DEF_HELPER_1(sll_T0_cc, void, env)
-DEF_HELPER_1(srl_T0_cc, void, env)
 DEF_HELPER_1(rld_cc, void, env)
 DEF_HELPER_1(rrd_cc, void, env)
 
@@ -88,6 +83,7 @@ DEF_HELPER_2(bli_cp_rep, void, env, int)
 DEF_HELPER_2(bli_io_T0_inc, void, env, int)
 DEF_HELPER_2(bli_io_T0_dec, void, env, int)
 DEF_HELPER_2(bli_io_rep, void, env, i32)
+DEF_HELPER_4(loop_idiom, void, env, i32, i32, i32)
 
 
 /* Misc */
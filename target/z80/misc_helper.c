@@ -24,6 +24,9 @@
 
 #include "exec/helper-proto.h"
 #include "exec/exec-all.h"
+#ifdef CONFIG_USER_ONLY
+#include "qemu.h"       /* bblbrx fuzzing support */
+#endif
 
 
 void helper_halt(CPUZ80State *env)
@@ -55,3 +58,11 @@ void helper_debug(CPUZ80State *env)
     cpu_loop_exit(cs);
 #endif
 }
+
+
+#ifdef CONFIG_USER_ONLY
+void helper_afl_maybe_log(CPUZ80State *env, uint32_t cur_loc)
+{
+    afl_maybe_log(cur_loc);
+}
+#endif
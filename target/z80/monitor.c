@@ -0,0 +1,47 @@
+/*
+ * QEmu Z80 CPU - monitor commands
+ * vim: ft=c sw=4 ts=4 et :
+ *
+ *  Copyright (c) 2018-2023 William Towle <william_towle@yahoo.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
+ */
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+#include "monitor/monitor.h"
+#include "monitor/hmp-target.h"
+#include "monitor/hmp.h"
+#include "qapi/qmp/qdict.h"
+
+void hmp_info_tbtrace(Monitor *mon, const QDict *qdict)
+{
+    bool        all_cpus= qdict_get_try_bool(qdict, "cpustate_all", false);
+    CPUState    *cs;
+
+    if (all_cpus)
+    {
+        CPU_FOREACH(cs)
+            z80_cpu_dump_tb_trace(cs, NULL);
+        return;
+    }
+
+    if ((cs= mon_get_cpu()) == NULL)
+    {
+        monitor_printf(mon, "No CPU available\n");
+        return;
+    }
+    z80_cpu_dump_tb_trace(cs, NULL);
+}
@@ -26,6 +26,7 @@
 
 #include "qemu/error-report.h"
 #include "exec/helper-proto.h"
+#include "exec/cpu_ldst.h"
 #include "exec.h"
 #include "exec/ioport.h"
 #include "exec/address-spaces.h"
@@ -129,7 +130,7 @@ void z80_cpu_outb(CPUZ80State *env, uint16_t port, uint8_t data)
 #else	/* follows target/i386 helper_outb() */
 //;DPRINTF("%s(): called with port=0x%04x, data=0x%02x\n", __func__, port, data);
     /* A7-A0 selects one of the 256 possible ports; A8-15 is ignored */
-    address_space_stb(&address_space_io, port & 0xff, data,
+    address_space_stb(env_archcpu(env)->io_as, port & 0xff, data,
                       cpu_get_mem_attrs(env), NULL);
 #endif
 }
@@ -143,7 +144,7 @@ uint8_t z80_cpu_inb(CPUZ80State *env, uint16_t port)
 #else   /* follows target/i386 helper_inb() */
 //;DPRINTF("%s(): called with port=0x%04x\n", __func__, port);
     /* A7-A0 selects one of the 256 possible ports; A8-15 is ignored */
-    return address_space_ldub(&address_space_io, port & 0xff,
+    return address_space_ldub(env_archcpu(env)->io_as, port & 0xff,
                               cpu_get_mem_attrs(env), NULL);
 #endif
 }
@@ -191,16 +192,6 @@ void helper_out_T0_bc(CPUZ80State *env)
 
 /* Misc */
 
-void helper_bit_T0(CPUZ80State *env, int val)
-{
-    int sf, zf, pf;
-
-    sf = (T0 & val & 0x80) ? CC_S : 0;
-    zf = (T0 & val) ? 0 : CC_Z;
-    pf = (T0 & val) ? 0 : CC_P;
-    F = (F & CC_C) | sf | zf | CC_H | pf;
-}
-
 void helper_jmp_T0(CPUZ80State *env)
 {
     PC = T0;
@@ -211,6 +202,7 @@ void helper_djnz(CPUZ80State *env, int pc1, int pc2)
     BC = (uint16_t)(BC - 0x0100);
     if (BC & 0xff00) {
         PC = (uint16_t)pc1;
+        env->tstates += 5;
     } else {
         PC = (uint16_t)pc2;
     }
@@ -349,119 +341,6 @@ void helper_cp_cc(CPUZ80State *env)
 
 /* Rotation/shift operations */
 
-void helper_rlc_T0_cc(CPUZ80State *env)
-{
-    int sf, zf, pf, cf;
-    int tmp;
-
-    tmp = T0;
-    T0 = (uint8_t)((T0 << 1) | !!(T0 & 0x80));
-    sf = (T0 & 0x80) ? CC_S : 0;
-    zf = T0 ? 0 : CC_Z;
-    pf = parity_table[T0];
-    cf = (tmp & 0x80) ? CC_C : 0;
-    F = sf | zf | pf | cf;
-}
-
-void helper_rrc_T0_cc(CPUZ80State *env)
-{
-    int sf, zf, pf, cf;
-    int tmp;
-
-    tmp = T0;
-    T0 = (uint8_t)((T0 >> 1) | ((tmp & 0x01) ? 0x80 : 0));
-    sf = (T0 & 0x80) ? CC_S : 0;
-    zf = T0 ? 0 : CC_Z;
-    pf = parity_table[T0];
-    cf = (tmp & 0x01) ? CC_C : 0;
-    F = sf | zf | pf | cf;
-}
-
-void helper_rl_T0_cc(CPUZ80State *env)
-{
-    int sf, zf, pf, cf;
-    int tmp;
-
-    tmp = T0;
-    T0 = (uint8_t)((T0 << 1) | !!(F & CC_C));
-    sf = (T0 & 0x80) ? CC_S : 0;
-    zf = T0 ? 0 : CC_Z;
-    pf = parity_table[T0];
-    cf = (tmp & 0x80) ? CC_C : 0;
-    F = sf | zf | pf | cf;
-}
-
-void helper_rr_T0_cc(CPUZ80State *env)
-{
-    int sf, zf, pf, cf;
-    int tmp;
-
-    tmp = T0;
-    T0 = (uint8_t)((T0 >> 1) | ((F & CC_C) ? 0x80 : 0));
-    sf = (T0 & 0x80) ? CC_S : 0;
-    zf = T0 ? 0 : CC_Z;
-    pf = parity_table[T0];
-    cf = (tmp & 0x01) ? CC_C : 0;
-    F = sf | zf | pf | cf;
-}
-
-void helper_sla_T0_cc(CPUZ80State *env)
-{
-    int sf, zf, pf, cf;
-    int tmp;
-
-    tmp = T0;
-    T0 = (uint8_t)(T0 << 1);
-    sf = (T0 & 0x80) ? CC_S : 0;
-    zf = T0 ? 0 : CC_Z;
-    pf = parity_table[T0];
-    cf = (tmp & 0x80) ? CC_C : 0;
-    F = sf | zf | pf | cf;
-}
-
-void helper_sra_T0_cc(CPUZ80State *env)
-{
-    int sf, zf, pf, cf;
-    int tmp;
-
-    tmp = T0;
-    T0 = (uint8_t)((T0 >> 1) | (T0 & 0x80));
-    sf = (T0 & 0x80) ? CC_S : 0;
-    zf = T0 ? 0 : CC_Z;
-    pf = parity_table[T0];
-    cf = (tmp & 0x01) ? CC_C : 0;
-    F = sf | zf | pf | cf;
-}
-
-/* Z80-specific: R800 has tst instruction */
-void helper_sll_T0_cc(CPUZ80State *env)
-{
-    int sf, zf, pf, cf;
-    int tmp;
-
-    tmp = T0;
-    T0 = (uint8_t)((T0 << 1) | 1); /* Yes -- bit 0 is *set* */
-    sf = (T0 & 0x80) ? CC_S : 0;
-    zf = T0 ? 0 : CC_Z;
-    pf = parity_table[T0];
-    cf = (tmp & 0x80) ? CC_C : 0;
-    F = sf | zf | pf | cf;
-}
-
-void helper_srl_T0_cc(CPUZ80State *env)
-{
-    int sf, zf, pf, cf;
-    int tmp;
-
-    tmp = T0;
-    T0 = (uint8_t)(T0 >> 1);
-    sf = (T0 & 0x80) ? CC_S : 0;
-    zf = T0 ? 0 : CC_Z;
-    pf = parity_table[T0];
-    cf = (tmp & 0x01) ? CC_C : 0;
-    F = sf | zf | pf | cf;
-}
-
 void helper_rld_cc(CPUZ80State *env)
 {
     int sf, zf, pf;
@@ -523,6 +402,7 @@ void helper_bli_ld_rep(CPUZ80State *env, int next_pc)
 {
     if (BC) {
         PC = (uint16_t)(next_pc - 2);
+        env->tstates += 5;
     } else {
         PC = next_pc;
     }
@@ -569,6 +449,7 @@ void helper_bli_cp_rep(CPUZ80State *env, int next_pc)
 {
     if (BC && T0 != A) {
         PC = (uint16_t)(next_pc - 2);
+        env->tstates += 5;
     } else {
         PC = next_pc;
     }
@@ -608,12 +489,93 @@ void helper_bli_io_rep(CPUZ80State *env, uint32_t next_pc)
 {
     if (F & CC_Z) {
         PC = (uint16_t)(next_pc - 2);
+        env->tstates += 5;
     } else {
         PC = next_pc;
     }
 }
 
 
+/* Loop idioms */
+
+/* Run all but the last iteration of a copy/fill loop recognised by
+ * the translator, which leaves the translated loop body to perform
+ * the final one - so A and the flags, which depend only on that
+ * iteration, come out exactly as they would have. We run fewer
+ * iterations (or none, and let the loop proceed as normal) rather
+ * than cross a page, touch anything that isn't plain RAM (including
+ * pages holding translated code, in softmmu), overrun an instruction
+ * budget or hold off a pending interrupt.
+ * 'cost' gives the instructions and T-states per iteration, packed
+ * as (insns << 8) | tstates
+ */
+void helper_loop_idiom(CPUZ80State *env, uint32_t kind, uint32_t value,
+                        uint32_t cost)
+{
+    CPUState    *cs = env_cpu(env);
+    int         mmu_idx = cpu_mmu_index(env, false);
+    bool        copy = (kind == Z80_LOOP_COPY_BC || kind == Z80_LOOP_COPY_B);
+    bool        by_bc = (kind == Z80_LOOP_COPY_BC || kind == Z80_LOOP_FILL_BC);
+    uint32_t    dst_addr = copy ? DE : HL;
+    uint32_t    count, k, n;
+    uint8_t     *src = NULL, *dst;
+
+    if (cs->interrupt_request || atomic_read(&cs->exit_request)) {
+        return;
+    }
+
+    if (by_bc) {
+        count = BC ? BC : 0x10000;
+    } else {
+        count = (BC >> 8) ? (BC >> 8) : 0x100;
+    }
+
+    k = count - 1;
+    k = MIN(k, TARGET_PAGE_SIZE - (dst_addr & ~TARGET_PAGE_MASK));
+    if (copy) {
+        k = MIN(k, TARGET_PAGE_SIZE - (HL & ~TARGET_PAGE_MASK));
+    }
+    if (env->accounting) {
+        k = MIN(k, (env->insn_limit - env->insns) / (cost >> 8));
+    }
+    if (k == 0) {
+        return;
+    }
+
+    dst = tlb_vaddr_to_host(env, dst_addr, MMU_DATA_STORE, mmu_idx);
+    if (copy) {
+        src = tlb_vaddr_to_host(env, HL, MMU_DATA_LOAD, mmu_idx);
+    }
+    if (dst == NULL || (copy && src == NULL)) {
+        return;
+    }
+
+    if (copy) {
+        if (DE > HL && DE < HL + k) {
+            /* overlapping: replicate byte-at-a-time semantics */
+            for (n = 0; n < k; n++) {
+                dst[n] = src[n];
+            }
+        } else {
+            memmove(dst, src, k);
+        }
+        DE = (uint16_t)(DE + k);
+    } else {
+        memset(dst, value, k);
+    }
+    HL = (uint16_t)(HL + k);
+
+    if (by_bc) {
+        BC = (uint16_t)(BC - k);
+    } else {
+        BC = (uint16_t)(BC - (k << 8));
+    }
+
+    env->insns += (uint64_t)k * (cost >> 8);
+    env->tstates += (uint64_t)k * (cost & 0xff);
+}
+
+
 /* Misc */
 
 void helper_rlca_cc(CPUZ80State *env)
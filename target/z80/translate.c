@@ -86,8 +86,19 @@ typedef struct DisasContext {
     bool cc_op_dirty;
 #endif
     uint32_t        flags; /* all execution flags */
+
+    /* execution accounting: block totals, patched into the code
+     * emitted at block start once translation is complete
+     */
+    bool            accounting;
+    int             acct_insns;
+    int             acct_tstates;
+    TCGOp           *acct_insns_op;
+    TCGOp           *acct_tstates_op;
+    bool            tb_trace;       /* record entry in the TB ring */
 #ifdef CONFIG_USER_ONLY
     target_ulong    magic_ramloc;
+    bool            afl_instrument;
 #endif
 } DisasContext;
 
@@ -634,20 +645,111 @@ static const char *const rot[8] = {
     "srl",
 };
 
-//typedef void (rot_helper_func)(void);
-/* [QEmu v2+] to suit helpers with CPUZ80State* parameter */
-typedef void (rot_helper_func)(TCGv_env cpu_env);
-
-static rot_helper_func *const gen_rot_T0[8] = {
-    gen_helper_rlc_T0_cc,
-    gen_helper_rrc_T0_cc,
-    gen_helper_rl_T0_cc,
-    gen_helper_rr_T0_cc,
-    gen_helper_sla_T0_cc,
-    gen_helper_sra_T0_cc,
-    gen_helper_sll_T0_cc,
-    gen_helper_srl_T0_cc,
-};
+/* S, Z and P/V flags for each possible result, as set by the CB-prefix
+ * rotates/shifts. Built by tcg_z80_init() and indexed from generated
+ * code
+ */
+static uint8_t szp_table[256];
+
+/* F = szp_table[v] | cf, for 8-bit 'v' and 'cf' of 0 or CC_C */
+static void gen_szp_flags(TCGv v, TCGv cf)
+{
+    TCGv_ptr    ptr= tcg_temp_new_ptr();
+    TCGv        tmp= tcg_temp_new();
+
+    tcg_gen_ext_i32_ptr(ptr, v);
+    tcg_gen_add_ptr(ptr, ptr, tcg_const_ptr(szp_table));
+    tcg_gen_ld8u_tl(tmp, ptr, 0);
+    tcg_gen_or_tl(tmp, tmp, cf);
+    gen_movb_F_v(tmp);
+
+    tcg_temp_free(tmp);
+    tcg_temp_free_ptr(ptr);
+}
+
+/* Rotate/shift 8-bit 'v' in place by rot[op], setting flags */
+static void gen_rot(int op, TCGv v)
+{
+    TCGv    cf= tcg_temp_new();
+    TCGv    res= tcg_temp_new();
+    TCGv    tmp= tcg_temp_new();
+
+    if (op & 1)
+    {   /* rrc, rr, sra, srl */
+        tcg_gen_andi_tl(cf, v, 0x01);
+        tcg_gen_shri_tl(res, v, 1);
+        switch (op)
+        {
+        case 1:     /* rrc */
+            tcg_gen_shli_tl(tmp, cf, 7);
+            tcg_gen_or_tl(res, res, tmp);
+            break;
+        case 3:     /* rr */
+            gen_movb_v_F(tmp);
+            tcg_gen_andi_tl(tmp, tmp, CC_C);
+            tcg_gen_shli_tl(tmp, tmp, 7);
+            tcg_gen_or_tl(res, res, tmp);
+            break;
+        case 5:     /* sra */
+            tcg_gen_andi_tl(tmp, v, 0x80);
+            tcg_gen_or_tl(res, res, tmp);
+            break;
+        }
+    }
+    else
+    {   /* rlc, rl, sla, sll */
+        tcg_gen_shri_tl(cf, v, 7);
+        tcg_gen_shli_tl(res, v, 1);
+        switch (op)
+        {
+        case 0:     /* rlc */
+            tcg_gen_or_tl(res, res, cf);
+            break;
+        case 2:     /* rl */
+            gen_movb_v_F(tmp);
+            tcg_gen_andi_tl(tmp, tmp, CC_C);
+            tcg_gen_or_tl(res, res, tmp);
+            break;
+        case 6:     /* sll: bit 0 is *set* */
+            tcg_gen_ori_tl(res, res, 0x01);
+            break;
+        }
+        tcg_gen_andi_tl(res, res, 0xff);
+    }
+
+    tcg_gen_mov_tl(v, res);
+    gen_szp_flags(v, cf);       /* CC_C is bit 0 */
+
+    tcg_temp_free(tmp);
+    tcg_temp_free(res);
+    tcg_temp_free(cf);
+}
+
+/* bit n,v: Z and P/V set if the bit is clear, S if it is bit 7 and
+ * set, H always set and C preserved
+ */
+static void gen_bit(int n, TCGv v)
+{
+    TCGv    f= tcg_temp_new();
+    TCGv    t= tcg_temp_new();
+    TCGv    zf= tcg_temp_new();
+
+    tcg_gen_andi_tl(t, v, 1 << n);
+    tcg_gen_setcondi_tl(TCG_COND_EQ, zf, t, 0);
+    tcg_gen_muli_tl(zf, zf, CC_Z | CC_P);
+    tcg_gen_andi_tl(t, t, CC_S);    /* CC_S is bit 7 */
+
+    gen_movb_v_F(f);
+    tcg_gen_andi_tl(f, f, CC_C);
+    tcg_gen_ori_tl(f, f, CC_H);
+    tcg_gen_or_tl(f, f, zf);
+    tcg_gen_or_tl(f, f, t);
+    gen_movb_F_v(f);
+
+    tcg_temp_free(zf);
+    tcg_temp_free(t);
+    tcg_temp_free(f);
+}
 
 
 /* Block instructions */
@@ -681,8 +783,11 @@ static inline void gen_cond_jump(int cc, TCGLabel *l1)
     tcg_gen_brcondi_tl((cc & 1) ? TCG_COND_NE : TCG_COND_EQ, cpu_T[0], 0, l1);
 }
 
+static void gen_add_tstates(DisasContext *s, int n);
+
 static inline void gen_jcc(DisasContext *s, int cc,
-                                target_ulong val, target_ulong next_pc)
+                                target_ulong val, target_ulong next_pc,
+                                int taken_tstates)
 {
     //TranslationBlock *tb;     /* as repo.or.cz: "set but unused" */
     TCGLabel *l1;
@@ -694,6 +799,7 @@ static inline void gen_jcc(DisasContext *s, int cc,
     gen_goto_tb(s, 0, next_pc);
 
     gen_set_label(l1);
+    gen_add_tstates(s, taken_tstates);
     gen_goto_tb(s, 1, val);
 
 #if QEMU_VERSION_MAJOR < 2  /* gen_eob() does this for us */
@@ -714,6 +820,7 @@ static inline void gen_callcc(DisasContext *s, int cc,
     gen_goto_tb(s, 0, next_pc);
 
     gen_set_label(l1);
+    gen_add_tstates(s, 7);
     tcg_gen_movi_tl(cpu_T[0], next_pc);
     gen_pushw(cpu_T[0]);
     gen_goto_tb(s, 1, val);
@@ -734,6 +841,7 @@ static inline void gen_retcc(DisasContext *s, int cc,
     gen_cond_jump(cc, l1);
     gen_goto_tb(s, 0, next_pc);
     gen_set_label(l1);
+    gen_add_tstates(s, 6);
     gen_popw(cpu_T[0]);
     gen_helper_jmp_T0(cpu_env);
     gen_eob(s);
@@ -845,6 +953,313 @@ static inline uint16_t z80_lduw_code(CPUZ80State *env, DisasContext *s)
 }
 
 
+/* Execution accounting */
+
+/* Documented Z80 T-states for unprefixed opcodes. Conditional jr/
+ * call/ret and djnz are given their not-taken costs; the extra
+ * cycles for taken branches and repeating block instructions are
+ * added as they happen
+ */
+static const uint8_t tstates_main[256]= {
+    4, 10,  7,  6,  4,  4,  7,  4,  4, 11,  7,  6,  4,  4,  7,  4,   /* 00 */
+    8, 10,  7,  6,  4,  4,  7,  4, 12, 11,  7,  6,  4,  4,  7,  4,   /* 10 */
+    7, 10, 16,  6,  4,  4,  7,  4,  7, 11, 16,  6,  4,  4,  7,  4,   /* 20 */
+    7, 10, 13,  6, 11, 11, 10,  4,  7, 11, 13,  6,  4,  4,  7,  4,   /* 30 */
+    4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,   /* 40 */
+    4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,   /* 50 */
+    4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,   /* 60 */
+    7,  7,  7,  7,  7,  7,  4,  7,  4,  4,  4,  4,  4,  4,  7,  4,   /* 70 */
+    4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,   /* 80 */
+    4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,   /* 90 */
+    4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,   /* A0 */
+    4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,   /* B0 */
+    5, 10, 10, 10, 10, 11,  7, 11,  5, 10, 10,  0, 10, 17,  7, 11,   /* C0 */
+    5, 10, 10, 11, 10, 11,  7, 11,  5,  4, 10, 11, 10,  0,  7, 11,   /* D0 */
+    5, 10, 10, 19, 10, 11,  7, 11,  5,  4, 10,  4, 10,  0,  7, 11,   /* E0 */
+    5, 10, 10,  4, 10, 11,  7, 11,  5,  6, 10,  4, 10,  0,  7, 11,   /* F0 */
+};
+
+/* opcodes whose (HL) operand becomes (IX+d)/(IY+d) under DD/FD */
+static bool uses_hl_mem(unsigned int b)
+{
+    if (b == 0x34 || b == 0x35 || b == 0x36)
+        return true;
+    if (b >= 0x40 && b < 0x80 && b != 0x76)
+        return (b & 0x07) == 6 || (b & 0x38) == 0x30;
+    if (b >= 0x80 && b < 0xc0)
+        return (b & 0x07) == 6;
+    return false;
+}
+
+static int z80_insn_tstates(CPUZ80State *env, target_ulong pc)
+{
+    unsigned int    b, x, y, z;
+    bool            indexed= false;
+    int             t= 0;
+
+    /* each DD/FD costs 4, and only the last one seen takes effect */
+    for (;;)
+    {
+        b= cpu_ldub_code(env, pc);
+        pc= (pc + 1) & 0xffff;
+        if (b != 0xdd && b != 0xfd)
+            break;
+        indexed= true;
+        t+= 4;
+    }
+
+    if (b == 0xcb)
+    {
+        if (indexed)
+        {   /* DDCB/FDCB: displacement precedes the opcode */
+            b= cpu_ldub_code(env, (pc + 1) & 0xffff);
+            return t + (((b & 0xc0) == 0x40) ? 16 : 19);
+        }
+        b= cpu_ldub_code(env, pc);
+        if ((b & 0x07) == 6)
+            return t + (((b & 0xc0) == 0x40) ? 12 : 15);
+        return t + 8;
+    }
+
+    if (b == 0xed)
+    {
+        static const uint8_t tstates_ed_x1[8]= { 12, 12, 15, 20, 8, 14, 8, 9 };
+
+        b= cpu_ldub_code(env, pc);
+        x= b >> 6;
+        y= (b >> 3) & 0x07;
+        z= b & 0x07;
+        if (x == 1)
+        {
+            if (z == 7 && (y == 4 || y == 5))
+                return t + 18;      /* rrd, rld */
+            if (z == 7 && y >= 6)
+                return t + 8;
+            return t + tstates_ed_x1[z];
+        }
+        if (x == 2 && y >= 4 && z <= 3)
+            return t + 16;          /* block instructions */
+        return t + 8;
+    }
+
+    if (indexed && uses_hl_mem(b))
+        return t + tstates_main[b] + ((b == 0x36) ? 5 : 8);
+    return t + tstates_main[b];
+}
+
+static void gen_add_tstates(DisasContext *s, int n)
+{
+    TCGv_i64 t;
+
+    if (!s->accounting || n == 0)
+        return;
+
+    t= tcg_temp_new_i64();
+    tcg_gen_ld_i64(t, cpu_env, offsetof(CPUZ80State, tstates));
+    tcg_gen_addi_i64(t, t, n);
+    tcg_gen_st_i64(t, cpu_env, offsetof(CPUZ80State, tstates));
+    tcg_temp_free_i64(t);
+}
+
+/* Add the block's totals to the running counts, first checking the
+ * instruction count against the budget so that a block which would
+ * overrun it never starts. The totals are not known until the block
+ * is complete, so as with gen_tb_start() the immediates are emitted
+ * as placeholders and patched by z80_tr_tb_stop()
+ */
+static void gen_accounting_start(DisasContext *s)
+{
+    TCGv_i64    total= tcg_temp_local_new_i64();
+    TCGv_i64    t= tcg_temp_new_i64();
+    TCGv_i32    n= tcg_temp_new_i32();
+    TCGLabel    *l1= gen_new_label();
+
+    tcg_gen_movi_i32(n, 0);
+    s->acct_insns_op= tcg_last_op();
+    tcg_gen_extu_i32_i64(t, n);
+    tcg_gen_ld_i64(total, cpu_env, offsetof(CPUZ80State, insns));
+    tcg_gen_add_i64(total, total, t);
+
+    tcg_gen_ld_i64(t, cpu_env, offsetof(CPUZ80State, insn_limit));
+    tcg_gen_brcond_i64(TCG_COND_LEU, total, t, l1);
+    tcg_temp_free_i64(t);
+    tcg_temp_free_i32(n);
+    gen_jmp_im(s->base.pc_first);
+    gen_helper_raise_exception(cpu_env, tcg_const_i32(EXCP_INSN_LIMIT));
+
+    gen_set_label(l1);
+    tcg_gen_st_i64(total, cpu_env, offsetof(CPUZ80State, insns));
+    tcg_temp_free_i64(total);
+
+    total= tcg_temp_new_i64();
+    t= tcg_temp_new_i64();
+    n= tcg_temp_new_i32();
+    tcg_gen_movi_i32(n, 0);
+    s->acct_tstates_op= tcg_last_op();
+    tcg_gen_extu_i32_i64(t, n);
+    tcg_gen_ld_i64(total, cpu_env, offsetof(CPUZ80State, tstates));
+    tcg_gen_add_i64(total, total, t);
+    tcg_gen_st_i64(total, cpu_env, offsetof(CPUZ80State, tstates));
+    tcg_temp_free_i64(total);
+    tcg_temp_free_i64(t);
+    tcg_temp_free_i32(n);
+}
+
+
+/* Block trace */
+
+/* Record the block's entry PC in the vCPU's ring. This costs one
+ * load of the index and two stores (the slot, then the advanced
+ * index) per block entered, with no helper call. Only the vCPU's own
+ * thread writes these, so there is no locking; every block ends with
+ * an exit to the main loop, so this runs whichever way it was reached
+ */
+static void gen_tb_trace(DisasContext *s)
+{
+    TCGv_i32    pos= tcg_temp_new_i32();
+    TCGv_i32    t= tcg_temp_new_i32();
+    TCGv_ptr    p= tcg_temp_new_ptr();
+
+    tcg_gen_ld_i32(pos, cpu_env, offsetof(CPUZ80State, tb_trace_pos));
+    tcg_gen_andi_i32(t, pos, Z80_TB_TRACE_SIZE - 1);
+    tcg_gen_shli_i32(t, t, 1);
+    tcg_gen_ext_i32_ptr(p, t);
+    tcg_gen_add_ptr(p, p, cpu_env);
+    tcg_gen_movi_i32(t, s->base.pc_first);
+    tcg_gen_st16_i32(t, p, offsetof(CPUZ80State, tb_trace_ring));
+    tcg_gen_addi_i32(pos, pos, 1);
+    tcg_gen_st_i32(pos, cpu_env, offsetof(CPUZ80State, tb_trace_pos));
+    tcg_temp_free_ptr(p);
+    tcg_temp_free_i32(t);
+    tcg_temp_free_i32(pos);
+}
+
+
+
+/* Loop idioms */
+
+/* Canonical forward memcpy()/memset() loops, counted in BC or (with
+ * djnz) in B. Fill loops start with a store of a register or
+ * immediate and are matched from the instruction following it; the
+ * closing branch offset depends on the store's length, so it is
+ * checked separately
+ */
+static const uint8_t idiom_copy_bc[]= { 0x7e, 0x12, 0x23, 0x13, 0x0b, 0x78, 0xb1, 0x20, 0xf7 };
+static const uint8_t idiom_copy_b[]= { 0x7e, 0x12, 0x23, 0x13, 0x10, 0xfa };
+static const uint8_t idiom_fill_bc[]= { 0x23, 0x0b, 0x78, 0xb1, 0x20 };
+static const uint8_t idiom_fill_b[]= { 0x23, 0x10 };
+
+/* The helper's shortcut is only valid while the loop is unchanged,
+ * so the block must span all of its 'len' bytes and 'insns'
+ * instructions - keeping it on this page, and clear of the limits at
+ * which z80_tr_translate_insn() ends a block early - for a write to
+ * any of them to invalidate it
+ */
+static bool idiom_in_tb(DisasContext *s, target_ulong pc, int len, int insns)
+{
+    if ((pc & ~TARGET_PAGE_MASK) + len + TARGET_MAX_INSN_SIZE - 1 > TARGET_PAGE_SIZE)
+        return false;
+    if (pc + len - s->base.pc_first > TARGET_PAGE_SIZE - 32)
+        return false;
+    if (s->base.num_insns - 1 + insns > s->base.max_insns)
+        return false;
+    return !(s->base.tb->flags & HF_INHIBIT_IRQ_MASK);
+}
+
+static bool idiom_match(CPUZ80State *env, target_ulong pc,
+                        const uint8_t *code, int len)
+{
+    int     n;
+
+    for (n= 0; n < len; n++)
+    {
+        if (cpu_ldub_code(env, (pc + n) & 0xffff) != code[n])
+            return false;
+    }
+    return true;
+}
+
+/* If a recognised loop starts here, emit a call to run all but its
+ * final iteration natively; the loop body is translated as usual,
+ * and performs that last iteration (or continues, if the helper
+ * declines to run any)
+ */
+static void gen_loop_idiom(DisasContext *s, CPUZ80State *env)
+{
+    target_ulong    pc= s->base.pc_next;
+    unsigned int    b= cpu_ldub_code(env, pc);
+    int             kind, insns, tstates, store;
+    TCGv_i32        value;
+
+    if (b == 0x7e && idiom_in_tb(s, pc, sizeof(idiom_copy_bc), 8)
+            && idiom_match(env, pc, idiom_copy_bc, sizeof(idiom_copy_bc)))
+    {
+        kind= Z80_LOOP_COPY_BC;
+        insns= 8;
+        tstates= 7 + 7 + 6 + 6 + 6 + 4 + 4 + 12;
+        value= tcg_const_i32(0);
+    }
+    else if (b == 0x7e && idiom_in_tb(s, pc, sizeof(idiom_copy_b), 5)
+            && idiom_match(env, pc, idiom_copy_b, sizeof(idiom_copy_b)))
+    {
+        kind= Z80_LOOP_COPY_B;
+        insns= 5;
+        tstates= 7 + 7 + 6 + 6 + 13;
+        value= tcg_const_i32(0);
+    }
+    else
+    {   /* fills: ld (hl),n or ld (hl),r for r unchanged by the loop */
+        if (b == 0x36)
+        {
+            store= 2;
+            tstates= 10;
+        }
+        else if (b == 0x71 || b == 0x72 || b == 0x73 || b == 0x77)
+        {
+            store= 1;
+            tstates= 7;
+        }
+        else
+            return;
+
+        if (b != 0x71 && b != 0x77
+                && idiom_in_tb(s, pc, store + sizeof(idiom_fill_bc) + 1, 6)
+                && idiom_match(env, pc + store, idiom_fill_bc, sizeof(idiom_fill_bc))
+                && cpu_ldub_code(env, (pc + store + 5) & 0xffff) == (uint8_t)-(store + 6))
+        {
+            kind= Z80_LOOP_FILL_BC;
+            insns= 6;
+            tstates+= 6 + 6 + 4 + 4 + 12;
+        }
+        else if (idiom_in_tb(s, pc, store + sizeof(idiom_fill_b) + 1, 3)
+                && idiom_match(env, pc + store, idiom_fill_b, sizeof(idiom_fill_b))
+                && cpu_ldub_code(env, (pc + store + 2) & 0xffff) == (uint8_t)-(store + 3))
+        {
+            kind= Z80_LOOP_FILL_B;
+            insns= 3;
+            tstates+= 6 + 13;
+        }
+        else
+            return;
+
+        if (store == 2)
+            value= tcg_const_i32(cpu_ldub_code(env, (pc + 1) & 0xffff));
+        else
+        {
+            value= tcg_temp_new_i32();
+            gen_movb_v_reg(value, reg[b & 0x07]);
+        }
+    }
+
+#if 1   /* WmT - TRACE */
+;DPRINTF("DEBUG: %s() loop idiom %d at pc 0x%04x\n", __func__, kind, pc);
+#endif
+    gen_helper_loop_idiom(cpu_env, tcg_const_i32(kind), value,
+                            tcg_const_i32((insns << 8) | tstates));
+    tcg_temp_free_i32(value);
+}
+
+
 /* Convert one instruction and return the next PC value */
 static target_ulong disas_insn(DisasContext *s, CPUState *cpu)
 {
@@ -936,7 +1351,7 @@ next_byte:
                 case 7:
                     n= z80_ldsb_code(env, s);
                     //s->pc++;
-                    gen_jcc(s, y-4, s->pc + n, s->pc);
+                    gen_jcc(s, y-4, s->pc + n, s->pc, 5);
                     zprintf("jr %s,$%04x\n", cc[y-4], (s->pc + n) & 0xffff);
                     break;
                 }   /* end z=0 switch(y) */
@@ -1285,7 +1700,7 @@ next_byte:
             case 2: /* Conditional jump */
                 n= z80_lduw_code(env, s);
                 //s->pc += 2;
-                gen_jcc(s, y, n, s->pc);
+                gen_jcc(s, y, n, s->pc, 0);
                 zprintf("jp %s,$%04x\n", cc[y], n);
                 /* TODO: gen_eob() w/ DISAS_NORETURN missing? */
                 break;
@@ -1436,6 +1851,7 @@ next_byte:
         //unsigned int p, q;
         int d;              /* displacement 'd' */
         int r1, r2;         /* register number */
+        TCGv val;
 
         if (m != MODE_NORMAL) {
             /* 0xDD 0xCB DISP OP or 0xFD 0xCB DISP OP cases */
@@ -1452,71 +1868,73 @@ next_byte:
         //p = y >> 1;
         //q = y & 0x01;
 
+        val= tcg_temp_new();
         if (m != MODE_NORMAL) {
             r1 = regmap(OR_HLmem, m);
-            gen_movb_v_idx(cpu_T[0], r1, d);
+            gen_movb_v_idx(val, r1, d);
             if (z != 6) {
                 r2 = regmap(reg[z], 0);
             }
         } else {
             r1 = regmap(reg[z], m);
-            gen_movb_v_reg(cpu_T[0], r1);
+            gen_movb_v_reg(val, r1);
         }
 
         switch (x)
         {
         case 0: /* Roll/shift register or memory location */
             /* TODO: TST instead of SLL for R800 */
-            gen_rot_T0[y](cpu_env);
+            gen_rot(y, val);
             if (m != MODE_NORMAL) {
-                gen_movb_idx_v(r1, cpu_T[0], d);
+                gen_movb_idx_v(r1, val, d);
                 if (z != 6) {
-                    gen_movb_reg_v(r2, cpu_T[0]);
+                    gen_movb_reg_v(r2, val);
                 }
             } else {
-                gen_movb_reg_v(r1, cpu_T[0]);
+                gen_movb_reg_v(r1, val);
             }
             zprintf("%s %s\n", rot[y], regnames[r1]);
             break;
         case 1: /* Test bit */
-            gen_helper_bit_T0(cpu_env, tcg_const_i32(1 << y));
+            gen_bit(y, val);
             zprintf("bit %i,%s\n", y, regnames[r1]);
             break;
         case 2: /* Reset bit */
-            tcg_gen_andi_tl(cpu_T[0], cpu_T[0], ~(1 << y));
+            tcg_gen_andi_tl(val, val, ~(1 << y));
             if (m != MODE_NORMAL) {
-                gen_movb_idx_v(r1, cpu_T[0], d);
+                gen_movb_idx_v(r1, val, d);
                 if (z != 6) {
 #ifdef __GNUC__     /* gcc didn't complain above!! */
 #if __GNUC__ == 6   /* suppress v6.3.0 warning (TODO: also v8?) */
                     r2 = regmap(reg[z], 0);
 #endif
 #endif
-                    gen_movb_reg_v(r2, cpu_T[0]);
+                    gen_movb_reg_v(r2, val);
                 }
             } else {
-                gen_movb_reg_v(r1, cpu_T[0]);
+                gen_movb_reg_v(r1, val);
             }
             zprintf("res %i,%s\n", y, regnames[r1]);
             break;
         case 3: /* Set bit */
-            tcg_gen_ori_tl(cpu_T[0], cpu_T[0], 1 << y);
+            tcg_gen_ori_tl(val, val, 1 << y);
             if (m != MODE_NORMAL) {
-                gen_movb_idx_v(r1, cpu_T[0], d);
+                gen_movb_idx_v(r1, val, d);
                 if (z != 6) {
 #ifdef __GNUC__     /* gcc didn't complain above!! */
 #if __GNUC__ == 6   /* suppress v6.3.0 warning (TODO: also v8?) */
                     r2 = regmap(reg[z], 0);
 #endif
 #endif
-                    gen_movb_reg_v(r2, cpu_T[0]);
+                    gen_movb_reg_v(r2, val);
                 }
             } else {
-                gen_movb_reg_v(r1, cpu_T[0]);
+                gen_movb_reg_v(r1, val);
             }
             zprintf("set %i,%s\n", y, regnames[r1]);
             break;
         }
+        tcg_temp_free(val);
     }
     else if (prefixes & PREFIX_ED)
     {   /* ed mode: */
@@ -1824,6 +2242,8 @@ __asm__ volatile("unknown_op:");    /* "bad insn" case (Z80: normally unreachabl
 
 void tcg_z80_init(void)
 {
+    int n;
+
     /* CPU initialisation for i386 has:
      * - cpu_regs[] as a static TCGv[] above, initialised here
      * - "TCG local temps" A0, T0, T1 are in struct DisasContext
@@ -1833,12 +2253,18 @@ void tcg_z80_init(void)
     cpu_T[0]= tcg_global_mem_new_i32(cpu_env, Z80_REG_OFFS(t0), "T0");
     cpu_T[1]= tcg_global_mem_new_i32(cpu_env, Z80_REG_OFFS(t1), "T1");
     cpu_A0= tcg_global_mem_new_i32(cpu_env, Z80_REG_OFFS(a0), "A0");
+
+    for (n= 0; n < 256; n++)
+    {
+        szp_table[n]= (n & CC_S) | (n ? 0 : CC_Z)
+                        | ((ctpop8(n) & 1) ? 0 : CC_P);
+    }
 }
 
 static void z80_tr_init_disas_context(DisasContextBase *dcbase, CPUState *cpu)
 {
     DisasContext *dc = container_of(dcbase, DisasContext, base);
-//    CPUX86State *env = cpu->env_ptr;
+    CPUZ80State *env = cpu->env_ptr;
     uint32_t flags = dc->base.tb->flags;
 #ifdef CONFIG_USER_ONLY
     TaskState       *ts = cpu->opaque;
@@ -1875,6 +2301,10 @@ static void z80_tr_init_disas_context(DisasContextBase *dcbase, CPUState *cpu)
 //#endif
 
     dc->flags= flags;
+    dc->accounting= env->accounting;
+    dc->acct_insns= 0;
+    dc->acct_tstates= 0;
+    dc->tb_trace= env->tb_trace;
 
 //    dc->jmp_opt = !(dc->tf || dc->base.singlestep_enabled ||
 //                    (flags & HF_INHIBIT_IRQ_MASK));
@@ -1910,6 +2340,7 @@ static void z80_tr_init_disas_context(DisasContextBase *dcbase, CPUState *cpu)
 
 #ifdef CONFIG_USER_ONLY
     dc->magic_ramloc= magic;
+    dc->afl_instrument= ts->afl_instrument;
 #endif
 }
 
@@ -1919,7 +2350,29 @@ static void z80_tr_tb_start(DisasContextBase *db, CPUState *cpu)
 ;DPRINTF("INFO: Reached %s() ** PARTIAL **\n", __func__);
 ;exit(1);
 #else
-    /* nothing to do */
+    DisasContext *dc = container_of(db, DisasContext, base);
+
+    if (dc->accounting)
+    {
+        gen_accounting_start(dc);
+    }
+    /* NB. after the budget check, which may stop the block starting */
+    if (dc->tb_trace)
+    {
+        gen_tb_trace(dc);
+    }
+#ifdef CONFIG_USER_ONLY
+    if (dc->afl_instrument)
+    {   /* AFL-style edge coverage: the block's location hash is
+         * fixed at translation time, and the helper combines it
+         * with its predecessor's to index the fuzzer's bitmap
+         */
+        target_ulong cur_loc= (dc->base.pc_first >> 4) ^ (dc->base.pc_first << 8);
+
+        cur_loc&= AFL_MAP_SIZE - 1;
+        gen_helper_afl_maybe_log(cpu_env, tcg_const_i32(cur_loc));
+    }
+#endif
 #endif
 }
 
@@ -1984,6 +2437,14 @@ static void z80_tr_translate_insn(DisasContextBase *dcbase, CPUState *cpu)
         return;
     }
 
+    if (dc->accounting)
+    {
+        dc->acct_insns++;
+        dc->acct_tstates+= z80_insn_tstates(cpu->env_ptr, dc->base.pc_next);
+    }
+
+    gen_loop_idiom(dc, cpu->env_ptr);
+
     pc_next = disas_insn(dc, cpu);
 
 #if 1   /* WmT - TRACE */
@@ -2026,6 +2487,12 @@ static void z80_tr_tb_stop(DisasContextBase *dcbase, CPUState *cpu)
         gen_jmp_im(dc->base.pc_next);
         gen_eob(dc);
     }
+
+    if (dc->accounting)
+    {   /* block totals are now known */
+        tcg_set_insn_param(dc->acct_insns_op, 1, dc->acct_insns);
+        tcg_set_insn_param(dc->acct_tstates_op, 1, dc->acct_tstates);
+    }
 }
 
 static void z80_tr_disas_log(const DisasContextBase *dcbase,
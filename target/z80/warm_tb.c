@@ -0,0 +1,224 @@
+/*
+ * QEmu Z80 CPU - translation cache warm-up
+ * vim: ft=c sw=4 ts=4 et :
+ *
+ *  Copyright (c) 2018-2023 William Towle <william_towle@yahoo.co.uk>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
+ */
+
+#include "qemu/osdep.h"
+#include "cpu.h"
+
+#include "exec/exec-all.h"
+#include "exec/tb-hash.h"
+#include "disas/dis-asm.h"
+#include "qemu/bitmap.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "sysemu/cpus.h"
+#include "sysemu/tcg.h"
+
+
+/* Translates the blocks reachable from a set of entry points (the
+ * reset and RST vectors, say) before the guest first runs them. The
+ * walk follows static control flow only - jumps, calls and RSTs to
+ * known addresses - so computed jumps and code reached through them
+ * are still translated on first use.
+ *
+ * TCG contexts belong to vCPU threads, so the work is queued on the
+ * CPU's own thread rather than a separate one; it runs before the
+ * first guest instruction, with the BQL dropped so that the rest of
+ * machine startup carries on meanwhile.
+ */
+
+#define Z80_WARM_TB_MAX     512     /* blocks translated per warm-up */
+#define Z80_WARM_INSN_MAX   64      /* decoded per block */
+
+/* How an instruction affects the block containing it */
+#define FLOW_BRANCH         0x01    /* 'target' may be executed next */
+#define FLOW_END            0x02    /* no fall through */
+#define FLOW_SPLIT          0x04    /* the next instruction starts a TB */
+
+typedef struct {
+    Z80WarmFilterFn filter;
+    void *opaque;
+    int count;
+    uint16_t entry[];
+} Z80WarmWork;
+
+static int z80_insn_flow(const uint8_t *p, uint16_t pc, uint16_t *target)
+{
+    uint8_t     op= p[0];
+
+    switch (op)
+    {
+    case 0xc3:                                  /* jp nn */
+        *target= p[1] | (p[2] << 8);
+        return FLOW_BRANCH | FLOW_END;
+    case 0x18:                                  /* jr e */
+        *target= pc + 2 + (int8_t)p[1];
+        return FLOW_BRANCH | FLOW_END;
+    case 0x10:                                  /* djnz e */
+    case 0x20: case 0x28: case 0x30: case 0x38: /* jr cc,e */
+        *target= pc + 2 + (int8_t)p[1];
+        return FLOW_BRANCH | FLOW_SPLIT;
+    case 0xcd:                                  /* call nn */
+        *target= p[1] | (p[2] << 8);
+        return FLOW_BRANCH | FLOW_SPLIT;
+    case 0xc9:                                  /* ret */
+    case 0xe9:                                  /* jp (hl) */
+    case 0x76:                                  /* halt */
+        return FLOW_END;
+    case 0xdd:
+    case 0xfd:
+        return (p[1] == 0xe9) ? FLOW_END : 0;   /* jp (ix/iy) */
+    case 0xed:
+        return ((p[1] & 0xc7) == 0x45) ? FLOW_END : 0;  /* retn/reti */
+    }
+
+    switch (op & 0xc7)
+    {
+    case 0xc2:                                  /* jp cc,nn */
+    case 0xc4:                                  /* call cc,nn */
+        *target= p[1] | (p[2] << 8);
+        return FLOW_BRANCH | FLOW_SPLIT;
+    case 0xc7:                                  /* rst n */
+        *target= op & 0x38;
+        return FLOW_BRANCH | FLOW_SPLIT;
+    case 0xc0:                                  /* ret cc */
+        return FLOW_SPLIT;
+    }
+
+    return 0;
+}
+
+/* Returns false if the code buffer filled (and was flushed) */
+static bool z80_warm_one(CPUState *cs, uint16_t pc, uint32_t flags,
+                            uint32_t cflags)
+{
+    TranslationBlock    *tb;
+
+    tb= tb_htable_lookup(cs, pc, 0, flags,
+                            (cflags & ~CF_CLUSTER_MASK)
+                            | (cs->cluster_index << CF_CLUSTER_SHIFT));
+    if (tb == NULL)
+    {
+        if (sigsetjmp(cs->jmp_env, 0) != 0)
+        {   /* tb_gen_code() flushed; its mmap_lock is already dropped */
+            cs->exception_index= -1;
+            return false;
+        }
+        mmap_lock();
+        tb= tb_gen_code(cs, pc, 0, flags, cflags);
+        mmap_unlock();
+    }
+    atomic_set(&cs->tb_jmp_cache[tb_jmp_cache_hash_func(pc)], tb);
+    return true;
+}
+
+static void z80_warm_tb_work(CPUState *cs, run_on_cpu_data data)
+{
+    Z80WarmWork     *work= data.host_ptr;
+    CPUZ80State     *env= &Z80_CPU(cs)->env;
+    unsigned long   *seen= bitmap_new(0x10000);
+    uint16_t        *queue= g_new(uint16_t, Z80_WARM_TB_MAX);
+    uint32_t        cflags= curr_cflags();
+    int             head= 0, tail= 0, n;
+
+    for (n= 0; n < work->count && tail < Z80_WARM_TB_MAX; n++)
+    {
+        uint16_t    pc= work->entry[n];
+
+        if (!test_and_set_bit(pc, seen) && work->filter(work->opaque, pc))
+            queue[tail++]= pc;
+    }
+
+    qemu_mutex_unlock_iothread();
+    rcu_read_lock();
+
+    while (head < tail)
+    {
+        uint16_t    start= queue[head++], pc= start;
+
+        if (!z80_warm_one(cs, start, env->hflags, cflags))
+            break;
+
+        for (n= 0; n < Z80_WARM_INSN_MAX; n++)
+        {
+            uint8_t     code[4];
+            char        txt[32];
+            uint16_t    target;
+            int         len, flow;
+
+            if (cpu_memory_rw_debug(cs, pc, code, sizeof(code), false) != 0)
+                break;
+            len= print_insn_z80_buf(pc, code, sizeof(code), txt, sizeof(txt));
+            if (len <= 0)
+                break;
+
+            flow= z80_insn_flow(code, pc, &target);
+            if ((flow & FLOW_BRANCH) && tail < Z80_WARM_TB_MAX
+                    && !test_and_set_bit(target, seen)
+                    && work->filter(work->opaque, target))
+                queue[tail++]= target;
+            pc+= len;
+            if (flow & FLOW_END)
+                break;
+            if (flow & FLOW_SPLIT)
+            {
+                if (tail < Z80_WARM_TB_MAX && !test_and_set_bit(pc, seen)
+                        && work->filter(work->opaque, pc))
+                    queue[tail++]= pc;
+                break;
+            }
+            if (!work->filter(work->opaque, pc))
+                break;
+        }
+    }
+
+    rcu_read_unlock();
+    qemu_mutex_lock_iothread();
+
+    g_free(queue);
+    g_free(seen);
+    g_free(work);
+}
+
+static bool z80_warm_filter_any(void *opaque, uint16_t pc)
+{
+    return true;
+}
+
+/* Queue a warm-up of the blocks reachable from 'entry' on the CPU's
+ * thread. 'filter', if given, limits it to addresses worth caching
+ * (such as ROM, which won't be overwritten)
+ */
+void z80_cpu_warm_tb_cache(Z80CPU *cpu, const uint16_t *entry, int count,
+                            Z80WarmFilterFn filter, void *opaque)
+{
+    Z80WarmWork     *work;
+
+    if (!tcg_enabled() || use_icount || count <= 0)
+        return;
+
+    work= g_malloc(sizeof(*work) + count * sizeof(work->entry[0]));
+    work->filter= filter ? filter : z80_warm_filter_any;
+    work->opaque= opaque;
+    work->count= count;
+    memcpy(work->entry, entry, count * sizeof(work->entry[0]));
+
+    async_run_on_cpu(CPU(cpu), z80_warm_tb_work, RUN_ON_CPU_HOST_PTR(work));
+}
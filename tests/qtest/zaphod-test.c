@@ -0,0 +1,387 @@
+/*
+ * QEmu Zaphod board - boot, console throughput and interrupt latency
+ *
+ * [...William Towle c. 2013-2022, under GPL...]
+ *
+ * Each board is booted with a small ROM on its console (the 'stdio'
+ * ports or the MC6850 ACIA, whichever it has) connected to a pipe:
+ *
+ * - boot: time from launching QEMU to the ROM's first output byte
+ * - throughput: bytes/s the ROM can stream out through the console
+ * - irq-latency: round trip from the host writing a byte to an
+ *   ACIA receive interrupt handler echoing it back
+ * - dma-full-block: a Z80 DMA memory copy of the largest block
+ *   length, 64KiB, runs to completion
+ *
+ * Timings are reported as "min perf"/"max perf" TAP comments, and in
+ * perf mode ('-m perf') the throughput and latency runs are longer.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "libqtest.h"
+
+#define TIMEOUT_US          (60 * G_USEC_PER_SEC)
+
+typedef enum {
+    CONSOLE_STDIO,
+    CONSOLE_ACIA,
+} ConsoleType;
+
+typedef struct {
+    const char *machine;
+    ConsoleType console;
+    const char *serial_before;      /* '-serial's ahead of the console */
+    bool dma;                       /* Z80 DMA at port 0x0b */
+} ZaphodBoard;
+
+static const ZaphodBoard boards[] = {
+    { "zaphod-pb",  CONSOLE_STDIO,  "",             false },
+    { "zaphod-gs",  CONSOLE_ACIA,   "",             false },
+    { "zaphod-dev", CONSOLE_STDIO,  "",             true },
+    /* zaphod-dev's ACIA is its second serial port */
+    { "zaphod-dev", CONSOLE_ACIA,   "-serial null", false },
+    { NULL }
+};
+
+/* ROMs, loaded at 0x0000 with '-kernel' */
+
+static const uint8_t rom_boot_stdio[] = {
+    0x3e, 0x54,             /* 0000: ld   a,'T'         */
+    0xd3, 0x01,             /* 0002: out  (0x01),a      */
+    0x18, 0xfe,             /* 0004: jr   $             */
+};
+
+static const uint8_t rom_boot_acia[] = {
+    0x3e, 0x03,             /* 0000: ld   a,0x03        master reset */
+    0xd3, 0x80,             /* 0002: out  (0x80),a      */
+    0x3e, 0x16,             /* 0004: ld   a,0x16        8N1, /64 */
+    0xd3, 0x80,             /* 0006: out  (0x80),a      */
+    0x3e, 0x54,             /* 0008: ld   a,'T'         */
+    0xd3, 0x81,             /* 000a: out  (0x81),a      */
+    0x18, 0xfe,             /* 000c: jr   $             */
+};
+
+static const uint8_t rom_stream_stdio[] = {
+    0x3e, 0x55,             /* 0000: ld   a,'U'         */
+    0xd3, 0x01,             /* 0002: out  (0x01),a      */
+    0x18, 0xfc,             /* 0004: jr   0x0002        */
+};
+
+static const uint8_t rom_stream_acia[] = {
+    0x3e, 0x03,             /* 0000: ld   a,0x03        */
+    0xd3, 0x80,             /* 0002: out  (0x80),a      */
+    0x3e, 0x16,             /* 0004: ld   a,0x16        */
+    0xd3, 0x80,             /* 0006: out  (0x80),a      */
+    0xdb, 0x80,             /* 0008: in   a,(0x80)      */
+    0xe6, 0x02,             /* 000a: and  0x02          TDRE? */
+    0x28, 0xfa,             /* 000c: jr   z,0x0008      */
+    0x3e, 0x55,             /* 000e: ld   a,'U'         */
+    0xd3, 0x81,             /* 0010: out  (0x81),a      */
+    0x18, 0xf4,             /* 0012: jr   0x0008        */
+};
+
+static const uint8_t rom_echo_acia[] = {
+    0xf3,                   /* 0000: di                 */
+    0x31, 0x00, 0x00,       /* 0001: ld   sp,0x0000     */
+    0x3e, 0x03,             /* 0004: ld   a,0x03        */
+    0xd3, 0x80,             /* 0006: out  (0x80),a      */
+    0x3e, 0x96,             /* 0008: ld   a,0x96        RX IRQ, 8N1, /64 */
+    0xd3, 0x80,             /* 000a: out  (0x80),a      */
+    0xed, 0x56,             /* 000c: im   1             */
+    0xfb,                   /* 000e: ei                 */
+    0x3e, 0x3e,             /* 000f: ld   a,'>'         ready */
+    0xd3, 0x81,             /* 0011: out  (0x81),a      */
+    0x18, 0xfe,             /* 0013: jr   $             */
+    [0x38] =
+    0xf5,                   /* 0038: push af            */
+    0xdb, 0x81,             /* 0039: in   a,(0x81)      */
+    0xd3, 0x81,             /* 003b: out  (0x81),a      */
+    0xf1,                   /* 003d: pop  af            */
+    0xfb,                   /* 003e: ei                 */
+    0xed, 0x4d,             /* 003f: reti               */
+};
+
+/* Copies all 64KiB onto itself (block length 0xffff moves 0x10000
+ * bytes), waits for end of block, then sends 'D' and the byte
+ * counter - whose low 16 bits are zero again
+ */
+static const uint8_t rom_dma_stdio[] = {
+    0x3e, 0xc3,             /* 0000: ld   a,0xc3        reset */
+    0xd3, 0x0b,             /* 0002: out  (0x0b),a      */
+    0x3e, 0x7d,             /* 0004: ld   a,0x7d        WR0: A->B, A, length */
+    0xd3, 0x0b,             /* 0006: out  (0x0b),a      */
+    0x3e, 0x00,             /* 0008: ld   a,0x00        A = 0x0000 */
+    0xd3, 0x0b,             /* 000a: out  (0x0b),a      */
+    0xd3, 0x0b,             /* 000c: out  (0x0b),a      */
+    0x3e, 0xff,             /* 000e: ld   a,0xff        length = 0xffff */
+    0xd3, 0x0b,             /* 0010: out  (0x0b),a      */
+    0xd3, 0x0b,             /* 0012: out  (0x0b),a      */
+    0x3e, 0x14,             /* 0014: ld   a,0x14        WR1: memory, inc */
+    0xd3, 0x0b,             /* 0016: out  (0x0b),a      */
+    0x3e, 0x10,             /* 0018: ld   a,0x10        WR2: memory, inc */
+    0xd3, 0x0b,             /* 001a: out  (0x0b),a      */
+    0x3e, 0x8d,             /* 001c: ld   a,0x8d        WR4: B */
+    0xd3, 0x0b,             /* 001e: out  (0x0b),a      */
+    0x3e, 0x00,             /* 0020: ld   a,0x00        B = 0x0000 */
+    0xd3, 0x0b,             /* 0022: out  (0x0b),a      */
+    0xd3, 0x0b,             /* 0024: out  (0x0b),a      */
+    0x3e, 0xcf,             /* 0026: ld   a,0xcf        load */
+    0xd3, 0x0b,             /* 0028: out  (0x0b),a      */
+    0x3e, 0x87,             /* 002a: ld   a,0x87        enable */
+    0xd3, 0x0b,             /* 002c: out  (0x0b),a      */
+    0xdb, 0x0b,             /* 002e: in   a,(0x0b)      */
+    0xe6, 0x20,             /* 0030: and  0x20          end of block? */
+    0x20, 0xfa,             /* 0032: jr   nz,0x002e     */
+    0x3e, 0xa7,             /* 0034: ld   a,0xa7        read sequence */
+    0xd3, 0x0b,             /* 0036: out  (0x0b),a      */
+    0x3e, 0x44,             /* 0038: ld   a,'D'         */
+    0xd3, 0x01,             /* 003a: out  (0x01),a      */
+    0xdb, 0x0b,             /* 003c: in   a,(0x0b)      status */
+    0xdb, 0x0b,             /* 003e: in   a,(0x0b)      count, low */
+    0xd3, 0x01,             /* 0040: out  (0x01),a      */
+    0xdb, 0x0b,             /* 0042: in   a,(0x0b)      count, high */
+    0xd3, 0x01,             /* 0044: out  (0x01),a      */
+    0x18, 0xfe,             /* 0046: jr   $             */
+};
+
+typedef struct {
+    QTestState *qts;
+    char *dir;
+    char *pipe;
+    int in_fd;                      /* host -> guest */
+    int out_fd;                     /* guest -> host */
+    int64_t start;
+} ZaphodTest;
+
+static void zaphod_start(ZaphodTest *t, const ZaphodBoard *board,
+                         const uint8_t *rom, size_t rom_size)
+{
+    char *path, *rom_path;
+
+    t->dir = g_dir_make_tmp("qtest-zaphod-XXXXXX", NULL);
+    g_assert(t->dir);
+
+    rom_path = g_build_filename(t->dir, "rom.bin", NULL);
+    g_assert(g_file_set_contents(rom_path, (const char *)rom, rom_size,
+                                 NULL));
+
+    /* the pipe chardev reads from <path>.in and writes to <path>.out */
+    t->pipe = g_build_filename(t->dir, "console", NULL);
+    path = g_strdup_printf("%s.in", t->pipe);
+    g_assert(mkfifo(path, 0600) == 0);
+    g_free(path);
+    path = g_strdup_printf("%s.out", t->pipe);
+    g_assert(mkfifo(path, 0600) == 0);
+    t->out_fd = open(path, O_RDONLY | O_NONBLOCK);
+    g_assert(t->out_fd >= 0);
+    g_free(path);
+
+    t->start = g_get_monotonic_time();
+    t->qts = qtest_initf("-M %s -kernel %s %s "
+                         "-chardev pipe,id=console,path=%s "
+                         "-serial chardev:console -accel tcg",
+                         board->machine, rom_path, board->serial_before,
+                         t->pipe);
+    unlink(rom_path);
+    g_free(rom_path);
+
+    /* QEMU now holds <path>.in open for reading */
+    path = g_strdup_printf("%s.in", t->pipe);
+    t->in_fd = open(path, O_WRONLY | O_NONBLOCK);
+    g_assert(t->in_fd >= 0);
+    g_free(path);
+}
+
+static void zaphod_stop(ZaphodTest *t)
+{
+    char *path;
+
+    qtest_quit(t->qts);
+    close(t->in_fd);
+    close(t->out_fd);
+
+    path = g_strdup_printf("%s.in", t->pipe);
+    unlink(path);
+    g_free(path);
+    path = g_strdup_printf("%s.out", t->pipe);
+    unlink(path);
+    g_free(path);
+    g_free(t->pipe);
+    rmdir(t->dir);
+    g_free(t->dir);
+}
+
+/* Reads up to 'len' bytes, waiting until at least one arrives */
+static ssize_t zaphod_read(ZaphodTest *t, uint8_t *buf, size_t len)
+{
+    int64_t deadline = g_get_monotonic_time() + TIMEOUT_US;
+    ssize_t nbr;
+
+    for (;;) {
+        nbr = read(t->out_fd, buf, len);
+        if (nbr > 0) {
+            return nbr;
+        }
+        g_assert(nbr == 0 || errno == EAGAIN || errno == EINTR);
+        g_assert(qtest_probe_child(t->qts));
+        g_assert(g_get_monotonic_time() < deadline);
+        g_usleep(100);
+    }
+}
+
+static char *test_name(const ZaphodBoard *board, const char *test)
+{
+    return g_strdup_printf("zaphod/%s/%s/%s", board->machine,
+                           board->console == CONSOLE_ACIA ? "acia" : "stdio",
+                           test);
+}
+
+static void test_boot(const void *data)
+{
+    const ZaphodBoard *board = data;
+    ZaphodTest t;
+    uint8_t ch;
+    double secs;
+
+    if (board->console == CONSOLE_ACIA) {
+        zaphod_start(&t, board, rom_boot_acia, sizeof(rom_boot_acia));
+    } else {
+        zaphod_start(&t, board, rom_boot_stdio, sizeof(rom_boot_stdio));
+    }
+
+    g_assert_cmpint(zaphod_read(&t, &ch, 1), ==, 1);
+    secs = (g_get_monotonic_time() - t.start) / (double)G_USEC_PER_SEC;
+    g_assert_cmphex(ch, ==, 'T');
+    g_test_minimized_result(secs, "%s time to first output: %.3f s",
+                            board->machine, secs);
+
+    zaphod_stop(&t);
+}
+
+static void test_throughput(const void *data)
+{
+    const ZaphodBoard *board = data;
+    size_t total = g_test_perf() ? 4 * MiB : 256 * KiB;
+    size_t count = 0;
+    uint8_t buf[4096];
+    int64_t start;
+    ssize_t nbr, n;
+    ZaphodTest t;
+    double secs;
+
+    if (board->console == CONSOLE_ACIA) {
+        zaphod_start(&t, board, rom_stream_acia, sizeof(rom_stream_acia));
+    } else {
+        zaphod_start(&t, board, rom_stream_stdio, sizeof(rom_stream_stdio));
+    }
+
+    /* time from the first byte, so that startup isn't counted */
+    zaphod_read(&t, buf, 1);
+    start = g_get_monotonic_time();
+    while (count < total) {
+        nbr = zaphod_read(&t, buf, MIN(sizeof(buf), total - count));
+        for (n = 0; n < nbr; n++) {
+            g_assert_cmphex(buf[n], ==, 'U');
+        }
+        count += nbr;
+    }
+    secs = (g_get_monotonic_time() - start) / (double)G_USEC_PER_SEC;
+    g_test_maximized_result(count / secs, "%s console throughput: %.0f B/s",
+                            board->machine, count / secs);
+
+    zaphod_stop(&t);
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static void test_irq_latency(const void *data)
+{
+    const ZaphodBoard *board = data;
+    int rounds = g_test_perf() ? 1000 : 50;
+    int64_t *lat = g_new(int64_t, rounds);
+    int64_t start;
+    ZaphodTest t;
+    uint8_t ch;
+    int i;
+
+    zaphod_start(&t, board, rom_echo_acia, sizeof(rom_echo_acia));
+
+    /* wait until the handler is installed */
+    g_assert_cmpint(zaphod_read(&t, &ch, 1), ==, 1);
+    g_assert_cmphex(ch, ==, '>');
+
+    for (i = 0; i < rounds; i++) {
+        uint8_t out = 'a' + i % 26;
+
+        start = g_get_monotonic_time();
+        g_assert_cmpint(write(t.in_fd, &out, 1), ==, 1);
+        g_assert_cmpint(zaphod_read(&t, &ch, 1), ==, 1);
+        lat[i] = g_get_monotonic_time() - start;
+        g_assert_cmphex(ch, ==, out);
+    }
+
+    qsort(lat, rounds, sizeof(lat[0]), compare_int64);
+    g_test_minimized_result(lat[rounds / 2] / (double)G_USEC_PER_SEC,
+                            "%s ACIA IRQ echo latency: median %" PRId64
+                            " us, min %" PRId64 " us, max %" PRId64 " us",
+                            board->machine, lat[rounds / 2], lat[0],
+                            lat[rounds - 1]);
+
+    g_free(lat);
+    zaphod_stop(&t);
+}
+
+static void test_dma_full_block(const void *data)
+{
+    const ZaphodBoard *board = data;
+    uint8_t buf[3];
+    size_t count = 0;
+    ZaphodTest t;
+
+    zaphod_start(&t, board, rom_dma_stdio, sizeof(rom_dma_stdio));
+
+    while (count < sizeof(buf)) {
+        count += zaphod_read(&t, &buf[count], sizeof(buf) - count);
+    }
+    g_assert_cmphex(buf[0], ==, 'D');
+    g_assert_cmphex(buf[1], ==, 0x00);
+    g_assert_cmphex(buf[2], ==, 0x00);
+
+    zaphod_stop(&t);
+}
+
+int main(int argc, char *argv[])
+{
+    const ZaphodBoard *board;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (board = boards; board->machine; board++) {
+        char *name;
+
+        name = test_name(board, "boot");
+        qtest_add_data_func(name, board, test_boot);
+        g_free(name);
+        name = test_name(board, "throughput");
+        qtest_add_data_func(name, board, test_throughput);
+        g_free(name);
+        if (board->console == CONSOLE_ACIA) {
+            name = test_name(board, "irq-latency");
+            qtest_add_data_func(name, board, test_irq_latency);
+            g_free(name);
+        }
+        if (board->dma) {
+            name = test_name(board, "dma-full-block");
+            qtest_add_data_func(name, board, test_dma_full_block);
+            g_free(name);
+        }
+    }
+
+    return g_test_run();
+}